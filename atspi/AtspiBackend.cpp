@@ -0,0 +1,737 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "AtspiBackend.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <dbus/dbus.h>
+
+#include "IpcAccounting.h"
+
+namespace aspk {
+
+static const char kRootPath[] = "/org/a11y/atspi/accessible/root";
+static const char kNullPath[] = "/org/a11y/atspi/null";
+static const char kRegistryBusName[] = "org.a11y.atspi.Registry";
+static const char kIfaceAccessible[] = "org.a11y.atspi.Accessible";
+static const char kIfaceAction[] = "org.a11y.atspi.Action";
+static const char kIfaceComponent[] = "org.a11y.atspi.Component";
+static const char kIfaceValue[] = "org.a11y.atspi.Value";
+static const char kIfaceProperties[] = "org.freedesktop.DBus.Properties";
+
+static const int kCallTimeoutMs = 10000;
+
+// ATSPI_COORD_TYPE_SCREEN, for GetExtents.
+static const uint32_t kCoordTypeScreen = 0;
+
+struct AtspiBackend::Node : public BackendNode {
+  Node(const char* aBusName, const char* aPath)
+      : mBusName(aBusName), mPath(aPath) {}
+
+  std::string mBusName;
+  std::string mPath;
+  // Set for nodes reached by FirstChild or NextSibling.
+  BackendNodePtr mParent;
+  int32_t mIndexInParent = -1;
+};
+
+void DBusMessageUnref::operator()(DBusMessage* aMessage) const {
+  dbus_message_unref(aMessage);
+}
+
+long AtspiRoleToAccRole(const uint32_t aRole) {
+  // The values are from atspi-constants.h, oleacc.h and AccessibleRole.idl.
+  switch (aRole) {
+    case 2: return 0x08;     // ALERT: ROLE_SYSTEM_ALERT
+    case 3: return 0x36;     // ANIMATION
+    case 6: return 0x401;    // CANVAS: IA2_ROLE_CANVAS
+    case 7: return 0x2C;     // CHECK_BOX: ROLE_SYSTEM_CHECKBUTTON
+    case 8: return 0x403;    // CHECK_MENU_ITEM
+    case 10: return 0x19;    // COLUMN_HEADER
+    case 11: return 0x2E;    // COMBO_BOX
+    case 15: return 0x31;    // DIAL
+    case 16: return 0x12;    // DIALOG
+    case 20: return 0x14;    // FILLER: ROLE_SYSTEM_GROUPING
+    case 23: return 0x09;    // FRAME: ROLE_SYSTEM_WINDOW
+    case 27: return 0x28;    // IMAGE: ROLE_SYSTEM_GRAPHIC
+    case 28: return 0x418;   // INTERNAL_FRAME
+    case 29: return 0x29;    // LABEL: ROLE_SYSTEM_STATICTEXT
+    case 31: return 0x21;    // LIST
+    case 32: return 0x22;    // LIST_ITEM
+    case 33: return 0x0B;    // MENU: ROLE_SYSTEM_MENUPOPUP
+    case 34: return 0x02;    // MENU_BAR
+    case 35: return 0x0C;    // MENU_ITEM
+    case 37: return 0x25;    // PAGE_TAB
+    case 38: return 0x3C;    // PAGE_TAB_LIST
+    case 39: return 0x10;    // PANEL: ROLE_SYSTEM_PANE
+    case 40: return 0x2A;    // PASSWORD_TEXT: ROLE_SYSTEM_TEXT
+    case 41: return 0x0B;    // POPUP_MENU
+    case 42: return 0x30;    // PROGRESS_BAR
+    case 43: return 0x2B;    // PUSH_BUTTON
+    case 44: return 0x2D;    // RADIO_BUTTON
+    case 45: return 0x41F;   // RADIO_MENU_ITEM
+    case 47: return 0x1A;    // ROW_HEADER
+    case 48: return 0x03;    // SCROLL_BAR
+    case 49: return 0x423;   // SCROLL_PANE
+    case 50: return 0x15;    // SEPARATOR
+    case 51: return 0x33;    // SLIDER
+    case 52: return 0x34;    // SPIN_BUTTON
+    case 54: return 0x17;    // STATUS_BAR
+    case 55: return 0x18;    // TABLE
+    case 56: return 0x1D;    // TABLE_CELL: ROLE_SYSTEM_CELL
+    case 57: return 0x19;    // TABLE_COLUMN_HEADER
+    case 58: return 0x1A;    // TABLE_ROW_HEADER
+    case 61: return 0x2A;    // TEXT
+    case 62: return 0x42A;   // TOGGLE_BUTTON
+    case 63: return 0x16;    // TOOL_BAR
+    case 64: return 0x0D;    // TOOL_TIP
+    case 65: return 0x23;    // TREE: ROLE_SYSTEM_OUTLINE
+    case 66: return 0x23;    // TREE_TABLE
+    case 69: return 0x09;    // WINDOW
+    case 71: return 0x413;   // HEADER
+    case 72: return 0x40E;   // FOOTER
+    case 73: return 0x41E;   // PARAGRAPH
+    case 75: return 0x0E;    // APPLICATION
+    case 76: return 0x2E;    // AUTOCOMPLETE
+    case 77: return 0x409;   // EDITBAR
+    case 78: return 0x40A;   // EMBEDDED: IA2_ROLE_EMBEDDED_OBJECT
+    case 79: return 0x2A;    // ENTRY
+    case 80: return 0x11;    // CHART
+    case 81: return 0x402;   // CAPTION
+    case 82:                 // DOCUMENT_FRAME
+    case 92:                 // DOCUMENT_SPREADSHEET
+    case 93:                 // DOCUMENT_PRESENTATION
+    case 94:                 // DOCUMENT_TEXT
+    case 95:                 // DOCUMENT_WEB
+    case 96:                 // DOCUMENT_EMAIL
+      return kAccRoleDocument;
+    case 83: return 0x414;   // HEADING
+    case 84: return 0x41D;   // PAGE
+    case 85: return 0x424;   // SECTION
+    case 86: return 0x420;   // REDUNDANT_OBJECT
+    case 87: return 0x410;   // FORM
+    case 88: return 0x1E;    // LINK
+    case 90: return 0x1C;    // TABLE_ROW: ROLE_SYSTEM_ROW
+    case 91: return 0x24;    // TREE_ITEM: ROLE_SYSTEM_OUTLINEITEM
+    case 98: return 0x21;    // LIST_BOX
+    case 99: return 0x14;    // GROUPING
+    case 110: return 0x42D;  // LANDMARK
+    case 113: return 0x37;   // MATH: ROLE_SYSTEM_EQUATION
+    default: return 0;       // IA2_ROLE_UNKNOWN
+  }
+}
+
+long AtspiStatesToAccState(const uint32_t aLow, const uint32_t aHigh) {
+  const uint64_t states = static_cast<uint64_t>(aHigh) << 32 | aLow;
+  auto has = [states](const unsigned int aState) {
+    return !!(states & (uint64_t(1) << aState));
+  };
+
+  // Pairs of AtspiStateType and MSAA state.
+  static const struct {
+    unsigned int mAtspi;
+    long mAcc;
+  } kMapped[] = {
+      {23, 0x2},         {12, 0x4},        {20, 0x8},
+      {4, 0x10},         {32, 0x20},       {43, 0x40},
+      {39, 0x100},       {10, 0x200},      {5, 0x400},
+      {3, 0x800},        {35, 0x4000},     {11, 0x100000},
+      {22, 0x200000},    {40, 0x800000},   {18, 0x1000000},
+      {42, 0x40000000},
+  };
+
+  long state = 0;
+  for (const auto& mapped : kMapped) {
+    if (has(mapped.mAtspi)) {
+      state |= mapped.mAcc;
+    }
+  }
+
+  // ENABLED, VISIBLE and SHOWING are the inverses of MSAA's UNAVAILABLE,
+  // INVISIBLE and OFFSCREEN.
+  if (!has(8)) {
+    state |= 0x1;
+  }
+  if (!has(30)) {
+    state |= kAccStateInvisible;
+  } else if (!has(25)) {
+    state |= kAccStateOffscreen;
+  }
+  return state;
+}
+
+// Reads the AT-SPI object reference, a (so), at aIter. Returns false if there
+// is none or if it is the null reference.
+static bool ReadObjectRef(DBusMessageIter* aIter, const char*& aOutBusName,
+                          const char*& aOutPath) {
+  if (dbus_message_iter_get_arg_type(aIter) != DBUS_TYPE_STRUCT) {
+    return false;
+  }
+  DBusMessageIter ref;
+  dbus_message_iter_recurse(aIter, &ref);
+  if (dbus_message_iter_get_arg_type(&ref) != DBUS_TYPE_STRING) {
+    return false;
+  }
+  dbus_message_iter_get_basic(&ref, &aOutBusName);
+  if (!dbus_message_iter_next(&ref) ||
+      dbus_message_iter_get_arg_type(&ref) != DBUS_TYPE_OBJECT_PATH) {
+    return false;
+  }
+  dbus_message_iter_get_basic(&ref, &aOutPath);
+  return strcmp(aOutPath, kNullPath) != 0;
+}
+
+// Points aOut at the value inside the variant that a Properties.Get reply
+// holds.
+static bool RecurseVariant(DBusMessage* aReply, DBusMessageIter& aOut) {
+  DBusMessageIter iter;
+  if (!dbus_message_iter_init(aReply, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_VARIANT) {
+    return false;
+  }
+  dbus_message_iter_recurse(&iter, &aOut);
+  return true;
+}
+
+static bool ReadStateSet(DBusMessage* aReply, uint32_t& aOutLow,
+                         uint32_t& aOutHigh) {
+  DBusMessageIter iter, words;
+  if (!dbus_message_iter_init(aReply, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+    return false;
+  }
+  dbus_message_iter_recurse(&iter, &words);
+  aOutLow = aOutHigh = 0;
+  for (uint32_t* word : {&aOutLow, &aOutHigh}) {
+    if (dbus_message_iter_get_arg_type(&words) != DBUS_TYPE_UINT32) {
+      break;
+    }
+    dbus_message_iter_get_basic(&words, word);
+    dbus_message_iter_next(&words);
+  }
+  return true;
+}
+
+// Takes a uniqueID from the last element of an object path, if it is a
+// number.
+static bool UniqueIdFromPath(const std::string& aPath, long& aOut) {
+  const size_t slash = aPath.rfind('/');
+  const char* id = aPath.c_str() + (slash == std::string::npos ? 0 : slash + 1);
+  if (!*id) {
+    return false;
+  }
+  char* end;
+  aOut = strtol(id, &end, 10);
+  return !*end;
+}
+
+// Whether a failed call only means that the node does not implement the
+// interface, which a screen reader takes as an empty value.
+static bool IsMissingInterfaceError(const std::string& aName) {
+  return aName == DBUS_ERROR_UNKNOWN_METHOD ||
+         aName == DBUS_ERROR_UNKNOWN_INTERFACE ||
+         aName == DBUS_ERROR_UNKNOWN_PROPERTY ||
+         aName == DBUS_ERROR_INVALID_ARGS;
+}
+
+static DBusMessagePtr NewCall(const std::string& aBusName,
+                              const std::string& aPath,
+                              const char* aInterface, const char* aMember) {
+  return DBusMessagePtr(dbus_message_new_method_call(
+      aBusName.c_str(), aPath.c_str(), aInterface, aMember));
+}
+
+AtspiBackend::~AtspiBackend() {
+  if (mConnection) {
+    dbus_connection_close(mConnection);
+    dbus_connection_unref(mConnection);
+  }
+}
+
+bool AtspiBackend::Connect(const char* aAppName, const char* aBusName) {
+  DBusError error;
+  dbus_error_init(&error);
+  mConnection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+  if (!mConnection) {
+    mPrint("Couldn't connect to the session bus: %s\n", error.message);
+    dbus_error_free(&error);
+    return false;
+  }
+  dbus_connection_set_exit_on_disconnect(mConnection, FALSE);
+
+  // Assistive technologies talk to applications over a bus of their own,
+  // whose address the session bus hands out. Without one, applications
+  // register on the session bus itself.
+  DBusMessagePtr reply =
+      Send(A11yMethod::GetAddress,
+           NewCall("org.a11y.Bus", "/org/a11y/bus", "org.a11y.Bus",
+                   "GetAddress"),
+           true);
+  const char* address = nullptr;
+  if (reply && dbus_message_get_args(reply.get(), nullptr, DBUS_TYPE_STRING,
+                                     &address, DBUS_TYPE_INVALID)) {
+    DBusConnection* a11yBus = dbus_connection_open_private(address, &error);
+    if (a11yBus && dbus_bus_register(a11yBus, &error)) {
+      dbus_connection_set_exit_on_disconnect(a11yBus, FALSE);
+      dbus_connection_close(mConnection);
+      dbus_connection_unref(mConnection);
+      mConnection = a11yBus;
+    } else {
+      mPrint("Couldn't connect to the accessibility bus at %s: %s\n", address,
+             error.message);
+      dbus_error_free(&error);
+      if (a11yBus) {
+        dbus_connection_close(a11yBus);
+        dbus_connection_unref(a11yBus);
+      }
+    }
+  }
+
+  if (aBusName && *aBusName) {
+    // Nodes refer to each other by unique name, so look up the owner of a
+    // well-known name.
+    DBusMessagePtr call = NewCall(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                  DBUS_INTERFACE_DBUS, "GetNameOwner");
+    if (call && !dbus_message_append_args(call.get(), DBUS_TYPE_STRING,
+                                          &aBusName, DBUS_TYPE_INVALID)) {
+      call.reset();
+    }
+    reply = Send(A11yMethod::GetNameOwner, std::move(call));
+    const char* owner = nullptr;
+    if (!reply || !dbus_message_get_args(reply.get(), nullptr,
+                                         DBUS_TYPE_STRING, &owner,
+                                         DBUS_TYPE_INVALID)) {
+      return false;
+    }
+    mAppBusName = owner;
+    mAppPath = kRootPath;
+    return true;
+  }
+
+  // Ask the registry for every application and find ours by name.
+  reply = Send(A11yMethod::GetChildren,
+               NewCall(kRegistryBusName, kRootPath, kIfaceAccessible,
+                       "GetChildren"));
+  DBusMessageIter iter, apps;
+  if (!reply || !dbus_message_iter_init(reply.get(), &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+    mPrint("Couldn't list the applications in the AT-SPI registry!\n");
+    return false;
+  }
+  dbus_message_iter_recurse(&iter, &apps);
+  for (; dbus_message_iter_get_arg_type(&apps) != DBUS_TYPE_INVALID;
+       dbus_message_iter_next(&apps)) {
+    const char* busName;
+    const char* path;
+    if (!ReadObjectRef(&apps, busName, path)) {
+      continue;
+    }
+
+    BackendNodePtr app = NewNode(busName, path);
+    DBusMessagePtr name =
+        GetProperty(A11yMethod::GetName, app, kIfaceAccessible, "Name", true);
+    DBusMessageIter value;
+    const char* appName = nullptr;
+    if (!name || !RecurseVariant(name.get(), value) ||
+        dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_STRING) {
+      continue;
+    }
+    dbus_message_iter_get_basic(&value, &appName);
+    if (!strcasecmp(appName, aAppName)) {
+      mAppBusName = busName;
+      mAppPath = path;
+      return true;
+    }
+  }
+
+  mPrint("Couldn't find an application named %s in the AT-SPI registry!\n",
+         aAppName);
+  return false;
+}
+
+BackendNodePtr AtspiBackend::NewNode(const char* aBusName,
+                                     const char* aPath) const {
+  return std::make_shared<const Node>(aBusName, aPath);
+}
+
+// The size of aMessage on the wire, headers included.
+static uint64_t MarshaledBytes(DBusMessage* aMessage) {
+  char* data = nullptr;
+  int length = 0;
+  if (!aMessage || !dbus_message_marshal(aMessage, &data, &length)) {
+    return 0;
+  }
+  dbus_free(data);
+  return static_cast<uint64_t>(length);
+}
+
+DBusMessagePtr AtspiBackend::Send(const A11yMethod aMethod,
+                                  DBusMessagePtr aCall, const bool aQuiet) {
+  if (!aCall) {
+    mPrint("Out of memory building %s!\n", A11yMethodName(aMethod));
+    return nullptr;
+  }
+
+  ++mCalls;
+  DBusError error;
+  dbus_error_init(&error);
+  DBusMessagePtr reply(TimeA11yCall(aMethod, [&]() {
+    return dbus_connection_send_with_reply_and_block(
+        mConnection, aCall.get(), kCallTimeoutMs, &error);
+  }));
+
+  IpcCost cost;
+  cost.mCalls = 1;
+  cost.mRequestBytes = MarshaledBytes(aCall.get());
+  cost.mResponseBytes = MarshaledBytes(reply.get());
+  IpcAccounting::Get().Record(cost);
+
+  if (reply) {
+    mLastError.clear();
+    return reply;
+  }
+
+  mLastError = error.name ? error.name : "";
+  if (!aQuiet) {
+    mPrint("%s failed: %s: %s\n", A11yMethodName(aMethod), error.name,
+           error.message);
+  }
+  dbus_error_free(&error);
+  return nullptr;
+}
+
+DBusMessagePtr AtspiBackend::CallNode(const A11yMethod aMethod,
+                                      const BackendNodePtr& aNode,
+                                      const char* aInterface,
+                                      const char* aMember, const bool aQuiet) {
+  const Node& node = static_cast<const Node&>(*aNode);
+  return Send(aMethod, NewCall(node.mBusName, node.mPath, aInterface, aMember),
+              aQuiet);
+}
+
+DBusMessagePtr AtspiBackend::GetProperty(const A11yMethod aMethod,
+                                         const BackendNodePtr& aNode,
+                                         const char* aInterface,
+                                         const char* aProperty,
+                                         const bool aQuiet) {
+  const Node& node = static_cast<const Node&>(*aNode);
+  DBusMessagePtr call =
+      NewCall(node.mBusName, node.mPath, kIfaceProperties, "Get");
+  if (call &&
+      !dbus_message_append_args(call.get(), DBUS_TYPE_STRING, &aInterface,
+                                DBUS_TYPE_STRING, &aProperty,
+                                DBUS_TYPE_INVALID)) {
+    call.reset();
+  }
+  return Send(aMethod, std::move(call), aQuiet);
+}
+
+BackendNodePtr AtspiBackend::Root() {
+  // Connect found the application's root, so this costs no call.
+  if (!mConnection || mAppBusName.empty()) {
+    return nullptr;
+  }
+  return NewNode(mAppBusName.c_str(), mAppPath.c_str());
+}
+
+void AtspiBackend::GetChildren(const BackendNodePtr& aNode,
+                               const ChildStrategy aStrategy, size_t,
+                               std::vector<BackendNodePtr>& aOut,
+                               TraversalCounters& aCounters) {
+  aOut.clear();
+  const char* busName;
+  const char* path;
+
+  if (aStrategy == ChildStrategy::Bulk) {
+    ++aCounters.mRoundTrips;
+    DBusMessagePtr reply = CallNode(A11yMethod::GetChildren, aNode,
+                                    kIfaceAccessible, "GetChildren");
+    DBusMessageIter iter, children;
+    if (!reply || !dbus_message_iter_init(reply.get(), &iter) ||
+        dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) {
+      return;
+    }
+    dbus_message_iter_recurse(&iter, &children);
+    for (; dbus_message_iter_get_arg_type(&children) != DBUS_TYPE_INVALID;
+         dbus_message_iter_next(&children)) {
+      if (ReadObjectRef(&children, busName, path)) {
+        aOut.push_back(NewNode(busName, path));
+      }
+    }
+    return;
+  }
+
+  ++aCounters.mRoundTrips;
+  DBusMessagePtr reply = GetProperty(A11yMethod::GetChildCount, aNode,
+                                     kIfaceAccessible, "ChildCount");
+  DBusMessageIter value;
+  if (!reply || !RecurseVariant(reply.get(), value) ||
+      dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_INT32) {
+    return;
+  }
+  int32_t childCount;
+  dbus_message_iter_get_basic(&value, &childCount);
+
+  for (int32_t i = 0; i < childCount; ++i) {
+    ++aCounters.mRoundTrips;
+    BackendNodePtr child;
+    if (!GetChildAtIndex(aNode, i, false, child)) {
+      return;
+    }
+    if (child) {
+      aOut.push_back(std::move(child));
+    }
+  }
+}
+
+bool AtspiBackend::GetChildAtIndex(const BackendNodePtr& aParent,
+                                   const int32_t aIndex,
+                                   const bool aKeepParent,
+                                   BackendNodePtr& aOut) {
+  aOut = nullptr;
+  const Node& parent = static_cast<const Node&>(*aParent);
+  DBusMessagePtr call = NewCall(parent.mBusName, parent.mPath,
+                                kIfaceAccessible, "GetChildAtIndex");
+  if (call && !dbus_message_append_args(call.get(), DBUS_TYPE_INT32, &aIndex,
+                                        DBUS_TYPE_INVALID)) {
+    call.reset();
+  }
+  DBusMessagePtr reply = Send(A11yMethod::GetChildAtIndex, std::move(call));
+  DBusMessageIter iter;
+  if (!reply || !dbus_message_iter_init(reply.get(), &iter)) {
+    return false;
+  }
+  const char* busName;
+  const char* path;
+  if (!ReadObjectRef(&iter, busName, path)) {
+    return true;
+  }
+  if (!aKeepParent) {
+    aOut = NewNode(busName, path);
+    return true;
+  }
+  auto child = std::make_shared<Node>(busName, path);
+  child->mParent = aParent;
+  child->mIndexInParent = aIndex;
+  aOut = std::move(child);
+  return true;
+}
+
+BackendNodePtr AtspiBackend::FirstChild(const BackendNodePtr& aNode,
+                                        TraversalCounters& aCounters) {
+  ++aCounters.mRoundTrips;
+  BackendNodePtr child;
+  GetChildAtIndex(aNode, 0, true, child);
+  return child;
+}
+
+BackendNodePtr AtspiBackend::NextSibling(const BackendNodePtr& aNode,
+                                         TraversalCounters& aCounters) {
+  const Node& node = static_cast<const Node&>(*aNode);
+  if (!node.mParent) {
+    return nullptr;
+  }
+  ++aCounters.mRoundTrips;
+  BackendNodePtr sibling;
+  GetChildAtIndex(node.mParent, node.mIndexInParent + 1, true, sibling);
+  return sibling;
+}
+
+bool AtspiBackend::GetRole(const BackendNodePtr& aNode, long& aOut) {
+  DBusMessagePtr reply =
+      CallNode(A11yMethod::GetRole, aNode, kIfaceAccessible, "GetRole");
+  uint32_t role;
+  if (!reply || !dbus_message_get_args(reply.get(), nullptr, DBUS_TYPE_UINT32,
+                                       &role, DBUS_TYPE_INVALID)) {
+    return false;
+  }
+  aOut = AtspiRoleToAccRole(role);
+  return true;
+}
+
+bool AtspiBackend::GetIA2Role(const BackendNodePtr&, long&) {
+  // AT-SPI2 has a single role per node, which GetRole maps.
+  return false;
+}
+
+bool AtspiBackend::GetState(const BackendNodePtr& aNode, long& aOut) {
+  DBusMessagePtr reply =
+      CallNode(A11yMethod::GetState, aNode, kIfaceAccessible, "GetState");
+  uint32_t low, high;
+  if (!reply || !ReadStateSet(reply.get(), low, high)) {
+    return false;
+  }
+  aOut = AtspiStatesToAccState(low, high);
+  return true;
+}
+
+bool AtspiBackend::GetUniqueId(const BackendNodePtr& aNode, long& aOut) {
+  // Firefox names its objects by uniqueID, so this needs no round-trip.
+  return UniqueIdFromPath(static_cast<const Node&>(*aNode).mPath, aOut);
+}
+
+bool AtspiBackend::GetBounds(const BackendNodePtr& aNode, ScreenRect& aOut) {
+  const Node& node = static_cast<const Node&>(*aNode);
+  DBusMessagePtr call =
+      NewCall(node.mBusName, node.mPath, kIfaceComponent, "GetExtents");
+  if (call && !dbus_message_append_args(call.get(), DBUS_TYPE_UINT32,
+                                        &kCoordTypeScreen,
+                                        DBUS_TYPE_INVALID)) {
+    call.reset();
+  }
+  DBusMessagePtr reply = Send(A11yMethod::GetExtents, std::move(call), true);
+  DBusMessageIter iter, extents;
+  if (!reply || !dbus_message_iter_init(reply.get(), &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRUCT) {
+    return false;
+  }
+  dbus_message_iter_recurse(&iter, &extents);
+  int32_t values[4];
+  for (int32_t& value : values) {
+    if (dbus_message_iter_get_arg_type(&extents) != DBUS_TYPE_INT32) {
+      return false;
+    }
+    dbus_message_iter_get_basic(&extents, &value);
+    dbus_message_iter_next(&extents);
+  }
+  aOut = ScreenRect::FromLocation(values[0], values[1], values[2], values[3]);
+  return true;
+}
+
+ScreenRect AtspiBackend::Viewport() {
+  // The application has no extents of its own, so use its first window's.
+  ScreenRect viewport;
+  BackendNodePtr root = Root();
+  if (!root) {
+    return viewport;
+  }
+  std::vector<BackendNodePtr> windows;
+  TraversalCounters counters;
+  GetChildren(root, ChildStrategy::Bulk, 0, windows, counters);
+  if (!windows.empty()) {
+    GetBounds(windows.front(), viewport);
+  }
+  return viewport;
+}
+
+bool AtspiBackend::GetParent(const BackendNodePtr& aNode,
+                             BackendNodePtr& aOut) {
+  DBusMessagePtr reply = GetProperty(A11yMethod::GetParent, aNode,
+                                     kIfaceAccessible, "Parent");
+  DBusMessageIter value;
+  if (!reply || !RecurseVariant(reply.get(), value)) {
+    return false;
+  }
+  const char* busName;
+  const char* path;
+  aOut = ReadObjectRef(&value, busName, path) ? NewNode(busName, path)
+                                              : nullptr;
+  return true;
+}
+
+const void* AtspiBackend::Identity(const Node& aNode) {
+  std::string key(aNode.mBusName);
+  key.push_back(':');
+  key.append(aNode.mPath);
+  return &*mIdentities.insert(std::move(key)).first;
+}
+
+bool AtspiBackend::Describe(const BackendNodePtr& aNode,
+                            BackendNodeDescription& aOut) {
+  const Node& node = static_cast<const Node&>(*aNode);
+  aOut = BackendNodeDescription();
+  aOut.mIdentity = Identity(node);
+
+  DBusMessagePtr name =
+      GetProperty(A11yMethod::GetName, aNode, kIfaceAccessible, "Name");
+  DBusMessageIter value;
+  if (!name || !RecurseVariant(name.get(), value)) {
+    return false;
+  }
+  if (dbus_message_iter_get_arg_type(&value) == DBUS_TYPE_STRING) {
+    const char* str;
+    dbus_message_iter_get_basic(&value, &str);
+    aOut.mName = str;
+  }
+
+  if (!GetRole(aNode, aOut.mRole)) {
+    return false;
+  }
+  aOut.mHasUniqueId = UniqueIdFromPath(node.mPath, aOut.mUniqueId);
+
+  BackendNodePtr parent;
+  if (GetParent(aNode, parent) && parent) {
+    const Node& parentNode = static_cast<const Node&>(*parent);
+    aOut.mParentIdentity = Identity(parentNode);
+    aOut.mHasParentUniqueId =
+        UniqueIdFromPath(parentNode.mPath, aOut.mParentUniqueId);
+  }
+  return true;
+}
+
+bool AtspiBackend::FetchProperty(const BackendNodePtr& aNode,
+                                 const AccProperty aProp) {
+  const Node& node = static_cast<const Node&>(*aNode);
+  long value;
+  DBusMessagePtr reply;
+  switch (aProp) {
+    case kPropRole:
+      return GetRole(aNode, value);
+    case kPropState:
+    // AT-SPI2 has one state set, which holds the IA2 states too.
+    case kPropIA2States:
+      return GetState(aNode, value);
+    case kPropName:
+      return !!GetProperty(A11yMethod::GetName, aNode, kIfaceAccessible,
+                           "Name");
+    case kPropDescription:
+      return !!GetProperty(A11yMethod::GetDescription, aNode,
+                           kIfaceAccessible, "Description");
+    case kPropChildCount:
+      return !!GetProperty(A11yMethod::GetChildCount, aNode, kIfaceAccessible,
+                           "ChildCount");
+    case kPropLocale:
+      return !!GetProperty(A11yMethod::GetLocale, aNode, kIfaceAccessible,
+                           "Locale");
+    case kPropAttributes:
+      return !!CallNode(A11yMethod::GetAttributes, aNode, kIfaceAccessible,
+                        "GetAttributes");
+    case kPropKeyboardShortcut: {
+      DBusMessagePtr call =
+          NewCall(node.mBusName, node.mPath, kIfaceAction, "GetKeyBinding");
+      const int32_t index = 0;
+      if (call && !dbus_message_append_args(call.get(), DBUS_TYPE_INT32,
+                                            &index, DBUS_TYPE_INVALID)) {
+        call.reset();
+      }
+      reply = Send(A11yMethod::GetKeyBinding, std::move(call), true);
+      break;
+    }
+    case kPropValue:
+      reply = GetProperty(A11yMethod::GetCurrentValue, aNode, kIfaceValue,
+                          "CurrentValue", true);
+      break;
+    // Neither needs a call: the uniqueID is in the path and there is no
+    // window handle.
+    case kPropUniqueId:
+      return UniqueIdFromPath(node.mPath, value) || node.mPath == kRootPath;
+    case kPropWindowHandle:
+      return true;
+    default:
+      return false;
+  }
+
+  if (reply || IsMissingInterfaceError(mLastError)) {
+    return true;
+  }
+  mPrint("%s failed: %s\n", AccPropertyName(aProp), mLastError.c_str());
+  return false;
+}
+
+}  // namespace aspk
@@ -0,0 +1,137 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_ATSPIBACKEND_H
+#define __ASPK_ATSPIBACKEND_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "A11yCall.h"
+#include "AccBackend.h"
+#include "TreeBench.h"
+
+struct DBusConnection;
+struct DBusMessage;
+
+namespace aspk {
+
+struct DBusMessageUnref {
+  void operator()(DBusMessage* aMessage) const;
+};
+
+using DBusMessagePtr = std::unique_ptr<DBusMessage, DBusMessageUnref>;
+
+// Maps an AtspiRole onto its MSAA role, or onto its IA2 role where MSAA has
+// none, as IAccessible2::role would report it.
+long AtspiRoleToAccRole(uint32_t aRole);
+
+// Maps an AtspiStateSet, as the two words that GetState returns, onto MSAA
+// states.
+long AtspiStatesToAccState(uint32_t aLow, uint32_t aHigh);
+
+/**
+ * Serves an application's AT-SPI2 tree over D-Bus through AccBackend, so
+ * that the benchmarks run against Firefox on Linux. Every D-Bus call blocks
+ * on its reply and is timed in MethodLatencies.
+ *
+ * Navigate fetches children as IAccessible navigation would, with a
+ * ChildCount read and then a GetChildAtIndex call per child. Bulk fetches
+ * them all with one GetChildren call; AT-SPI2 has no chunked equivalent, so
+ * aMaxChunk is ignored.
+ *
+ * AT-SPI2 has no sibling navigation either, so nodes reached through
+ * FirstChild and NextSibling remember their parent and index, and the next
+ * sibling is derived again with GetChildAtIndex on the parent.
+ *
+ * AT-SPI2 has no uniqueID, so one is taken from the numeric last element of
+ * a node's object path, which is how Gecko and most toolkits name them.
+ * There is no window handle to fetch.
+ */
+class AtspiBackend : public AccBackend {
+ public:
+  explicit AtspiBackend(BenchPrintFn aPrint) : mPrint(aPrint) {}
+  ~AtspiBackend() override;
+
+  /**
+   * Connects to the accessibility bus, or to the session bus if no
+   * accessibility bus is running, and finds the application: the one that
+   * owns aBusName if that is set, otherwise the first one that the registry
+   * lists whose name is aAppName. Returns false after reporting why.
+   */
+  bool Connect(const char* aAppName, const char* aBusName);
+
+  // The number of D-Bus calls made so far.
+  uint64_t Calls() const { return mCalls; }
+
+  const char* Name() const override { return "atspi"; }
+  BackendNodePtr Root() override;
+  void GetChildren(const BackendNodePtr& aNode, ChildStrategy aStrategy,
+                   size_t aMaxChunk, std::vector<BackendNodePtr>& aOut,
+                   TraversalCounters& aCounters) override;
+  BackendNodePtr FirstChild(const BackendNodePtr& aNode,
+                            TraversalCounters& aCounters) override;
+  BackendNodePtr NextSibling(const BackendNodePtr& aNode,
+                             TraversalCounters& aCounters) override;
+  bool GetRole(const BackendNodePtr& aNode, long& aOut) override;
+  bool GetIA2Role(const BackendNodePtr& aNode, long& aOut) override;
+  bool GetState(const BackendNodePtr& aNode, long& aOut) override;
+  bool GetUniqueId(const BackendNodePtr& aNode, long& aOut) override;
+  bool GetBounds(const BackendNodePtr& aNode, ScreenRect& aOut) override;
+  ScreenRect Viewport() override;
+  bool Describe(const BackendNodePtr& aNode,
+                BackendNodeDescription& aOut) override;
+  bool FetchProperty(const BackendNodePtr& aNode, AccProperty aProp) override;
+
+ private:
+  struct Node;
+
+  BackendNodePtr NewNode(const char* aBusName, const char* aPath) const;
+
+  // Calls GetChildAtIndex on aParent. Returns false if the call failed, and
+  // otherwise sets aOut to the child, or to null if there is none. The child
+  // remembers aParent and aIndex if aKeepParent is set.
+  bool GetChildAtIndex(const BackendNodePtr& aParent, int32_t aIndex,
+                       bool aKeepParent, BackendNodePtr& aOut);
+
+  // Sends aCall and waits for the reply. Returns null on failure, after
+  // reporting the error unless aQuiet is set.
+  DBusMessagePtr Send(A11yMethod aMethod, DBusMessagePtr aCall,
+                      bool aQuiet = false);
+
+  // Calls aMember of aInterface on aNode with no arguments.
+  DBusMessagePtr CallNode(A11yMethod aMethod, const BackendNodePtr& aNode,
+                          const char* aInterface, const char* aMember,
+                          bool aQuiet = false);
+
+  // Reads aProperty of aInterface on aNode. The reply holds a variant.
+  DBusMessagePtr GetProperty(A11yMethod aMethod, const BackendNodePtr& aNode,
+                             const char* aInterface, const char* aProperty,
+                             bool aQuiet = false);
+
+  bool GetParent(const BackendNodePtr& aNode, BackendNodePtr& aOut);
+
+  // Returns an address that stays the same for every node with the same bus
+  // name and path, for dumps.
+  const void* Identity(const Node& aNode);
+
+  const BenchPrintFn mPrint;
+  DBusConnection* mConnection = nullptr;
+  std::string mAppBusName;
+  std::string mAppPath;
+  uint64_t mCalls = 0;
+  std::unordered_set<std::string> mIdentities;
+  // The name of the last D-Bus error, for callers that tolerate some.
+  std::string mLastError;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_ATSPIBACKEND_H
@@ -0,0 +1,425 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// A stand-in AT-SPI2 application for trying atspitest without a browser. It
+// serves a page-like tree on the session bus under a well-known name and,
+// unless another registry is running, acts as the AT-SPI registry too, eg:
+//
+//   atspistub [<depth> [<fanout>]]
+//
+// The tree has the shape of treebench's: a frame holding a tool bar, a
+// background tab's document, which is not visible, and the selected tab's
+// document. Each document holds a complete tree of links and paragraphs of
+// the given depth and fanout, in which every fourth link is not showing.
+// Once the names are owned, it prints "ready" and the number of nodes.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include <dbus/dbus.h>
+
+namespace {
+
+const char kBusName[] = "org.aspk.AtspiStub";
+const char kAppName[] = "atspistub";
+const char kRegistryBusName[] = "org.a11y.atspi.Registry";
+const char kPathPrefix[] = "/org/a11y/atspi/accessible/";
+const char kRootPath[] = "/org/a11y/atspi/accessible/root";
+const char kNullPath[] = "/org/a11y/atspi/null";
+const char kIfaceAccessible[] = "org.a11y.atspi.Accessible";
+const char kIfaceAction[] = "org.a11y.atspi.Action";
+const char kIfaceComponent[] = "org.a11y.atspi.Component";
+const char kIfaceValue[] = "org.a11y.atspi.Value";
+const char kIfaceProperties[] = "org.freedesktop.DBus.Properties";
+
+// AtspiRole values.
+const uint32_t kRolePushButton = 43;
+const uint32_t kRoleFrame = 23;
+const uint32_t kRoleSlider = 51;
+const uint32_t kRoleToolBar = 63;
+const uint32_t kRoleParagraph = 73;
+const uint32_t kRoleApplication = 75;
+const uint32_t kRoleLink = 88;
+const uint32_t kRoleDocumentWeb = 95;
+
+// AtspiStateType bits.
+const uint64_t kStateEnabled = uint64_t(1) << 8;
+const uint64_t kStateFocusable = uint64_t(1) << 11;
+const uint64_t kStateSensitive = uint64_t(1) << 24;
+const uint64_t kStateShowing = uint64_t(1) << 25;
+const uint64_t kStateVisible = uint64_t(1) << 30;
+
+const uint64_t kStatesShown =
+    kStateEnabled | kStateSensitive | kStateVisible | kStateShowing;
+const uint64_t kStatesNotShowing = kStateEnabled | kStateSensitive |
+                                   kStateVisible;
+const uint64_t kStatesHidden = kStateEnabled | kStateSensitive;
+
+struct StubNode {
+  uint32_t mRole;
+  uint64_t mStates;
+  std::string mName;
+  int32_t mParent;
+  std::vector<int32_t> mChildren;
+  int32_t mExtents[4];
+  bool mHasAction;
+  bool mHasValue;
+};
+
+std::vector<StubNode> gNodes;
+std::string gUniqueName;
+
+int32_t AddNode(const int32_t aParent, const uint32_t aRole,
+                const uint64_t aStates, const char* aName) {
+  StubNode node{aRole, aStates, aName, aParent, {}, {0, 0, 0, 0}, false,
+                false};
+  if (aParent >= 0) {
+    const StubNode& parent = gNodes[aParent];
+    const int32_t index = static_cast<int32_t>(parent.mChildren.size());
+    // Lay children out in rows inside the parent, and push everything that
+    // is not showing off the bottom of the screen.
+    node.mExtents[0] = parent.mExtents[0] + 10 * (index % 8);
+    node.mExtents[1] = (aStates & kStateShowing)
+                           ? parent.mExtents[1] + 10 * (index / 8)
+                           : 100000;
+    node.mExtents[2] = 10;
+    node.mExtents[3] = 10;
+  }
+  gNodes.push_back(node);
+  const int32_t id = static_cast<int32_t>(gNodes.size() - 1);
+  if (aParent >= 0) {
+    gNodes[aParent].mChildren.push_back(id);
+  }
+  return id;
+}
+
+void BuildPage(const unsigned int aDepth, const unsigned int aFanout) {
+  AddNode(-1, kRoleApplication, kStateEnabled, kAppName);
+  const int32_t frame = AddNode(0, kRoleFrame, kStatesShown, "Stub Window");
+  gNodes[frame].mExtents[2] = 1000;
+  gNodes[frame].mExtents[3] = 800;
+
+  const int32_t toolbar = AddNode(frame, kRoleToolBar, kStatesShown, "");
+  for (unsigned int i = 0; i < aFanout; ++i) {
+    const int32_t button = AddNode(toolbar, kRolePushButton,
+                                   kStatesShown | kStateFocusable, "Button");
+    gNodes[button].mHasAction = true;
+  }
+  const int32_t slider = AddNode(toolbar, kRoleSlider,
+                                 kStatesShown | kStateFocusable, "Zoom");
+  gNodes[slider].mHasValue = true;
+
+  for (const uint64_t docStates : {kStatesHidden, kStatesShown}) {
+    const int32_t doc = AddNode(frame, kRoleDocumentWeb, docStates, "Page");
+    gNodes[doc].mExtents[1] = 100;
+    std::vector<int32_t> level(1, doc);
+    for (unsigned int d = 0; d < aDepth; ++d) {
+      std::vector<int32_t> next;
+      for (const int32_t parent : level) {
+        const uint64_t parentStates = gNodes[parent].mStates;
+        for (unsigned int i = 0; i < aFanout; ++i) {
+          const bool leaf = d + 1 == aDepth;
+          uint64_t states = parentStates;
+          if (!leaf && next.size() % 4 == 3 && (states & kStateShowing)) {
+            states = kStatesNotShowing;
+          }
+          next.push_back(AddNode(parent, leaf ? kRoleParagraph : kRoleLink,
+                                 states, leaf ? "Text" : "Link"));
+        }
+      }
+      level.swap(next);
+    }
+  }
+}
+
+std::string PathOf(const int32_t aNode) {
+  if (aNode < 0) {
+    return kNullPath;
+  }
+  if (!aNode) {
+    return kRootPath;
+  }
+  return kPathPrefix + std::to_string(aNode);
+}
+
+// Returns the node at aPath, or -1.
+int32_t NodeAt(const char* aPath) {
+  if (!strcmp(aPath, kRootPath)) {
+    return 0;
+  }
+  const size_t prefixLength = strlen(kPathPrefix);
+  if (strncmp(aPath, kPathPrefix, prefixLength)) {
+    return -1;
+  }
+  char* end;
+  const long id = strtol(aPath + prefixLength, &end, 10);
+  if (*end || id <= 0 || id >= static_cast<long>(gNodes.size())) {
+    return -1;
+  }
+  return static_cast<int32_t>(id);
+}
+
+void AppendObjectRef(DBusMessageIter* aIter, const std::string& aBusName,
+                     const std::string& aPath) {
+  DBusMessageIter ref;
+  const char* busName = aBusName.c_str();
+  const char* path = aPath.c_str();
+  dbus_message_iter_open_container(aIter, DBUS_TYPE_STRUCT, nullptr, &ref);
+  dbus_message_iter_append_basic(&ref, DBUS_TYPE_STRING, &busName);
+  dbus_message_iter_append_basic(&ref, DBUS_TYPE_OBJECT_PATH, &path);
+  dbus_message_iter_close_container(aIter, &ref);
+}
+
+void AppendNodeRef(DBusMessageIter* aIter, const int32_t aNode) {
+  AppendObjectRef(aIter, aNode < 0 ? std::string() : gUniqueName,
+                  PathOf(aNode));
+}
+
+// Appends a variant holding one value of the basic aType.
+void AppendVariant(DBusMessageIter* aIter, const int aType,
+                   const void* aValue) {
+  const char signature[2] = {static_cast<char>(aType), 0};
+  DBusMessageIter variant;
+  dbus_message_iter_open_container(aIter, DBUS_TYPE_VARIANT, signature,
+                                   &variant);
+  dbus_message_iter_append_basic(&variant, aType, aValue);
+  dbus_message_iter_close_container(aIter, &variant);
+}
+
+DBusMessage* Error(DBusMessage* aCall, const char* aName) {
+  return dbus_message_new_error(aCall, aName, dbus_message_get_member(aCall));
+}
+
+DBusMessage* GetProperty(DBusMessage* aCall, const int32_t aNode) {
+  const char* iface;
+  const char* property;
+  if (!dbus_message_get_args(aCall, nullptr, DBUS_TYPE_STRING, &iface,
+                             DBUS_TYPE_STRING, &property,
+                             DBUS_TYPE_INVALID)) {
+    return Error(aCall, DBUS_ERROR_INVALID_ARGS);
+  }
+
+  const StubNode& node = gNodes[aNode];
+  DBusMessage* reply = dbus_message_new_method_return(aCall);
+  DBusMessageIter iter;
+  dbus_message_iter_init_append(reply, &iter);
+  if (!strcmp(iface, kIfaceAccessible)) {
+    if (!strcmp(property, "Name")) {
+      const char* name = node.mName.c_str();
+      AppendVariant(&iter, DBUS_TYPE_STRING, &name);
+      return reply;
+    }
+    if (!strcmp(property, "Description") || !strcmp(property, "Locale")) {
+      const char* value = !strcmp(property, "Locale") ? "en-US" : "";
+      AppendVariant(&iter, DBUS_TYPE_STRING, &value);
+      return reply;
+    }
+    if (!strcmp(property, "ChildCount")) {
+      const int32_t count = static_cast<int32_t>(node.mChildren.size());
+      AppendVariant(&iter, DBUS_TYPE_INT32, &count);
+      return reply;
+    }
+    if (!strcmp(property, "Parent")) {
+      DBusMessageIter variant;
+      dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, "(so)",
+                                       &variant);
+      AppendNodeRef(&variant, node.mParent);
+      dbus_message_iter_close_container(&iter, &variant);
+      return reply;
+    }
+  } else if (!strcmp(iface, kIfaceValue) && node.mHasValue &&
+             !strcmp(property, "CurrentValue")) {
+    const double value = 50.0;
+    AppendVariant(&iter, DBUS_TYPE_DOUBLE, &value);
+    return reply;
+  }
+
+  dbus_message_unref(reply);
+  return Error(aCall, DBUS_ERROR_UNKNOWN_PROPERTY);
+}
+
+DBusMessage* HandleAccessible(DBusMessage* aCall, const int32_t aNode) {
+  const StubNode& node = gNodes[aNode];
+  const char* member = dbus_message_get_member(aCall);
+  DBusMessage* reply = dbus_message_new_method_return(aCall);
+  DBusMessageIter iter, array;
+  dbus_message_iter_init_append(reply, &iter);
+
+  if (!strcmp(member, "GetChildAtIndex")) {
+    int32_t index;
+    if (!dbus_message_get_args(aCall, nullptr, DBUS_TYPE_INT32, &index,
+                               DBUS_TYPE_INVALID)) {
+      dbus_message_unref(reply);
+      return Error(aCall, DBUS_ERROR_INVALID_ARGS);
+    }
+    const bool valid =
+        index >= 0 && index < static_cast<int32_t>(node.mChildren.size());
+    AppendNodeRef(&iter, valid ? node.mChildren[index] : -1);
+  } else if (!strcmp(member, "GetChildren")) {
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(so)", &array);
+    for (const int32_t child : node.mChildren) {
+      AppendNodeRef(&array, child);
+    }
+    dbus_message_iter_close_container(&iter, &array);
+  } else if (!strcmp(member, "GetRole")) {
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT32, &node.mRole);
+  } else if (!strcmp(member, "GetState")) {
+    const uint32_t words[2] = {static_cast<uint32_t>(node.mStates),
+                               static_cast<uint32_t>(node.mStates >> 32)};
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "u", &array);
+    for (const uint32_t word : words) {
+      dbus_message_iter_append_basic(&array, DBUS_TYPE_UINT32, &word);
+    }
+    dbus_message_iter_close_container(&iter, &array);
+  } else if (!strcmp(member, "GetAttributes")) {
+    DBusMessageIter entry;
+    const char* key = "tag";
+    const char* value = node.mRole == kRoleLink ? "a" : "div";
+    dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{ss}", &array);
+    dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, nullptr,
+                                     &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &value);
+    dbus_message_iter_close_container(&array, &entry);
+    dbus_message_iter_close_container(&iter, &array);
+  } else {
+    dbus_message_unref(reply);
+    return Error(aCall, DBUS_ERROR_UNKNOWN_METHOD);
+  }
+  return reply;
+}
+
+DBusMessage* HandleComponent(DBusMessage* aCall, const int32_t aNode) {
+  if (strcmp(dbus_message_get_member(aCall), "GetExtents") || !aNode) {
+    return Error(aCall, DBUS_ERROR_UNKNOWN_METHOD);
+  }
+  DBusMessage* reply = dbus_message_new_method_return(aCall);
+  DBusMessageIter iter, extents;
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_STRUCT, nullptr,
+                                   &extents);
+  for (const int32_t& value : gNodes[aNode].mExtents) {
+    dbus_message_iter_append_basic(&extents, DBUS_TYPE_INT32, &value);
+  }
+  dbus_message_iter_close_container(&iter, &extents);
+  return reply;
+}
+
+DBusMessage* HandleAction(DBusMessage* aCall, const int32_t aNode) {
+  if (!gNodes[aNode].mHasAction) {
+    return Error(aCall, DBUS_ERROR_UNKNOWN_INTERFACE);
+  }
+  if (strcmp(dbus_message_get_member(aCall), "GetKeyBinding")) {
+    return Error(aCall, DBUS_ERROR_UNKNOWN_METHOD);
+  }
+  DBusMessage* reply = dbus_message_new_method_return(aCall);
+  const char* binding = "Alt+B";
+  dbus_message_append_args(reply, DBUS_TYPE_STRING, &binding,
+                           DBUS_TYPE_INVALID);
+  return reply;
+}
+
+// The registry's root lists this application as the only one.
+DBusMessage* HandleRegistry(DBusMessage* aCall) {
+  const char* iface = dbus_message_get_interface(aCall);
+  const char* member = dbus_message_get_member(aCall);
+  if (strcmp(dbus_message_get_path(aCall), kRootPath) || !iface ||
+      strcmp(iface, kIfaceAccessible) || strcmp(member, "GetChildren")) {
+    return Error(aCall, DBUS_ERROR_UNKNOWN_METHOD);
+  }
+  DBusMessage* reply = dbus_message_new_method_return(aCall);
+  DBusMessageIter iter, array;
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(so)", &array);
+  AppendNodeRef(&array, 0);
+  dbus_message_iter_close_container(&iter, &array);
+  return reply;
+}
+
+DBusMessage* Handle(DBusMessage* aCall) {
+  const char* destination = dbus_message_get_destination(aCall);
+  if (destination && !strcmp(destination, kRegistryBusName)) {
+    return HandleRegistry(aCall);
+  }
+
+  const int32_t node = NodeAt(dbus_message_get_path(aCall));
+  const char* iface = dbus_message_get_interface(aCall);
+  if (node < 0) {
+    return Error(aCall, DBUS_ERROR_UNKNOWN_OBJECT);
+  }
+  if (!iface) {
+    return Error(aCall, DBUS_ERROR_UNKNOWN_METHOD);
+  }
+  if (!strcmp(iface, kIfaceProperties) &&
+      !strcmp(dbus_message_get_member(aCall), "Get")) {
+    return GetProperty(aCall, node);
+  }
+  if (!strcmp(iface, kIfaceAccessible)) {
+    return HandleAccessible(aCall, node);
+  }
+  if (!strcmp(iface, kIfaceComponent)) {
+    return HandleComponent(aCall, node);
+  }
+  if (!strcmp(iface, kIfaceAction)) {
+    return HandleAction(aCall, node);
+  }
+  return Error(aCall, DBUS_ERROR_UNKNOWN_INTERFACE);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  const unsigned long depth = argc > 1 ? strtoul(argv[1], nullptr, 0) : 4;
+  const unsigned long fanout = argc > 2 ? strtoul(argv[2], nullptr, 0) : 8;
+  BuildPage(static_cast<unsigned int>(depth),
+            static_cast<unsigned int>(fanout ? fanout : 1));
+
+  DBusError error;
+  dbus_error_init(&error);
+  DBusConnection* connection = dbus_bus_get(DBUS_BUS_SESSION, &error);
+  if (!connection) {
+    fprintf(stderr, "Couldn't connect to the session bus: %s\n",
+            error.message);
+    return 1;
+  }
+  gUniqueName = dbus_bus_get_unique_name(connection);
+
+  if (dbus_bus_request_name(connection, kBusName,
+                            DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+    fprintf(stderr, "Couldn't own %s: %s\n", kBusName,
+            error.message ? error.message : "already owned");
+    return 1;
+  }
+  // A real registry may already be running, in which case it lists us
+  // only if we register with it, which the stub does not do.
+  const int registry = dbus_bus_request_name(
+      connection, kRegistryBusName, DBUS_NAME_FLAG_DO_NOT_QUEUE, nullptr);
+
+  printf("ready: %zu nodes on %s (%s)%s\n", gNodes.size(), kBusName,
+         gUniqueName.c_str(),
+         registry == DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER
+             ? ", serving the registry"
+             : "");
+  fflush(stdout);
+
+  while (dbus_connection_read_write(connection, -1)) {
+    while (DBusMessage* message = dbus_connection_pop_message(connection)) {
+      if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+        DBusMessage* reply = Handle(message);
+        dbus_connection_send(connection, reply, nullptr);
+        dbus_message_unref(reply);
+      }
+      dbus_message_unref(message);
+    }
+  }
+  return 0;
+}
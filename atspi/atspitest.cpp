@@ -0,0 +1,413 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Runs find-document, speed-all, speed-visible and dump-entire-tree against
+// an application's AT-SPI2 tree on Linux, with the same output as a11ytest
+// prints for IA2 on Windows. It needs libdbus-1, eg:
+//
+//   g++ -O2 -I../include `pkg-config --cflags dbus-1` atspitest.cpp
+//       AtspiBackend.cpp ../src/TreeBench.cpp ../src/PropertyCosts.cpp
+//       ../src/BenchStats.cpp ../src/A11yCall.cpp ../src/LatencyHistogram.cpp
+//       `pkg-config --libs dbus-1`
+//
+// check.sh runs it against atspistub, a stand-in application.
+
+#include "AtspiBackend.h"
+#include "BenchStats.h"
+#include "IpcAccounting.h"
+#include "TreeBench.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace aspk;
+
+namespace {
+
+const char kSwitchApp[] = "-app";
+const char kSwitchBusName[] = "-bus-name";
+const char kSwitchChildStrategy[] = "-children";
+const char kSwitchProperties[] = "-props";
+const char kSwitchWarmup[] = "-warmup";
+const char kSwitchIterations[] = "-iterations";
+const char kSwitchKeepOutliers[] = "-keep-outliers";
+const char kSwitchViewport[] = "-viewport";
+const char kSwitchBoundRefs[] = "-bound-refs";
+const char kSwitchOrder[] = "-order";
+const char kSwitchMaxDepth[] = "-max-depth";
+
+enum Command : uint32_t {
+  NONE = 0,
+  FIND_DOCUMENT = 0x1,
+  SPEED_ALL = 0x2,
+  SPEED_VISIBLE = 0x4,
+  DUMP_ENTIRE_TREE = 0x8,
+};
+
+const struct {
+  const char* mName;
+  Command mCommand;
+} kCommands[] = {
+    {"find-document", FIND_DOCUMENT},
+    {"speed-all", SPEED_ALL},
+    {"speed-visible", SPEED_VISIBLE},
+    {"dump-entire-tree", DUMP_ENTIRE_TREE},
+};
+
+const ChildStrategy kAllChildStrategies[] = {ChildStrategy::Navigate,
+                                             ChildStrategy::Bulk};
+
+const char* gAppName = "Firefox";
+const char* gBusName;
+ChildStrategy gChildStrategy = ChildStrategy::Navigate;
+uint32_t gPropertyMask = kAllAccPropertiesMask;
+unsigned int gWarmupIterations;
+unsigned int gMeasuredIterations = 1;
+bool gRejectOutliers = true;
+bool gCompareViewportCulling;
+bool gBoundRefs;
+TreeWalkOptions gWalkOptions;
+
+TraversalCounters gCounters;
+PropertyCosts gPropertyCosts;
+
+void Print(const char* aFmt, ...) {
+  va_list args;
+  va_start(args, aFmt);
+  vprintf(aFmt, args);
+  va_end(args);
+}
+
+TreeBenchOptions GetTreeBenchOptions(const ChildStrategy aStrategy,
+                                     const bool aCullToViewport) {
+  TreeBenchOptions options;
+  options.mStrategy = aStrategy;
+  options.mPropertyMask = gPropertyMask;
+  options.mCullToViewport = aCullToViewport;
+  options.mBoundRefs = gBoundRefs;
+  options.mWalk = gWalkOptions;
+  options.mPrint = &Print;
+  return options;
+}
+
+std::string TraversalLabel(const ChildStrategy aStrategy,
+                           const bool aCullToViewport) {
+  std::string label(gBoundRefs ? "bounded" : ChildStrategyName(aStrategy));
+  if (aCullToViewport) {
+    label += "+viewport";
+  }
+  if (!gBoundRefs && gWalkOptions.mOrder != WalkOrder::DepthFirst) {
+    label += "+";
+    label += WalkOrderName(gWalkOptions.mOrder);
+  }
+  if (gWalkOptions.mMaxDepth != kNoDepthLimit) {
+    label += "+depth" + std::to_string(gWalkOptions.mMaxDepth);
+  }
+  return label;
+}
+
+// Prints the child round-trips per node, as a11ytest does, every D-Bus call
+// made per node, property queries included, and the most nodes held at once.
+void PrintCounters(const std::string& aLabel, const uint64_t aCalls) {
+  Print("[%s] %llu nodes, %llu child round-trips (%g per node), %llu D-Bus "
+        "calls (%g per node)\n",
+        aLabel.c_str(), static_cast<unsigned long long>(gCounters.mNodes),
+        static_cast<unsigned long long>(gCounters.mRoundTrips),
+        gCounters.RoundTripsPerNode(),
+        static_cast<unsigned long long>(aCalls),
+        gCounters.mNodes ? static_cast<double>(aCalls) /
+                               static_cast<double>(gCounters.mNodes)
+                         : 0.0);
+  IpcAccounting::Get().Print(stdout, gCounters.mNodes);
+  Print("\t%u levels deep, at most %llu nodes held at once\n",
+        gCounters.mMaxDepth,
+        static_cast<unsigned long long>(BackendNode::Live().Peak()));
+  if (gCounters.mDepthLimited) {
+    Print("\t%llu nodes at the depth limit\n",
+          static_cast<unsigned long long>(gCounters.mDepthLimited));
+  }
+}
+
+// Starts the counters that PrintCounters reports afresh.
+void ResetCounters() {
+  gCounters.Reset();
+  IpcAccounting::Get().Reset();
+  BackendNode::Live().ResetPeak();
+}
+
+/**
+ * Runs aRun gWarmupIterations times, then gMeasuredIterations times, and
+ * summarizes the measured runs. gCounters and aOutCalls describe the last.
+ */
+bool RunBenchmark(AtspiBackend& aBackend,
+                  const std::function<bool(double&)>& aRun,
+                  SampleSummary& aOut, uint64_t& aOutCalls) {
+  double ms = 0.0;
+  for (unsigned int i = 0; i < gWarmupIterations; ++i) {
+    ResetCounters();
+    if (!aRun(ms)) {
+      return false;
+    }
+  }
+
+  gPropertyCosts.Reset();
+
+  std::vector<double> samples;
+  samples.reserve(gMeasuredIterations);
+  for (unsigned int i = 0; i < gMeasuredIterations; ++i) {
+    ResetCounters();
+    const uint64_t calls = aBackend.Calls();
+    if (!aRun(ms)) {
+      return false;
+    }
+    aOutCalls = aBackend.Calls() - calls;
+    samples.push_back(ms);
+  }
+
+  return Summarize(samples, gRejectOutliers, aOut);
+}
+
+void PrintBenchmark(const char* aLabel, const SampleSummary& aSummary) {
+  if (aSummary.mCount + aSummary.mOutliers == 1) {
+    Print("%s: Total execution time: %g ms\n", aLabel, aSummary.mMean);
+    return;
+  }
+  PrintSummary(stdout, aLabel, "ms", aSummary);
+}
+
+bool FindDocument(AtspiBackend& aBackend) {
+  TreeBench bench(aBackend, GetTreeBenchOptions(gChildStrategy, false),
+                  gCounters, gPropertyCosts);
+  BackendNodePtr doc = bench.FindVisibleRole(aBackend.Root(),
+                                             kAccRoleDocument);
+  if (!doc) {
+    Print("Couldn't find document!\n");
+    return false;
+  }
+
+  Print("Document: ");
+  bench.DumpNode(doc);
+  return true;
+}
+
+bool SpeedAll(AtspiBackend& aBackend) {
+  for (ChildStrategy strategy : kAllChildStrategies) {
+    TreeBenchOptions options = GetTreeBenchOptions(strategy, false);
+    SampleSummary summary;
+    uint64_t calls = 0;
+    bool ok = RunBenchmark(
+        aBackend,
+        [&](double& aOutMs) {
+          TreeBench bench(aBackend, options, gCounters, gPropertyCosts);
+          return bench.FindDocumentAndQuery(aOutMs);
+        },
+        summary, calls);
+    if (!ok) {
+      return false;
+    }
+    PrintBenchmark(ChildStrategyName(strategy), summary);
+    PrintCounters(TraversalLabel(strategy, false), calls);
+    gPropertyCosts.Print(stdout);
+  }
+  return true;
+}
+
+bool SpeedVisible(AtspiBackend& aBackend) {
+  for (ChildStrategy strategy : kAllChildStrategies) {
+    TraversalCounters stateCounters;
+    SampleSummary stateSummary;
+    for (bool cull : {false, true}) {
+      if (cull && !gCompareViewportCulling) {
+        break;
+      }
+      TreeBenchOptions options = GetTreeBenchOptions(strategy, cull);
+      SampleSummary summary;
+      uint64_t calls = 0;
+      bool ok = RunBenchmark(
+          aBackend,
+          [&](double& aOutMs) {
+            TreeBench bench(aBackend, options, gCounters, gPropertyCosts);
+            bench.WalkVisible(aBackend.Root(), aOutMs);
+            return true;
+          },
+          summary, calls);
+      if (!ok) {
+        return false;
+      }
+      const std::string label = TraversalLabel(strategy, cull);
+      PrintBenchmark(label.c_str(), summary);
+      PrintCounters(label, calls);
+      if (cull) {
+        const double savedNodes = static_cast<double>(stateCounters.mNodes) -
+                                  static_cast<double>(gCounters.mNodes);
+        Print("\tviewport culling visited %.0f fewer nodes and saved %g ms\n",
+              savedNodes, stateSummary.mMedian - summary.mMedian);
+      } else {
+        stateCounters = gCounters;
+        stateSummary = summary;
+      }
+      gPropertyCosts.Print(stdout);
+    }
+  }
+  return true;
+}
+
+bool DumpEntireTree(AtspiBackend& aBackend) {
+  ResetCounters();
+  const uint64_t calls = aBackend.Calls();
+  TreeBench bench(aBackend, GetTreeBenchOptions(gChildStrategy, false),
+                  gCounters, gPropertyCosts);
+  bench.DumpTree(aBackend.Root());
+  PrintCounters(TraversalLabel(gChildStrategy, false),
+                aBackend.Calls() - calls);
+  return true;
+}
+
+void Usage(const char* aArgv0) {
+  Print(
+      "Usage: %s [-app <name>|-bus-name <name>] [-children navigate|bulk]\n"
+      "       [-props <list>] [-warmup <n>] [-iterations <n>]\n"
+      "       [-keep-outliers] [-viewport] [-bound-refs] [-order dfs|bfs]\n"
+      "       [-max-depth <n>] <command(s)>\n\n",
+      aArgv0);
+  Print(
+      "Commands: find-document, speed-all, speed-visible, "
+      "dump-entire-tree.\n\n");
+  Print(
+      "The application is the one that the AT-SPI registry lists with the\n"
+      "-app name (default \"Firefox\"), or the one that owns -bus-name on\n"
+      "the accessibility bus, or on the session bus if there is none.\n\n");
+  Print(
+      "-children selects how children are fetched: \"navigate\" (the\n"
+      "default) reads ChildCount and calls GetChildAtIndex per child,\n"
+      "\"bulk\" calls GetChildren once. speed-* commands report both.\n\n");
+  Print(
+      "-bound-refs walks holding only the path to the current node, moving\n"
+      "to each sibling with GetChildAtIndex on its parent, rather than\n"
+      "holding every pending sibling.\n\n");
+  Print(
+      "Roles and states are printed as their MSAA (or IA2) equivalents.\n"
+      "The other switches are as for a11ytest.\n");
+}
+
+bool ParseUnsigned(const char* aArg, unsigned int& aOut) {
+  char* end;
+  const unsigned long value = strtoul(aArg, &end, 0);
+  if (!*aArg || *end) {
+    return false;
+  }
+  aOut = static_cast<unsigned int>(value);
+  return true;
+}
+
+bool ParseCommandLine(int argc, char* argv[], uint32_t& aOutCommands) {
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+    if (!strcmp(arg, kSwitchApp) && hasValue) {
+      gAppName = argv[++i];
+    } else if (!strcmp(arg, kSwitchBusName) && hasValue) {
+      gBusName = argv[++i];
+    } else if (!strcmp(arg, kSwitchChildStrategy) && hasValue) {
+      ++i;
+      if (!strcmp(argv[i], "navigate")) {
+        gChildStrategy = ChildStrategy::Navigate;
+      } else if (!strcmp(argv[i], "bulk")) {
+        gChildStrategy = ChildStrategy::Bulk;
+      } else {
+        return false;
+      }
+    } else if (!strcmp(arg, kSwitchProperties) && hasValue) {
+      const std::string spec(argv[++i]);
+      const std::wstring wideSpec(spec.begin(), spec.end());
+      gPropertyMask = 0;
+      if (!ParseAccPropertyMask(wideSpec.c_str(), gPropertyMask)) {
+        return false;
+      }
+    } else if (!strcmp(arg, kSwitchWarmup) && hasValue) {
+      if (!ParseUnsigned(argv[++i], gWarmupIterations)) {
+        return false;
+      }
+    } else if (!strcmp(arg, kSwitchIterations) && hasValue) {
+      if (!ParseUnsigned(argv[++i], gMeasuredIterations) ||
+          !gMeasuredIterations) {
+        return false;
+      }
+    } else if (!strcmp(arg, kSwitchKeepOutliers)) {
+      gRejectOutliers = false;
+    } else if (!strcmp(arg, kSwitchViewport)) {
+      gCompareViewportCulling = true;
+    } else if (!strcmp(arg, kSwitchBoundRefs)) {
+      gBoundRefs = true;
+    } else if (!strcmp(arg, kSwitchOrder) && hasValue) {
+      ++i;
+      if (!strcmp(argv[i], "dfs")) {
+        gWalkOptions.mOrder = WalkOrder::DepthFirst;
+      } else if (!strcmp(argv[i], "bfs")) {
+        gWalkOptions.mOrder = WalkOrder::BreadthFirst;
+      } else {
+        return false;
+      }
+    } else if (!strcmp(arg, kSwitchMaxDepth) && hasValue) {
+      if (!ParseUnsigned(argv[++i], gWalkOptions.mMaxDepth)) {
+        return false;
+      }
+    } else {
+      bool found = false;
+      for (const auto& command : kCommands) {
+        if (!strcmp(arg, command.mName)) {
+          aOutCommands |= command.mCommand;
+          found = true;
+        }
+      }
+      if (!found) {
+        return false;
+      }
+    }
+  }
+  return aOutCommands != NONE;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  uint32_t commands = NONE;
+  if (!ParseCommandLine(argc, argv, commands)) {
+    Usage(argv[0]);
+    return 1;
+  }
+
+  AtspiBackend backend(&Print);
+  if (!backend.Connect(gAppName, gBusName)) {
+    return 1;
+  }
+
+  bool ok = true;
+  if (ok && (commands & FIND_DOCUMENT)) {
+    ok = FindDocument(backend);
+  }
+  if (ok && (commands & SPEED_ALL)) {
+    ok = SpeedAll(backend);
+  }
+  if (ok && (commands & SPEED_VISIBLE)) {
+    ok = SpeedVisible(backend);
+  }
+  if (ok && (commands & DUMP_ENTIRE_TREE)) {
+    ok = DumpEntireTree(backend);
+  }
+
+  Print("\nPer-method latencies:\n");
+  MethodLatencies::Get().Print(stdout);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,52 @@
+#!/bin/sh
+# This Source Code Form is subject to the terms of the Mozilla Public
+# License, v. 2.0. If a copy of the MPL was not distributed with this
+# file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+# Runs every atspitest command against atspistub on a private session bus,
+# and checks that dump-entire-tree reaches every node with both child
+# strategies, breadth-first and with bounded references, once through the
+# registry and once by bus name.
+#
+#   dbus-run-session -- ./check.sh
+
+set -e
+cd "$(dirname "$0")"
+
+log=$(mktemp)
+./atspistub 3 4 > "$log" &
+stub=$!
+trap 'kill $stub; rm -f "$log"' EXIT
+while ! grep -q ready "$log"; do
+  sleep 0.1
+done
+nodes=$(sed -n 's/^ready: \([0-9]*\) nodes.*/\1/p' "$log")
+
+./atspitest -app atspistub find-document speed-all speed-visible -viewport
+
+failures=0
+for args in "-app atspistub" "-bus-name org.aspk.AtspiStub"; do
+  for strategy in navigate bulk; do
+    if ! ./atspitest $args -children $strategy dump-entire-tree |
+        grep -q "^\[$strategy\] $nodes nodes"; then
+      echo "FAILED: dump-entire-tree $args -children $strategy"
+      failures=$((failures + 1))
+    fi
+  done
+  if ! ./atspitest $args -order bfs dump-entire-tree |
+      grep -q "^\[navigate+bfs\] $nodes nodes"; then
+    echo "FAILED: dump-entire-tree $args -order bfs"
+    failures=$((failures + 1))
+  fi
+  if ! ./atspitest $args -bound-refs dump-entire-tree |
+      grep -q "^\[bounded\] $nodes nodes"; then
+    echo "FAILED: dump-entire-tree $args -bound-refs"
+    failures=$((failures + 1))
+  fi
+done
+
+if [ $failures -ne 0 ]; then
+  echo "$failures checks failed"
+  exit 1
+fi
+echo "All checks passed"
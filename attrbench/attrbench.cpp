@@ -0,0 +1,318 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Measures and fuzzes the IA2 object attribute parser. It does not use COM,
+// so it builds anywhere; the Tupfile builds it with g++ on Linux, as in:
+//
+//   g++ -O2 -I../include attrbench.cpp ../src/IA2Attributes.cpp
+//
+//   attrbench [bench [<nodes>]]       Time parsing Gecko-like attributes
+//   attrbench fuzz [<runs> [<seed>]]  Check the parser against a reference
+
+#include "IA2Attributes.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace aspk;
+
+namespace {
+
+using AttributeList = std::vector<std::pair<std::wstring, std::wstring>>;
+
+// A deliberately simple parser with the same rules as IA2AttributeParser: it
+// copies every key and value into its own string as it goes.
+void ReferenceParse(const wchar_t* aData, size_t aLength,
+                    AttributeList& aOut) {
+  aOut.clear();
+  std::wstring key, value;
+  std::wstring* cur = &key;
+  bool sawColon = false;
+  for (size_t i = 0; i < aLength; ++i) {
+    wchar_t c = aData[i];
+    if (c == L'\\') {
+      if (i + 1 < aLength) {
+        c = aData[++i];
+      }
+      cur->push_back(c);
+    } else if (c == L':' && !sawColon) {
+      sawColon = true;
+      cur = &value;
+    } else if (c == L';') {
+      if (sawColon) {
+        aOut.emplace_back(key, value);
+      }
+      key.clear();
+      value.clear();
+      cur = &key;
+      sawColon = false;
+    } else {
+      cur->push_back(c);
+    }
+  }
+  if (sawColon) {
+    aOut.emplace_back(key, value);
+  }
+}
+
+// What a parser that allocates does: copy everything into a map, then look
+// up the common attributes.
+void NaiveParseCommon(const wchar_t* aData, size_t aLength, long& aOutLevel,
+                      size_t& aOutTagLength) {
+  AttributeList list;
+  ReferenceParse(aData, aLength, list);
+  std::unordered_map<std::wstring, std::wstring> map(list.begin(),
+                                                     list.end());
+  aOutLevel = 0;
+  aOutTagLength = 0;
+  auto it = map.find(L"level");
+  if (it != map.end()) {
+    aOutLevel = wcstol(it->second.c_str(), nullptr, 10);
+  }
+  it = map.find(L"tag");
+  if (it != map.end()) {
+    aOutTagLength = it->second.size();
+  }
+  map.find(L"display");
+  map.find(L"xml-roles");
+}
+
+uint64_t NextRandom(uint64_t& aState) {
+  // xorshift64*
+  aState ^= aState >> 12;
+  aState ^= aState << 25;
+  aState ^= aState >> 27;
+  return aState * 0x2545F4914F6CDD1DULL;
+}
+
+// Attributes in the style of what Gecko reports for HTML content.
+std::vector<std::wstring> MakeCorpus(const size_t aNodes) {
+  static const wchar_t* kTags[] = {L"div", L"p", L"a", L"span", L"li",
+                                   L"h2", L"td", L"button"};
+  static const wchar_t* kDisplays[] = {L"block", L"inline", L"list-item",
+                                       L"table-cell", L"inline-block"};
+  static const wchar_t* kRoles[] = {L"", L"link", L"heading",
+                                    L"navigation main", L"button"};
+
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  std::vector<std::wstring> corpus;
+  corpus.reserve(aNodes);
+  wchar_t buf[512];
+  for (size_t i = 0; i < aNodes; ++i) {
+    const uint64_t r = NextRandom(rng);
+    int len = swprintf(
+        buf, sizeof(buf) / sizeof(buf[0]),
+        L"margin-left:%dpx;text-align:start;formatting:block;display:%ls;"
+        L"margin-right:0px;tag:%ls;margin-top:%dpx;text-indent:0px;"
+        L"margin-bottom:0px;",
+        static_cast<int>(r % 32), kDisplays[(r >> 8) % 5],
+        kTags[(r >> 16) % 8], static_cast<int>((r >> 24) % 16));
+    std::wstring attrs(buf, len);
+    const wchar_t* role = kRoles[(r >> 32) % 5];
+    if (*role) {
+      attrs += L"xml-roles:";
+      attrs += role;
+      attrs += L";";
+    }
+    if ((r >> 40) % 4 == 0) {
+      attrs += L"level:2;";
+    }
+    if ((r >> 48) % 8 == 0) {
+      // URLs and font families are where escapes show up in practice.
+      attrs += L"src:https\\://example.com/a\\;b.png;font-family:a\\,b;";
+    }
+    corpus.push_back(std::move(attrs));
+  }
+  return corpus;
+}
+
+template <typename Fn>
+double BestNsPerNode(const std::vector<std::wstring>& aCorpus, Fn&& aFn,
+                     uint64_t& aOutChecksum) {
+  const int kRuns = 5;
+  double best = 0.0;
+  for (int run = 0; run < kRuns; ++run) {
+    uint64_t checksum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const std::wstring& attrs : aCorpus) {
+      checksum += aFn(attrs);
+    }
+    std::chrono::duration<double, std::nano> elapsed =
+        std::chrono::steady_clock::now() - start;
+    const double ns = elapsed.count() / static_cast<double>(aCorpus.size());
+    if (!run || ns < best) {
+      best = ns;
+    }
+    aOutChecksum = checksum;
+  }
+  return best;
+}
+
+uint64_t CommonChecksum(const std::wstring& aAttrs,
+                        IA2DelimiterScanner aScanner) {
+  IA2CommonAttributes common;
+  ParseCommonIA2Attributes(aAttrs.data(), aAttrs.size(), common, aScanner);
+  return static_cast<uint64_t>(common.mLevel) * 1000 + common.mTag.mLength;
+}
+
+int Bench(const size_t aNodes) {
+  std::vector<std::wstring> corpus = MakeCorpus(aNodes);
+  size_t units = 0;
+  for (const std::wstring& attrs : corpus) {
+    units += attrs.size();
+  }
+  printf("%zu nodes, %.1f characters per node\n", aNodes,
+         static_cast<double>(units) / static_cast<double>(aNodes));
+
+  struct Variant {
+    const char* mName;
+    double mNs;
+    uint64_t mChecksum;
+  };
+  Variant variants[3] = {{"naive (copy into a map)", 0.0, 0},
+                         {"zero-copy, scalar scan", 0.0, 0},
+                         {"zero-copy, SIMD scan", 0.0, 0}};
+
+  variants[0].mNs = BestNsPerNode(
+      corpus,
+      [](const std::wstring& aAttrs) {
+        long level;
+        size_t tagLength;
+        NaiveParseCommon(aAttrs.data(), aAttrs.size(), level, tagLength);
+        return static_cast<uint64_t>(level) * 1000 + tagLength;
+      },
+      variants[0].mChecksum);
+  variants[1].mNs = BestNsPerNode(
+      corpus,
+      [](const std::wstring& aAttrs) {
+        return CommonChecksum(aAttrs, FindIA2DelimiterScalar);
+      },
+      variants[1].mChecksum);
+  variants[2].mNs = BestNsPerNode(
+      corpus,
+      [](const std::wstring& aAttrs) {
+        return CommonChecksum(aAttrs, FindIA2Delimiter);
+      },
+      variants[2].mChecksum);
+
+  for (const Variant& variant : variants) {
+    printf("%-26s %8.1f ns/node %8.1f Mchars/s %6.2fx\n", variant.mName,
+           variant.mNs,
+           static_cast<double>(units) / static_cast<double>(aNodes) /
+               variant.mNs * 1000.0,
+           variants[0].mNs / variant.mNs);
+  }
+
+  if (variants[1].mChecksum != variants[0].mChecksum ||
+      variants[2].mChecksum != variants[0].mChecksum) {
+    printf("Parsers disagree!\n");
+    return 1;
+  }
+  return 0;
+}
+
+void PrintInput(const wchar_t* aData, size_t aLength) {
+  for (size_t i = 0; i < aLength; ++i) {
+    const unsigned int c = static_cast<unsigned int>(aData[i]);
+    if (c >= 0x20 && c < 0x7F) {
+      putchar(static_cast<int>(c));
+    } else {
+      printf("\\u%04X", c);
+    }
+  }
+  putchar('\n');
+}
+
+bool CheckParser(const wchar_t* aData, size_t aLength,
+                 const AttributeList& aExpected,
+                 IA2DelimiterScanner aScanner) {
+  IA2AttributeParser parser(aData, aLength, aScanner);
+  IA2Attribute attr;
+  size_t i = 0;
+  std::wstring key, value;
+  for (; parser.Next(attr); ++i) {
+    key.clear();
+    value.clear();
+    attr.mKey.AppendTo(key);
+    attr.mValue.AppendTo(value);
+    if (i >= aExpected.size() || key != aExpected[i].first ||
+        value != aExpected[i].second ||
+        !attr.mKey.Equals(key.data(), key.size()) ||
+        !attr.mValue.Equals(value.data(), value.size()) ||
+        (!attr.mValue.mEscaped && value.size() != attr.mValue.mLength)) {
+      return false;
+    }
+  }
+  return i == aExpected.size();
+}
+
+int Fuzz(const uint64_t aRuns, uint64_t aSeed) {
+  // Mostly delimiters, so that escapes and empty keys and values are common,
+  // plus characters that only differ from a delimiter in their high bits.
+  static const wchar_t kAlphabet[] = {L':',    L';',    L'\\',   L'a',
+                                      L'b',    L'1',    L'-',    L' ',
+                                      0xFF3A,  0x3B00,  0x5C5C,  0x013A};
+  const size_t kAlphabetSize = sizeof(kAlphabet) / sizeof(kAlphabet[0]);
+  uint64_t rng = aSeed ? aSeed : 1;
+  AttributeList expected;
+
+  for (uint64_t run = 0; run < aRuns; ++run) {
+    const size_t length = NextRandom(rng) % 100;
+    // Allocate exactly length characters so that overreads are caught by
+    // AddressSanitizer or page heap.
+    std::unique_ptr<wchar_t[]> data(new wchar_t[length ? length : 1]);
+    for (size_t i = 0; i < length; ++i) {
+      data[i] = kAlphabet[NextRandom(rng) % kAlphabetSize];
+    }
+
+    for (size_t i = 0; i < length; ++i) {
+      const wchar_t* scalar = FindIA2DelimiterScalar(&data[i], &data[length]);
+      if (FindIA2Delimiter(&data[i], &data[length]) != scalar) {
+        printf("Delimiter scans disagree at %zu in run %llu:\n", i,
+               static_cast<unsigned long long>(run));
+        PrintInput(data.get(), length);
+        return 1;
+      }
+    }
+
+    ReferenceParse(data.get(), length, expected);
+    if (!CheckParser(data.get(), length, expected, FindIA2Delimiter) ||
+        !CheckParser(data.get(), length, expected, FindIA2DelimiterScalar)) {
+      printf("Parser disagrees with the reference in run %llu:\n",
+             static_cast<unsigned long long>(run));
+      PrintInput(data.get(), length);
+      return 1;
+    }
+  }
+
+  printf("%llu runs passed\n", static_cast<unsigned long long>(aRuns));
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && !strcmp(argv[1], "fuzz")) {
+    const uint64_t runs = argc > 2 ? strtoull(argv[2], nullptr, 0) : 1000000;
+    const uint64_t seed = argc > 3 ? strtoull(argv[3], nullptr, 0) : 1;
+    return Fuzz(runs, seed);
+  }
+  if (argc > 1 && strcmp(argv[1], "bench")) {
+    printf("Usage: %s [bench [<nodes>]] | fuzz [<runs> [<seed>]]\n", argv[0]);
+    return 2;
+  }
+  const size_t nodes = argc > 2 ? strtoul(argv[2], nullptr, 0) : 100000;
+  return Bench(nodes ? nodes : 1);
+}
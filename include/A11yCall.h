@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_A11YCALL_H
+#define __ASPK_A11YCALL_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+
+#include "LatencyHistogram.h"
+
+/**
+ * Every accessibility API entry point that we time. To instrument a new call,
+ * add it here and invoke it through A11Y_CALL or A11Y_CALL_FN from ComCall.h,
+ * or through TimeA11yCall off Windows.
+ *
+ * The entries from GetAddress on are AT-SPI2 D-Bus calls, timed through
+ * TimeA11yCall. Properties are read with Properties.Get and are listed as Get
+ * followed by the property name.
+ */
+#define A11Y_METHODS(X)                \
+  X(AccessibleObjectFromWindow)  \
+  X(AccessibleChildren)          \
+  X(QueryInterface)              \
+  X(QueryService)                \
+  X(accNavigate)                 \
+  X(accLocation)                 \
+  X(get_accParent)               \
+  X(get_accChild)                \
+  X(get_accChildCount)           \
+  X(get_accRole)                 \
+  X(get_accState)                \
+  X(get_accName)                 \
+  X(get_accValue)                \
+  X(get_accDescription)          \
+  X(get_accKeyboardShortcut)     \
+  X(get_states)                  \
+  X(role)                        \
+  X(get_locale)                  \
+  X(get_attributes)              \
+  X(get_uniqueID)                \
+  X(get_windowHandle)            \
+  X(get_appName)                 \
+  X(get_appVersion)              \
+  X(get_toolkitName)             \
+  X(get_toolkitVersion)          \
+  X(Next)                        \
+  X(Reset)                       \
+  X(GetAddress)                  \
+  X(GetNameOwner)                \
+  X(GetChildAtIndex)             \
+  X(GetChildren)                 \
+  X(GetRole)                     \
+  X(GetState)                    \
+  X(GetAttributes)               \
+  X(GetExtents)                  \
+  X(GetKeyBinding)               \
+  X(GetName)                     \
+  X(GetDescription)              \
+  X(GetChildCount)               \
+  X(GetParent)                   \
+  X(GetLocale)                   \
+  X(GetCurrentValue)
+
+namespace aspk {
+
+enum class A11yMethod : uint32_t {
+#define A11Y_METHOD_ENUM(name) name,
+  A11Y_METHODS(A11Y_METHOD_ENUM)
+#undef A11Y_METHOD_ENUM
+  Count
+};
+
+const char* A11yMethodName(A11yMethod aMethod);
+
+/**
+ * One latency histogram per A11yMethod, in nanoseconds. Shared by every
+ * thread in the process.
+ */
+class MethodLatencies {
+ public:
+  static MethodLatencies& Get();
+
+  void Record(A11yMethod aMethod, uint64_t aNanoseconds) {
+    mHistograms[static_cast<uint32_t>(aMethod)].Record(aNanoseconds);
+  }
+
+  void Reset();
+
+  // Prints counts and percentiles (in microseconds) for every method that was
+  // called at least once. Prints nothing if no calls were recorded.
+  void Print(FILE* aOut) const;
+
+ private:
+  MethodLatencies() = default;
+
+  LatencyHistogram mHistograms[static_cast<uint32_t>(A11yMethod::Count)];
+};
+
+template <typename Fn>
+inline auto TimeA11yCall(A11yMethod aMethod, Fn&& aFn) -> decltype(aFn()) {
+  auto start = std::chrono::steady_clock::now();
+  auto result = aFn();
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  MethodLatencies::Get().Record(
+      aMethod, static_cast<uint64_t>(
+                   std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed)
+                       .count()));
+  return result;
+}
+
+}  // namespace aspk
+
+#endif  // __ASPK_A11YCALL_H
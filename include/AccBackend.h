@@ -0,0 +1,138 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_ACCBACKEND_H
+#define __ASPK_ACCBACKEND_H
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ChildFetch.h"
+#include "LiveCount.h"
+#include "PropertyCosts.h"
+#include "ScreenRect.h"
+
+namespace aspk {
+
+// Backends report roles and states as their MSAA equivalents, so that every
+// backend's output reads the same. These are the values from oleacc.h.
+static const long kAccRoleDocument = 0x0F;
+static const long kAccStateInvisible = 0x8000;
+static const long kAccStateOffscreen = 0x10000;
+
+inline bool IsVisibleAccState(const long aState) {
+  return (aState & (kAccStateInvisible | kAccStateOffscreen)) == 0;
+}
+
+/**
+ * A node of a backend's tree. Backends derive from this to hold whatever
+ * keeps the node reachable, eg a COM proxy; nothing else looks inside.
+ *
+ * Every node alive is counted in Live(), since each is a reference that pins
+ * something in the target application.
+ */
+class BackendNode {
+ public:
+  BackendNode() { Live().Add(); }
+  BackendNode(const BackendNode&) { Live().Add(); }
+  virtual ~BackendNode() { Live().Remove(); }
+
+  static LiveCount& Live() {
+    static LiveCount sLive;
+    return sLive;
+  }
+};
+
+using BackendNodePtr = std::shared_ptr<const BackendNode>;
+
+// What a tree dump prints about a node.
+struct BackendNodeDescription {
+  // Identify the node and its parent within this process, eg by proxy
+  // address. Only ever printed.
+  const void* mIdentity = nullptr;
+  const void* mParentIdentity = nullptr;
+  std::string mName;  // UTF-8
+  long mRole = 0;
+  bool mHasUniqueId = false;
+  long mUniqueId = 0;
+  bool mHasParentUniqueId = false;
+  long mParentUniqueId = 0;
+};
+
+/**
+ * The accessibility API that TreeBench walks. Each platform API, and the
+ * in-memory FakeBackend, implements this once; everything that walks, times
+ * and reports sits above it and builds on any platform.
+ *
+ * A backend is used from one thread at a time.
+ */
+class AccBackend {
+ public:
+  virtual ~AccBackend() = default;
+
+  // A short name for reports, eg "ia2".
+  virtual const char* Name() const = 0;
+
+  // Looks up the root of the tree afresh, as a client connecting to the
+  // application would. Returns null if it cannot be reached.
+  virtual BackendNodePtr Root() = 0;
+
+  // Fetches aNode's children in document order into aOut, adding the
+  // round-trips made to aCounters. See FetchChildren for aStrategy and
+  // aMaxChunk; backends without an equivalent of both strategies may treat
+  // them alike.
+  virtual void GetChildren(const BackendNodePtr& aNode,
+                           ChildStrategy aStrategy, size_t aMaxChunk,
+                           std::vector<BackendNodePtr>& aOut,
+                           TraversalCounters& aCounters) = 0;
+
+  /**
+   * Return aNode's first child, or the sibling after aNode, or null if there
+   * is none, adding the round-trips made to aCounters. Walks that bound the
+   * references they hold move through the tree with these one node at a
+   * time instead of fetching every child up front.
+   */
+  virtual BackendNodePtr FirstChild(const BackendNodePtr& aNode,
+                                    TraversalCounters& aCounters) = 0;
+  virtual BackendNodePtr NextSibling(const BackendNodePtr& aNode,
+                                     TraversalCounters& aCounters) = 0;
+
+  virtual bool GetRole(const BackendNodePtr& aNode, long& aOut) = 0;
+  // The IA2 role, for backends that have one; false otherwise.
+  virtual bool GetIA2Role(const BackendNodePtr& aNode, long& aOut) = 0;
+  virtual bool GetState(const BackendNodePtr& aNode, long& aOut) = 0;
+  // The IA2 uniqueID, for backends that have one; false otherwise.
+  virtual bool GetUniqueId(const BackendNodePtr& aNode, long& aOut) = 0;
+  virtual bool GetBounds(const BackendNodePtr& aNode, ScreenRect& aOut) = 0;
+
+  // The part of the screen in which content is visible, for viewport culling.
+  virtual ScreenRect Viewport() = 0;
+
+  /**
+   * Prints aNode for a tree dump in a format of the backend's own, returning
+   * false if it has none. TreeBench then prints what Describe fills in.
+   */
+  virtual bool DumpNode(const BackendNodePtr&) { return false; }
+
+  // Only needed by backends that do not override DumpNode.
+  virtual bool Describe(const BackendNodePtr&, BackendNodeDescription&) {
+    return false;
+  }
+
+  /**
+   * Makes the query for aProp that a screen reader would make, and discards
+   * the result. Returns false if the query failed, after reporting why.
+   */
+  virtual bool FetchProperty(const BackendNodePtr& aNode,
+                             AccProperty aProp) = 0;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_ACCBACKEND_H
@@ -0,0 +1,81 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_BENCHREPORT_H
+#define __ASPK_BENCHREPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "BenchStats.h"
+
+namespace aspk {
+
+// Describes the target and the run configuration. Strings are UTF-8.
+struct BenchMetadata {
+  std::string mExePath;
+  std::string mAppName;
+  std::string mAppVersion;
+  std::string mToolkitName;
+  std::string mToolkitVersion;
+  unsigned int mWarmupIterations = 0;
+  unsigned int mMeasuredIterations = 0;
+};
+
+// One benchmarked configuration of one speed-* command.
+struct BenchResult {
+  std::string mCommand;   // eg "speed-all"
+  std::string mStrategy;  // Child fetch strategy, eg "bulk"
+  unsigned int mThreads = 1;
+  uint64_t mNodes = 0;       // Nodes visited by a single run
+  uint64_t mRoundTrips = 0;  // Child fetch round trips made by a single run
+  SampleSummary mTimeMs;
+};
+
+class BenchReport {
+ public:
+  BenchMetadata& Metadata() { return mMetadata; }
+  const BenchMetadata& Metadata() const { return mMetadata; }
+
+  void Add(const BenchResult& aResult) { mResults.push_back(aResult); }
+  const std::vector<BenchResult>& Results() const { return mResults; }
+
+  void WriteJson(FILE* aOut) const;
+
+  // Writes one row per result, repeating the metadata on every row so that
+  // rows from several reports can be concatenated and still be told apart.
+  void WriteCsv(FILE* aOut) const;
+
+ private:
+  BenchMetadata mMetadata;
+  std::vector<BenchResult> mResults;
+};
+
+/**
+ * Reads results previously written by BenchReport::WriteCsv. Columns are
+ * matched by their header names, so files written by older versions load as
+ * long as the identifying columns are present.
+ * Returns false if the file is malformed.
+ */
+bool ReadCsvResults(FILE* aIn, std::vector<BenchResult>& aOut);
+
+/**
+ * Matches aCurrent against aBaseline by command, strategy and thread count and
+ * prints the change in median time and round trips for every match. A metric
+ * that grew by more than aThresholdPercent is reported as a regression.
+ * Returns the number of regressions.
+ */
+size_t CompareWithBaseline(const std::vector<BenchResult>& aBaseline,
+                           const std::vector<BenchResult>& aCurrent,
+                           double aThresholdPercent, FILE* aOut);
+
+}  // namespace aspk
+
+#endif  // __ASPK_BENCHREPORT_H
@@ -0,0 +1,53 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_BENCHSTATS_H
+#define __ASPK_BENCHSTATS_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <vector>
+
+namespace aspk {
+
+struct SampleSummary {
+  size_t mCount = 0;     // Samples remaining after outlier rejection
+  size_t mOutliers = 0;  // Samples rejected as outliers
+  double mMin = 0.0;
+  double mMax = 0.0;
+  double mMedian = 0.0;
+  double mMean = 0.0;
+  double mStdDev = 0.0;
+  double mP90 = 0.0;
+  double mP99 = 0.0;
+  // 95% confidence interval for the mean
+  double mCiLow = 0.0;
+  double mCiHigh = 0.0;
+};
+
+/**
+ * Returns the aFraction (0..1) quantile of aSorted, which must be sorted in
+ * ascending order, interpolating linearly between neighbouring samples.
+ */
+double Percentile(const std::vector<double>& aSorted, double aFraction);
+
+/**
+ * Summarizes aSamples. When aRejectOutliers is set, samples outside Tukey's
+ * fences (1.5 * IQR beyond the quartiles) are discarded first; this needs at
+ * least four samples to be meaningful and is skipped otherwise.
+ * Returns false if there are no samples.
+ */
+bool Summarize(const std::vector<double>& aSamples, bool aRejectOutliers,
+               SampleSummary& aOut);
+
+// Prints aSummary on one line, prefixed with aLabel. Values are in aUnit.
+void PrintSummary(FILE* aOut, const char* aLabel, const char* aUnit,
+                  const SampleSummary& aSummary);
+
+}  // namespace aspk
+
+#endif  // __ASPK_BENCHSTATS_H
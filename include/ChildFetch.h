@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_CHILDFETCH_H
+#define __ASPK_CHILDFETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace aspk {
+
+/**
+ * How a traversal obtains the children of a node.
+ *
+ * Navigate: accNavigate(NAVDIR_FIRSTCHILD) followed by accNavigate(NAVDIR_NEXT)
+ *           on every sibling. One round-trip per child.
+ * Bulk:     get_accChildCount followed by IEnumVARIANT::Next with a count
+ *           large enough to fetch every child in one (or a few) chunks.
+ */
+enum class ChildStrategy : uint32_t { Navigate, Bulk };
+
+inline const char* ChildStrategyName(const ChildStrategy aStrategy) {
+  switch (aStrategy) {
+    case ChildStrategy::Navigate:
+      return "navigate";
+    case ChildStrategy::Bulk:
+      return "bulk";
+    default:
+      return "unknown";
+  }
+}
+
+struct TraversalCounters {
+  uint64_t mNodes = 0;
+  uint64_t mRoundTrips = 0;
+  // The deepest node visited, counting the walk's root as depth 0.
+  uint32_t mMaxDepth = 0;
+  // Subtrees skipped by prune predicates, and nodes whose children were left
+  // unfetched by a depth limit.
+  uint64_t mPrunedSubtrees = 0;
+  uint64_t mDepthLimited = 0;
+
+  void Reset() { *this = TraversalCounters(); }
+
+  // Counts a node visited at aDepth.
+  void Visit(const uint32_t aDepth) {
+    ++mNodes;
+    if (aDepth > mMaxDepth) {
+      mMaxDepth = aDepth;
+    }
+  }
+
+  double RoundTripsPerNode() const {
+    if (!mNodes) {
+      return 0.0;
+    }
+    return static_cast<double>(mRoundTrips) / static_cast<double>(mNodes);
+  }
+};
+
+// Default upper bound on the number of children requested by a single bulk
+// call. Large enough that almost every node is fetched in one chunk, small
+// enough that we never ask the marshaler for an absurd array.
+static const size_t kMaxChildChunk = 1024;
+
+// Passed as aMaxChunk to fetch every child in a single bulk call.
+static const size_t kUnboundedChildChunk = SIZE_MAX;
+
+/**
+ * Fetches the children of aNode into aOut (in document order) using
+ * aStrategy, adding every call made on the provider to aCounters. Bulk fetches
+ * ask for at most aMaxChunk children per ChildChunk call.
+ *
+ * Provider must supply:
+ *   typename Provider::Node      default-constructible, testable as bool
+ *   bool FirstChild(const Node&, Node& aOut)
+ *   bool NextSibling(const Node&, Node& aOut)
+ *   long ChildCount(const Node&)
+ *   size_t ChildChunk(const Node&, size_t aStart, size_t aCount, Node* aOut)
+ *
+ * ChildChunk is always called with consecutive, increasing values of aStart
+ * for a given node, beginning at zero. It returns the number of children it
+ * consumed, which may be less than aCount at the end of the child list.
+ *
+ * Each provider call is counted as one round-trip. Providers that need extra
+ * calls to service a request (eg a QueryInterface on the returned IDispatch)
+ * account for those themselves.
+ */
+template <typename Provider>
+void FetchChildren(Provider& aProvider, const typename Provider::Node& aNode,
+                   const ChildStrategy aStrategy,
+                   std::vector<typename Provider::Node>& aOut,
+                   TraversalCounters& aCounters,
+                   const size_t aMaxChunk = kMaxChildChunk) {
+  using Node = typename Provider::Node;
+  aOut.clear();
+
+  if (aStrategy == ChildStrategy::Navigate) {
+    Node child;
+    ++aCounters.mRoundTrips;
+    if (!aProvider.FirstChild(aNode, child)) {
+      return;
+    }
+    while (child) {
+      aOut.push_back(child);
+      Node next;
+      ++aCounters.mRoundTrips;
+      if (!aProvider.NextSibling(aOut.back(), next)) {
+        break;
+      }
+      child = next;
+    }
+    return;
+  }
+
+  ++aCounters.mRoundTrips;
+  long childCount = aProvider.ChildCount(aNode);
+  if (childCount <= 0) {
+    return;
+  }
+
+  size_t remaining = static_cast<size_t>(childCount);
+  aOut.resize(remaining);
+  size_t fetched = 0;
+  while (remaining) {
+    size_t chunk = remaining < aMaxChunk ? remaining : aMaxChunk;
+    ++aCounters.mRoundTrips;
+    size_t got =
+        aProvider.ChildChunk(aNode, fetched, chunk, aOut.data() + fetched);
+    if (!got) {
+      // The child count was stale; the tree shrank underneath us.
+      break;
+    }
+    fetched += got;
+    remaining -= got;
+  }
+
+  aOut.resize(fetched);
+
+  // Providers leave a null Node in place of any child that cannot be
+  // traversed (eg a simple element reported only as a child ID).
+  aOut.erase(std::remove_if(aOut.begin(), aOut.end(),
+                            [](const Node& aChild) { return !aChild; }),
+             aOut.end());
+}
+
+}  // namespace aspk
+
+#endif  // __ASPK_CHILDFETCH_H
@@ -0,0 +1,216 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_COMCALL_H
+#define __ASPK_COMCALL_H
+
+#include <stdint.h>
+
+#include <utility>
+
+#include <oleacc.h>
+
+#include "A11yCall.h"
+#include "Accessible2.h"
+#include "IpcAccounting.h"
+
+namespace aspk {
+
+/**
+ * Estimates of the NDR sizes of what a COM call marshals, as sent over ALPC
+ * to another process. They leave out the RPC PDU headers, which cost the
+ * same for every call.
+ */
+
+// ORPCTHIS before the arguments of every request.
+static const uint64_t kWireRequestBytes = 32;
+// ORPCTHAT and the HRESULT around the results of every response.
+static const uint64_t kWireResponseBytes = 12;
+// A unique pointer to an MInterfacePointer holding a standard OBJREF with
+// local resolver bindings.
+static const uint64_t kWireInterfaceBytes = 112;
+// A unique pointer, which is all that a null pointer costs.
+static const uint64_t kWirePointerBytes = 4;
+// The wireVARIANT header and union discriminant.
+static const uint64_t kWireVariantBytes = 24;
+
+inline uint64_t WireBytes(BSTR aBstr) {
+  // A unique pointer to a FLAGGED_WORD_BLOB: flags, size, conformance and
+  // the characters.
+  return aBstr ? kWirePointerBytes + 12 + 2 * uint64_t(SysStringLen(aBstr))
+               : kWirePointerBytes;
+}
+
+inline uint64_t WireBytes(const IUnknown* aUnknown) {
+  return aUnknown ? kWireInterfaceBytes : kWirePointerBytes;
+}
+
+inline uint64_t WireBytes(const VARIANT& aVar) {
+  switch (aVar.vt) {
+    case VT_EMPTY:
+      return kWireVariantBytes;
+    case VT_BSTR:
+      return kWireVariantBytes + WireBytes(aVar.bstrVal);
+    case VT_DISPATCH:
+      return kWireVariantBytes + WireBytes(aVar.pdispVal);
+    case VT_UNKNOWN:
+      return kWireVariantBytes + WireBytes(aVar.punkVal);
+    default:
+      return kWireVariantBytes + 8;
+  }
+}
+
+// In-parameters add to the request.
+inline void AddArgBytes(IpcCost& aCost, bool, long) {
+  aCost.mRequestBytes += 4;
+}
+inline void AddArgBytes(IpcCost& aCost, bool, unsigned long) {
+  aCost.mRequestBytes += 4;
+}
+inline void AddArgBytes(IpcCost& aCost, bool, int) {
+  aCost.mRequestBytes += 4;
+}
+inline void AddArgBytes(IpcCost& aCost, bool, const GUID&) {
+  aCost.mRequestBytes += 16;
+}
+inline void AddArgBytes(IpcCost& aCost, bool, HWND) {
+  aCost.mRequestBytes += 8;
+}
+inline void AddArgBytes(IpcCost& aCost, bool, const VARIANT& aIn) {
+  aCost.mRequestBytes += WireBytes(aIn);
+}
+
+// Out-parameters add to the response, but only if the call succeeded, since
+// they are left unset otherwise.
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, long*) {
+  aCost.mResponseBytes += aSucceeded ? 4 : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, unsigned long*) {
+  aCost.mResponseBytes += aSucceeded ? 4 : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, HWND*) {
+  aCost.mResponseBytes += aSucceeded ? 8 : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, BSTR* aOut) {
+  aCost.mResponseBytes += aSucceeded ? WireBytes(*aOut) : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, VARIANT* aOut) {
+  aCost.mResponseBytes += aSucceeded ? WireBytes(*aOut) : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, IA2Locale* aOut) {
+  aCost.mResponseBytes +=
+      aSucceeded ? WireBytes(aOut->language) + WireBytes(aOut->country) +
+                       WireBytes(aOut->variant)
+                 : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, IDispatch** aOut) {
+  aCost.mResponseBytes += aSucceeded ? WireBytes(*aOut) : 0;
+}
+inline void AddArgBytes(IpcCost& aCost, bool aSucceeded, void** aOut) {
+  aCost.mResponseBytes +=
+      aSucceeded ? WireBytes(static_cast<const IUnknown*>(*aOut)) : 0;
+}
+
+// Anything else, such as an enum, is taken to be sent as it is.
+template <typename T>
+inline void AddArgBytes(IpcCost& aCost, bool, const T&) {
+  aCost.mRequestBytes += sizeof(T);
+}
+
+// Sizes a call from its arguments, after it has returned.
+template <typename... Args>
+inline IpcCost MeasureComCall(const bool aSucceeded, Args&... aArgs) {
+  IpcCost cost;
+  cost.mCalls = 1;
+  cost.mRequestBytes = kWireRequestBytes;
+  cost.mResponseBytes = kWireResponseBytes;
+  // Expands to one AddArgBytes per argument, in order.
+  const int expand[] = {0, (AddArgBytes(cost, aSucceeded, aArgs), 0)...};
+  (void)expand;
+  return cost;
+}
+
+// IEnumVARIANT::Next returns as many VARIANTs as it fetched.
+inline IpcCost MeasureComCall(const bool aSucceeded, ULONG& aCount,
+                              VARIANT*& aVars, ULONG*& aFetched) {
+  IpcCost cost;
+  cost.mCalls = 1;
+  cost.mRequestBytes = kWireRequestBytes + 4;
+  cost.mResponseBytes = kWireResponseBytes + 4;
+  const ULONG fetched = aSucceeded ? (aFetched ? *aFetched : aCount) : 0;
+  for (ULONG i = 0; i < fetched; ++i) {
+    cost.mResponseBytes += WireBytes(aVars[i]);
+  }
+  return cost;
+}
+
+// AccessibleChildren makes the calls itself, either through IEnumVARIANT or
+// with one get_accChild per child; it is counted as one call per child
+// obtained, each returning that child.
+inline IpcCost MeasureComCall(const bool aSucceeded, IAccessible*&, LONG&,
+                              LONG&, VARIANT*& aVars, LONG*& aObtained) {
+  IpcCost cost;
+  const LONG obtained = aSucceeded && *aObtained > 0 ? *aObtained : 0;
+  cost.mCalls = obtained ? obtained : 1;
+  cost.mRequestBytes = cost.mCalls * (kWireRequestBytes + 4);
+  cost.mResponseBytes = cost.mCalls * kWireResponseBytes;
+  for (LONG i = 0; i < obtained; ++i) {
+    cost.mResponseBytes += WireBytes(aVars[i]);
+  }
+  return cost;
+}
+
+/**
+ * Invokes a COM method through aFn, recording its latency under aMethod and
+ * its IPC cost, estimated from its arguments, under the current
+ * IpcOperation. The arguments are evaluated once, when the ComCall is
+ * invoked.
+ *
+ * Every call is counted, although the proxy manager answers a repeated
+ * QueryInterface for an interface that it already holds without one.
+ */
+template <typename Fn>
+class ComCall {
+ public:
+  ComCall(A11yMethod aMethod, Fn&& aFn)
+      : mMethod(aMethod), mFn(std::move(aFn)) {}
+
+  template <typename... Args>
+  HRESULT operator()(Args&&... aArgs) {
+    const HRESULT hr =
+        TimeA11yCall(mMethod, [&]() { return mFn(aArgs...); });
+    IpcAccounting::Get().Record(MeasureComCall(SUCCEEDED(hr), aArgs...));
+    return hr;
+  }
+
+ private:
+  const A11yMethod mMethod;
+  Fn mFn;
+};
+
+template <typename Fn>
+inline ComCall<Fn> MakeComCall(A11yMethod aMethod, Fn&& aFn) {
+  return ComCall<Fn>(aMethod, std::forward<Fn>(aFn));
+}
+
+}  // namespace aspk
+
+// Invokes aObj->aMethod(...), recording its latency under aMethod and its
+// IPC cost.
+#define A11Y_CALL(aMethod, aObj, ...)                               \
+  ::aspk::MakeComCall(::aspk::A11yMethod::aMethod,                  \
+                      [&](auto&... aArgs) {                         \
+                        return (aObj)->aMethod(aArgs...);           \
+                      })(__VA_ARGS__)
+
+// Invokes the free function ::aFn(...), recording its latency under aFn and
+// its IPC cost.
+#define A11Y_CALL_FN(aFn, ...)                                              \
+  ::aspk::MakeComCall(::aspk::A11yMethod::aFn,                              \
+                      [&](auto&... aArgs) { return ::aFn(aArgs...); })( \
+      __VA_ARGS__)
+
+#endif  // __ASPK_COMCALL_H
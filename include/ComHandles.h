@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_COMHANDLES_H
+#define __ASPK_COMHANDLES_H
+
+#include <oleacc.h>
+
+#include "Accessible2.h"
+
+namespace aspk {
+
+/**
+ * Owns a VARIANT, clearing it when destroyed or refilled so that any
+ * interface it holds is released and any string is freed. Pass Receive() as
+ * the out-parameter and Get() as an in-parameter.
+ */
+class AutoVariant {
+ public:
+  AutoVariant() { ::VariantInit(&mVar); }
+
+  explicit AutoVariant(const long aLong) : AutoVariant() {
+    mVar.vt = VT_I4;
+    mVar.lVal = aLong;
+  }
+
+  ~AutoVariant() { ::VariantClear(&mVar); }
+
+  // Clears the VARIANT and returns it to be filled in.
+  VARIANT* Receive() {
+    ::VariantClear(&mVar);
+    return &mVar;
+  }
+
+  const VARIANT& Get() const { return mVar; }
+  const VARIANT* operator->() const { return &mVar; }
+
+  // Copies out a VT_I4, returning false for any other type.
+  bool GetLong(long& aOut) const {
+    if (mVar.vt != VT_I4) {
+      return false;
+    }
+    aOut = mVar.lVal;
+    return true;
+  }
+
+  // The IDispatch held, if any. This still owns it.
+  IDispatch* GetDispatch() const {
+    return mVar.vt == VT_DISPATCH ? mVar.pdispVal : nullptr;
+  }
+
+ private:
+  AutoVariant(const AutoVariant&) = delete;
+  AutoVariant& operator=(const AutoVariant&) = delete;
+
+  VARIANT mVar;
+};
+
+/**
+ * Owns a BSTR, freeing it when destroyed or refilled. Pass Receive() as the
+ * out-parameter.
+ */
+class AutoBstr {
+ public:
+  AutoBstr() = default;
+  ~AutoBstr() { ::SysFreeString(mBstr); }
+
+  // Frees the BSTR and returns it to be filled in.
+  BSTR* Receive() {
+    ::SysFreeString(mBstr);
+    mBstr = nullptr;
+    return &mBstr;
+  }
+
+  BSTR Get() const { return mBstr; }
+  unsigned int Length() const { return ::SysStringLen(mBstr); }
+
+  explicit operator bool() const { return !!mBstr; }
+
+ private:
+  AutoBstr(const AutoBstr&) = delete;
+  AutoBstr& operator=(const AutoBstr&) = delete;
+
+  BSTR mBstr = nullptr;
+};
+
+// Owns the three BSTRs of an IA2Locale.
+class AutoLocale {
+ public:
+  AutoLocale() { Clear(); }
+  ~AutoLocale() { Free(); }
+
+  IA2Locale* Receive() {
+    Free();
+    Clear();
+    return &mLocale;
+  }
+
+  const IA2Locale& Get() const { return mLocale; }
+
+ private:
+  AutoLocale(const AutoLocale&) = delete;
+  AutoLocale& operator=(const AutoLocale&) = delete;
+
+  void Clear() {
+    mLocale.language = nullptr;
+    mLocale.country = nullptr;
+    mLocale.variant = nullptr;
+  }
+
+  void Free() {
+    ::SysFreeString(mLocale.language);
+    ::SysFreeString(mLocale.country);
+    ::SysFreeString(mLocale.variant);
+  }
+
+  IA2Locale mLocale;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_COMHANDLES_H
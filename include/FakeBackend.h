@@ -0,0 +1,174 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_FAKEBACKEND_H
+#define __ASPK_FAKEBACKEND_H
+
+#include <stdint.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "AccBackend.h"
+#include "ChildFetch.h"
+#include "FakeTree.h"
+#include "Utf8.h"
+
+namespace aspk {
+
+/**
+ * Serves a FakeTree through AccBackend, so that TreeBench can be run and
+ * checked on any platform. Every call can be made to spin for a fixed time to
+ * stand in for the cross-process round-trip that a real backend pays.
+ */
+class FakeBackend : public AccBackend {
+ public:
+  explicit FakeBackend(FakeTree& aTree) : mTree(aTree) {}
+
+  // How long every call spins for.
+  void SetCallLatency(std::chrono::nanoseconds aLatency) {
+    mCallLatency = aLatency;
+  }
+
+  void SetViewport(const ScreenRect& aViewport) { mViewport = aViewport; }
+
+  // The number of calls made so far, children fetched one at a time or in a
+  // chunk each counting as one.
+  uint64_t Calls() const { return mCalls; }
+
+  static BackendNodePtr Wrap(const FakeNode* aNode) {
+    return std::make_shared<const Node>(aNode);
+  }
+
+  static const FakeNode* Unwrap(const BackendNodePtr& aNode) {
+    return static_cast<const Node&>(*aNode).mNode;
+  }
+
+  const char* Name() const override { return "fake"; }
+
+  BackendNodePtr Root() override {
+    Call();
+    return Wrap(mTree.Root());
+  }
+
+  void GetChildren(const BackendNodePtr& aNode, ChildStrategy aStrategy,
+                   size_t aMaxChunk, std::vector<BackendNodePtr>& aOut,
+                   TraversalCounters& aCounters) override {
+    // Pay for the calls that FetchChildren will count.
+    const uint64_t roundTrips = aCounters.mRoundTrips;
+    FetchChildren(mTree, Unwrap(aNode), aStrategy, mChildren, aCounters,
+                  aMaxChunk);
+    for (uint64_t i = roundTrips; i < aCounters.mRoundTrips; ++i) {
+      Call();
+    }
+
+    aOut.clear();
+    aOut.reserve(mChildren.size());
+    for (const FakeNode* child : mChildren) {
+      aOut.push_back(Wrap(child));
+    }
+  }
+
+  BackendNodePtr FirstChild(const BackendNodePtr& aNode,
+                            TraversalCounters& aCounters) override {
+    ++aCounters.mRoundTrips;
+    Call();
+    const FakeNode* child;
+    return mTree.FirstChild(Unwrap(aNode), child) ? Wrap(child) : nullptr;
+  }
+
+  BackendNodePtr NextSibling(const BackendNodePtr& aNode,
+                             TraversalCounters& aCounters) override {
+    ++aCounters.mRoundTrips;
+    Call();
+    const FakeNode* sibling;
+    return mTree.NextSibling(Unwrap(aNode), sibling) ? Wrap(sibling)
+                                                     : nullptr;
+  }
+
+  bool GetRole(const BackendNodePtr& aNode, long& aOut) override {
+    Call();
+    aOut = Unwrap(aNode)->mRole;
+    return true;
+  }
+
+  bool GetIA2Role(const BackendNodePtr& aNode, long& aOut) override {
+    Call();
+    const FakeNode* node = Unwrap(aNode);
+    aOut = node->mIA2Role ? node->mIA2Role : node->mRole;
+    return true;
+  }
+
+  bool GetState(const BackendNodePtr& aNode, long& aOut) override {
+    Call();
+    aOut = Unwrap(aNode)->mState;
+    return true;
+  }
+
+  bool GetUniqueId(const BackendNodePtr& aNode, long& aOut) override {
+    Call();
+    aOut = Unwrap(aNode)->mUniqueId;
+    return true;
+  }
+
+  bool GetBounds(const BackendNodePtr& aNode, ScreenRect& aOut) override {
+    Call();
+    aOut = Unwrap(aNode)->mBounds;
+    return true;
+  }
+
+  ScreenRect Viewport() override { return mViewport; }
+
+  bool Describe(const BackendNodePtr& aNode,
+                BackendNodeDescription& aOut) override {
+    Call();
+    const FakeNode* node = Unwrap(aNode);
+    aOut.mIdentity = node;
+    aOut.mParentIdentity = node->mParent;
+    aOut.mName.clear();
+    AppendUtf8(node->mName.data(), node->mName.size(), aOut.mName);
+    aOut.mRole = node->mRole;
+    aOut.mHasUniqueId = true;
+    aOut.mUniqueId = node->mUniqueId;
+    aOut.mHasParentUniqueId = !!node->mParent;
+    aOut.mParentUniqueId = node->mParent ? node->mParent->mUniqueId : 0;
+    return true;
+  }
+
+  bool FetchProperty(const BackendNodePtr&, AccProperty aProp) override {
+    // The values are all in memory already; only the call costs anything.
+    Call();
+    return aProp < kNumAccProperties;
+  }
+
+ private:
+  struct Node : public BackendNode {
+    explicit Node(const FakeNode* aNode) : mNode(aNode) {}
+
+    const FakeNode* mNode;
+  };
+
+  void Call() {
+    ++mCalls;
+    if (mCallLatency.count() <= 0) {
+      return;
+    }
+    const auto end = std::chrono::steady_clock::now() + mCallLatency;
+    while (std::chrono::steady_clock::now() < end) {
+    }
+  }
+
+  FakeTree& mTree;
+  std::chrono::nanoseconds mCallLatency{0};
+  ScreenRect mViewport;
+  uint64_t mCalls = 0;
+  std::vector<const FakeNode*> mChildren;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_FAKEBACKEND_H
@@ -0,0 +1,251 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_FAKETREE_H
+#define __ASPK_FAKETREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ScreenRect.h"
+#include "TreeMirror.h"
+
+namespace aspk {
+
+/**
+ * An in-memory accessibility tree that satisfies the Provider requirements of
+ * FetchChildren (see ChildFetch.h) and RunSelector (see Selector.h). It does
+ * not depend on COM or Win32, so the traversal code can be exercised on any
+ * platform.
+ */
+struct FakeNode {
+  long mRole = 0;
+  long mState = 0;
+  long mUniqueId = 0;
+  std::wstring mName;
+  long mIA2Role = 0;  // If zero, the IA2 role is mRole
+  long mIA2State = 0;
+  std::wstring mAttributes;  // In IA2 form, eg "tag:h1;level:1;"
+  ScreenRect mBounds;
+  FakeNode* mParent = nullptr;
+  size_t mIndexInParent = 0;
+  std::vector<FakeNode*> mChildren;
+};
+
+class FakeTree {
+ public:
+  using Node = const FakeNode*;
+
+  FakeTree() { NewNode(nullptr); }
+
+  FakeNode* Root() { return &mNodes.front(); }
+  const FakeNode* Root() const { return &mNodes.front(); }
+  size_t Size() const { return mNodes.size(); }
+
+  FakeNode* AddChild(FakeNode* aParent, long aRole, long aState = 0,
+                     const std::wstring& aName = std::wstring()) {
+    FakeNode* node = NewNode(aParent);
+    node->mRole = aRole;
+    node->mState = aState;
+    node->mName = aName;
+    return node;
+  }
+
+  FakeNode* FindById(long aUniqueId) {
+    auto it = mById.find(aUniqueId);
+    return it == mById.end() ? nullptr : it->second;
+  }
+
+  // Removes aNode and its subtree from the tree. Their storage stays alive, but
+  // they can no longer be found by ID.
+  void Remove(FakeNode* aNode) {
+    Detach(aNode);
+    std::vector<FakeNode*> stack(1, aNode);
+    while (!stack.empty()) {
+      FakeNode* node = stack.back();
+      stack.pop_back();
+      mById.erase(node->mUniqueId);
+      stack.insert(stack.end(), node->mChildren.begin(), node->mChildren.end());
+    }
+  }
+
+  // Moves aNode (with its subtree) to be child aIndex of aNewParent.
+  void Move(FakeNode* aNode, FakeNode* aNewParent, size_t aIndex) {
+    Detach(aNode);
+    std::vector<FakeNode*>& siblings = aNewParent->mChildren;
+    if (aIndex > siblings.size()) {
+      aIndex = siblings.size();
+    }
+    siblings.insert(siblings.begin() + aIndex, aNode);
+    aNode->mParent = aNewParent;
+    Reindex(aNewParent);
+  }
+
+  /**
+   * Populates a complete tree of the given depth below the root, giving every
+   * interior node aFanout children. Roles cycle through aRoles.
+   */
+  void Populate(unsigned int aDepth, unsigned int aFanout,
+                const std::vector<long>& aRoles) {
+    std::vector<FakeNode*> level(1, Root());
+    size_t roleIdx = 0;
+    for (unsigned int d = 0; d < aDepth; ++d) {
+      std::vector<FakeNode*> next;
+      next.reserve(level.size() * aFanout);
+      for (FakeNode* parent : level) {
+        for (unsigned int i = 0; i < aFanout; ++i) {
+          long role = aRoles.empty() ? 0 : aRoles[roleIdx++ % aRoles.size()];
+          next.push_back(AddChild(parent, role));
+        }
+      }
+      level.swap(next);
+    }
+  }
+
+  // Provider interface
+
+  bool FirstChild(const Node& aNode, Node& aOut) {
+    if (aNode->mChildren.empty()) {
+      return false;
+    }
+    aOut = aNode->mChildren.front();
+    return true;
+  }
+
+  bool NextSibling(const Node& aNode, Node& aOut) {
+    const FakeNode* parent = aNode->mParent;
+    if (!parent) {
+      return false;
+    }
+    size_t next = aNode->mIndexInParent + 1;
+    if (next >= parent->mChildren.size()) {
+      return false;
+    }
+    aOut = parent->mChildren[next];
+    return true;
+  }
+
+  long ChildCount(const Node& aNode) {
+    return static_cast<long>(aNode->mChildren.size());
+  }
+
+  size_t ChildChunk(const Node& aNode, size_t aStart, size_t aCount,
+                    Node* aOut) {
+    const std::vector<FakeNode*>& children = aNode->mChildren;
+    size_t i = 0;
+    for (; i < aCount && aStart + i < children.size(); ++i) {
+      aOut[i] = children[aStart + i];
+    }
+    return i;
+  }
+
+  bool GetRole(const Node& aNode, long& aOut) {
+    aOut = aNode->mRole;
+    return true;
+  }
+
+  bool GetIA2Role(const Node& aNode, long& aOut) {
+    aOut = aNode->mIA2Role ? aNode->mIA2Role : aNode->mRole;
+    return true;
+  }
+
+  bool GetState(const Node& aNode, long& aOut) {
+    aOut = aNode->mState;
+    return true;
+  }
+
+  bool GetIA2State(const Node& aNode, long& aOut) {
+    aOut = aNode->mIA2State;
+    return true;
+  }
+
+  bool GetName(const Node& aNode, std::wstring& aOut) {
+    aOut = aNode->mName;
+    return true;
+  }
+
+  bool GetAttributes(const Node& aNode, std::wstring& aOut) {
+    aOut = aNode->mAttributes;
+    return true;
+  }
+
+ private:
+  FakeNode* NewNode(FakeNode* aParent) {
+    // std::deque never relocates existing elements on push_back, so the raw
+    // pointers handed out above stay valid as the tree grows.
+    mNodes.emplace_back();
+    FakeNode* node = &mNodes.back();
+    node->mUniqueId = -static_cast<long>(mNodes.size());
+    node->mParent = aParent;
+    mById[node->mUniqueId] = node;
+    if (aParent) {
+      node->mIndexInParent = aParent->mChildren.size();
+      aParent->mChildren.push_back(node);
+    }
+    return node;
+  }
+
+  void Detach(FakeNode* aNode) {
+    FakeNode* parent = aNode->mParent;
+    if (!parent) {
+      return;
+    }
+    parent->mChildren.erase(parent->mChildren.begin() + aNode->mIndexInParent);
+    aNode->mParent = nullptr;
+    Reindex(parent);
+  }
+
+  static void Reindex(FakeNode* aParent) {
+    for (size_t i = 0; i < aParent->mChildren.size(); ++i) {
+      aParent->mChildren[i]->mIndexInParent = i;
+    }
+  }
+
+  std::deque<FakeNode> mNodes;
+  std::unordered_map<long, FakeNode*> mById;
+};
+
+// Serves a TreeMirror from a FakeTree, so that mirror patching can be driven
+// by synthetic event streams.
+class FakeMirrorSource : public MirrorSource {
+ public:
+  explicit FakeMirrorSource(FakeTree& aTree) : mTree(aTree) {}
+
+  bool GetInfo(long aUniqueId, MirrorNodeInfo& aOut) override {
+    const FakeNode* node = mTree.FindById(aUniqueId);
+    if (!node) {
+      return false;
+    }
+    aOut.mParentId = node->mParent ? node->mParent->mUniqueId : kNoUniqueId;
+    aOut.mRole = node->mRole;
+    aOut.mState = node->mState;
+    aOut.mName = node->mName;
+    return true;
+  }
+
+  bool GetChildIds(long aUniqueId, std::vector<long>& aOut) override {
+    const FakeNode* node = mTree.FindById(aUniqueId);
+    if (!node) {
+      return false;
+    }
+    for (const FakeNode* child : node->mChildren) {
+      aOut.push_back(child->mUniqueId);
+    }
+    return true;
+  }
+
+ private:
+  FakeTree& mTree;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_FAKETREE_H
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_IA2ATTRIBUTES_H
+#define __ASPK_IA2ATTRIBUTES_H
+
+#include <stddef.h>
+#include <wchar.h>
+
+#include <string>
+
+namespace aspk {
+
+/**
+ * A key or value inside an IA2 object attribute string. It points into the
+ * string itself, so it is only valid for as long as that string is, and it
+ * still contains any backslash escapes.
+ */
+struct IA2AttributeText {
+  const wchar_t* mData = nullptr;
+  size_t mLength = 0;
+  // Whether mData contains escapes, and so differs from the text it encodes.
+  bool mEscaped = false;
+
+  bool IsEmpty() const { return !mLength; }
+
+  // Compares the unescaped text with aStr.
+  bool Equals(const wchar_t* aStr, size_t aLength) const;
+  bool Equals(const wchar_t* aStr) const { return Equals(aStr, wcslen(aStr)); }
+
+  // Appends the unescaped text to aOut.
+  void AppendTo(std::wstring& aOut) const;
+
+  // Parses the text as a decimal integer, failing if anything else is there.
+  bool ToLong(long& aOut) const;
+};
+
+struct IA2Attribute {
+  IA2AttributeText mKey;
+  IA2AttributeText mValue;
+};
+
+// Returns the first ':', ';' or '\' in [aBegin, aEnd), or aEnd if none.
+using IA2DelimiterScanner = const wchar_t* (*)(const wchar_t* aBegin,
+                                               const wchar_t* aEnd);
+
+// Compares a vector of characters at a time where SSE2 is available.
+const wchar_t* FindIA2Delimiter(const wchar_t* aBegin, const wchar_t* aEnd);
+// Compares one character at a time.
+const wchar_t* FindIA2DelimiterScalar(const wchar_t* aBegin,
+                                      const wchar_t* aEnd);
+
+/**
+ * Splits the string returned by IAccessible2::get_attributes, in the form
+ * "key:value;key:value;" with "\" escaping the character after it, into its
+ * keys and values without copying or allocating anything. The string need
+ * not be null-terminated.
+ *
+ * An unescaped ':' inside a value is taken literally. Entries with no ':' at
+ * all are skipped.
+ */
+class IA2AttributeParser {
+ public:
+  IA2AttributeParser(const wchar_t* aData, size_t aLength,
+                     IA2DelimiterScanner aScanner = FindIA2Delimiter)
+      : mCur(aData), mEnd(aData + aLength), mScanner(aScanner) {}
+
+  // Reads the next attribute into aOut, or returns false at the end.
+  bool Next(IA2Attribute& aOut);
+
+ private:
+  // Reads up to the first unescaped aDelimiter or ';', and leaves mCur on
+  // it. Returns that character, or zero at the end of the string.
+  wchar_t ReadText(wchar_t aDelimiter, IA2AttributeText& aOut);
+
+  const wchar_t* mCur;
+  const wchar_t* const mEnd;
+  const IA2DelimiterScanner mScanner;
+};
+
+// The attributes that screen readers fetch for nearly every node.
+struct IA2CommonAttributes {
+  IA2AttributeText mTag;
+  IA2AttributeText mDisplay;
+  IA2AttributeText mXmlRoles;
+  long mLevel = 0;  // Zero if absent
+  size_t mCount = 0;  // Attributes seen, common or not
+};
+
+void ParseCommonIA2Attributes(const wchar_t* aData, size_t aLength,
+                              IA2CommonAttributes& aOut,
+                              IA2DelimiterScanner aScanner = FindIA2Delimiter);
+
+}  // namespace aspk
+
+#endif  // __ASPK_IA2ATTRIBUTES_H
@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_IPCACCOUNTING_H
+#define __ASPK_IPCACCOUNTING_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+
+/**
+ * The logical operations that cross-process calls are attributed to. A call
+ * counts towards the innermost AutoIpcOperation on its thread, or towards
+ * Other outside of any.
+ */
+#define IPC_OPERATIONS(X) \
+  X(Other)                \
+  X(FindRoot)             \
+  X(GetChildren)          \
+  X(Navigate)             \
+  X(CheckVisibility)      \
+  X(CheckPrune)           \
+  X(GetServingProcess)    \
+  X(QueryAccInfo)         \
+  X(DumpAccInfo)          \
+  X(GetParentUniqueId)
+
+namespace aspk {
+
+enum class IpcOperation : uint32_t {
+#define IPC_OPERATION_ENUM(name) name,
+  IPC_OPERATIONS(IPC_OPERATION_ENUM)
+#undef IPC_OPERATION_ENUM
+  Count
+};
+
+const char* IpcOperationName(IpcOperation aOperation);
+
+// Outgoing calls and the bytes marshaled for them, in each direction.
+struct IpcCost {
+  uint64_t mCalls = 0;
+  uint64_t mRequestBytes = 0;
+  uint64_t mResponseBytes = 0;
+
+  uint64_t Bytes() const { return mRequestBytes + mResponseBytes; }
+
+  IpcCost& operator+=(const IpcCost& aOther) {
+    mCalls += aOther.mCalls;
+    mRequestBytes += aOther.mRequestBytes;
+    mResponseBytes += aOther.mResponseBytes;
+    return *this;
+  }
+};
+
+/**
+ * Totals the IPC cost of every IpcOperation. Shared by every thread in the
+ * process; recording is lock-free.
+ */
+class IpcAccounting {
+ public:
+  static IpcAccounting& Get();
+
+  // Adds aCost to the current thread's operation.
+  void Record(const IpcCost& aCost);
+
+  void Reset();
+
+  IpcCost Cost(IpcOperation aOperation) const;
+  IpcCost Total() const;
+
+  // Prints the calls and bytes per node over aNodes visited nodes, in total
+  // and for every operation that made a call.
+  void Print(FILE* aOut, uint64_t aNodes) const;
+
+ private:
+  IpcAccounting() = default;
+
+  struct Counters {
+    std::atomic<uint64_t> mCalls{0};
+    std::atomic<uint64_t> mRequestBytes{0};
+    std::atomic<uint64_t> mResponseBytes{0};
+  };
+
+  Counters mOperations[static_cast<uint32_t>(IpcOperation::Count)];
+};
+
+/**
+ * Attributes the calls made on this thread to aOperation for as long as it
+ * lives. Nests, so that eg the Navigate calls behind GetChildren are counted
+ * separately.
+ */
+class AutoIpcOperation {
+ public:
+  explicit AutoIpcOperation(IpcOperation aOperation);
+  ~AutoIpcOperation();
+
+  static IpcOperation Current();
+
+ private:
+  AutoIpcOperation(const AutoIpcOperation&) = delete;
+  AutoIpcOperation& operator=(const AutoIpcOperation&) = delete;
+
+  const IpcOperation mPrevious;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_IPCACCOUNTING_H
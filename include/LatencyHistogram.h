@@ -0,0 +1,59 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_LATENCYHISTOGRAM_H
+#define __ASPK_LATENCYHISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace aspk {
+
+/**
+ * A fixed-size, log-linear histogram in the style of HdrHistogram. Values are
+ * grouped by their highest set bit, and each power-of-two range is split into
+ * kHalfSubBuckets linear buckets, so every recorded value is kept to within
+ * about 3% of its true value across the whole 64-bit range.
+ *
+ * Recording is lock-free and may happen from any number of threads.
+ */
+class LatencyHistogram {
+ public:
+  static const unsigned int kSubBucketBits = 6;
+  static const uint64_t kSubBuckets = 1ULL << kSubBucketBits;
+  static const uint64_t kHalfSubBuckets = kSubBuckets / 2;
+  static const size_t kBucketCount =
+      (64 - kSubBucketBits + 1) * kHalfSubBuckets + kHalfSubBuckets;
+
+  LatencyHistogram() { Reset(); }
+
+  void Record(uint64_t aValue);
+  void Reset();
+
+  uint64_t Count() const { return mCount.load(std::memory_order_relaxed); }
+  uint64_t Min() const;
+  uint64_t Max() const { return mMax.load(std::memory_order_relaxed); }
+  double Mean() const;
+
+  // Returns the highest value equivalent to the aPercentile (0..100) entry.
+  uint64_t ValueAtPercentile(double aPercentile) const;
+
+ private:
+  static size_t BucketIndex(uint64_t aValue);
+  static uint64_t BucketHighestValue(size_t aIndex);
+
+  std::atomic<uint64_t> mBuckets[kBucketCount];
+  std::atomic<uint64_t> mCount;
+  std::atomic<uint64_t> mTotal;
+  std::atomic<uint64_t> mMin;
+  std::atomic<uint64_t> mMax;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_LATENCYHISTOGRAM_H
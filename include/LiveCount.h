@@ -0,0 +1,46 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_LIVECOUNT_H
+#define __ASPK_LIVECOUNT_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace aspk {
+
+/**
+ * Counts the objects of some kind that are alive, and the most that were
+ * alive at once since the peak was last reset. Safe to use from any thread.
+ */
+class LiveCount {
+ public:
+  void Add() {
+    const uint64_t live = mLive.fetch_add(1, std::memory_order_relaxed) + 1;
+    uint64_t peak = mPeak.load(std::memory_order_relaxed);
+    while (live > peak &&
+           !mPeak.compare_exchange_weak(peak, live,
+                                        std::memory_order_relaxed)) {
+    }
+  }
+
+  void Remove() { mLive.fetch_sub(1, std::memory_order_relaxed); }
+
+  uint64_t Live() const { return mLive.load(std::memory_order_relaxed); }
+  uint64_t Peak() const { return mPeak.load(std::memory_order_relaxed); }
+
+  // Restarts the peak from what is alive now.
+  void ResetPeak() { mPeak.store(Live(), std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> mLive{0};
+  std::atomic<uint64_t> mPeak{0};
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_LIVECOUNT_H
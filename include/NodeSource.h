@@ -0,0 +1,52 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_NODESOURCE_H
+#define __ASPK_NODESOURCE_H
+
+#include <stdint.h>
+
+namespace aspk {
+
+/**
+ * The process that serves an accessible, as Firefox encodes it in the IA2
+ * uniqueIDs that it hands out. Those IDs are negative, and bits 24-30 of
+ * their complement hold the ID of the content process that owns the
+ * accessible, or 0 for the parent process, which serves the chrome.
+ */
+enum class NodeSource : uint8_t { Other, Chrome, Content };
+
+// Returns the content process ID in aUniqueId, or 0 if the node is not
+// served by a content process.
+inline uint32_t ContentProcessOf(const long aUniqueId) {
+  if (aUniqueId >= 0) {
+    return 0;
+  }
+  return (~static_cast<uint32_t>(aUniqueId) & 0x7F000000UL) >> 24;
+}
+
+inline NodeSource GetNodeSource(const long aUniqueId) {
+  if (aUniqueId >= 0) {
+    return NodeSource::Other;
+  }
+  return ContentProcessOf(aUniqueId) ? NodeSource::Content
+                                     : NodeSource::Chrome;
+}
+
+inline const char* NodeSourceName(const NodeSource aSource) {
+  switch (aSource) {
+    case NodeSource::Chrome:
+      return "chrome";
+    case NodeSource::Content:
+      return "content";
+    default:
+      return "other";
+  }
+}
+
+}  // namespace aspk
+
+#endif  // __ASPK_NODESOURCE_H
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_OUTPUTSINK_H
+#define __ASPK_OUTPUTSINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace aspk {
+
+/**
+ * Moves console I/O off the threads that produce it. Each thread appends to
+ * its own fixed-size chunk; full chunks are pushed onto a lock-free queue and
+ * written out by a background thread. Output from a single thread stays in
+ * order; output from different threads is interleaved a chunk at a time, and
+ * a single write is never split unless it is larger than a chunk.
+ *
+ * While the sink is not running, Write goes straight to the output file.
+ */
+class AsyncOutputSink {
+ public:
+  static const size_t kChunkSize = 64 * 1024;
+
+  AsyncOutputSink() = default;
+  ~AsyncOutputSink() { Stop(); }
+
+  AsyncOutputSink(const AsyncOutputSink&) = delete;
+  AsyncOutputSink& operator=(const AsyncOutputSink&) = delete;
+
+  bool Start(FILE* aOut);
+
+  // Writes everything that has been queued, including the calling thread's
+  // partial chunk, and stops the writer thread. Partial chunks still held by
+  // other threads are written when those threads exit or call Flush. Other
+  // threads must not be writing while this runs.
+  void Stop();
+
+  bool IsRunning() const { return mRunning.load(std::memory_order_acquire); }
+
+  void Write(const char* aData, size_t aLen);
+
+  // Queues the calling thread's partial chunk and blocks until the writer has
+  // written everything queued so far. Call this before writing to the output
+  // file by any other means.
+  void Flush();
+
+  uint64_t BytesWritten() const {
+    return mBytesWritten.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Chunk {
+    Chunk* mNext = nullptr;
+    AsyncOutputSink* mOwner = nullptr;
+    size_t mLen = 0;
+    char mData[kChunkSize];
+  };
+
+  // Holds the calling thread's current chunk and queues it when the thread
+  // exits.
+  struct ThreadChunk {
+    ~ThreadChunk();
+    Chunk* mChunk = nullptr;
+  };
+
+  static ThreadChunk& CurrentThreadChunk();
+
+  void Submit(Chunk* aChunk);
+  void WriterLoop();
+  void WriteQueued();
+
+  FILE* mOut = stdout;
+  std::atomic<bool> mRunning{false};
+  std::atomic<bool> mStopping{false};
+  // Most recently submitted chunk first; the writer reverses the list.
+  std::atomic<Chunk*> mQueue{nullptr};
+  std::atomic<uint64_t> mSubmitted{0};
+  std::atomic<uint64_t> mWritten{0};
+  std::atomic<uint64_t> mBytesWritten{0};
+
+  std::mutex mLock;
+  std::condition_variable mWakeWriter;
+  std::condition_variable mDrained;
+  std::thread mWriter;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_OUTPUTSINK_H
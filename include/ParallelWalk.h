@@ -0,0 +1,347 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_PARALLELWALK_H
+#define __ASPK_PARALLELWALK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace aspk {
+
+/**
+ * Walks a tree on a pool of worker threads. Every worker owns a deque of
+ * pending subtrees: it pushes and pops at the back of its own deque, and when
+ * that runs dry it steals from the front of another worker's deque, where the
+ * oldest (and usually largest) subtrees live.
+ *
+ * Each visited node produces a text record. Records are kept in a tree that
+ * mirrors the walked one, so that once the walk has finished they can be
+ * emitted in document order regardless of which thread produced them. The
+ * same tree orders the nodes at which the visitor stops the walk, so that a
+ * search ends at the first match in document order, as a single-threaded walk
+ * would, rather than at whichever match a worker happened to reach first.
+ * Idle workers sleep until there is work to steal.
+ *
+ * Node must be copyable and testable as bool. The engine itself knows nothing
+ * about COM; callers wrap each worker's body to set up whatever per-thread
+ * state (eg an MTA) the visitor needs.
+ */
+template <typename Node>
+class ParallelWalk {
+ public:
+  // Produces the root node. Runs on worker 0, inside its thread wrapper.
+  using RootFn = std::function<Node()>;
+  // Visits aNode, aDepth levels below the root, appending its output to aOut
+  // and its children (in document order) to aChildren. Returning false stops
+  // the walk at aNode: no node after it in document order is visited from then
+  // on, and none that was is output. If several workers stop, the walk ends at
+  // the stop that comes first in document order.
+  using VisitFn = std::function<bool(size_t aThread, Node& aNode,
+                                     uint32_t aDepth, std::string& aOut,
+                                     std::vector<Node>& aChildren)>;
+  // Must invoke aBody exactly once on the calling thread.
+  using ThreadFn =
+      std::function<void(size_t aThread, const std::function<void()>& aBody)>;
+  // Invoked once, from a worker, as soon as the walk has finished.
+  using DoneFn = std::function<void()>;
+
+  explicit ParallelWalk(size_t aThreadCount)
+      : mWorkers(aThreadCount ? aThreadCount : 1),
+        mPending(0),
+        mQueued(0),
+        mIdle(0),
+        mStopped(false),
+        mDoneSignaled(false) {}
+
+  ~ParallelWalk() { Join(); }
+
+  void Start(RootFn aRoot, VisitFn aVisit, ThreadFn aThreadFn, DoneFn aDone) {
+    mRootFn = std::move(aRoot);
+    mVisitFn = std::move(aVisit);
+    mThreadFn = std::move(aThreadFn);
+    mDoneFn = std::move(aDone);
+    mRootRecord.reset(new Record());
+
+    // Held on behalf of the root until worker 0 has produced it.
+    mPending = 1;
+
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+      mThreads.emplace_back([this, i]() {
+        mThreadFn(i, [this, i]() { WorkerMain(i); });
+      });
+    }
+  }
+
+  void Join() {
+    for (std::thread& thread : mThreads) {
+      thread.join();
+    }
+    mThreads.clear();
+  }
+
+  size_t ThreadCount() const { return mWorkers.size(); }
+
+  bool WasStopped() const { return mStopped; }
+
+  // The worker that made the stop the walk ended at. A worker only visits
+  // nodes before the stop in force, so the last stop it made is that one.
+  // Only valid after Join(), if WasStopped().
+  size_t StopThread() const { return mStopThread; }
+
+  uint64_t NodesVisited(size_t aThread) const {
+    return mWorkers[aThread].mVisited;
+  }
+
+  uint64_t Steals(size_t aThread) const { return mWorkers[aThread].mSteals; }
+
+  /**
+   * Calls aFn(const std::string&) for every non-empty record in document
+   * order, up to and including that of the node the walk stopped at. Only
+   * valid after Join().
+   */
+  template <typename Fn>
+  void ForEachOutput(Fn&& aFn) const {
+    if (!mRootRecord) {
+      return;
+    }
+
+    std::vector<const Record*> stack(1, mRootRecord.get());
+    while (!stack.empty()) {
+      const Record* record = stack.back();
+      stack.pop_back();
+      if (!record->mOutput.empty()) {
+        aFn(record->mOutput);
+      }
+      if (record == mStopRecord) {
+        return;
+      }
+      for (auto it = record->mChildren.rbegin(),
+                end = record->mChildren.rend();
+           it != end; ++it) {
+        stack.push_back(it->get());
+      }
+    }
+  }
+
+ private:
+  struct Record {
+    Record() = default;
+    Record(const Record* aParent, size_t aIndex)
+        : mParent(aParent), mIndex(aIndex) {}
+
+    std::string mOutput;
+    std::vector<std::unique_ptr<Record>> mChildren;
+    const Record* mParent = nullptr;
+    // The index of this record in its parent's mChildren.
+    size_t mIndex = 0;
+  };
+
+  struct Task {
+    Node mNode;
+    Record* mRecord;
+    uint32_t mDepth;
+  };
+
+  struct Worker {
+    Worker() : mVisited(0), mSteals(0) {}
+
+    std::mutex mLock;
+    std::deque<Task> mTasks;
+    uint64_t mVisited;
+    uint64_t mSteals;
+  };
+
+  bool PopLocal(size_t aThread, Task& aOut) {
+    Worker& worker = mWorkers[aThread];
+    std::lock_guard<std::mutex> lock(worker.mLock);
+    if (worker.mTasks.empty()) {
+      return false;
+    }
+    aOut = std::move(worker.mTasks.back());
+    worker.mTasks.pop_back();
+    --mQueued;
+    return true;
+  }
+
+  bool Steal(size_t aThread, Task& aOut) {
+    const size_t count = mWorkers.size();
+    for (size_t i = 1; i < count; ++i) {
+      Worker& victim = mWorkers[(aThread + i) % count];
+      std::lock_guard<std::mutex> lock(victim.mLock);
+      if (victim.mTasks.empty()) {
+        continue;
+      }
+      aOut = std::move(victim.mTasks.front());
+      victim.mTasks.pop_front();
+      --mQueued;
+      ++mWorkers[aThread].mSteals;
+      return true;
+    }
+    return false;
+  }
+
+  // Appends the indices leading from the root to aRecord, deepest first.
+  static void GetPath(const Record* aRecord, std::vector<size_t>& aOut) {
+    aOut.clear();
+    for (; aRecord->mParent; aRecord = aRecord->mParent) {
+      aOut.push_back(aRecord->mIndex);
+    }
+  }
+
+  // Whether aRecord comes before the stop in force in document order, in
+  // which an ancestor comes before its descendants. Requires mStopLock.
+  bool PrecedesStop(const Record* aRecord) {
+    if (!mStopRecord) {
+      return true;
+    }
+    GetPath(aRecord, mPath);
+    GetPath(mStopRecord, mStopPath);
+    return std::lexicographical_compare(mPath.rbegin(), mPath.rend(),
+                                        mStopPath.rbegin(), mStopPath.rend());
+  }
+
+  void Release() {
+    if (--mPending == 0) {
+      WakeIdle();
+    }
+  }
+
+  void WakeIdle() {
+    { std::lock_guard<std::mutex> lock(mIdleLock); }
+    mIdleCond.notify_all();
+  }
+
+  void Run(size_t aThread, Task& aTask, std::vector<Node>& aChildren) {
+    Worker& worker = mWorkers[aThread];
+    if (mStopped) {
+      std::lock_guard<std::mutex> lock(mStopLock);
+      if (!PrecedesStop(aTask.mRecord)) {
+        Release();
+        return;
+      }
+    }
+
+    ++worker.mVisited;
+    aChildren.clear();
+    if (!mVisitFn(aThread, aTask.mNode, aTask.mDepth, aTask.mRecord->mOutput,
+                  aChildren)) {
+      std::lock_guard<std::mutex> lock(mStopLock);
+      if (PrecedesStop(aTask.mRecord)) {
+        mStopRecord = aTask.mRecord;
+        mStopThread = aThread;
+        mStopped = true;
+      }
+      Release();
+      return;
+    }
+
+    if (!aChildren.empty()) {
+      std::vector<std::unique_ptr<Record>>& records = aTask.mRecord->mChildren;
+      records.reserve(aChildren.size());
+      for (size_t i = 0; i < aChildren.size(); ++i) {
+        records.emplace_back(new Record(aTask.mRecord, i));
+      }
+
+      mPending += aChildren.size();
+      // Counted before they are queued, so that mQueued never goes below
+      // the true count.
+      mQueued += aChildren.size();
+      {
+        std::lock_guard<std::mutex> lock(worker.mLock);
+        // Push in reverse so that the owner pops the first child next.
+        for (size_t i = aChildren.size(); i > 0; --i) {
+          worker.mTasks.push_back(Task{std::move(aChildren[i - 1]),
+                                       records[i - 1].get(),
+                                       aTask.mDepth + 1});
+        }
+      }
+      if (mIdle) {
+        WakeIdle();
+      }
+    }
+
+    Release();
+  }
+
+  void WorkerMain(size_t aThread) {
+    if (!aThread) {
+      Node root = mRootFn();
+      if (root) {
+        ++mQueued;
+        {
+          std::lock_guard<std::mutex> lock(mWorkers[0].mLock);
+          mWorkers[0].mTasks.push_back(Task{root, mRootRecord.get(), 0});
+        }
+        WakeIdle();
+      } else {
+        mPending = 0;
+        WakeIdle();
+      }
+    }
+
+    std::vector<Node> children;
+    Task task;
+    while (mPending > 0) {
+      if (PopLocal(aThread, task) || Steal(aThread, task)) {
+        Run(aThread, task, children);
+        task.mNode = Node();
+        continue;
+      }
+      // Counted as idle before looking at mQueued, so that a worker that
+      // queues work after we look sees us and wakes us.
+      std::unique_lock<std::mutex> lock(mIdleLock);
+      ++mIdle;
+      mIdleCond.wait(lock, [this]() { return mQueued > 0 || mPending == 0; });
+      --mIdle;
+    }
+
+    if (!mDoneSignaled.exchange(true) && mDoneFn) {
+      mDoneFn();
+    }
+  }
+
+  std::vector<Worker> mWorkers;
+  std::vector<std::thread> mThreads;
+  std::unique_ptr<Record> mRootRecord;
+  // Nodes queued or being visited, plus one for the root until it has been
+  // produced.
+  std::atomic<size_t> mPending;
+  // Nodes queued in a worker's deque.
+  std::atomic<size_t> mQueued;
+  // Workers waiting on mIdleCond.
+  std::atomic<size_t> mIdle;
+  std::mutex mIdleLock;
+  std::condition_variable mIdleCond;
+  std::mutex mStopLock;
+  // Set under mStopLock.
+  std::atomic<bool> mStopped;
+  const Record* mStopRecord = nullptr;
+  size_t mStopThread = 0;
+  std::vector<size_t> mPath;
+  std::vector<size_t> mStopPath;
+  std::atomic<bool> mDoneSignaled;
+  RootFn mRootFn;
+  VisitFn mVisitFn;
+  ThreadFn mThreadFn;
+  DoneFn mDoneFn;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_PARALLELWALK_H
@@ -0,0 +1,311 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_PROCESSWALK_H
+#define __ASPK_PROCESSWALK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ChildFetch.h"
+#include "LatencyHistogram.h"
+#include "TraversalStack.h"
+
+namespace aspk {
+
+/**
+ * Walks a tree with one worker thread per process that serves part of it, so
+ * that a slow content process holds up only its own subtrees. Each worker
+ * walks its subtrees depth-first; a child served by another process is handed
+ * to that process's worker, which is started the first time one turns up.
+ *
+ * Every worker keeps its own counters and a histogram of the time spent on
+ * each of its nodes: visiting it, fetching its children and finding out which
+ * process serves each child. Process 0 is the parent process, which serves
+ * the root.
+ *
+ * Node must be copyable and testable as bool. Like ParallelWalk, the engine
+ * knows nothing about COM; callers wrap each worker's body to set up whatever
+ * per-thread state the visitor needs.
+ */
+template <typename Node>
+class ProcessWalk {
+ public:
+  // Produces the root node. Runs on the parent process's worker, inside its
+  // thread wrapper.
+  using RootFn = std::function<Node()>;
+  // Sets aOutProcess to the process that serves aNode. Returning false, eg
+  // for nodes without a uniqueID, leaves aNode with its parent.
+  using ProcessFn = std::function<bool(const Node& aNode,
+                                       uint32_t& aOutProcess)>;
+  // Visits aNode, aDepth levels below the root, appending the children to go
+  // on to (in document order) to aChildren and counting the calls made into
+  // aCounters. Returning false stops the entire walk.
+  using VisitFn = std::function<bool(const Node& aNode, uint32_t aDepth,
+                                     TraversalCounters& aCounters,
+                                     std::vector<Node>& aChildren)>;
+  // Must invoke aBody exactly once on the calling thread.
+  using ThreadFn = std::function<void(uint32_t aProcess,
+                                      const std::function<void()>& aBody)>;
+  // Invoked once, from a worker, as soon as the walk has finished.
+  using DoneFn = std::function<void()>;
+
+  static const uint32_t kParentProcess = 0;
+
+  // What one process's worker did.
+  struct ProcessStats {
+    uint32_t mProcess = kParentProcess;
+    TraversalCounters mCounters;
+    // Subtrees handed to the worker, the root's included.
+    uint64_t mSubtrees = 0;
+    // Time spent walking rather than waiting for work.
+    uint64_t mBusyNs = 0;
+    // Nanoseconds per node.
+    LatencyHistogram mLatency;
+  };
+
+  ProcessWalk() = default;
+  ~ProcessWalk() {
+    Stop();
+    Join();
+  }
+
+  void Start(RootFn aRoot, ProcessFn aProcess, VisitFn aVisit,
+             ThreadFn aThreadFn, DoneFn aDone) {
+    mRootFn = std::move(aRoot);
+    mProcessFn = std::move(aProcess);
+    mVisitFn = std::move(aVisit);
+    mThreadFn = std::move(aThreadFn);
+    mDoneFn = std::move(aDone);
+
+    // Held on behalf of the root until the parent process's worker has
+    // produced it.
+    mPending = 1;
+    std::lock_guard<std::mutex> lock(mWorkersLock);
+    StartWorker(kParentProcess);
+  }
+
+  // Asks every worker to abandon its subtrees.
+  void Stop() {
+    mStop = true;
+    WakeAll();
+  }
+
+  // Waits for the walk to finish and for every worker to exit.
+  void Join() {
+    {
+      std::unique_lock<std::mutex> lock(mWorkersLock);
+      mFinishedCond.wait(lock, [this]() { return mFinished || !mStarted; });
+    }
+    for (auto& entry : mWorkers) {
+      if (entry.second->mThread.joinable()) {
+        entry.second->mThread.join();
+      }
+    }
+  }
+
+  bool WasStopped() const { return mStop; }
+
+  // The processes that served the walk's nodes, in order of process ID. Only
+  // valid after Join().
+  template <typename Fn>
+  void ForEachProcess(Fn&& aFn) const {
+    for (const auto& entry : mWorkers) {
+      aFn(static_cast<const ProcessStats&>(entry.second->mStats));
+    }
+  }
+
+ private:
+  struct Task {
+    Node mNode;
+    uint32_t mDepth;
+  };
+
+  struct Worker {
+    std::mutex mLock;
+    std::condition_variable mWake;
+    std::deque<Task> mTasks;
+    std::thread mThread;
+    ProcessStats mStats;
+  };
+
+  // Requires mWorkersLock.
+  Worker& StartWorker(const uint32_t aProcess) {
+    std::unique_ptr<Worker>& worker = mWorkers[aProcess];
+    if (!worker) {
+      worker.reset(new Worker());
+      worker->mStats.mProcess = aProcess;
+      Worker* raw = worker.get();
+      mStarted = true;
+      raw->mThread = std::thread([this, raw, aProcess]() {
+        mThreadFn(aProcess, [this, raw]() { WorkerMain(*raw); });
+      });
+    }
+    return *worker;
+  }
+
+  // Hands aNode's subtree to the worker for aProcess.
+  void Post(const uint32_t aProcess, Node&& aNode, const uint32_t aDepth) {
+    if (mStop) {
+      return;
+    }
+    ++mPending;
+    Worker* worker;
+    {
+      std::lock_guard<std::mutex> lock(mWorkersLock);
+      worker = &StartWorker(aProcess);
+    }
+    std::lock_guard<std::mutex> lock(worker->mLock);
+    worker->mTasks.push_back(Task{std::move(aNode), aDepth});
+    worker->mWake.notify_one();
+  }
+
+  void WakeAll() {
+    std::lock_guard<std::mutex> lock(mWorkersLock);
+    for (auto& entry : mWorkers) {
+      std::lock_guard<std::mutex> workerLock(entry.second->mLock);
+      entry.second->mWake.notify_all();
+    }
+  }
+
+  // Called once every subtree has been walked or dropped.
+  void Finish() {
+    {
+      std::lock_guard<std::mutex> lock(mWorkersLock);
+      mFinished = true;
+      for (auto& entry : mWorkers) {
+        std::lock_guard<std::mutex> workerLock(entry.second->mLock);
+        entry.second->mWake.notify_all();
+      }
+    }
+    mFinishedCond.notify_all();
+    if (mDoneFn) {
+      mDoneFn();
+    }
+  }
+
+  void Release() {
+    if (--mPending == 0) {
+      Finish();
+    }
+  }
+
+  void WorkerMain(Worker& aWorker) {
+    if (aWorker.mStats.mProcess == kParentProcess) {
+      Node root = mRootFn();
+      uint32_t rootProcess = kParentProcess;
+      if (root && !mStop) {
+        mProcessFn(root, rootProcess);
+        Post(rootProcess, std::move(root), 0);
+      }
+      Release();
+    }
+
+    TraversalStack<Node> local;
+    std::vector<Node> children;
+    Task task;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(aWorker.mLock);
+        aWorker.mWake.wait(lock, [&]() {
+          return !aWorker.mTasks.empty() || mFinished;
+        });
+        if (aWorker.mTasks.empty()) {
+          return;
+        }
+        task = std::move(aWorker.mTasks.front());
+        aWorker.mTasks.pop_front();
+      }
+      // Once stopped, subtrees are dropped rather than walked.
+      if (!mStop) {
+        WalkSubtree(aWorker, task, local, children);
+      }
+      task.mNode = Node();
+      Release();
+    }
+  }
+
+  // Walks the subtree under aTask, handing children served by other
+  // processes to their workers.
+  void WalkSubtree(Worker& aWorker, Task& aTask, TraversalStack<Node>& aLocal,
+                   std::vector<Node>& aChildren) {
+    using std::chrono::steady_clock;
+    ProcessStats& stats = aWorker.mStats;
+    ++stats.mSubtrees;
+    const steady_clock::time_point walkStart = steady_clock::now();
+
+    aLocal.Push(std::move(aTask.mNode), aTask.mDepth);
+    Node node;
+    uint32_t depth;
+    while (aLocal.Pop(node, depth)) {
+      if (mStop) {
+        aLocal.Clear();
+        break;
+      }
+      const steady_clock::time_point start = steady_clock::now();
+      stats.mCounters.Visit(depth);
+      aChildren.clear();
+      if (!mVisitFn(node, depth, stats.mCounters, aChildren)) {
+        aLocal.Clear();
+        Stop();
+        break;
+      }
+
+      // Reversed so that children are visited in document order.
+      for (auto it = aChildren.rbegin(); it != aChildren.rend(); ++it) {
+        uint32_t process = stats.mProcess;
+        if (mProcessFn(*it, process) && process != stats.mProcess) {
+          Post(process, std::move(*it), depth + 1);
+        } else {
+          aLocal.Push(std::move(*it), depth + 1);
+        }
+      }
+      stats.mLatency.Record(NsSince(start));
+    }
+    node = Node();
+    stats.mBusyNs += NsSince(walkStart);
+  }
+
+  static uint64_t NsSince(const std::chrono::steady_clock::time_point aStart) {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - aStart)
+            .count());
+  }
+
+  std::mutex mWorkersLock;
+  std::condition_variable mFinishedCond;
+  // Ordered so that processes are reported by ID.
+  std::map<uint32_t, std::unique_ptr<Worker>> mWorkers;
+  // Subtrees posted but not yet walked, plus one for the root until it has
+  // been produced.
+  std::atomic<size_t> mPending{0};
+  std::atomic<bool> mStop{false};
+  // Set under mWorkersLock.
+  bool mStarted = false;
+  std::atomic<bool> mFinished{false};
+  RootFn mRootFn;
+  ProcessFn mProcessFn;
+  VisitFn mVisitFn;
+  ThreadFn mThreadFn;
+  DoneFn mDoneFn;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_PROCESSWALK_H
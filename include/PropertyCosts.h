@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_PROPERTYCOSTS_H
+#define __ASPK_PROPERTYCOSTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <mutex>
+#include <vector>
+
+namespace aspk {
+
+/**
+ * The properties that QueryAccInfo can fetch for a node. These are the
+ * queries commonly issued by NVDA; a property mask selects a subset of them so
+ * that cheaper client profiles can be modelled.
+ */
+enum AccProperty : uint32_t {
+  kPropRole,
+  kPropState,
+  kPropKeyboardShortcut,
+  kPropName,
+  kPropDescription,
+  kPropChildCount,
+  kPropValue,
+  kPropIA2States,
+  kPropLocale,
+  kPropAttributes,
+  kPropUniqueId,
+  kPropWindowHandle,
+  kNumAccProperties
+};
+
+static const uint32_t kAllAccPropertiesMask = (1U << kNumAccProperties) - 1;
+
+inline uint32_t AccPropertyBit(const AccProperty aProp) { return 1U << aProp; }
+
+// Returns the command-line name of aProp, eg "ia2states".
+const char* AccPropertyName(AccProperty aProp);
+
+/**
+ * Parses a comma-separated list of property names (or "all") into a mask.
+ * Returns false if any name is not recognized.
+ */
+bool ParseAccPropertyMask(const wchar_t* aSpec, uint32_t& aOutMask);
+
+/**
+ * Collects per-property call latencies. Safe to record into from several
+ * threads at once.
+ */
+class PropertyCosts {
+ public:
+  void Record(AccProperty aProp, double aMicroseconds);
+  void Reset();
+
+  // Prints calls, total, mean and p99 latency for every property that was
+  // fetched at least once.
+  void Print(FILE* aOut) const;
+
+ private:
+  mutable std::mutex mLock;
+  std::vector<double> mSamples[kNumAccProperties];
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_PROPERTYCOSTS_H
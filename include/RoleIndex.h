@@ -0,0 +1,86 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_ROLEINDEX_H
+#define __ASPK_ROLEINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+namespace aspk {
+
+/**
+ * Maps roles to the nodes that have them, so that any number of role queries
+ * can be answered from a single traversal. Roles are plain longs: MSAA roles
+ * and IA2 roles do not overlap, so one node may be filed under both.
+ *
+ * Nodes are identified by handles, which number them in the order they were
+ * added. Adding nodes in document order therefore keeps every query result in
+ * document order too.
+ */
+template <typename Node>
+class RoleIndex {
+ public:
+  using Handle = uint32_t;
+
+  // Adds aNode without any roles and returns its handle.
+  Handle AddNode(const Node& aNode) {
+    mNodes.push_back(aNode);
+    return static_cast<Handle>(mNodes.size() - 1);
+  }
+
+  // Files aHandle under aRole. Adding the same role twice is harmless.
+  void AddRole(const Handle aHandle, const long aRole) {
+    std::vector<Handle>& handles = mRoles[aRole];
+    if (handles.empty() || handles.back() != aHandle) {
+      handles.push_back(aHandle);
+    }
+  }
+
+  const Node& Get(const Handle aHandle) const { return mNodes[aHandle]; }
+
+  size_t NodeCount() const { return mNodes.size(); }
+  size_t RoleCount() const { return mRoles.size(); }
+
+  // Every node with aRole, in the order they were added.
+  const std::vector<Handle>& Find(const long aRole) const {
+    auto it = mRoles.find(aRole);
+    return it == mRoles.end() ? mEmpty : it->second;
+  }
+
+  // Every node with any of aRoles, in the order they were added and without
+  // duplicates.
+  std::vector<Handle> FindAny(const long* aRoles, const size_t aCount) const {
+    std::vector<Handle> result;
+    for (size_t i = 0; i < aCount; ++i) {
+      const std::vector<Handle>& handles = Find(aRoles[i]);
+      const size_t middle = result.size();
+      result.insert(result.end(), handles.begin(), handles.end());
+      std::inplace_merge(result.begin(), result.begin() + middle,
+                         result.end());
+    }
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+  }
+
+  void Clear() {
+    mNodes.clear();
+    mRoles.clear();
+  }
+
+ private:
+  std::vector<Node> mNodes;
+  std::unordered_map<long, std::vector<Handle>> mRoles;
+  std::vector<Handle> mEmpty;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_ROLEINDEX_H
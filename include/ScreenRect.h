@@ -0,0 +1,57 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_SCREENRECT_H
+#define __ASPK_SCREENRECT_H
+
+#include <stdint.h>
+
+namespace aspk {
+
+/**
+ * A rectangle in screen coordinates, right and bottom exclusive. Coordinates
+ * are 64-bit so that adding an accLocation width to its left edge can never
+ * overflow.
+ */
+struct ScreenRect {
+  int64_t mLeft = 0;
+  int64_t mTop = 0;
+  int64_t mRight = 0;
+  int64_t mBottom = 0;
+
+  // Converts the out-parameters of IAccessible::accLocation.
+  static ScreenRect FromLocation(long aLeft, long aTop, long aWidth,
+                                 long aHeight) {
+    ScreenRect rect;
+    rect.mLeft = aLeft;
+    rect.mTop = aTop;
+    rect.mRight = static_cast<int64_t>(aLeft) + aWidth;
+    rect.mBottom = static_cast<int64_t>(aTop) + aHeight;
+    return rect;
+  }
+
+  bool IsEmpty() const { return mRight <= mLeft || mBottom <= mTop; }
+
+  bool Intersects(const ScreenRect& aOther) const {
+    return !IsEmpty() && !aOther.IsEmpty() && mLeft < aOther.mRight &&
+           aOther.mLeft < mRight && mTop < aOther.mBottom &&
+           aOther.mTop < mBottom;
+  }
+};
+
+/**
+ * Whether the subtree rooted at a node whose bounding box is aBox might have
+ * anything inside aViewport. A node with an empty box (eg a zero-sized
+ * container) cannot be judged, since its descendants may overflow it.
+ */
+inline bool MayIntersectViewport(const ScreenRect& aBox,
+                                 const ScreenRect& aViewport) {
+  return aBox.IsEmpty() || aBox.Intersects(aViewport);
+}
+
+}  // namespace aspk
+
+#endif  // __ASPK_SCREENRECT_H
@@ -0,0 +1,301 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_SELECTOR_H
+#define __ASPK_SELECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ChildFetch.h"
+#include "TreeWalk.h"
+
+namespace aspk {
+
+/**
+ * A small CSS-like selector language over accessibility trees, eg
+ *
+ *   document > *[role=link][state!=invisible]
+ *   dialog pushbutton[name*="OK"]
+ *   heading[attr:level=2][ia2state!=stale]
+ *
+ * A selector is a chain of compounds joined by ">" (child) or whitespace
+ * (descendant). A compound is a role name or "*" followed by any number of
+ * bracketed tests:
+ *
+ *   [role=<role>]  [role!=<role>]     MSAA or IA2 role, by name or number
+ *   [state=<s>]    [state!=<s>]       MSAA state flag set or clear
+ *   [ia2state=<s>] [ia2state!=<s>]    IA2 state flag set or clear
+ *   [name=<v>] [name!=<v>] [name*=<v>]
+ *   [attr:<key>] [attr:<key>=<v>] [attr:<key>!=<v>] [attr:<key>*=<v>]
+ *
+ * "*=" matches a substring, case-sensitively. Values may be quoted with
+ * double quotes, in which case backslash escapes the next character.
+ */
+
+enum class SelectorCombinator : uint8_t { Descendant, Child };
+
+// Ordered by how expensive each property is to fetch, cheapest first.
+enum class SelectorProperty : uint8_t {
+  Role,
+  IA2Role,
+  State,
+  IA2State,
+  Name,
+  Attributes,
+  Count
+};
+
+inline uint32_t SelectorPropertyBit(const SelectorProperty aProp) {
+  return 1U << static_cast<uint32_t>(aProp);
+}
+
+enum class SelectorOp : uint8_t { Equals, NotEquals, Contains, Present };
+
+struct SelectorTest {
+  SelectorProperty mProperty = SelectorProperty::Role;
+  SelectorOp mOp = SelectorOp::Equals;
+  // Every property the test reads, as SelectorPropertyBits.
+  uint32_t mNeeds = 0;
+  // The role, or the state flag, for role and state tests.
+  long mValue = 0;
+  // The attribute key, for attribute tests.
+  std::wstring mKey;
+  // The value to compare with, for name and attribute tests.
+  std::wstring mText;
+};
+
+struct SelectorStep {
+  // How this step relates to the previous one; unused for the first step.
+  SelectorCombinator mCombinator = SelectorCombinator::Descendant;
+  // Sorted so that the cheapest properties are checked first.
+  std::vector<SelectorTest> mTests;
+};
+
+/**
+ * A compiled selector: a flat program of steps, each a list of tests that
+ * must all pass.
+ */
+struct Selector {
+  // Limited by the bitsets that RunSelector tracks partial matches in.
+  static const size_t kMaxSteps = 64;
+
+  std::vector<SelectorStep> mSteps;
+  // MSAA states that the last step requires to be clear and that every
+  // descendant of a node with them shares (invisible and offscreen), so that
+  // subtrees of nodes with any of them cannot match and are pruned.
+  long mPruneStates = 0;
+};
+
+/**
+ * Compiles aText into aOut. On failure returns false and describes the
+ * problem and its offset in aOutError.
+ */
+bool CompileSelector(const wchar_t* aText, Selector& aOut,
+                     std::string& aOutError);
+
+// Looks up a role as selectors spell it: by name, such as "link" or
+// "heading", or as a number.
+bool LookupRoleName(const std::wstring& aName, long& aOutRole);
+
+// The properties of one node, fetched lazily as tests need them.
+struct SelectorNodeProps {
+  uint32_t mFetched = 0;  // SelectorPropertyBits
+  long mRole = 0;
+  long mIA2Role = 0;
+  long mState = 0;
+  long mIA2State = 0;
+  std::wstring mName;
+  // In IA2 form: "key:value;key:value;" with "\" escaping ",:;=\".
+  std::wstring mAttributes;
+};
+
+// Evaluates aTest. Every property it needs must have been fetched already.
+bool SelectorTestMatches(const SelectorTest& aTest,
+                         const SelectorNodeProps& aProps);
+
+/**
+ * Looks up aKey in an IA2 attribute string and unescapes its value into
+ * aOutValue. Returns false if aKey is not there.
+ */
+bool FindIA2Attribute(const std::wstring& aAttributes,
+                      const std::wstring& aKey, std::wstring& aOutValue);
+
+struct SelectorRunStats {
+  uint64_t mMatches = 0;
+  uint64_t mPrunedSubtrees = 0;
+  // Whether the visitor ended the walk early.
+  bool mStopped = false;
+};
+
+/**
+ * Fetches every property in aNeeds that aProps lacks from aProvider, which
+ * must provide, besides the FetchChildren requirements:
+ *
+ *   bool GetRole(const Node&, long& aOut);      // MSAA role
+ *   bool GetIA2Role(const Node&, long& aOut);
+ *   bool GetState(const Node&, long& aOut);     // MSAA states
+ *   bool GetIA2State(const Node&, long& aOut);
+ *   bool GetName(const Node&, std::wstring& aOut);
+ *   bool GetAttributes(const Node&, std::wstring& aOut);
+ *
+ * Properties that cannot be fetched read as zero or empty.
+ */
+template <typename Provider>
+void FetchSelectorProperties(Provider& aProvider,
+                             const typename Provider::Node& aNode,
+                             uint32_t aNeeds, SelectorNodeProps& aProps) {
+  aNeeds &= ~aProps.mFetched;
+  if (!aNeeds) {
+    return;
+  }
+  if ((aNeeds & SelectorPropertyBit(SelectorProperty::Role)) &&
+      !aProvider.GetRole(aNode, aProps.mRole)) {
+    aProps.mRole = 0;
+  }
+  if ((aNeeds & SelectorPropertyBit(SelectorProperty::IA2Role)) &&
+      !aProvider.GetIA2Role(aNode, aProps.mIA2Role)) {
+    aProps.mIA2Role = 0;
+  }
+  if ((aNeeds & SelectorPropertyBit(SelectorProperty::State)) &&
+      !aProvider.GetState(aNode, aProps.mState)) {
+    aProps.mState = 0;
+  }
+  if ((aNeeds & SelectorPropertyBit(SelectorProperty::IA2State)) &&
+      !aProvider.GetIA2State(aNode, aProps.mIA2State)) {
+    aProps.mIA2State = 0;
+  }
+  if ((aNeeds & SelectorPropertyBit(SelectorProperty::Name)) &&
+      !aProvider.GetName(aNode, aProps.mName)) {
+    aProps.mName.clear();
+  }
+  if ((aNeeds & SelectorPropertyBit(SelectorProperty::Attributes)) &&
+      !aProvider.GetAttributes(aNode, aProps.mAttributes)) {
+    aProps.mAttributes.clear();
+  }
+  aProps.mFetched |= aNeeds;
+}
+
+template <typename Provider>
+bool SelectorStepMatches(Provider& aProvider,
+                         const typename Provider::Node& aNode,
+                         const SelectorStep& aStep, SelectorNodeProps& aProps) {
+  for (const SelectorTest& test : aStep.mTests) {
+    FetchSelectorProperties(aProvider, aNode, test.mNeeds, aProps);
+    if (!SelectorTestMatches(test, aProps)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Walks the tree under aRoot in aOrder and calls aVisit(node) for every
+ * node that aSelector matches. The walk ends early if aVisit returns false.
+ * Each node only fetches the properties that the steps it could match need,
+ * and subtrees that cannot contain a match are skipped (see
+ * Selector::mPruneStates), as are those that aFilter skips. aCounters.mNodes
+ * counts the nodes visited.
+ */
+template <typename Provider, typename Visitor>
+SelectorRunStats RunSelector(Provider& aProvider,
+                             const typename Provider::Node& aRoot,
+                             const Selector& aSelector,
+                             const ChildStrategy aStrategy,
+                             TraversalCounters& aCounters,
+                             const WalkOrder aOrder,
+                             const WalkFilter<typename Provider::Node>& aFilter,
+                             Visitor&& aVisit,
+                             const size_t aMaxChunk = kMaxChildChunk) {
+  using Node = typename Provider::Node;
+
+  SelectorRunStats stats;
+  const size_t numSteps = aSelector.mSteps.size();
+  if (!numSteps || numSteps > Selector::kMaxSteps) {
+    return stats;
+  }
+  const uint64_t lastStep = 1ULL << (numSteps - 1);
+
+  struct Matched {
+    // Steps matched by the parent, and by any ancestor.
+    uint64_t mParent = 0;
+    uint64_t mAncestors = 0;
+  };
+
+  TreeWalker<Node, Matched> walker(
+      aOrder,
+      [&](const Node& aNode, std::vector<Node>& aOut) {
+        FetchChildren(aProvider, aNode, aStrategy, aOut, aCounters,
+                      aMaxChunk);
+      },
+      aCounters);
+  walker.Walk(aRoot, aFilter, [&](WalkStep<Node, Matched>& aStep) {
+    SelectorNodeProps props;
+    uint64_t matched = 0;
+    for (size_t i = 0; i < numSteps; ++i) {
+      const SelectorStep& step = aSelector.mSteps[i];
+      if (i) {
+        // A later step is only worth testing once its prefix has matched.
+        const uint64_t prefix =
+            step.mCombinator == SelectorCombinator::Child
+                ? aStep.mContext.mParent
+                : aStep.mContext.mAncestors;
+        if (!(prefix & (1ULL << (i - 1)))) {
+          continue;
+        }
+      }
+      if (SelectorStepMatches(aProvider, aStep.mNode, step, props)) {
+        matched |= 1ULL << i;
+      }
+    }
+
+    if (matched & lastStep) {
+      ++stats.mMatches;
+      if (!aVisit(aStep.mNode)) {
+        stats.mStopped = true;
+        return WalkAction::Stop;
+      }
+    }
+
+    if (aSelector.mPruneStates) {
+      FetchSelectorProperties(aProvider, aStep.mNode,
+                              SelectorPropertyBit(SelectorProperty::State),
+                              props);
+      if (props.mState & aSelector.mPruneStates) {
+        ++stats.mPrunedSubtrees;
+        return WalkAction::SkipChildren;
+      }
+    }
+
+    aStep.mChildContext.mParent = matched;
+    aStep.mChildContext.mAncestors = aStep.mContext.mAncestors | matched;
+    return WalkAction::Continue;
+  });
+
+  return stats;
+}
+
+// Walks depth-first, into every subtree that aSelector does not prune.
+template <typename Provider, typename Visitor>
+SelectorRunStats RunSelector(Provider& aProvider,
+                             const typename Provider::Node& aRoot,
+                             const Selector& aSelector,
+                             const ChildStrategy aStrategy,
+                             TraversalCounters& aCounters, Visitor&& aVisit,
+                             const size_t aMaxChunk = kMaxChildChunk) {
+  const WalkFilter<typename Provider::Node> filter;
+  return RunSelector(aProvider, aRoot, aSelector, aStrategy, aCounters,
+                     WalkOrder::DepthFirst, filter,
+                     std::forward<Visitor>(aVisit), aMaxChunk);
+}
+
+}  // namespace aspk
+
+#endif  // __ASPK_SELECTOR_H
@@ -0,0 +1,279 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TRACE_H
+#define __ASPK_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+
+#include <atomic>
+#include <chrono>
+#include <type_traits>
+
+#include "TraceFormat.h"
+
+/**
+ * Low-overhead binary tracing in the style of NanoLog. A trace point costs one
+ * relaxed load while tracing is off. While it is on, each call site registers
+ * its format string and argument types once, and each event only copies its
+ * raw arguments into the calling thread's ring buffer. A background thread
+ * drains the buffers to the trace file, and the tracedecode tool does the
+ * formatting offline.
+ *
+ * Formats use printf conventions. Arguments may be integers, enums, floating
+ * point values, pointers, and narrow or wide C strings. Arguments are
+ * evaluated only while tracing is on.
+ */
+#define ASPK_TRACE(aFormat, ...)                                        \
+  do {                                                                  \
+    if (::aspk::Tracer::IsEnabled()) {                                  \
+      static ::aspk::TraceSite sTraceSite(aFormat, __FILE__, __LINE__); \
+      ::aspk::Tracer::Record(sTraceSite, ##__VA_ARGS__);                \
+    }                                                                   \
+  } while (false)
+
+namespace aspk {
+
+template <typename T>
+struct TraceArgTraits {
+  using Type = typename std::decay<T>::type;
+
+  static const bool kIsString = std::is_same<Type, const char*>::value ||
+                                std::is_same<Type, char*>::value;
+  static const bool kIsWideString =
+      std::is_same<Type, const wchar_t*>::value ||
+      std::is_same<Type, wchar_t*>::value;
+  static const bool kIsSigned =
+      std::is_signed<typename std::conditional<std::is_enum<Type>::value, int,
+                                               Type>::type>::value;
+
+  static_assert(std::is_arithmetic<Type>::value || std::is_enum<Type>::value ||
+                    std::is_pointer<Type>::value,
+                "Unsupported trace argument type");
+
+  static const TraceArgType kType =
+      kIsString                             ? TraceArgType::String
+      : kIsWideString                       ? TraceArgType::WideString
+      : std::is_pointer<Type>::value        ? TraceArgType::Pointer
+      : std::is_floating_point<Type>::value ? TraceArgType::Double
+      : sizeof(Type) > 4 ? (kIsSigned ? TraceArgType::Int64
+                                      : TraceArgType::UInt64)
+                         : (kIsSigned ? TraceArgType::Int32
+                                      : TraceArgType::UInt32);
+};
+
+template <typename... Args>
+struct TraceArgTypeList {
+  // One extra element so that the array is never empty.
+  static const TraceArgType kTypes[sizeof...(Args) + 1];
+};
+
+template <typename... Args>
+const TraceArgType TraceArgTypeList<Args...>::kTypes[sizeof...(Args) + 1] = {
+    TraceArgTraits<Args>::kType..., TraceArgType::Int32};
+
+// A trace call site. Each ASPK_TRACE expansion owns one constant-initialized
+// static instance, which is registered the first time it records an event.
+struct TraceSite {
+  constexpr TraceSite(const char* aFormat, const char* aFile, int aLine)
+      : mFormat(aFormat), mFile(aFile), mLine(static_cast<uint32_t>(aLine)) {}
+
+  TraceSite(const TraceSite&) = delete;
+  TraceSite& operator=(const TraceSite&) = delete;
+
+  const char* const mFormat;
+  const char* const mFile;
+  const uint32_t mLine;
+  // Set during registration, before mId is published.
+  uint8_t mArgCount = 0;
+  const TraceArgType* mTypes = nullptr;
+  // The site's id plus one, or zero while unregistered.
+  std::atomic<uint32_t> mId{0};
+};
+
+// A single-producer, single-consumer byte ring owned by one thread.
+struct TraceBuffer {
+  static const size_t kSize = 1024 * 1024;  // Must be a power of two
+  static const uint64_t kMask = kSize - 1;
+
+  std::atomic<uint64_t> mHead{0};  // Advanced by the owning thread
+  std::atomic<uint64_t> mTail{0};  // Advanced by the drain thread
+  std::atomic<uint64_t> mDropped{0};
+  std::atomic<bool> mRetired{false};  // Owning thread has exited
+  uint64_t mDroppedReported = 0;
+  uint32_t mThreadId = 0;
+  uint8_t mData[kSize];
+
+  void Put(uint64_t& aPos, const void* aData, size_t aLen) {
+    if (!aLen) {
+      return;  // aData may be null, e.g. for a null string
+    }
+    const uint8_t* src = static_cast<const uint8_t*>(aData);
+    size_t offset = static_cast<size_t>(aPos & kMask);
+    size_t first = kSize - offset < aLen ? kSize - offset : aLen;
+    memcpy(mData + offset, src, first);
+    memcpy(mData, src + first, aLen - first);
+    aPos += aLen;
+  }
+};
+
+class Tracer {
+ public:
+  // Longer strings are truncated.
+  static const size_t kMaxStringUnits = 512;
+
+  // Starts writing a trace to aOut, which must be opened for binary writing.
+  // The tracer does not close it.
+  static bool Start(FILE* aOut);
+
+  // Stops tracing and writes out everything recorded so far.
+  static void Stop();
+
+  static bool IsEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+  static uint64_t EventsWritten();
+  static uint64_t EventsDropped();
+
+  template <typename... Args>
+  static void Record(TraceSite& aSite, const Args&... aArgs) {
+    uint32_t id = aSite.mId.load(std::memory_order_acquire);
+    if (!id) {
+      id = RegisterSite(aSite, static_cast<uint8_t>(sizeof...(Args)),
+                        TraceArgTypeList<Args...>::kTypes);
+    }
+    --id;
+
+    TraceBuffer* buffer = CurrentBuffer();
+    const size_t size =
+        sizeof(uint32_t) + sizeof(uint64_t) + ArgsSize(aArgs...);
+    uint64_t pos = buffer->mHead.load(std::memory_order_relaxed);
+    uint64_t tail = buffer->mTail.load(std::memory_order_acquire);
+    if (size > TraceBuffer::kSize - (pos - tail)) {
+      // Never block the traced thread; the drain thread reports drops.
+      buffer->mDropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+
+    uint64_t timestamp = static_cast<uint64_t>(
+        std::chrono::steady_clock::now().time_since_epoch().count());
+    buffer->Put(pos, &id, sizeof(id));
+    buffer->Put(pos, &timestamp, sizeof(timestamp));
+    PutArgs(buffer, pos, aArgs...);
+    buffer->mHead.store(pos, std::memory_order_release);
+  }
+
+ private:
+  template <TraceArgType kType>
+  using ArgTag = std::integral_constant<TraceArgType, kType>;
+
+  // Returns the site's id plus one.
+  static uint32_t RegisterSite(TraceSite& aSite, uint8_t aArgCount,
+                               const TraceArgType* aTypes);
+  static TraceBuffer* CurrentBuffer();
+
+  static size_t StringUnits(const char* aStr) {
+    return aStr ? strnlen(aStr, kMaxStringUnits) : 0;
+  }
+  static size_t StringUnits(const wchar_t* aStr) {
+    return aStr ? wcsnlen(aStr, kMaxStringUnits) : 0;
+  }
+
+  template <typename T, TraceArgType kType>
+  static size_t ArgSize(const T&, ArgTag<kType>) {
+    return kType == TraceArgType::Int32 || kType == TraceArgType::UInt32 ? 4
+                                                                         : 8;
+  }
+  template <typename T>
+  static size_t ArgSize(const T& aArg, ArgTag<TraceArgType::String>) {
+    return sizeof(uint16_t) + StringUnits(static_cast<const char*>(aArg));
+  }
+  template <typename T>
+  static size_t ArgSize(const T& aArg, ArgTag<TraceArgType::WideString>) {
+    return sizeof(uint16_t) +
+           StringUnits(static_cast<const wchar_t*>(aArg)) * sizeof(uint16_t);
+  }
+
+  static size_t ArgsSize() { return 0; }
+
+  template <typename T, typename... Rest>
+  static size_t ArgsSize(const T& aArg, const Rest&... aRest) {
+    return ArgSize(aArg, ArgTag<TraceArgTraits<T>::kType>()) +
+           ArgsSize(aRest...);
+  }
+
+  template <typename Stored, typename T>
+  static typename std::enable_if<std::is_pointer<T>::value, Stored>::type
+  ToStored(T aValue) {
+    return static_cast<Stored>(reinterpret_cast<uintptr_t>(aValue));
+  }
+  template <typename Stored, typename T>
+  static typename std::enable_if<!std::is_pointer<T>::value, Stored>::type
+  ToStored(T aValue) {
+    return static_cast<Stored>(aValue);
+  }
+
+  template <typename T, TraceArgType kType>
+  static void PutArg(TraceBuffer* aBuffer, uint64_t& aPos, const T& aArg,
+                     ArgTag<kType>) {
+    using Stored = typename std::conditional<
+        kType == TraceArgType::Int32, int32_t,
+        typename std::conditional<
+            kType == TraceArgType::UInt32, uint32_t,
+            typename std::conditional<
+                kType == TraceArgType::Int64, int64_t,
+                typename std::conditional<kType == TraceArgType::Double,
+                                          double, uint64_t>::type>::type>::
+            type>::type;
+    Stored value =
+        ToStored<Stored>(static_cast<typename TraceArgTraits<T>::Type>(aArg));
+    aBuffer->Put(aPos, &value, sizeof(value));
+  }
+
+  template <typename T>
+  static void PutArg(TraceBuffer* aBuffer, uint64_t& aPos, const T& aArg,
+                     ArgTag<TraceArgType::String>) {
+    const char* str = aArg;
+    uint16_t len = static_cast<uint16_t>(StringUnits(str));
+    aBuffer->Put(aPos, &len, sizeof(len));
+    aBuffer->Put(aPos, str, len);
+  }
+
+  template <typename T>
+  static void PutArg(TraceBuffer* aBuffer, uint64_t& aPos, const T& aArg,
+                     ArgTag<TraceArgType::WideString>) {
+    const wchar_t* str = aArg;
+    uint16_t len = static_cast<uint16_t>(StringUnits(str));
+    aBuffer->Put(aPos, &len, sizeof(len));
+    if (sizeof(wchar_t) == sizeof(uint16_t)) {
+      aBuffer->Put(aPos, str, len * sizeof(uint16_t));
+      return;
+    }
+    for (uint16_t i = 0; i < len; ++i) {
+      // Only Windows has a 16-bit wchar_t; elsewhere keep the low 16 bits.
+      uint16_t unit = static_cast<uint16_t>(str[i]);
+      aBuffer->Put(aPos, &unit, sizeof(unit));
+    }
+  }
+
+  static void PutArgs(TraceBuffer*, uint64_t&) {}
+
+  template <typename T, typename... Rest>
+  static void PutArgs(TraceBuffer* aBuffer, uint64_t& aPos, const T& aArg,
+                      const Rest&... aRest) {
+    PutArg(aBuffer, aPos, aArg, ArgTag<TraceArgTraits<T>::kType>());
+    PutArgs(aBuffer, aPos, aRest...);
+  }
+
+  static std::atomic<bool> sEnabled;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TRACE_H
@@ -0,0 +1,65 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TRACEFORMAT_H
+#define __ASPK_TRACEFORMAT_H
+
+#include <stdint.h>
+
+/**
+ * The on-disk layout of a binary trace, shared by the tracer and by the
+ * tracedecode tool. All integers are little-endian.
+ *
+ * A trace starts with a TraceFileHeader and is followed by records, each of
+ * which begins with a one-byte TraceRecordKind:
+ *
+ *   kTraceRecordSite:    uint32 id, uint32 line, uint8 argCount,
+ *                        uint8 types[argCount], uint16 fileLen, char file[],
+ *                        uint16 formatLen, char format[]
+ *   kTraceRecordEvents:  uint32 threadId, uint32 byteLen, events[byteLen]
+ *   kTraceRecordDropped: uint32 threadId, uint64 count
+ *
+ * A site is always written before any event that refers to it. Each event is
+ *
+ *   uint32 siteId, uint64 timestamp, args...
+ *
+ * where the arguments are encoded back to back according to the site's types:
+ * fixed-size values as themselves, and strings as a uint16 length in code
+ * units followed by that many UTF-8 bytes or UTF-16 code units.
+ */
+
+namespace aspk {
+
+static const char kTraceMagic[8] = {'A', '1', '1', 'Y', 'T', 'R', 'C', 'E'};
+static const uint32_t kTraceVersion = 1;
+
+struct TraceFileHeader {
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mReserved;
+  uint64_t mTicksPerSecond;  // Units of event timestamps
+};
+
+enum TraceRecordKind : uint8_t {
+  kTraceRecordSite = 1,
+  kTraceRecordEvents = 2,
+  kTraceRecordDropped = 3,
+};
+
+enum class TraceArgType : uint8_t {
+  Int32,
+  UInt32,
+  Int64,
+  UInt64,
+  Double,
+  Pointer,     // Stored as uint64
+  String,      // UTF-8
+  WideString,  // UTF-16
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TRACEFORMAT_H
@@ -0,0 +1,166 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TRAVERSALSTACK_H
+#define __ASPK_TRAVERSALSTACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace aspk {
+
+struct TraversalStackStats {
+  // Blocks obtained from the heap, and their total size in bytes.
+  uint64_t mBlockAllocations = 0;
+  uint64_t mBytesAllocated = 0;
+  uint64_t mPushes = 0;
+  // The most nodes held at once, and the deepest node pushed.
+  uint64_t mPeakSize = 0;
+  uint32_t mMaxDepth = 0;
+};
+
+/**
+ * The pending nodes of a depth-first walk, each with its depth below the
+ * walk's root. Nodes are moved in and out, so handles such as COM smart
+ * pointers are never AddRef'd or Released by the stack itself.
+ *
+ * Storage is an arena of blocks, each twice the size of the one before, that
+ * pushes bump through and pops unwind. Blocks are kept when the stack
+ * empties, so a stack reused across walks stops allocating once it has grown
+ * to the widest walk's frontier.
+ */
+template <typename T>
+class TraversalStack {
+ public:
+  TraversalStack() = default;
+  ~TraversalStack() { Clear(); }
+
+  bool IsEmpty() const { return !mSize; }
+  size_t Size() const { return mSize; }
+
+  void Push(T&& aNode, const uint32_t aDepth) {
+    if (mNext == mEnd) {
+      NextBlock();
+    }
+    new (mNext++) Entry{std::move(aNode), aDepth};
+    ++mSize;
+    ++mStats.mPushes;
+    if (mSize > mStats.mPeakSize) {
+      mStats.mPeakSize = mSize;
+    }
+    if (aDepth > mStats.mMaxDepth) {
+      mStats.mMaxDepth = aDepth;
+    }
+  }
+
+  // Moves every node of aNodes, a vector or the like, onto the stack so that
+  // aNodes.front() is popped first, then clears aNodes.
+  template <typename Nodes>
+  void PushReversed(Nodes& aNodes, const uint32_t aDepth) {
+    for (auto it = aNodes.rbegin(); it != aNodes.rend(); ++it) {
+      Push(std::move(*it), aDepth);
+    }
+    aNodes.clear();
+  }
+
+  // Moves the top node into aOut and its depth into aOutDepth. Returns false
+  // if the stack is empty.
+  bool Pop(T& aOut, uint32_t& aOutDepth) {
+    if (!mSize) {
+      return false;
+    }
+    Entry* entry = Top();
+    aOut = std::move(entry->mNode);
+    aOutDepth = entry->mDepth;
+    entry->~Entry();
+    Unwind();
+    return true;
+  }
+
+  // Destroys every node held, keeping the blocks for reuse.
+  void Clear() {
+    while (mSize) {
+      Top()->~Entry();
+      Unwind();
+    }
+  }
+
+  const TraversalStackStats& Stats() const { return mStats; }
+
+  // Restarts the stats, except for the blocks already held.
+  void ResetStats() {
+    const TraversalStackStats blocks = mStats;
+    mStats = TraversalStackStats();
+    mStats.mBlockAllocations = blocks.mBlockAllocations;
+    mStats.mBytesAllocated = blocks.mBytesAllocated;
+    mStats.mPeakSize = mSize;
+  }
+
+ private:
+  struct Entry {
+    T mNode;
+    uint32_t mDepth;
+  };
+
+  using Slot =
+      typename std::aligned_storage<sizeof(Entry), alignof(Entry)>::type;
+
+  static const size_t kFirstBlockSize = 64;
+  // Enough blocks for 64 << 40 entries.
+  static const size_t kMaxBlocks = 41;
+
+  static size_t BlockSize(const size_t aBlock) {
+    return kFirstBlockSize << aBlock;
+  }
+
+  Entry* Top() { return reinterpret_cast<Entry*>(mNext - 1); }
+
+  // Moves on to the next block, allocating it if it is the first time.
+  void NextBlock() {
+    if (mEnd) {
+      ++mBlock;
+    }
+    if (!mBlocks[mBlock]) {
+      mBlocks[mBlock].reset(new Slot[BlockSize(mBlock)]);
+      ++mStats.mBlockAllocations;
+      mStats.mBytesAllocated += BlockSize(mBlock) * sizeof(Slot);
+    }
+    mNext = mBlocks[mBlock].get();
+    mEnd = mNext + BlockSize(mBlock);
+  }
+
+  // Drops the top entry, which has been destroyed.
+  void Unwind() {
+    --mNext;
+    --mSize;
+    if (mNext == mBlocks[mBlock].get() && mBlock) {
+      --mBlock;
+      mEnd = mBlocks[mBlock].get() + BlockSize(mBlock);
+      mNext = mEnd;
+    }
+  }
+
+  TraversalStack(const TraversalStack&) = delete;
+  TraversalStack& operator=(const TraversalStack&) = delete;
+
+  std::unique_ptr<Slot[]> mBlocks[kMaxBlocks];
+  // The block being filled, the next free slot in it and its end. Every
+  // block before it is full.
+  size_t mBlock = 0;
+  Slot* mNext = nullptr;
+  Slot* mEnd = nullptr;
+  size_t mSize = 0;
+  TraversalStackStats mStats;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TRAVERSALSTACK_H
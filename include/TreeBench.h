@@ -0,0 +1,149 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TREEBENCH_H
+#define __ASPK_TREEBENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <vector>
+
+#include "AccBackend.h"
+#include "ChildFetch.h"
+#include "PropertyCosts.h"
+#include "TreeWalk.h"
+
+namespace aspk {
+
+// Formats output the way printf does.
+using BenchPrintFn = void (*)(const char* aFmt, ...);
+
+// Returns the total nanoseconds spent printing so far, by any thread.
+using BenchOutputNsFn = uint64_t (*)();
+
+struct TreeBenchOptions {
+  ChildStrategy mStrategy = ChildStrategy::Navigate;
+  size_t mMaxChunk = kMaxChildChunk;
+  uint32_t mPropertyMask = kAllAccPropertiesMask;
+  // Prunes children whose bounds lie outside the backend's viewport, as well
+  // as those whose states are invisible or offscreen.
+  bool mCullToViewport = false;
+  // Walks hold only the path from the root to the current node and move
+  // between siblings one at a time, rather than holding every pending
+  // sibling, so that the references held are bounded by the tree's depth.
+  // The child strategy is then unused.
+  bool mBoundRefs = false;
+  // The order, depth limit and pruning of every walk. Bounded walks are
+  // always depth-first.
+  TreeWalkOptions mWalk;
+  BenchPrintFn mPrint = nullptr;
+  // If set, the time spent printing is subtracted from every timed run.
+  BenchOutputNsFn mOutputNs = nullptr;
+};
+
+/**
+ * The traversals behind the speed-* and dump-entire-tree commands, over any
+ * AccBackend. Every node visited and every child round-trip is added to the
+ * counters, and the latency of every property query to the costs, both of
+ * which are owned by the caller so that they can span several runs.
+ *
+ * Walks run on a TreeWalker, in the order and within the limits that mWalk
+ * sets. By default they fetch every child of a node at once and keep the
+ * ones not yet visited; with mBoundRefs they keep only the current path.
+ */
+class TreeBench {
+ public:
+  TreeBench(AccBackend& aBackend, const TreeBenchOptions& aOptions,
+            TraversalCounters& aCounters, PropertyCosts& aCosts)
+      : mBackend(aBackend),
+        mOptions(aOptions),
+        mCounters(aCounters),
+        mCosts(aCosts),
+        mWalker(aOptions.mWalk.mOrder,
+                [this](const BackendNodePtr& aNode,
+                       std::vector<BackendNodePtr>& aOut) {
+                  FetchChildren(aNode, aOut);
+                },
+                aCounters) {}
+
+  // Returns the first visible node under aRoot that has aRole, or null.
+  BackendNodePtr FindVisibleRole(const BackendNodePtr& aRoot, long aRole);
+
+  // Makes every query selected by the property mask, recording the latency
+  // of each. Stops at the first that fails and returns false.
+  bool QueryProperties(const BackendNodePtr& aNode);
+
+  // Looks up the root, finds the visible document and queries its
+  // properties, which is what a screen reader does on focusing a page.
+  bool FindDocumentAndQuery(double& aOutMs);
+
+  // Queries the properties of every node under aRoot, skipping the subtrees
+  // of children that are not visible.
+  void WalkVisible(const BackendNodePtr& aRoot, double& aOutMs);
+
+  // Prints a line for every node under aRoot.
+  void DumpTree(const BackendNodePtr& aRoot);
+  void DumpNode(const BackendNodePtr& aNode);
+
+  // The allocations and high-water marks of the pending-node stack shared by
+  // the walks that fetch every child at once.
+  const TraversalStackStats& StackStats() const {
+    return mWalker.StackStats();
+  }
+
+ private:
+  using Filter = WalkFilter<BackendNodePtr>;
+
+  void FetchChildren(const BackendNodePtr& aNode,
+                     std::vector<BackendNodePtr>& aOut);
+
+  // Adds the prune predicates for mWalk.mPrune to aFilter. If aViewport is
+  // set, children that ShouldVisitChild rejects are pruned too.
+  void AddPrunes(Filter& aFilter, const ScreenRect* aViewport);
+
+  // Whether aChild has a role or source that mWalk.mPrune skips.
+  bool PrunedByRole(const BackendNodePtr& aChild);
+  bool PrunedBySource(const BackendNodePtr& aChild);
+
+  /**
+   * Calls aVisit(node) on aRoot and then on every node under it in document
+   * order that aFilter keeps, holding only the current path, until aVisit
+   * returns false.
+   */
+  template <typename Visitor>
+  void WalkBounded(const BackendNodePtr& aRoot, const Filter& aFilter,
+                   Visitor&& aVisit);
+
+  // Returns aNode, or the first sibling after it, that aFilter keeps.
+  BackendNodePtr SkipRejected(BackendNodePtr aNode, const Filter& aFilter);
+
+  bool HasVisibleRole(const BackendNodePtr& aNode, long aRole);
+
+  bool ShouldVisitChild(const BackendNodePtr& aChild,
+                        const ScreenRect& aViewport);
+
+  // The time since aStart, less any printing since aOutputStartNs.
+  double ElapsedMs(std::chrono::steady_clock::time_point aStart,
+                   uint64_t aOutputStartNs) const;
+
+  uint64_t OutputNs() const {
+    return mOptions.mOutputNs ? mOptions.mOutputNs() : 0;
+  }
+
+  AccBackend& mBackend;
+  const TreeBenchOptions mOptions;
+  TraversalCounters& mCounters;
+  PropertyCosts& mCosts;
+  TreeWalker<BackendNodePtr> mWalker;
+  // The ancestors of the current node, in bounded walks.
+  std::vector<BackendNodePtr> mPath;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TREEBENCH_H
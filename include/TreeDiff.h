@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TREEDIFF_H
+#define __ASPK_TREEDIFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "TreeMirror.h"
+#include "TreeSnapshot.h"
+
+namespace aspk {
+
+static const uint32_t kNoDiffNode = UINT32_MAX;
+
+// The properties compared between matched nodes, as bits of TreeEdit::mChanged.
+enum DiffProperty : uint32_t {
+  kDiffRole = 1 << 0,
+  kDiffState = 1 << 1,
+  kDiffIA2States = 1 << 2,
+  kDiffName = 1 << 3,
+};
+
+struct DiffNode {
+  long mUniqueId = kNoUniqueId;
+  long mRole = 0;
+  uint32_t mState = 0;
+  uint32_t mIA2States = 0;
+  std::string mName;  // UTF-8
+
+  // Filled in by DiffTree::AddNode.
+  uint32_t mParent = kNoDiffNode;
+  uint32_t mIndexInParent = 0;
+  std::vector<uint32_t> mChildren;
+};
+
+/**
+ * One capture of a tree, in a form that DiffTrees can compare with another.
+ * Node 0 is the root, and every node is numbered after its parent.
+ */
+class DiffTree {
+ public:
+  // Adds aNode as the last child of aParent, or as the root if aParent is
+  // kNoDiffNode, and returns its index.
+  uint32_t AddNode(uint32_t aParent, DiffNode&& aNode);
+
+  size_t Size() const { return mNodes.size(); }
+  const DiffNode& Node(uint32_t aIndex) const { return mNodes[aIndex]; }
+
+  void Clear() { mNodes.clear(); }
+
+  // Loads a validated snapshot (see SnapshotView::Validate).
+  bool LoadSnapshot(const SnapshotView& aView);
+
+  // Loads everything reachable from aMirror's root.
+  bool LoadMirror(const TreeMirror& aMirror);
+
+ private:
+  std::vector<DiffNode> mNodes;
+};
+
+enum class TreeEditType : uint8_t { Insert, Remove, Move, Change };
+
+const char* TreeEditTypeName(TreeEditType aType);
+
+/**
+ * One step of an edit script. Inserts refer to a node of the new tree and
+ * removes to one of the old tree. Moves and changes refer to a matched pair:
+ * a move puts the node at its new parent and position, and a change updates
+ * the properties in mChanged. A node that both moved and changed gets one
+ * edit of each kind.
+ */
+struct TreeEdit {
+  TreeEditType mType;
+  uint32_t mOldNode;
+  uint32_t mNewNode;
+  uint32_t mChanged;  // DiffProperty bits, for changes
+};
+
+struct TreeDiffStats {
+  uint64_t mMatchedById = 0;
+  uint64_t mMatchedByPosition = 0;
+  uint64_t mInserted = 0;
+  uint64_t mRemoved = 0;
+  uint64_t mMoved = 0;
+  uint64_t mChanged = 0;
+  uint64_t mUnchanged = 0;  // Matched nodes with no edits at all
+};
+
+/**
+ * Computes an edit script that turns aOld into aNew.
+ *
+ * Nodes are matched by IA2 uniqueID. A node that cannot be matched that way
+ * and that lacks a uniqueID on one side falls back to the node at the same
+ * child index under its matched parent, provided both have the same role.
+ * The two roots are matched with each other unless either matched by ID.
+ * Matched nodes whose parents do not match are moved; among siblings that
+ * stayed under the same parent, only those outside a longest increasing run
+ * of old positions are moved, which is the fewest moves that restore the new
+ * order.
+ *
+ * Apart from sorting reordered sibling lists, which costs O(k log k) for k
+ * siblings and nothing when no siblings were reordered, this is linear in the
+ * size of both trees. Edits are ordered with every remove first, in old tree
+ * order, followed by the rest in new tree order.
+ */
+void DiffTrees(const DiffTree& aOld, const DiffTree& aNew,
+               std::vector<TreeEdit>& aOutEdits, TreeDiffStats& aOutStats);
+
+}  // namespace aspk
+
+#endif  // __ASPK_TREEDIFF_H
@@ -0,0 +1,134 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TREEMIRROR_H
+#define __ASPK_TREEMIRROR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace aspk {
+
+static const long kNoUniqueId = 0;
+
+struct MirrorNodeInfo {
+  long mParentId = kNoUniqueId;
+  long mRole = 0;
+  long mState = 0;
+  std::wstring mName;
+};
+
+/**
+ * Where the mirror gets its data from. Nodes are identified by their IA2
+ * uniqueID. Both methods return false if the node no longer exists.
+ */
+class MirrorSource {
+ public:
+  virtual ~MirrorSource() {}
+
+  virtual bool GetInfo(long aUniqueId, MirrorNodeInfo& aOut) = 0;
+  virtual bool GetChildIds(long aUniqueId, std::vector<long>& aOut) = 0;
+};
+
+enum class MirrorEventType : uint32_t {
+  Show,
+  Hide,
+  Reorder,
+  NameChange,
+  StateChange
+};
+
+struct MirrorEvent {
+  MirrorEventType mType;
+  long mUniqueId;
+  // Caller-defined clock, in microseconds. Only used for latency accounting.
+  uint64_t mTimestampUs;
+};
+
+struct MirrorUpdateStats {
+  uint64_t mEventsReceived = 0;
+  uint64_t mEventsApplied = 0;
+  uint64_t mEventsCoalesced = 0;
+  uint64_t mEventsIgnored = 0;
+  uint64_t mSourceCalls = 0;
+  uint64_t mNodesAdded = 0;
+  uint64_t mNodesRemoved = 0;
+  uint64_t mNodesRefreshed = 0;
+  uint64_t mTotalLatencyUs = 0;
+  uint64_t mMaxLatencyUs = 0;
+
+  double MeanLatencyUs() const {
+    if (!mEventsApplied) {
+      return 0.0;
+    }
+    return static_cast<double>(mTotalLatencyUs) /
+           static_cast<double>(mEventsApplied);
+  }
+};
+
+/**
+ * A client-side copy of an accessibility tree, keyed by IA2 uniqueID. It is
+ * populated once with a full walk and then patched from a stream of events.
+ * Each event only causes the affected node (and for structural changes, its
+ * new subtrees) to be re-fetched from the source.
+ */
+class TreeMirror {
+ public:
+  struct Node {
+    long mUniqueId = kNoUniqueId;
+    MirrorNodeInfo mInfo;
+    std::vector<long> mChildren;
+  };
+
+  explicit TreeMirror(MirrorSource& aSource) : mSource(aSource), mRootId(0) {}
+
+  // Discards the current contents and walks the whole tree below aRootId.
+  bool Build(long aRootId);
+
+  void Enqueue(const MirrorEvent& aEvent);
+  size_t PendingCount() const { return mPending.size(); }
+
+  // Applies (and coalesces) every queued event. aNowUs is on the same clock
+  // as the event timestamps.
+  void ApplyPending(uint64_t aNowUs);
+
+  const Node* Find(long aUniqueId) const;
+  long RootId() const { return mRootId; }
+  size_t Size() const { return mNodes.size(); }
+
+  // Collects the uniqueIDs of every node with aRole, in document order.
+  void FindRole(long aRole, std::vector<long>& aOut) const;
+
+  // Counts nodes that are missing from, or differ from, their counterpart in
+  // aOther, in either direction.
+  size_t CountDifferences(const TreeMirror& aOther) const;
+
+  const MirrorUpdateStats& Stats() const { return mStats; }
+
+ private:
+  bool FetchInfo(long aUniqueId, MirrorNodeInfo& aOut);
+  bool FetchChildIds(long aUniqueId, std::vector<long>& aOut);
+
+  void AddSubtree(long aUniqueId, const MirrorNodeInfo& aInfo);
+  void RemoveSubtree(long aUniqueId);
+  void DetachFromParent(long aUniqueId);
+  void SyncChildren(long aUniqueId);
+  void RefreshInfo(long aUniqueId);
+
+  MirrorSource& mSource;
+  long mRootId;
+  std::unordered_map<long, Node> mNodes;
+  std::vector<MirrorEvent> mPending;
+  MirrorUpdateStats mStats;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TREEMIRROR_H
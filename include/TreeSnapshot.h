@@ -0,0 +1,187 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TREESNAPSHOT_H
+#define __ASPK_TREESNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <unordered_map>
+
+namespace aspk {
+
+/**
+ * A tree snapshot is a flat, memory-mappable file:
+ *
+ *   SnapshotHeader
+ *   SnapshotNode[mNodeCount]   (at mNodesOffset)
+ *   string pool                (mStringsSize bytes at mStringsOffset)
+ *
+ * Nodes are stored in breadth-first order, so the children of any node occupy
+ * the contiguous range [mFirstChild, mFirstChild + mChildCount). Strings are
+ * UTF-8 and NUL-terminated in the pool; nodes refer to them by offset and
+ * length. Fields are naturally aligned and in host byte order, so a mapped
+ * file can be used in place without any parsing; mEndianMark lets a host of
+ * the other byte order reject it.
+ */
+static const char kSnapshotMagic[8] = {'A', '1', '1', 'Y', 'S', 'N', 'A', 'P'};
+static const uint32_t kSnapshotVersion = 1;
+static const uint32_t kSnapshotEndianMark = 0x01020304;
+static const uint32_t kNoSnapshotNode = UINT32_MAX;
+static const uint32_t kNoSnapshotString = UINT32_MAX;
+
+struct SnapshotHeader {
+  char mMagic[8];
+  uint32_t mVersion;
+  uint32_t mEndianMark;
+  uint32_t mNodeSize;
+  uint32_t mReserved;
+  uint64_t mNodeCount;
+  uint64_t mNodesOffset;
+  uint64_t mStringsOffset;
+  uint64_t mStringsSize;
+};
+
+static_assert(sizeof(SnapshotHeader) == 56, "SnapshotHeader must be packed");
+
+struct SnapshotNode {
+  int32_t mRole;         // MSAA role, or 0 if the role was not an integer
+  uint32_t mState;       // MSAA state flags
+  uint32_t mIA2States;   // IA2 AccessibleStates
+  int32_t mUniqueId;     // IA2 uniqueID, or 0 if unavailable
+  uint32_t mParent;      // Index of the parent, or kNoSnapshotNode
+  uint32_t mFirstChild;  // Index of the first child, if any
+  uint32_t mChildCount;
+  uint32_t mNameOffset;  // Offset into the string pool, or kNoSnapshotString
+  uint32_t mNameLength;  // In bytes, excluding the terminator
+};
+
+static_assert(sizeof(SnapshotNode) == 36, "SnapshotNode must be packed");
+
+// The per-node data that a traversal hands to SnapshotWriter.
+struct SnapshotNodeInfo {
+  int32_t mRole = 0;
+  uint32_t mState = 0;
+  uint32_t mIA2States = 0;
+  int32_t mUniqueId = 0;
+  bool mHasName = false;
+  std::string mName;  // UTF-8
+};
+
+/**
+ * Streams a snapshot to disk while the tree is being walked breadth-first.
+ * Node records go straight to the output file and string data to a temporary
+ * file that is appended on Finish, so memory use is bounded by the intern
+ * table, which stops growing once it holds kMaxInternedStrings entries.
+ */
+class SnapshotWriter {
+ public:
+  static const size_t kMaxInternedStrings = 64 * 1024;
+
+  SnapshotWriter() = default;
+  ~SnapshotWriter();
+
+  SnapshotWriter(const SnapshotWriter&) = delete;
+  SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+  // aOut must be opened for binary writing and seekable. The writer does not
+  // close it.
+  bool Begin(FILE* aOut);
+
+  /**
+   * Writes the next node in breadth-first order and reserves indices for its
+   * aChildCount children, the first of which is returned via aOutFirstChild.
+   * Nodes must be added in index order, starting with the root (index 0,
+   * aParent == kNoSnapshotNode), and every reserved index must be filled
+   * before Finish.
+   */
+  bool AddNode(const SnapshotNodeInfo& aInfo, uint32_t aParent,
+               uint32_t aChildCount, uint32_t& aOutFirstChild);
+
+  // Appends the string pool and fills in the header.
+  bool Finish();
+
+  uint64_t NodeCount() const { return mNodeCount; }
+  uint64_t StringsSize() const { return mStringsSize; }
+  uint64_t InternHits() const { return mInternHits; }
+
+ private:
+  bool InternString(const std::string& aStr, uint32_t& aOutOffset);
+
+  FILE* mOut = nullptr;
+  FILE* mStrings = nullptr;
+  uint64_t mNodeCount = 0;
+  uint64_t mNextFree = 1;
+  uint64_t mStringsSize = 0;
+  uint64_t mInternHits = 0;
+  std::unordered_map<std::string, uint32_t> mInterned;
+};
+
+/**
+ * A read-only view over snapshot bytes that are already in memory, eg from
+ * MappedSnapshot. The view does not copy or own the bytes.
+ */
+class SnapshotView {
+ public:
+  // Validates the header and the bounds of every section. Does not walk the
+  // nodes; use Validate for that.
+  bool Init(const void* aData, size_t aSize);
+
+  // Checks that every node's parent, child range and name lie within bounds
+  // and that each child points back at its parent.
+  bool Validate() const;
+
+  uint64_t NodeCount() const { return mHeader ? mHeader->mNodeCount : 0; }
+  const SnapshotNode& Node(uint32_t aIndex) const { return mNodes[aIndex]; }
+
+  // Returns the NUL-terminated name of aNode, or nullptr if it has none.
+  const char* Name(const SnapshotNode& aNode) const;
+
+ private:
+  const SnapshotHeader* mHeader = nullptr;
+  const SnapshotNode* mNodes = nullptr;
+  const char* mStrings = nullptr;
+  uint64_t mStringsSize = 0;
+};
+
+#if defined(_WIN32)
+using SnapshotPathChar = wchar_t;
+#else
+using SnapshotPathChar = char;
+#endif
+
+// Maps a snapshot file read-only into memory.
+class MappedSnapshot {
+ public:
+  MappedSnapshot() = default;
+  ~MappedSnapshot() { Close(); }
+
+  MappedSnapshot(const MappedSnapshot&) = delete;
+  MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+  bool Open(const SnapshotPathChar* aPath);
+  void Close();
+
+  const SnapshotView& View() const { return mView; }
+
+ private:
+  const void* mData = nullptr;
+  size_t mSize = 0;
+#if defined(_WIN32)
+  void* mFile = nullptr;
+  void* mMapping = nullptr;
+#else
+  int mFd = -1;
+#endif
+  SnapshotView mView;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TREESNAPSHOT_H
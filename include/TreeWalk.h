@@ -0,0 +1,343 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_TREEWALK_H
+#define __ASPK_TREEWALK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "ChildFetch.h"
+#include "NodeSource.h"
+#include "TraversalStack.h"
+
+namespace aspk {
+
+// IA2 roles (IA2_ROLE_* in AccessibleRole.idl) are numbered above every MSAA
+// role, starting with IA2_ROLE_CANVAS.
+static const long kFirstIA2Role = 0x401;
+
+enum class WalkOrder : uint8_t { DepthFirst, BreadthFirst };
+
+inline const char* WalkOrderName(const WalkOrder aOrder) {
+  return aOrder == WalkOrder::BreadthFirst ? "bfs" : "dfs";
+}
+
+// Passed as a maximum depth to walk every level.
+static const uint32_t kNoDepthLimit = UINT32_MAX;
+
+// The parent index of a walk's root.
+static const uint32_t kNoWalkParent = UINT32_MAX;
+
+/**
+ * Which subtrees a walk skips, described independently of any backend. Each
+ * walk turns these into prune predicates for its own kind of node.
+ */
+struct PruneRules {
+  // Skip nodes whose MSAA states include invisible or offscreen.
+  bool mInvisible = false;
+  // Skip nodes served by the parent process, or by a content process, as
+  // their IA2 uniqueIDs tell (see NodeSource.h). Nodes without a uniqueID
+  // are kept.
+  bool mChrome = false;
+  bool mContent = false;
+  // Skip nodes with any of these MSAA or IA2 roles.
+  std::vector<long> mRoles;
+
+  bool IsEmpty() const {
+    return !mInvisible && !mChrome && !mContent && mRoles.empty();
+  }
+
+  bool SkipsRole(const long aRole) const {
+    return std::find(mRoles.begin(), mRoles.end(), aRole) != mRoles.end();
+  }
+
+  bool HasIA2Roles() const {
+    return std::any_of(mRoles.begin(), mRoles.end(),
+                       [](const long aRole) { return aRole >= kFirstIA2Role; });
+  }
+
+  bool SkipsSource(const long aUniqueId) const {
+    switch (GetNodeSource(aUniqueId)) {
+      case NodeSource::Chrome:
+        return mChrome;
+      case NodeSource::Content:
+        return mContent;
+      default:
+        return false;
+    }
+  }
+};
+
+// How a command asked for its tree to be walked.
+struct TreeWalkOptions {
+  WalkOrder mOrder = WalkOrder::DepthFirst;
+  // The deepest level visited, counting the root as 0. Children of nodes at
+  // this depth are never fetched.
+  uint32_t mMaxDepth = kNoDepthLimit;
+  PruneRules mPrune;
+};
+
+/**
+ * Decides which children a walk goes on to: none below the depth limit, and
+ * none that a prune predicate rejects. Rejected children are skipped with
+ * their subtrees; the root is always visited.
+ *
+ * Predicates may be called from several threads at once, so that parallel
+ * walks can share a filter.
+ */
+template <typename Node>
+class WalkFilter {
+ public:
+  // Returns true if aChild is to be skipped.
+  using PruneFn = std::function<bool(const Node& aChild)>;
+
+  explicit WalkFilter(const uint32_t aMaxDepth = kNoDepthLimit)
+      : mMaxDepth(aMaxDepth) {}
+
+  void AddPrune(PruneFn aPrune) { mPrunes.push_back(std::move(aPrune)); }
+
+  uint32_t MaxDepth() const { return mMaxDepth; }
+
+  // Whether the children of a node at aDepth are to be fetched at all.
+  bool Expands(const uint32_t aDepth) const {
+    if (aDepth < mMaxDepth) {
+      return true;
+    }
+    mDepthLimited.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  bool Rejects(const Node& aChild) const {
+    for (const PruneFn& prune : mPrunes) {
+      if (prune(aChild)) {
+        mPruned.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Removes every child that Rejects, keeping the rest in order.
+  void Prune(std::vector<Node>& aChildren) const {
+    if (mPrunes.empty()) {
+      return;
+    }
+    aChildren.erase(
+        std::remove_if(aChildren.begin(), aChildren.end(),
+                       [this](const Node& aChild) { return Rejects(aChild); }),
+        aChildren.end());
+  }
+
+  // Subtrees skipped by a predicate, and nodes whose children were left
+  // unfetched by the depth limit.
+  uint64_t PrunedSubtrees() const {
+    return mPruned.load(std::memory_order_relaxed);
+  }
+  uint64_t DepthLimited() const {
+    return mDepthLimited.load(std::memory_order_relaxed);
+  }
+
+ private:
+  const uint32_t mMaxDepth;
+  std::vector<PruneFn> mPrunes;
+  mutable std::atomic<uint64_t> mPruned{0};
+  mutable std::atomic<uint64_t> mDepthLimited{0};
+};
+
+/**
+ * Adds the subtrees that aFilter skips for as long as it lives to aCounters.
+ * The filter may be shared with walks on other threads, whose skips are then
+ * counted too.
+ */
+template <typename Node>
+class AutoCountSkips {
+ public:
+  AutoCountSkips(const WalkFilter<Node>& aFilter, TraversalCounters& aCounters)
+      : mFilter(aFilter),
+        mCounters(aCounters),
+        mPruned(aFilter.PrunedSubtrees()),
+        mDepthLimited(aFilter.DepthLimited()) {}
+
+  ~AutoCountSkips() {
+    mCounters.mPrunedSubtrees += mFilter.PrunedSubtrees() - mPruned;
+    mCounters.mDepthLimited += mFilter.DepthLimited() - mDepthLimited;
+  }
+
+ private:
+  AutoCountSkips(const AutoCountSkips&) = delete;
+  AutoCountSkips& operator=(const AutoCountSkips&) = delete;
+
+  const WalkFilter<Node>& mFilter;
+  TraversalCounters& mCounters;
+  const uint64_t mPruned;
+  const uint64_t mDepthLimited;
+};
+
+// The default context of a TreeWalker: nothing.
+struct NoWalkContext {};
+
+/**
+ * What a visitor is told about a node. Nodes are indexed in the order they
+ * are visited, so that visitors building their own copy of the tree can
+ * refer to parents. mChildContext starts out empty and is handed to every
+ * child that the walk goes on to.
+ */
+template <typename Node, typename Context = NoWalkContext>
+struct WalkStep {
+  const Node& mNode;
+  uint32_t mDepth;
+  uint32_t mIndex;
+  uint32_t mParent;
+  const Context& mContext;
+  Context mChildContext;
+};
+
+enum class WalkAction : uint8_t {
+  Continue,
+  // Visit neither the children nor anything below them.
+  SkipChildren,
+  Stop
+};
+
+/**
+ * The traversal engine behind every command that walks a tree: visits nodes
+ * depth-first in document order, or breadth-first, fetching children
+ * through aFetch and going on to those that a WalkFilter keeps. Context,
+ * if given, is state that each node passes down to its children.
+ *
+ * A walker keeps its storage across walks, so reusing one for repeated walks
+ * stops allocating once it has grown to fit the tree.
+ */
+template <typename Node, typename Context = NoWalkContext>
+class TreeWalker {
+ public:
+  using Step = WalkStep<Node, Context>;
+  // Fetches the children of aNode into aOut, in document order, counting the
+  // round-trips made.
+  using FetchFn =
+      std::function<void(const Node& aNode, std::vector<Node>& aOut)>;
+
+  TreeWalker(const WalkOrder aOrder, FetchFn aFetch,
+             TraversalCounters& aCounters)
+      : mOrder(aOrder), mFetch(std::move(aFetch)), mCounters(aCounters) {}
+
+  WalkOrder Order() const { return mOrder; }
+
+  /**
+   * Walks aRoot's tree, calling aVisit(Step&), which returns a WalkAction,
+   * on every node the walk reaches and then aOnChildren(const Step&, size_t)
+   * with the number of its children that the walk will go on to. Returns
+   * false if aVisit stopped the walk.
+   */
+  template <typename Visitor, typename ChildrenFn>
+  bool Walk(const Node& aRoot, const WalkFilter<Node>& aFilter,
+            Visitor&& aVisit, ChildrenFn&& aOnChildren) {
+    Clear();
+    AutoCountSkips<Node> countSkips(aFilter, mCounters);
+    Enqueue(Pending{aRoot, kNoWalkParent, Context()}, 0);
+    uint32_t index = 0;
+    Pending cur;
+    uint32_t depth;
+    while (Dequeue(cur, depth)) {
+      mCounters.Visit(depth);
+      Step step{cur.mNode, depth, index++, cur.mParent, cur.mContext,
+                Context()};
+      const WalkAction action = aVisit(step);
+      if (action == WalkAction::Stop) {
+        Clear();
+        return false;
+      }
+
+      mChildren.clear();
+      if (action == WalkAction::Continue && aFilter.Expands(depth)) {
+        mFetch(cur.mNode, mChildren);
+        aFilter.Prune(mChildren);
+      }
+      aOnChildren(static_cast<const Step&>(step), mChildren.size());
+
+      if (mOrder == WalkOrder::BreadthFirst) {
+        for (Node& child : mChildren) {
+          Enqueue(Pending{std::move(child), step.mIndex, step.mChildContext},
+                  depth + 1);
+        }
+      } else {
+        // Reversed so that children are visited in document order.
+        for (auto it = mChildren.rbegin(); it != mChildren.rend(); ++it) {
+          Enqueue(Pending{std::move(*it), step.mIndex, step.mChildContext},
+                  depth + 1);
+        }
+      }
+    }
+    return true;
+  }
+
+  template <typename Visitor>
+  bool Walk(const Node& aRoot, const WalkFilter<Node>& aFilter,
+            Visitor&& aVisit) {
+    return Walk(aRoot, aFilter, std::forward<Visitor>(aVisit),
+                [](const Step&, size_t) {});
+  }
+
+  // The allocations and high-water marks of depth-first walks.
+  const TraversalStackStats& StackStats() const { return mStack.Stats(); }
+
+ private:
+  struct Pending {
+    Node mNode;
+    uint32_t mParent;
+    Context mContext;
+  };
+
+  struct QueuedNode {
+    Pending mPending;
+    uint32_t mDepth;
+  };
+
+  void Enqueue(Pending&& aPending, const uint32_t aDepth) {
+    if (mOrder == WalkOrder::BreadthFirst) {
+      mQueue.push_back(QueuedNode{std::move(aPending), aDepth});
+    } else {
+      mStack.Push(std::move(aPending), aDepth);
+    }
+  }
+
+  bool Dequeue(Pending& aOut, uint32_t& aOutDepth) {
+    if (mOrder != WalkOrder::BreadthFirst) {
+      return mStack.Pop(aOut, aOutDepth);
+    }
+    if (mQueue.empty()) {
+      return false;
+    }
+    aOut = std::move(mQueue.front().mPending);
+    aOutDepth = mQueue.front().mDepth;
+    mQueue.pop_front();
+    return true;
+  }
+
+  void Clear() {
+    mStack.Clear();
+    mQueue.clear();
+  }
+
+  const WalkOrder mOrder;
+  FetchFn mFetch;
+  TraversalCounters& mCounters;
+  TraversalStack<Pending> mStack;
+  std::deque<QueuedNode> mQueue;
+  std::vector<Node> mChildren;
+};
+
+}  // namespace aspk
+
+#endif  // __ASPK_TREEWALK_H
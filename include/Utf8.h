@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#ifndef __ASPK_UTF8_H
+#define __ASPK_UTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace aspk {
+
+// Appends aCodePoint as UTF-8.
+inline void AppendUtf8(const uint32_t aCodePoint, std::string& aOut) {
+  const uint32_t c = aCodePoint;
+  if (c < 0x80) {
+    aOut.push_back(static_cast<char>(c));
+  } else if (c < 0x800) {
+    aOut.push_back(static_cast<char>(0xC0 | (c >> 6)));
+    aOut.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  } else if (c < 0x10000) {
+    aOut.push_back(static_cast<char>(0xE0 | (c >> 12)));
+    aOut.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    aOut.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  } else {
+    aOut.push_back(static_cast<char>(0xF0 | (c >> 18)));
+    aOut.push_back(static_cast<char>(0x80 | ((c >> 12) & 0x3F)));
+    aOut.push_back(static_cast<char>(0x80 | ((c >> 6) & 0x3F)));
+    aOut.push_back(static_cast<char>(0x80 | (c & 0x3F)));
+  }
+}
+
+// Appends aStr as UTF-8. Two-byte units, such as wchar_t on Windows, are read
+// as UTF-16: surrogate pairs are combined, and unpaired surrogates become
+// U+FFFD. Unlike WideCharToMultiByte, this builds on any platform.
+template <typename Unit>
+void AppendUtf8(const Unit* aStr, const size_t aLength, std::string& aOut) {
+  for (size_t i = 0; i < aLength; ++i) {
+    uint32_t c = static_cast<uint32_t>(aStr[i]);
+    if (sizeof(Unit) == 2 && c >= 0xD800 && c < 0xE000) {
+      const uint32_t low =
+          i + 1 < aLength ? static_cast<uint32_t>(aStr[i + 1]) : 0;
+      if (c < 0xDC00 && low >= 0xDC00 && low < 0xE000) {
+        c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+        ++i;
+      } else {
+        c = 0xFFFD;
+      }
+    }
+    AppendUtf8(c, aOut);
+  }
+}
+
+inline std::string ToUtf8(const wchar_t* aStr, const size_t aLength) {
+  std::string result;
+  AppendUtf8(aStr, aLength, result);
+  return result;
+}
+
+}  // namespace aspk
+
+#endif  // __ASPK_UTF8_H
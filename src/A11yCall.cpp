@@ -0,0 +1,67 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "A11yCall.h"
+
+#include "ArrayLength.h"
+
+namespace aspk {
+
+static const char* kA11yMethodNames[] = {
+#define A11Y_METHOD_NAME(name) #name,
+    A11Y_METHODS(A11Y_METHOD_NAME)
+#undef A11Y_METHOD_NAME
+};
+
+static_assert(ArrayLength(kA11yMethodNames) ==
+                  static_cast<uint32_t>(A11yMethod::Count),
+              "kA11yMethodNames is out of sync with A11yMethod!");
+
+const char* A11yMethodName(A11yMethod aMethod) {
+  if (aMethod >= A11yMethod::Count) {
+    return "unknown";
+  }
+  return kA11yMethodNames[static_cast<uint32_t>(aMethod)];
+}
+
+MethodLatencies& MethodLatencies::Get() {
+  static MethodLatencies sInstance;
+  return sInstance;
+}
+
+void MethodLatencies::Reset() {
+  for (LatencyHistogram& histogram : mHistograms) {
+    histogram.Reset();
+  }
+}
+
+void MethodLatencies::Print(FILE* aOut) const {
+  bool printedHeader = false;
+
+  for (uint32_t i = 0; i < ArrayLength(mHistograms); ++i) {
+    const LatencyHistogram& histogram = mHistograms[i];
+    if (!histogram.Count()) {
+      continue;
+    }
+
+    if (!printedHeader) {
+      fprintf(aOut, "%-26s %10s %9s %9s %9s %9s %9s %9s\n", "method (us)",
+              "calls", "min", "p50", "p90", "p99", "p99.9", "max");
+      printedHeader = true;
+    }
+
+    fprintf(aOut, "%-26s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+            kA11yMethodNames[i],
+            static_cast<unsigned long long>(histogram.Count()),
+            histogram.Min() / 1000.0, histogram.ValueAtPercentile(50) / 1000.0,
+            histogram.ValueAtPercentile(90) / 1000.0,
+            histogram.ValueAtPercentile(99) / 1000.0,
+            histogram.ValueAtPercentile(99.9) / 1000.0,
+            histogram.Max() / 1000.0);
+  }
+}
+
+}  // namespace aspk
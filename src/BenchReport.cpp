@@ -0,0 +1,302 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "BenchReport.h"
+
+#include <stdlib.h>
+
+#include "ArrayLength.h"
+
+namespace aspk {
+
+static void WriteJsonString(FILE* aOut, const std::string& aStr) {
+  fputc('"', aOut);
+  for (unsigned char c : aStr) {
+    switch (c) {
+      case '"':
+        fputs("\\\"", aOut);
+        break;
+      case '\\':
+        fputs("\\\\", aOut);
+        break;
+      case '\n':
+        fputs("\\n", aOut);
+        break;
+      case '\r':
+        fputs("\\r", aOut);
+        break;
+      case '\t':
+        fputs("\\t", aOut);
+        break;
+      default:
+        if (c < 0x20) {
+          fprintf(aOut, "\\u%04x", c);
+        } else {
+          fputc(c, aOut);
+        }
+        break;
+    }
+  }
+  fputc('"', aOut);
+}
+
+void BenchReport::WriteJson(FILE* aOut) const {
+  fprintf(aOut, "{\n  \"metadata\": {\n    \"exePath\": ");
+  WriteJsonString(aOut, mMetadata.mExePath);
+  fprintf(aOut, ",\n    \"appName\": ");
+  WriteJsonString(aOut, mMetadata.mAppName);
+  fprintf(aOut, ",\n    \"appVersion\": ");
+  WriteJsonString(aOut, mMetadata.mAppVersion);
+  fprintf(aOut, ",\n    \"toolkitName\": ");
+  WriteJsonString(aOut, mMetadata.mToolkitName);
+  fprintf(aOut, ",\n    \"toolkitVersion\": ");
+  WriteJsonString(aOut, mMetadata.mToolkitVersion);
+  fprintf(aOut, ",\n    \"warmupIterations\": %u", mMetadata.mWarmupIterations);
+  fprintf(aOut, ",\n    \"measuredIterations\": %u\n  },\n",
+          mMetadata.mMeasuredIterations);
+
+  fprintf(aOut, "  \"results\": [");
+  for (size_t i = 0; i < mResults.size(); ++i) {
+    const BenchResult& result = mResults[i];
+    const SampleSummary& time = result.mTimeMs;
+
+    fprintf(aOut, "%s\n    {\n      \"command\": ", i ? "," : "");
+    WriteJsonString(aOut, result.mCommand);
+    fprintf(aOut, ",\n      \"strategy\": ");
+    WriteJsonString(aOut, result.mStrategy);
+    fprintf(aOut,
+            ",\n      \"threads\": %u,\n      \"nodes\": %llu,\n"
+            "      \"roundTrips\": %llu,\n      \"runs\": %zu,\n"
+            "      \"outliers\": %zu,\n",
+            result.mThreads, static_cast<unsigned long long>(result.mNodes),
+            static_cast<unsigned long long>(result.mRoundTrips), time.mCount,
+            time.mOutliers);
+    fprintf(aOut,
+            "      \"timeMs\": {\"min\": %.9g, \"median\": %.9g, "
+            "\"mean\": %.9g, \"stddev\": %.9g, \"p90\": %.9g, \"p99\": %.9g, "
+            "\"max\": %.9g, \"ciLow\": %.9g, \"ciHigh\": %.9g}\n    }",
+            time.mMin, time.mMedian, time.mMean, time.mStdDev, time.mP90,
+            time.mP99, time.mMax, time.mCiLow, time.mCiHigh);
+  }
+  fprintf(aOut, "%s]\n}\n", mResults.empty() ? "" : "\n  ");
+}
+
+static const char* kCsvColumns[] = {
+    "command", "strategy", "threads", "nodes", "round_trips", "runs",
+    "outliers", "min_ms", "median_ms", "mean_ms", "stddev_ms", "p90_ms",
+    "p99_ms", "max_ms", "ci_low_ms", "ci_high_ms", "exe_path", "app_name",
+    "app_version", "toolkit_name", "toolkit_version", "warmup", "iterations"};
+
+static void WriteCsvField(FILE* aOut, const std::string& aField) {
+  if (aField.find_first_of(",\"\r\n") == std::string::npos) {
+    fputs(aField.c_str(), aOut);
+    return;
+  }
+
+  fputc('"', aOut);
+  for (char c : aField) {
+    if (c == '"') {
+      fputc('"', aOut);
+    }
+    fputc(c, aOut);
+  }
+  fputc('"', aOut);
+}
+
+void BenchReport::WriteCsv(FILE* aOut) const {
+  for (size_t i = 0; i < ArrayLength(kCsvColumns); ++i) {
+    fprintf(aOut, "%s%s", i ? "," : "", kCsvColumns[i]);
+  }
+  fputc('\n', aOut);
+
+  for (const BenchResult& result : mResults) {
+    const SampleSummary& time = result.mTimeMs;
+
+    WriteCsvField(aOut, result.mCommand);
+    fputc(',', aOut);
+    WriteCsvField(aOut, result.mStrategy);
+    fprintf(aOut, ",%u,%llu,%llu,%zu,%zu", result.mThreads,
+            static_cast<unsigned long long>(result.mNodes),
+            static_cast<unsigned long long>(result.mRoundTrips), time.mCount,
+            time.mOutliers);
+    fprintf(aOut, ",%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,", time.mMin,
+            time.mMedian, time.mMean, time.mStdDev, time.mP90, time.mP99,
+            time.mMax, time.mCiLow, time.mCiHigh);
+
+    const std::string* metadata[] = {
+        &mMetadata.mExePath, &mMetadata.mAppName, &mMetadata.mAppVersion,
+        &mMetadata.mToolkitName, &mMetadata.mToolkitVersion};
+    for (const std::string* field : metadata) {
+      WriteCsvField(aOut, *field);
+      fputc(',', aOut);
+    }
+    fprintf(aOut, "%u,%u\n", mMetadata.mWarmupIterations,
+            mMetadata.mMeasuredIterations);
+  }
+}
+
+// Splits the next CSV record off aIn. Returns false at end of input.
+static bool ReadCsvRecord(FILE* aIn, std::vector<std::string>& aOut) {
+  aOut.clear();
+
+  int c = fgetc(aIn);
+  if (c == EOF) {
+    return false;
+  }
+
+  std::string field;
+  bool quoted = false;
+  for (; c != EOF; c = fgetc(aIn)) {
+    if (quoted) {
+      if (c != '"') {
+        field += static_cast<char>(c);
+        continue;
+      }
+      c = fgetc(aIn);
+      if (c == '"') {
+        field += '"';
+        continue;
+      }
+      quoted = false;
+      if (c == EOF) {
+        break;
+      }
+    }
+
+    if (c == '"' && field.empty()) {
+      quoted = true;
+    } else if (c == ',') {
+      aOut.push_back(field);
+      field.clear();
+    } else if (c == '\n') {
+      break;
+    } else if (c != '\r') {
+      field += static_cast<char>(c);
+    }
+  }
+
+  aOut.push_back(field);
+  return true;
+}
+
+bool ReadCsvResults(FILE* aIn, std::vector<BenchResult>& aOut) {
+  std::vector<std::string> header;
+  if (!ReadCsvRecord(aIn, header)) {
+    return false;
+  }
+
+  enum { kCommand, kStrategy, kThreads, kNodes, kRoundTrips, kMedian, kCount };
+  static const char* kWanted[] = {"command", "strategy",    "threads",
+                                  "nodes",   "round_trips", "median_ms"};
+  static_assert(ArrayLength(kWanted) == kCount,
+                "kWanted is out of sync with its enum!");
+
+  size_t columns[kCount];
+  for (size_t i = 0; i < kCount; ++i) {
+    columns[i] = header.size();
+    for (size_t j = 0; j < header.size(); ++j) {
+      if (header[j] == kWanted[i]) {
+        columns[i] = j;
+        break;
+      }
+    }
+  }
+
+  if (columns[kCommand] == header.size() ||
+      columns[kStrategy] == header.size() ||
+      columns[kThreads] == header.size() ||
+      columns[kMedian] == header.size()) {
+    return false;
+  }
+
+  std::vector<std::string> record;
+  while (ReadCsvRecord(aIn, record)) {
+    if (record.size() == 1 && record[0].empty()) {
+      // Blank line
+      continue;
+    }
+    if (record.size() != header.size()) {
+      return false;
+    }
+
+    BenchResult result;
+    result.mCommand = record[columns[kCommand]];
+    result.mStrategy = record[columns[kStrategy]];
+    result.mThreads =
+        static_cast<unsigned int>(strtoul(record[columns[kThreads]].c_str(),
+                                          nullptr, 10));
+    if (columns[kNodes] != header.size()) {
+      result.mNodes = strtoull(record[columns[kNodes]].c_str(), nullptr, 10);
+    }
+    if (columns[kRoundTrips] != header.size()) {
+      result.mRoundTrips =
+          strtoull(record[columns[kRoundTrips]].c_str(), nullptr, 10);
+    }
+    result.mTimeMs.mMedian = strtod(record[columns[kMedian]].c_str(), nullptr);
+    aOut.push_back(result);
+  }
+
+  return true;
+}
+
+static const BenchResult* FindMatch(const std::vector<BenchResult>& aResults,
+                                    const BenchResult& aResult) {
+  for (const BenchResult& candidate : aResults) {
+    if (candidate.mCommand == aResult.mCommand &&
+        candidate.mStrategy == aResult.mStrategy &&
+        candidate.mThreads == aResult.mThreads) {
+      return &candidate;
+    }
+  }
+  return nullptr;
+}
+
+// Prints one metric and returns true if it regressed.
+static bool CompareMetric(FILE* aOut, const char* aName, double aBaseline,
+                          double aCurrent, double aThresholdPercent) {
+  double change = aBaseline > 0.0
+                      ? (aCurrent - aBaseline) / aBaseline * 100.0
+                      : 0.0;
+  bool regressed = change > aThresholdPercent;
+  fprintf(aOut, "\t%-12s %12.3f -> %12.3f (%+.1f%%)%s\n", aName, aBaseline,
+          aCurrent, change, regressed ? " REGRESSION" : "");
+  return regressed;
+}
+
+size_t CompareWithBaseline(const std::vector<BenchResult>& aBaseline,
+                           const std::vector<BenchResult>& aCurrent,
+                           double aThresholdPercent, FILE* aOut) {
+  size_t regressions = 0;
+
+  for (const BenchResult& current : aCurrent) {
+    fprintf(aOut, "%s [%s] %u thread(s):\n", current.mCommand.c_str(),
+            current.mStrategy.c_str(), current.mThreads);
+
+    const BenchResult* baseline = FindMatch(aBaseline, current);
+    if (!baseline) {
+      fprintf(aOut, "\tnot in baseline\n");
+      continue;
+    }
+
+    if (CompareMetric(aOut, "median ms", baseline->mTimeMs.mMedian,
+                      current.mTimeMs.mMedian, aThresholdPercent)) {
+      ++regressions;
+    }
+    if (baseline->mRoundTrips &&
+        CompareMetric(aOut, "round trips",
+                      static_cast<double>(baseline->mRoundTrips),
+                      static_cast<double>(current.mRoundTrips),
+                      aThresholdPercent)) {
+      ++regressions;
+    }
+  }
+
+  fprintf(aOut, "%zu regression(s) beyond %g%%\n", regressions,
+          aThresholdPercent);
+  return regressions;
+}
+
+}  // namespace aspk
@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "BenchStats.h"
+
+#include <algorithm>
+
+#include <math.h>
+
+#include "ArrayLength.h"
+
+namespace aspk {
+
+// Two-sided 95% critical values of Student's t distribution for 1..30 degrees
+// of freedom. Beyond that the normal approximation is close enough.
+static const double kStudentT95[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+
+static double StudentT95(size_t aDegreesOfFreedom) {
+  if (!aDegreesOfFreedom) {
+    return 0.0;
+  }
+  if (aDegreesOfFreedom > ArrayLength(kStudentT95)) {
+    return 1.96;
+  }
+  return kStudentT95[aDegreesOfFreedom - 1];
+}
+
+double Percentile(const std::vector<double>& aSorted, double aFraction) {
+  if (aSorted.empty()) {
+    return 0.0;
+  }
+
+  aFraction = std::min(std::max(aFraction, 0.0), 1.0);
+  double rank = aFraction * static_cast<double>(aSorted.size() - 1);
+  size_t lower = static_cast<size_t>(floor(rank));
+  size_t upper = static_cast<size_t>(ceil(rank));
+  double weight = rank - static_cast<double>(lower);
+  return aSorted[lower] + (aSorted[upper] - aSorted[lower]) * weight;
+}
+
+bool Summarize(const std::vector<double>& aSamples, bool aRejectOutliers,
+               SampleSummary& aOut) {
+  aOut = SampleSummary();
+  if (aSamples.empty()) {
+    return false;
+  }
+
+  std::vector<double> sorted(aSamples);
+  std::sort(sorted.begin(), sorted.end());
+
+  if (aRejectOutliers && sorted.size() >= 4) {
+    double q1 = Percentile(sorted, 0.25);
+    double q3 = Percentile(sorted, 0.75);
+    double fence = 1.5 * (q3 - q1);
+    double lowFence = q1 - fence;
+    double highFence = q3 + fence;
+
+    auto first = std::lower_bound(sorted.begin(), sorted.end(), lowFence);
+    auto last = std::upper_bound(first, sorted.end(), highFence);
+    aOut.mOutliers = sorted.size() - static_cast<size_t>(last - first);
+    sorted = std::vector<double>(first, last);
+  }
+
+  const size_t n = sorted.size();
+  aOut.mCount = n;
+  aOut.mMin = sorted.front();
+  aOut.mMax = sorted.back();
+  aOut.mMedian = Percentile(sorted, 0.5);
+  aOut.mP90 = Percentile(sorted, 0.9);
+  aOut.mP99 = Percentile(sorted, 0.99);
+
+  double sum = 0.0;
+  for (double sample : sorted) {
+    sum += sample;
+  }
+  aOut.mMean = sum / static_cast<double>(n);
+
+  if (n > 1) {
+    double squares = 0.0;
+    for (double sample : sorted) {
+      double delta = sample - aOut.mMean;
+      squares += delta * delta;
+    }
+    aOut.mStdDev = sqrt(squares / static_cast<double>(n - 1));
+  }
+
+  double halfWidth =
+      StudentT95(n - 1) * aOut.mStdDev / sqrt(static_cast<double>(n));
+  aOut.mCiLow = aOut.mMean - halfWidth;
+  aOut.mCiHigh = aOut.mMean + halfWidth;
+  return true;
+}
+
+void PrintSummary(FILE* aOut, const char* aLabel, const char* aUnit,
+                  const SampleSummary& aSummary) {
+  fprintf(aOut, "%s: %zu runs", aLabel, aSummary.mCount);
+  if (aSummary.mOutliers) {
+    fprintf(aOut, " (%zu outliers rejected)", aSummary.mOutliers);
+  }
+  fprintf(aOut,
+          "\n\tmin %g, median %g, mean %g, stddev %g, p90 %g, p99 %g, "
+          "max %g %s\n",
+          aSummary.mMin, aSummary.mMedian, aSummary.mMean, aSummary.mStdDev,
+          aSummary.mP90, aSummary.mP99, aSummary.mMax, aUnit);
+  fprintf(aOut, "\t95%% confidence interval for the mean: [%g, %g] %s\n",
+          aSummary.mCiLow, aSummary.mCiHigh, aUnit);
+}
+
+}  // namespace aspk
@@ -0,0 +1,209 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "IA2Attributes.h"
+
+#include <limits.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define ASPK_IA2ATTRIBUTES_SSE2
+#  include <emmintrin.h>
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  endif
+#endif
+
+namespace aspk {
+
+namespace {
+
+#if defined(ASPK_IA2ATTRIBUTES_SSE2)
+
+// wchar_t is 16 bits on Windows but 32 bits elsewhere.
+inline __m128i SplatUnit(const wchar_t aChar) {
+  return sizeof(wchar_t) == 2 ? _mm_set1_epi16(static_cast<short>(aChar))
+                              : _mm_set1_epi32(static_cast<int>(aChar));
+}
+
+inline __m128i UnitsEqual(const __m128i aA, const __m128i aB) {
+  return sizeof(wchar_t) == 2 ? _mm_cmpeq_epi16(aA, aB)
+                              : _mm_cmpeq_epi32(aA, aB);
+}
+
+inline unsigned int CountTrailingZeros(const unsigned int aMask) {
+#  if defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, aMask);
+  return index;
+#  else
+  return __builtin_ctz(aMask);
+#  endif
+}
+
+#endif  // defined(ASPK_IA2ATTRIBUTES_SSE2)
+
+inline bool IsDelimiter(const wchar_t aChar) {
+  return aChar == L':' || aChar == L';' || aChar == L'\\';
+}
+
+}  // namespace
+
+const wchar_t* FindIA2DelimiterScalar(const wchar_t* aBegin,
+                                      const wchar_t* aEnd) {
+  while (aBegin < aEnd && !IsDelimiter(*aBegin)) {
+    ++aBegin;
+  }
+  return aBegin;
+}
+
+const wchar_t* FindIA2Delimiter(const wchar_t* aBegin, const wchar_t* aEnd) {
+#if defined(ASPK_IA2ATTRIBUTES_SSE2)
+  const size_t kUnits = sizeof(__m128i) / sizeof(wchar_t);
+  const __m128i colon = SplatUnit(L':');
+  const __m128i semicolon = SplatUnit(L';');
+  const __m128i backslash = SplatUnit(L'\\');
+
+  // Only whole vectors are loaded, so nothing past aEnd is ever read.
+  for (; static_cast<size_t>(aEnd - aBegin) >= kUnits; aBegin += kUnits) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(aBegin));
+    const __m128i hits =
+        _mm_or_si128(_mm_or_si128(UnitsEqual(chunk, colon),
+                                  UnitsEqual(chunk, semicolon)),
+                     UnitsEqual(chunk, backslash));
+    const unsigned int mask =
+        static_cast<unsigned int>(_mm_movemask_epi8(hits));
+    if (mask) {
+      return aBegin + CountTrailingZeros(mask) / sizeof(wchar_t);
+    }
+  }
+#endif  // defined(ASPK_IA2ATTRIBUTES_SSE2)
+
+  return FindIA2DelimiterScalar(aBegin, aEnd);
+}
+
+bool IA2AttributeText::Equals(const wchar_t* aStr, size_t aLength) const {
+  if (!mEscaped) {
+    return mLength == aLength && (!aLength || !wmemcmp(mData, aStr, aLength));
+  }
+
+  const wchar_t* cur = mData;
+  const wchar_t* const end = mData + mLength;
+  for (; cur < end; ++cur, ++aStr, --aLength) {
+    if (*cur == L'\\' && cur + 1 < end) {
+      ++cur;
+    }
+    if (!aLength || *cur != *aStr) {
+      return false;
+    }
+  }
+  return !aLength;
+}
+
+void IA2AttributeText::AppendTo(std::wstring& aOut) const {
+  if (!mEscaped) {
+    aOut.append(mData, mLength);
+    return;
+  }
+
+  const wchar_t* const end = mData + mLength;
+  for (const wchar_t* cur = mData; cur < end; ++cur) {
+    if (*cur == L'\\' && cur + 1 < end) {
+      ++cur;
+    }
+    aOut.push_back(*cur);
+  }
+}
+
+bool IA2AttributeText::ToLong(long& aOut) const {
+  // Digits and a sign never need escaping.
+  if (mEscaped || !mLength) {
+    return false;
+  }
+
+  size_t i = 0;
+  const bool negative = mData[0] == L'-';
+  if (negative && mLength == 1) {
+    return false;
+  }
+  i += negative;
+
+  long value = 0;
+  for (; i < mLength; ++i) {
+    const wchar_t c = mData[i];
+    if (c < L'0' || c > L'9' || value > (LONG_MAX - (c - L'0')) / 10) {
+      return false;
+    }
+    value = value * 10 + (c - L'0');
+  }
+  aOut = negative ? -value : value;
+  return true;
+}
+
+wchar_t IA2AttributeParser::ReadText(const wchar_t aDelimiter,
+                                     IA2AttributeText& aOut) {
+  aOut.mData = mCur;
+  aOut.mEscaped = false;
+  while (true) {
+    const wchar_t* found = mScanner(mCur, mEnd);
+    if (found == mEnd) {
+      mCur = mEnd;
+      break;
+    }
+    if (*found == L'\\') {
+      aOut.mEscaped = true;
+      mCur = mEnd - found > 1 ? found + 2 : mEnd;
+      continue;
+    }
+    mCur = found;
+    if (*found == aDelimiter || *found == L';') {
+      break;
+    }
+    ++mCur;
+  }
+  aOut.mLength = static_cast<size_t>(mCur - aOut.mData);
+  return mCur < mEnd ? *mCur : L'\0';
+}
+
+bool IA2AttributeParser::Next(IA2Attribute& aOut) {
+  while (mCur < mEnd) {
+    const wchar_t stop = ReadText(L':', aOut.mKey);
+    if (stop != L':') {
+      // No value; skip the ';' and try the next entry.
+      mCur += mCur < mEnd;
+      continue;
+    }
+    ++mCur;
+    ReadText(L';', aOut.mValue);
+    mCur += mCur < mEnd;
+    return true;
+  }
+  return false;
+}
+
+void ParseCommonIA2Attributes(const wchar_t* aData, size_t aLength,
+                              IA2CommonAttributes& aOut,
+                              IA2DelimiterScanner aScanner) {
+  aOut = IA2CommonAttributes();
+  IA2AttributeParser parser(aData, aLength, aScanner);
+  IA2Attribute attr;
+  while (parser.Next(attr)) {
+    ++aOut.mCount;
+    if (attr.mKey.Equals(L"tag", 3)) {
+      aOut.mTag = attr.mValue;
+    } else if (attr.mKey.Equals(L"display", 7)) {
+      aOut.mDisplay = attr.mValue;
+    } else if (attr.mKey.Equals(L"xml-roles", 9)) {
+      aOut.mXmlRoles = attr.mValue;
+    } else if (attr.mKey.Equals(L"level", 5) &&
+               !attr.mValue.ToLong(aOut.mLevel)) {
+      aOut.mLevel = 0;
+    }
+  }
+}
+
+}  // namespace aspk
@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "IpcAccounting.h"
+
+#include "ArrayLength.h"
+
+namespace aspk {
+
+static const char* kIpcOperationNames[] = {
+#define IPC_OPERATION_NAME(name) #name,
+    IPC_OPERATIONS(IPC_OPERATION_NAME)
+#undef IPC_OPERATION_NAME
+};
+
+static_assert(ArrayLength(kIpcOperationNames) ==
+                  static_cast<uint32_t>(IpcOperation::Count),
+              "kIpcOperationNames is out of sync with IpcOperation!");
+
+static thread_local IpcOperation tCurrentOperation = IpcOperation::Other;
+
+const char* IpcOperationName(IpcOperation aOperation) {
+  if (aOperation >= IpcOperation::Count) {
+    return "unknown";
+  }
+  return kIpcOperationNames[static_cast<uint32_t>(aOperation)];
+}
+
+IpcAccounting& IpcAccounting::Get() {
+  static IpcAccounting sInstance;
+  return sInstance;
+}
+
+void IpcAccounting::Record(const IpcCost& aCost) {
+  Counters& counters =
+      mOperations[static_cast<uint32_t>(AutoIpcOperation::Current())];
+  counters.mCalls.fetch_add(aCost.mCalls, std::memory_order_relaxed);
+  counters.mRequestBytes.fetch_add(aCost.mRequestBytes,
+                                   std::memory_order_relaxed);
+  counters.mResponseBytes.fetch_add(aCost.mResponseBytes,
+                                    std::memory_order_relaxed);
+}
+
+void IpcAccounting::Reset() {
+  for (Counters& counters : mOperations) {
+    counters.mCalls.store(0, std::memory_order_relaxed);
+    counters.mRequestBytes.store(0, std::memory_order_relaxed);
+    counters.mResponseBytes.store(0, std::memory_order_relaxed);
+  }
+}
+
+IpcCost IpcAccounting::Cost(IpcOperation aOperation) const {
+  IpcCost cost;
+  if (aOperation >= IpcOperation::Count) {
+    return cost;
+  }
+  const Counters& counters = mOperations[static_cast<uint32_t>(aOperation)];
+  cost.mCalls = counters.mCalls.load(std::memory_order_relaxed);
+  cost.mRequestBytes = counters.mRequestBytes.load(std::memory_order_relaxed);
+  cost.mResponseBytes =
+      counters.mResponseBytes.load(std::memory_order_relaxed);
+  return cost;
+}
+
+IpcCost IpcAccounting::Total() const {
+  IpcCost total;
+  for (uint32_t i = 0; i < ArrayLength(mOperations); ++i) {
+    total += Cost(static_cast<IpcOperation>(i));
+  }
+  return total;
+}
+
+static double PerNode(const uint64_t aValue, const uint64_t aNodes) {
+  return aNodes ? static_cast<double>(aValue) / static_cast<double>(aNodes)
+                : 0.0;
+}
+
+void IpcAccounting::Print(FILE* aOut, const uint64_t aNodes) const {
+  const IpcCost total = Total();
+  fprintf(aOut,
+          "\tIPC: %g round-trips and %g bytes per node (%llu calls, %llu "
+          "bytes sent, %llu received)\n",
+          PerNode(total.mCalls, aNodes), PerNode(total.Bytes(), aNodes),
+          static_cast<unsigned long long>(total.mCalls),
+          static_cast<unsigned long long>(total.mRequestBytes),
+          static_cast<unsigned long long>(total.mResponseBytes));
+  if (!total.mCalls) {
+    return;
+  }
+
+  fprintf(aOut, "\t%-18s %10s %14s %10s %14s\n", "operation", "calls",
+          "calls/node", "bytes", "bytes/node");
+  for (uint32_t i = 0; i < ArrayLength(mOperations); ++i) {
+    const IpcCost cost = Cost(static_cast<IpcOperation>(i));
+    if (!cost.mCalls) {
+      continue;
+    }
+    fprintf(aOut, "\t%-18s %10llu %14.3f %10llu %14.1f\n",
+            kIpcOperationNames[i],
+            static_cast<unsigned long long>(cost.mCalls),
+            PerNode(cost.mCalls, aNodes),
+            static_cast<unsigned long long>(cost.Bytes()),
+            PerNode(cost.Bytes(), aNodes));
+  }
+}
+
+AutoIpcOperation::AutoIpcOperation(const IpcOperation aOperation)
+    : mPrevious(tCurrentOperation) {
+  tCurrentOperation = aOperation;
+}
+
+AutoIpcOperation::~AutoIpcOperation() { tCurrentOperation = mPrevious; }
+
+IpcOperation AutoIpcOperation::Current() { return tCurrentOperation; }
+
+}  // namespace aspk
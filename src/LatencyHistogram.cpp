@@ -0,0 +1,114 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "LatencyHistogram.h"
+
+#include <math.h>
+
+namespace aspk {
+
+static unsigned int HighestBit(uint64_t aValue) {
+  unsigned int result = 0;
+  for (unsigned int shift = 32; shift; shift >>= 1) {
+    if (aValue >> shift) {
+      aValue >>= shift;
+      result += shift;
+    }
+  }
+  return result;
+}
+
+size_t LatencyHistogram::BucketIndex(uint64_t aValue) {
+  if (aValue < kSubBuckets) {
+    return static_cast<size_t>(aValue);
+  }
+
+  // Keep the top kSubBucketBits bits of the value. Their leading bit is always
+  // set, so only kHalfSubBuckets distinct values are possible per power of two.
+  unsigned int shift = HighestBit(aValue) - kSubBucketBits + 1;
+  return static_cast<size_t>(shift * kHalfSubBuckets + (aValue >> shift));
+}
+
+uint64_t LatencyHistogram::BucketHighestValue(size_t aIndex) {
+  if (aIndex < kSubBuckets) {
+    return aIndex;
+  }
+
+  uint64_t shift = aIndex / kHalfSubBuckets - 1;
+  uint64_t top = aIndex - shift * kHalfSubBuckets;
+  return ((top + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t aValue) {
+  mBuckets[BucketIndex(aValue)].fetch_add(1, std::memory_order_relaxed);
+  mCount.fetch_add(1, std::memory_order_relaxed);
+  mTotal.fetch_add(aValue, std::memory_order_relaxed);
+
+  uint64_t cur = mMin.load(std::memory_order_relaxed);
+  while (aValue < cur && !mMin.compare_exchange_weak(
+                             cur, aValue, std::memory_order_relaxed)) {
+  }
+
+  cur = mMax.load(std::memory_order_relaxed);
+  while (aValue > cur && !mMax.compare_exchange_weak(
+                             cur, aValue, std::memory_order_relaxed)) {
+  }
+}
+
+void LatencyHistogram::Reset() {
+  for (std::atomic<uint64_t>& bucket : mBuckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  mCount.store(0, std::memory_order_relaxed);
+  mTotal.store(0, std::memory_order_relaxed);
+  mMin.store(UINT64_MAX, std::memory_order_relaxed);
+  mMax.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Min() const {
+  return Count() ? mMin.load(std::memory_order_relaxed) : 0;
+}
+
+double LatencyHistogram::Mean() const {
+  uint64_t count = Count();
+  if (!count) {
+    return 0.0;
+  }
+  return static_cast<double>(mTotal.load(std::memory_order_relaxed)) /
+         static_cast<double>(count);
+}
+
+uint64_t LatencyHistogram::ValueAtPercentile(double aPercentile) const {
+  uint64_t count = Count();
+  if (!count) {
+    return 0;
+  }
+
+  if (aPercentile < 0.0) {
+    aPercentile = 0.0;
+  } else if (aPercentile > 100.0) {
+    aPercentile = 100.0;
+  }
+
+  uint64_t target = static_cast<uint64_t>(
+      ceil(aPercentile / 100.0 * static_cast<double>(count)));
+  if (!target) {
+    target = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBucketCount; ++i) {
+    seen += mBuckets[i].load(std::memory_order_relaxed);
+    if (seen >= target) {
+      uint64_t value = BucketHighestValue(i);
+      return value < Max() ? value : Max();
+    }
+  }
+
+  return Max();
+}
+
+}  // namespace aspk
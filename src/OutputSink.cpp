@@ -0,0 +1,191 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "OutputSink.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <string.h>
+
+namespace aspk {
+
+// The writer also wakes up on its own this often, in case it missed a
+// notification that raced with it going to sleep.
+static const std::chrono::milliseconds kWriterIdleWait(10);
+
+AsyncOutputSink::ThreadChunk::~ThreadChunk() {
+  if (!mChunk) {
+    return;
+  }
+  if (mChunk->mLen && mChunk->mOwner->IsRunning()) {
+    mChunk->mOwner->Submit(mChunk);
+    return;
+  }
+  delete mChunk;
+}
+
+AsyncOutputSink::ThreadChunk& AsyncOutputSink::CurrentThreadChunk() {
+  static thread_local ThreadChunk sThreadChunk;
+  return sThreadChunk;
+}
+
+bool AsyncOutputSink::Start(FILE* aOut) {
+  if (IsRunning() || !aOut) {
+    return false;
+  }
+
+  mOut = aOut;
+  mStopping.store(false, std::memory_order_relaxed);
+  mWriter = std::thread([this]() { WriterLoop(); });
+  mRunning.store(true, std::memory_order_release);
+  return true;
+}
+
+void AsyncOutputSink::Stop() {
+  if (!IsRunning()) {
+    return;
+  }
+
+  Flush();
+  mRunning.store(false, std::memory_order_release);
+  mStopping.store(true, std::memory_order_release);
+  mWakeWriter.notify_one();
+  mWriter.join();
+}
+
+void AsyncOutputSink::Write(const char* aData, size_t aLen) {
+  if (!IsRunning()) {
+    fwrite(aData, 1, aLen, mOut);
+    return;
+  }
+
+  ThreadChunk& current = CurrentThreadChunk();
+  if (current.mChunk && current.mChunk->mOwner != this) {
+    // Left over from another sink; hand it back before starting on ours.
+    ThreadChunk previous;
+    std::swap(previous.mChunk, current.mChunk);
+  }
+
+  // Keep each write within one chunk when it fits, so that output from
+  // different threads is only ever interleaved between writes.
+  if (current.mChunk && aLen > kChunkSize - current.mChunk->mLen &&
+      aLen <= kChunkSize) {
+    Chunk* chunk = current.mChunk;
+    current.mChunk = nullptr;
+    Submit(chunk);
+  }
+
+  while (aLen) {
+    if (!current.mChunk) {
+      current.mChunk = new Chunk();
+      current.mChunk->mOwner = this;
+    }
+
+    Chunk* chunk = current.mChunk;
+    size_t len = std::min(aLen, kChunkSize - chunk->mLen);
+    memcpy(chunk->mData + chunk->mLen, aData, len);
+    chunk->mLen += len;
+    aData += len;
+    aLen -= len;
+
+    if (chunk->mLen == kChunkSize) {
+      current.mChunk = nullptr;
+      Submit(chunk);
+    }
+  }
+}
+
+void AsyncOutputSink::Flush() {
+  if (!IsRunning()) {
+    fflush(mOut);
+    return;
+  }
+
+  ThreadChunk& current = CurrentThreadChunk();
+  if (current.mChunk && current.mChunk->mLen) {
+    Chunk* chunk = current.mChunk;
+    current.mChunk = nullptr;
+    chunk->mOwner->Submit(chunk);
+  }
+
+  const uint64_t target = mSubmitted.load(std::memory_order_acquire);
+  std::unique_lock<std::mutex> lock(mLock);
+  mWakeWriter.notify_one();
+  mDrained.wait(lock, [&]() {
+    return mWritten.load(std::memory_order_acquire) >= target;
+  });
+}
+
+void AsyncOutputSink::Submit(Chunk* aChunk) {
+  // Count the chunk before publishing it so that a Flush never sees the writer
+  // catch up with a target that does not include it yet.
+  mSubmitted.fetch_add(1, std::memory_order_release);
+
+  Chunk* head = mQueue.load(std::memory_order_relaxed);
+  do {
+    aChunk->mNext = head;
+  } while (!mQueue.compare_exchange_weak(head, aChunk,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
+
+  mWakeWriter.notify_one();
+}
+
+void AsyncOutputSink::WriteQueued() {
+  Chunk* chunk = mQueue.exchange(nullptr, std::memory_order_acquire);
+  if (!chunk) {
+    return;
+  }
+
+  // The queue is newest-first; reverse it to write in submission order.
+  Chunk* ordered = nullptr;
+  while (chunk) {
+    Chunk* next = chunk->mNext;
+    chunk->mNext = ordered;
+    ordered = chunk;
+    chunk = next;
+  }
+
+  uint64_t count = 0;
+  while (ordered) {
+    Chunk* next = ordered->mNext;
+    fwrite(ordered->mData, 1, ordered->mLen, mOut);
+    mBytesWritten.fetch_add(ordered->mLen, std::memory_order_relaxed);
+    delete ordered;
+    ordered = next;
+    ++count;
+  }
+  fflush(mOut);
+
+  // A whole batch is counted at once: any chunk submitted after a Flush read
+  // its target is in the same batch as, or a later batch than, the chunks that
+  // the target covers.
+  mWritten.fetch_add(count, std::memory_order_release);
+  { std::lock_guard<std::mutex> lock(mLock); }
+  mDrained.notify_all();
+}
+
+void AsyncOutputSink::WriterLoop() {
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mLock);
+      mWakeWriter.wait_for(lock, kWriterIdleWait, [this]() {
+        return mQueue.load(std::memory_order_relaxed) ||
+               mStopping.load(std::memory_order_relaxed);
+      });
+    }
+
+    WriteQueued();
+
+    if (mStopping.load(std::memory_order_acquire) &&
+        !mQueue.load(std::memory_order_acquire)) {
+      break;
+    }
+  }
+}
+
+}  // namespace aspk
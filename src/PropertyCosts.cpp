@@ -0,0 +1,114 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "PropertyCosts.h"
+
+#include <algorithm>
+#include <string>
+
+#include <math.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "ArrayLength.h"
+
+namespace aspk {
+
+static const char* kAccPropertyNames[] = {
+    "role",  "state",     "shortcut", "name",       "description", "childcount",
+    "value", "ia2states", "locale",   "attributes", "uniqueid",    "hwnd"};
+
+static_assert(ArrayLength(kAccPropertyNames) == kNumAccProperties,
+              "You changed AccProperty! Update kAccPropertyNames!");
+
+const char* AccPropertyName(AccProperty aProp) {
+  if (aProp >= kNumAccProperties) {
+    return "unknown";
+  }
+  return kAccPropertyNames[aProp];
+}
+
+static bool LookupProperty(const std::wstring& aName, uint32_t& aOutMask) {
+  if (aName == L"all") {
+    aOutMask |= kAllAccPropertiesMask;
+    return true;
+  }
+
+  for (uint32_t i = 0; i < kNumAccProperties; ++i) {
+    const char* name = kAccPropertyNames[i];
+    if (aName.size() == strlen(name) &&
+        std::equal(aName.begin(), aName.end(), name)) {
+      aOutMask |= AccPropertyBit(static_cast<AccProperty>(i));
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool ParseAccPropertyMask(const wchar_t* aSpec, uint32_t& aOutMask) {
+  uint32_t mask = 0;
+  const wchar_t* cur = aSpec;
+
+  while (true) {
+    const wchar_t* comma = wcschr(cur, L',');
+    std::wstring name(cur, comma ? comma - cur : wcslen(cur));
+    if (!LookupProperty(name, mask)) {
+      return false;
+    }
+    if (!comma) {
+      break;
+    }
+    cur = comma + 1;
+  }
+
+  aOutMask = mask;
+  return true;
+}
+
+void PropertyCosts::Record(AccProperty aProp, double aMicroseconds) {
+  std::lock_guard<std::mutex> lock(mLock);
+  mSamples[aProp].push_back(aMicroseconds);
+}
+
+void PropertyCosts::Reset() {
+  std::lock_guard<std::mutex> lock(mLock);
+  for (std::vector<double>& samples : mSamples) {
+    samples.clear();
+  }
+}
+
+void PropertyCosts::Print(FILE* aOut) const {
+  std::lock_guard<std::mutex> lock(mLock);
+
+  fprintf(aOut, "%-12s %10s %12s %10s %10s\n", "property", "calls",
+          "total ms", "mean us", "p99 us");
+
+  std::vector<double> sorted;
+  for (uint32_t i = 0; i < kNumAccProperties; ++i) {
+    const std::vector<double>& samples = mSamples[i];
+    if (samples.empty()) {
+      continue;
+    }
+
+    double total = 0.0;
+    for (double sample : samples) {
+      total += sample;
+    }
+
+    sorted = samples;
+    std::sort(sorted.begin(), sorted.end());
+    size_t p99Index =
+        static_cast<size_t>(ceil(0.99 * static_cast<double>(sorted.size())));
+    p99Index = p99Index ? p99Index - 1 : 0;
+
+    fprintf(aOut, "%-12s %10zu %12.3f %10.2f %10.2f\n", kAccPropertyNames[i],
+            samples.size(), total / 1000.0,
+            total / static_cast<double>(samples.size()), sorted[p99Index]);
+  }
+}
+
+}  // namespace aspk
@@ -0,0 +1,538 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "Selector.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+
+#include "ArrayLength.h"
+#include "IA2Attributes.h"
+
+namespace aspk {
+
+namespace {
+
+struct NamedValue {
+  const char* mName;
+  long mValue;
+};
+
+// The ROLE_SYSTEM_* values from oleacc.h, followed by the IA2_ROLE_* values
+// from AccessibleRole.idl. They are spelled out here so that selectors can
+// be compiled without the Windows headers.
+const NamedValue kRoles[] = {
+    {"titlebar", 0x1},
+    {"menubar", 0x2},
+    {"scrollbar", 0x3},
+    {"grip", 0x4},
+    {"sound", 0x5},
+    {"cursor", 0x6},
+    {"caret", 0x7},
+    {"alert", 0x8},
+    {"window", 0x9},
+    {"client", 0xA},
+    {"menupopup", 0xB},
+    {"menuitem", 0xC},
+    {"tooltip", 0xD},
+    {"application", 0xE},
+    {"document", 0xF},
+    {"pane", 0x10},
+    {"chart", 0x11},
+    {"dialog", 0x12},
+    {"border", 0x13},
+    {"grouping", 0x14},
+    {"separator", 0x15},
+    {"toolbar", 0x16},
+    {"statusbar", 0x17},
+    {"table", 0x18},
+    {"columnheader", 0x19},
+    {"rowheader", 0x1A},
+    {"column", 0x1B},
+    {"row", 0x1C},
+    {"cell", 0x1D},
+    {"link", 0x1E},
+    {"helpballoon", 0x1F},
+    {"character", 0x20},
+    {"list", 0x21},
+    {"listitem", 0x22},
+    {"outline", 0x23},
+    {"outlineitem", 0x24},
+    {"pagetab", 0x25},
+    {"propertypage", 0x26},
+    {"indicator", 0x27},
+    {"graphic", 0x28},
+    {"statictext", 0x29},
+    {"text", 0x2A},
+    {"pushbutton", 0x2B},
+    {"checkbutton", 0x2C},
+    {"radiobutton", 0x2D},
+    {"combobox", 0x2E},
+    {"droplist", 0x2F},
+    {"progressbar", 0x30},
+    {"dial", 0x31},
+    {"hotkeyfield", 0x32},
+    {"slider", 0x33},
+    {"spinbutton", 0x34},
+    {"diagram", 0x35},
+    {"animation", 0x36},
+    {"equation", 0x37},
+    {"buttondropdown", 0x38},
+    {"buttonmenu", 0x39},
+    {"buttondropdowngrid", 0x3A},
+    {"whitespace", 0x3B},
+    {"pagetablist", 0x3C},
+    {"clock", 0x3D},
+    {"splitbutton", 0x3E},
+    {"ipaddress", 0x3F},
+    {"outlinebutton", 0x40},
+    {"canvas", 0x401},
+    {"caption", 0x402},
+    {"checkmenuitem", 0x403},
+    {"colorchooser", 0x404},
+    {"dateeditor", 0x405},
+    {"desktopicon", 0x406},
+    {"desktoppane", 0x407},
+    {"directorypane", 0x408},
+    {"editbar", 0x409},
+    {"embeddedobject", 0x40A},
+    {"endnote", 0x40B},
+    {"filechooser", 0x40C},
+    {"fontchooser", 0x40D},
+    {"footer", 0x40E},
+    {"footnote", 0x40F},
+    {"form", 0x410},
+    {"frame", 0x411},
+    {"glasspane", 0x412},
+    {"header", 0x413},
+    {"heading", 0x414},
+    {"icon", 0x415},
+    {"imagemap", 0x416},
+    {"inputmethodwindow", 0x417},
+    {"internalframe", 0x418},
+    {"label", 0x419},
+    {"layeredpane", 0x41A},
+    {"note", 0x41B},
+    {"optionpane", 0x41C},
+    {"page", 0x41D},
+    {"paragraph", 0x41E},
+    {"radiomenuitem", 0x41F},
+    {"redundantobject", 0x420},
+    {"rootpane", 0x421},
+    {"ruler", 0x422},
+    {"scrollpane", 0x423},
+    {"section", 0x424},
+    {"shape", 0x425},
+    {"splitpane", 0x426},
+    {"tearoffmenu", 0x427},
+    {"terminal", 0x428},
+    {"textframe", 0x429},
+    {"togglebutton", 0x42A},
+    {"viewport", 0x42B},
+};
+
+// The STATE_SYSTEM_* flags from oleacc.h.
+const long kStateInvisible = 0x8000;
+const long kStateOffscreen = 0x10000;
+
+const NamedValue kStates[] = {
+    {"unavailable", 0x1},
+    {"selected", 0x2},
+    {"focused", 0x4},
+    {"pressed", 0x8},
+    {"checked", 0x10},
+    {"mixed", 0x20},
+    {"readonly", 0x40},
+    {"hottracked", 0x80},
+    {"default", 0x100},
+    {"expanded", 0x200},
+    {"collapsed", 0x400},
+    {"busy", 0x800},
+    {"floating", 0x1000},
+    {"marqueed", 0x2000},
+    {"animated", 0x4000},
+    {"invisible", kStateInvisible},
+    {"offscreen", kStateOffscreen},
+    {"sizeable", 0x20000},
+    {"moveable", 0x40000},
+    {"selfvoicing", 0x80000},
+    {"focusable", 0x100000},
+    {"selectable", 0x200000},
+    {"linked", 0x400000},
+    {"traversed", 0x800000},
+    {"multiselectable", 0x1000000},
+    {"extselectable", 0x2000000},
+    {"alertlow", 0x4000000},
+    {"alertmedium", 0x8000000},
+    {"alerthigh", 0x10000000},
+    {"protected", 0x20000000},
+    {"haspopup", 0x40000000},
+};
+
+// The IA2States flags from AccessibleStates.h.
+const NamedValue kIA2States[] = {
+    {"active", 0x1},
+    {"armed", 0x2},
+    {"defunct", 0x4},
+    {"editable", 0x8},
+    {"horizontal", 0x10},
+    {"iconified", 0x20},
+    {"invalidentry", 0x40},
+    {"managesdescendants", 0x80},
+    {"modal", 0x100},
+    {"multiline", 0x200},
+    {"opaque", 0x400},
+    {"required", 0x800},
+    {"selectabletext", 0x1000},
+    {"singleline", 0x2000},
+    {"stale", 0x4000},
+    {"supportsautocompletion", 0x8000},
+    {"transient", 0x10000},
+    {"vertical", 0x20000},
+    {"checkable", 0x40000},
+    {"pinned", 0x80000},
+};
+
+// Looks aName up in aTable, or parses it as a number.
+template <size_t N>
+bool LookupValue(const NamedValue (&aTable)[N], const std::wstring& aName,
+                 long& aOutValue) {
+  for (const NamedValue& entry : aTable) {
+    if (aName.size() == strlen(entry.mName) &&
+        std::equal(aName.begin(), aName.end(), entry.mName)) {
+      aOutValue = entry.mValue;
+      return true;
+    }
+  }
+
+  if (aName.empty() || !iswdigit(aName[0])) {
+    return false;
+  }
+  wchar_t* end = nullptr;
+  long value = wcstol(aName.c_str(), &end, 0);
+  if (*end || !value) {
+    return false;
+  }
+  aOutValue = value;
+  return true;
+}
+
+bool IsIdentChar(const wchar_t aChar) {
+  return iswalnum(aChar) || aChar == L'-' || aChar == L'_' || aChar == L'.';
+}
+
+class SelectorParser {
+ public:
+  SelectorParser(const wchar_t* aText, std::string& aOutError)
+      : mText(aText), mCur(aText), mError(aOutError) {}
+
+  bool Parse(Selector& aOut) {
+    aOut = Selector();
+    SkipSpace();
+    if (!*mCur) {
+      return Fail("empty selector");
+    }
+
+    SelectorCombinator combinator = SelectorCombinator::Descendant;
+    while (true) {
+      if (aOut.mSteps.size() == Selector::kMaxSteps) {
+        return Fail("too many steps");
+      }
+      SelectorStep step;
+      step.mCombinator = combinator;
+      if (!ParseCompound(step)) {
+        return false;
+      }
+      aOut.mSteps.push_back(std::move(step));
+
+      bool sawSpace = SkipSpace();
+      if (!*mCur) {
+        break;
+      }
+      if (*mCur == L'>') {
+        ++mCur;
+        SkipSpace();
+        combinator = SelectorCombinator::Child;
+      } else if (sawSpace) {
+        combinator = SelectorCombinator::Descendant;
+      } else {
+        return Fail("expected '>' or whitespace");
+      }
+    }
+
+    for (SelectorStep& step : aOut.mSteps) {
+      std::stable_sort(step.mTests.begin(), step.mTests.end(),
+                       [](const SelectorTest& aA, const SelectorTest& aB) {
+                         return aA.mProperty < aB.mProperty;
+                       });
+    }
+
+    for (const SelectorTest& test : aOut.mSteps.back().mTests) {
+      if (test.mProperty == SelectorProperty::State &&
+          test.mOp == SelectorOp::NotEquals &&
+          (test.mValue == kStateInvisible ||
+           test.mValue == kStateOffscreen)) {
+        aOut.mPruneStates |= test.mValue;
+      }
+    }
+    return true;
+  }
+
+ private:
+  // Reports aWhat at aAt, or at the current position if aAt is null.
+  bool Fail(const char* aWhat, const wchar_t* aAt = nullptr) {
+    char buf[128];
+    snprintf(buf, ArrayLength(buf), "%s at offset %zu", aWhat,
+             static_cast<size_t>((aAt ? aAt : mCur) - mText));
+    mError = buf;
+    return false;
+  }
+
+  // Returns whether any whitespace was skipped.
+  bool SkipSpace() {
+    const wchar_t* start = mCur;
+    while (iswspace(*mCur)) {
+      ++mCur;
+    }
+    return mCur != start;
+  }
+
+  bool ParseIdent(std::wstring& aOut) {
+    const wchar_t* start = mCur;
+    while (IsIdentChar(*mCur)) {
+      ++mCur;
+    }
+    aOut.assign(start, mCur - start);
+    return !aOut.empty();
+  }
+
+  bool ParseCompound(SelectorStep& aStep) {
+    if (*mCur == L'*') {
+      ++mCur;
+    } else if (IsIdentChar(*mCur)) {
+      const wchar_t* roleStart = mCur;
+      std::wstring role;
+      ParseIdent(role);
+      SelectorTest test;
+      if (!MakeRoleTest(role, SelectorOp::Equals, roleStart, test)) {
+        return false;
+      }
+      aStep.mTests.push_back(std::move(test));
+    } else if (*mCur != L'[') {
+      return Fail("expected a role, '*' or '['");
+    }
+
+    while (*mCur == L'[') {
+      ++mCur;
+      SkipSpace();
+      SelectorTest test;
+      if (!ParseTest(test)) {
+        return false;
+      }
+      SkipSpace();
+      if (*mCur != L']') {
+        return Fail("expected ']'");
+      }
+      ++mCur;
+      aStep.mTests.push_back(std::move(test));
+    }
+    return true;
+  }
+
+  bool ParseOp(SelectorOp& aOut) {
+    if (mCur[0] == L'=') {
+      aOut = SelectorOp::Equals;
+      ++mCur;
+    } else if (mCur[0] == L'!' && mCur[1] == L'=') {
+      aOut = SelectorOp::NotEquals;
+      mCur += 2;
+    } else if (mCur[0] == L'*' && mCur[1] == L'=') {
+      aOut = SelectorOp::Contains;
+      mCur += 2;
+    } else {
+      return Fail("expected '=', '!=' or '*='");
+    }
+    return true;
+  }
+
+  bool ParseValue(std::wstring& aOut) {
+    aOut.clear();
+    if (*mCur != L'"') {
+      while (*mCur && *mCur != L']' && !iswspace(*mCur)) {
+        aOut.push_back(*mCur++);
+      }
+      return aOut.empty() ? Fail("expected a value") : true;
+    }
+
+    ++mCur;
+    while (*mCur != L'"') {
+      if (*mCur == L'\\' && mCur[1]) {
+        ++mCur;
+      }
+      if (!*mCur) {
+        return Fail("unterminated string");
+      }
+      aOut.push_back(*mCur++);
+    }
+    ++mCur;
+    return true;
+  }
+
+  // aStart is where aRole appeared, for error reporting.
+  bool MakeRoleTest(const std::wstring& aRole, const SelectorOp aOp,
+                    const wchar_t* aStart, SelectorTest& aOut) {
+    aOut.mProperty = SelectorProperty::Role;
+    aOut.mOp = aOp;
+    if (!LookupValue(kRoles, aRole, aOut.mValue)) {
+      return Fail("unknown role", aStart);
+    }
+    aOut.mNeeds = SelectorPropertyBit(SelectorProperty::Role);
+    if (aOut.mValue >= kFirstIA2Role) {
+      aOut.mNeeds |= SelectorPropertyBit(SelectorProperty::IA2Role);
+    }
+    return true;
+  }
+
+  bool ParseTest(SelectorTest& aOut) {
+    const wchar_t* keyStart = mCur;
+    std::wstring key;
+    if (!ParseIdent(key)) {
+      return Fail("expected a test");
+    }
+
+    bool isAttr = key == L"attr" && *mCur == L':';
+    if (isAttr) {
+      ++mCur;
+      // Keys with characters that are special here can be quoted.
+      if (*mCur == L'"' ? !ParseValue(aOut.mKey) : !ParseIdent(aOut.mKey)) {
+        return Fail("expected an attribute name");
+      }
+    }
+    SkipSpace();
+
+    SelectorOp op = SelectorOp::Present;
+    if (!(isAttr && *mCur == L']') && !ParseOp(op)) {
+      return false;
+    }
+    SkipSpace();
+
+    const wchar_t* valueStart = mCur;
+    std::wstring value;
+    if (op != SelectorOp::Present && !ParseValue(value)) {
+      return false;
+    }
+
+    const bool isFlagOp =
+        op == SelectorOp::Equals || op == SelectorOp::NotEquals;
+    if (isAttr) {
+      aOut.mProperty = SelectorProperty::Attributes;
+    } else if (key == L"name") {
+      aOut.mProperty = SelectorProperty::Name;
+    } else if (key == L"role" || key == L"state" || key == L"ia2state") {
+      if (!isFlagOp) {
+        return Fail("expected '=' or '!='");
+      }
+      if (key == L"role") {
+        return MakeRoleTest(value, op, valueStart, aOut);
+      }
+      const bool isIA2 = key == L"ia2state";
+      aOut.mProperty =
+          isIA2 ? SelectorProperty::IA2State : SelectorProperty::State;
+      if (isIA2 ? !LookupValue(kIA2States, value, aOut.mValue)
+                : !LookupValue(kStates, value, aOut.mValue)) {
+        return Fail("unknown state", valueStart);
+      }
+    } else {
+      return Fail("unknown test", keyStart);
+    }
+
+    aOut.mOp = op;
+    aOut.mText = std::move(value);
+    aOut.mNeeds = SelectorPropertyBit(aOut.mProperty);
+    return true;
+  }
+
+  const wchar_t* const mText;
+  const wchar_t* mCur;
+  std::string& mError;
+};
+
+bool TextMatches(const SelectorOp aOp, const std::wstring& aText,
+                 const std::wstring& aPattern) {
+  switch (aOp) {
+    case SelectorOp::Equals:
+      return aText == aPattern;
+    case SelectorOp::NotEquals:
+      return aText != aPattern;
+    case SelectorOp::Contains:
+      return aText.find(aPattern) != std::wstring::npos;
+    default:
+      return true;
+  }
+}
+
+}  // namespace
+
+bool CompileSelector(const wchar_t* aText, Selector& aOut,
+                     std::string& aOutError) {
+  SelectorParser parser(aText, aOutError);
+  return parser.Parse(aOut);
+}
+
+bool LookupRoleName(const std::wstring& aName, long& aOutRole) {
+  return LookupValue(kRoles, aName, aOutRole);
+}
+
+bool FindIA2Attribute(const std::wstring& aAttributes,
+                      const std::wstring& aKey, std::wstring& aOutValue) {
+  IA2AttributeParser parser(aAttributes.data(), aAttributes.size());
+  IA2Attribute attr;
+  while (parser.Next(attr)) {
+    if (attr.mKey.Equals(aKey.data(), aKey.size())) {
+      aOutValue.clear();
+      attr.mValue.AppendTo(aOutValue);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SelectorTestMatches(const SelectorTest& aTest,
+                         const SelectorNodeProps& aProps) {
+  bool matches = false;
+  switch (aTest.mProperty) {
+    case SelectorProperty::Role:
+      matches = aProps.mRole == aTest.mValue ||
+                ((aTest.mNeeds &
+                  SelectorPropertyBit(SelectorProperty::IA2Role)) &&
+                 aProps.mIA2Role == aTest.mValue);
+      break;
+    case SelectorProperty::State:
+      matches = (aProps.mState & aTest.mValue) == aTest.mValue;
+      break;
+    case SelectorProperty::IA2State:
+      matches = (aProps.mIA2State & aTest.mValue) == aTest.mValue;
+      break;
+    case SelectorProperty::Name:
+      return TextMatches(aTest.mOp, aProps.mName, aTest.mText);
+    case SelectorProperty::Attributes: {
+      std::wstring value;
+      if (!FindIA2Attribute(aProps.mAttributes, aTest.mKey, value)) {
+        return aTest.mOp == SelectorOp::NotEquals;
+      }
+      return TextMatches(aTest.mOp, value, aTest.mText);
+    }
+    default:
+      return false;
+  }
+  return aTest.mOp == SelectorOp::NotEquals ? !matches : matches;
+}
+
+}  // namespace aspk
@@ -0,0 +1,295 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace aspk {
+
+namespace {
+
+// How often the drain thread empties the thread buffers. A 1MB buffer fills
+// up only if one thread records more than about 100MB/s of trace data.
+const std::chrono::milliseconds kDrainInterval(10);
+
+struct TraceState {
+  std::mutex mLock;  // Guards everything below
+  std::vector<TraceSite*> mSites;
+  size_t mSitesWritten = 0;
+  std::vector<TraceBuffer*> mBuffers;
+  uint32_t mNextThreadId = 0;
+
+  FILE* mOut = nullptr;
+  uint64_t mEventsWritten = 0;
+  uint64_t mEventsDropped = 0;
+
+  std::thread mDrainThread;
+  std::condition_variable mWakeDrain;
+  bool mStopping = false;
+};
+
+TraceState& State() {
+  static TraceState sState;
+  return sState;
+}
+
+// Owns the calling thread's buffer and retires it when the thread exits.
+struct ThreadBuffer {
+  ~ThreadBuffer() {
+    if (mBuffer) {
+      mBuffer->mRetired.store(true, std::memory_order_release);
+    }
+  }
+  TraceBuffer* mBuffer = nullptr;
+};
+
+thread_local ThreadBuffer tThreadBuffer;
+
+void WriteSites(TraceState& aState) {
+  for (; aState.mSitesWritten < aState.mSites.size();
+       ++aState.mSitesWritten) {
+    const TraceSite* site = aState.mSites[aState.mSitesWritten];
+    const uint8_t kind = kTraceRecordSite;
+    const uint32_t id = static_cast<uint32_t>(aState.mSitesWritten);
+    const uint16_t fileLen = static_cast<uint16_t>(
+        std::min<size_t>(strlen(site->mFile), UINT16_MAX));
+    const uint16_t formatLen = static_cast<uint16_t>(
+        std::min<size_t>(strlen(site->mFormat), UINT16_MAX));
+
+    fwrite(&kind, sizeof(kind), 1, aState.mOut);
+    fwrite(&id, sizeof(id), 1, aState.mOut);
+    fwrite(&site->mLine, sizeof(site->mLine), 1, aState.mOut);
+    fwrite(&site->mArgCount, sizeof(site->mArgCount), 1, aState.mOut);
+    fwrite(site->mTypes, sizeof(TraceArgType), site->mArgCount, aState.mOut);
+    fwrite(&fileLen, sizeof(fileLen), 1, aState.mOut);
+    fwrite(site->mFile, 1, fileLen, aState.mOut);
+    fwrite(&formatLen, sizeof(formatLen), 1, aState.mOut);
+    fwrite(site->mFormat, 1, formatLen, aState.mOut);
+  }
+}
+
+// Counts the events in aLen bytes starting at aPos in aBuffer. Every site they
+// refer to has been written already, so its argument types are known.
+uint64_t CountEvents(TraceState& aState, const TraceBuffer* aBuffer,
+                     uint64_t aPos, uint64_t aLen) {
+  auto read = [&](void* aOut, size_t aSize) {
+    uint8_t* out = static_cast<uint8_t*>(aOut);
+    for (size_t i = 0; i < aSize; ++i) {
+      out[i] = aBuffer->mData[(aPos + i) & TraceBuffer::kMask];
+    }
+    aPos += aSize;
+  };
+
+  const uint64_t end = aPos + aLen;
+  uint64_t count = 0;
+  while (aPos < end) {
+    uint32_t id;
+    read(&id, sizeof(id));
+    aPos += sizeof(uint64_t);  // Timestamp
+
+    const TraceSite* site = aState.mSites[id];
+    for (uint8_t i = 0; i < site->mArgCount; ++i) {
+      switch (site->mTypes[i]) {
+        case TraceArgType::Int32:
+        case TraceArgType::UInt32:
+          aPos += 4;
+          break;
+        case TraceArgType::String:
+        case TraceArgType::WideString: {
+          uint16_t len;
+          read(&len, sizeof(len));
+          aPos += site->mTypes[i] == TraceArgType::String
+                      ? len
+                      : len * sizeof(uint16_t);
+          break;
+        }
+        default:
+          aPos += 8;
+          break;
+      }
+    }
+    ++count;
+  }
+  return count;
+}
+
+// Writes out everything recorded so far. Called with mLock held.
+void Drain(TraceState& aState) {
+  // Sample every head before writing sites: an event is published only after
+  // its site was registered, so every site these events use gets written.
+  std::vector<uint64_t> heads;
+  heads.reserve(aState.mBuffers.size());
+  for (TraceBuffer* buffer : aState.mBuffers) {
+    heads.push_back(buffer->mHead.load(std::memory_order_acquire));
+  }
+
+  WriteSites(aState);
+
+  for (size_t i = 0; i < aState.mBuffers.size(); ++i) {
+    TraceBuffer* buffer = aState.mBuffers[i];
+    const uint64_t tail = buffer->mTail.load(std::memory_order_relaxed);
+    const uint64_t head = heads[i];
+
+    if (head != tail) {
+      const uint8_t kind = kTraceRecordEvents;
+      const uint32_t len = static_cast<uint32_t>(head - tail);
+      const size_t offset = static_cast<size_t>(tail & TraceBuffer::kMask);
+      const size_t first = std::min<size_t>(len, TraceBuffer::kSize - offset);
+      fwrite(&kind, sizeof(kind), 1, aState.mOut);
+      fwrite(&buffer->mThreadId, sizeof(buffer->mThreadId), 1, aState.mOut);
+      fwrite(&len, sizeof(len), 1, aState.mOut);
+      fwrite(buffer->mData + offset, 1, first, aState.mOut);
+      fwrite(buffer->mData, 1, len - first, aState.mOut);
+
+      aState.mEventsWritten += CountEvents(aState, buffer, tail, len);
+      buffer->mTail.store(head, std::memory_order_release);
+    }
+
+    const uint64_t dropped = buffer->mDropped.load(std::memory_order_relaxed);
+    if (dropped != buffer->mDroppedReported) {
+      const uint8_t kind = kTraceRecordDropped;
+      const uint64_t count = dropped - buffer->mDroppedReported;
+      fwrite(&kind, sizeof(kind), 1, aState.mOut);
+      fwrite(&buffer->mThreadId, sizeof(buffer->mThreadId), 1, aState.mOut);
+      fwrite(&count, sizeof(count), 1, aState.mOut);
+      aState.mEventsDropped += count;
+      buffer->mDroppedReported = dropped;
+    }
+  }
+
+  // Free the buffers of threads that have exited, once they are empty. The
+  // retired flag is read last so that no event can follow the final drain.
+  auto it = std::remove_if(
+      aState.mBuffers.begin(), aState.mBuffers.end(), [](TraceBuffer* aBuf) {
+        if (!aBuf->mRetired.load(std::memory_order_acquire) ||
+            aBuf->mHead.load(std::memory_order_relaxed) !=
+                aBuf->mTail.load(std::memory_order_relaxed)) {
+          return false;
+        }
+        delete aBuf;
+        return true;
+      });
+  aState.mBuffers.erase(it, aState.mBuffers.end());
+
+  fflush(aState.mOut);
+}
+
+}  // namespace
+
+std::atomic<bool> Tracer::sEnabled{false};
+
+bool Tracer::Start(FILE* aOut) {
+  TraceState& state = State();
+  std::lock_guard<std::mutex> lock(state.mLock);
+  if (state.mOut || !aOut) {
+    return false;
+  }
+
+  TraceFileHeader header = {};
+  memcpy(header.mMagic, kTraceMagic, sizeof(header.mMagic));
+  header.mVersion = kTraceVersion;
+  header.mTicksPerSecond = std::chrono::steady_clock::period::den /
+                           std::chrono::steady_clock::period::num;
+  if (fwrite(&header, sizeof(header), 1, aOut) != 1) {
+    return false;
+  }
+
+  // Anything recorded after an earlier Stop belongs to no trace.
+  for (TraceBuffer* buffer : state.mBuffers) {
+    buffer->mTail.store(buffer->mHead.load(std::memory_order_acquire),
+                        std::memory_order_release);
+    buffer->mDroppedReported =
+        buffer->mDropped.load(std::memory_order_relaxed);
+  }
+
+  state.mOut = aOut;
+  state.mSitesWritten = 0;
+  state.mEventsWritten = 0;
+  state.mEventsDropped = 0;
+  state.mStopping = false;
+  state.mDrainThread = std::thread([&state]() {
+    std::unique_lock<std::mutex> lock(state.mLock);
+    while (!state.mStopping) {
+      state.mWakeDrain.wait_for(lock, kDrainInterval);
+      Drain(state);
+    }
+    // Stop may have come before this thread first took the lock, in which
+    // case nothing has been drained yet.
+    Drain(state);
+  });
+
+  sEnabled.store(true, std::memory_order_release);
+  return true;
+}
+
+void Tracer::Stop() {
+  TraceState& state = State();
+  {
+    std::lock_guard<std::mutex> lock(state.mLock);
+    if (!state.mOut) {
+      return;
+    }
+    sEnabled.store(false, std::memory_order_release);
+    state.mStopping = true;
+  }
+
+  state.mWakeDrain.notify_one();
+  state.mDrainThread.join();
+
+  std::lock_guard<std::mutex> lock(state.mLock);
+  state.mOut = nullptr;
+}
+
+uint64_t Tracer::EventsWritten() {
+  TraceState& state = State();
+  std::lock_guard<std::mutex> lock(state.mLock);
+  return state.mEventsWritten;
+}
+
+uint64_t Tracer::EventsDropped() {
+  TraceState& state = State();
+  std::lock_guard<std::mutex> lock(state.mLock);
+  return state.mEventsDropped;
+}
+
+uint32_t Tracer::RegisterSite(TraceSite& aSite, uint8_t aArgCount,
+                              const TraceArgType* aTypes) {
+  TraceState& state = State();
+  std::lock_guard<std::mutex> lock(state.mLock);
+
+  // Another thread may have registered the site while we waited.
+  uint32_t id = aSite.mId.load(std::memory_order_relaxed);
+  if (id) {
+    return id;
+  }
+
+  aSite.mArgCount = aArgCount;
+  aSite.mTypes = aTypes;
+  state.mSites.push_back(&aSite);
+  id = static_cast<uint32_t>(state.mSites.size());
+  aSite.mId.store(id, std::memory_order_release);
+  return id;
+}
+
+TraceBuffer* Tracer::CurrentBuffer() {
+  ThreadBuffer& current = tThreadBuffer;
+  if (!current.mBuffer) {
+    TraceBuffer* buffer = new TraceBuffer();
+    TraceState& state = State();
+    std::lock_guard<std::mutex> lock(state.mLock);
+    buffer->mThreadId = state.mNextThreadId++;
+    state.mBuffers.push_back(buffer);
+    current.mBuffer = buffer;
+  }
+  return current.mBuffer;
+}
+
+}  // namespace aspk
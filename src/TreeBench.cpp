@@ -0,0 +1,302 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "TreeBench.h"
+
+#include <inttypes.h>
+
+#include "IpcAccounting.h"
+
+using std::chrono::steady_clock;
+
+namespace aspk {
+
+double TreeBench::ElapsedMs(const steady_clock::time_point aStart,
+                            const uint64_t aOutputStartNs) const {
+  std::chrono::duration<double, std::milli> elapsed =
+      steady_clock::now() - aStart;
+  const uint64_t outputNs = OutputNs() - aOutputStartNs;
+  return elapsed.count() - static_cast<double>(outputNs) / 1e6;
+}
+
+void TreeBench::FetchChildren(const BackendNodePtr& aNode,
+                              std::vector<BackendNodePtr>& aOut) {
+  AutoIpcOperation op(IpcOperation::GetChildren);
+  mBackend.GetChildren(aNode, mOptions.mStrategy, mOptions.mMaxChunk, aOut,
+                       mCounters);
+}
+
+bool TreeBench::PrunedByRole(const BackendNodePtr& aChild) {
+  AutoIpcOperation op(IpcOperation::CheckPrune);
+  const PruneRules& rules = mOptions.mWalk.mPrune;
+  long role;
+  if (mBackend.GetRole(aChild, role) && rules.SkipsRole(role)) {
+    return true;
+  }
+  return rules.HasIA2Roles() && mBackend.GetIA2Role(aChild, role) &&
+         rules.SkipsRole(role);
+}
+
+bool TreeBench::PrunedBySource(const BackendNodePtr& aChild) {
+  AutoIpcOperation op(IpcOperation::CheckPrune);
+  long uniqueId;
+  return mBackend.GetUniqueId(aChild, uniqueId) &&
+         mOptions.mWalk.mPrune.SkipsSource(uniqueId);
+}
+
+void TreeBench::AddPrunes(Filter& aFilter, const ScreenRect* aViewport) {
+  const PruneRules& rules = mOptions.mWalk.mPrune;
+  if (aViewport) {
+    aFilter.AddPrune([this, aViewport](const BackendNodePtr& aChild) {
+      return !ShouldVisitChild(aChild, *aViewport);
+    });
+  }
+  // A visibility-filtered walk has already checked the states.
+  if (rules.mInvisible && !aViewport) {
+    aFilter.AddPrune([this](const BackendNodePtr& aChild) {
+      AutoIpcOperation op(IpcOperation::CheckVisibility);
+      long state;
+      return mBackend.GetState(aChild, state) && !IsVisibleAccState(state);
+    });
+  }
+  if (rules.mChrome || rules.mContent) {
+    aFilter.AddPrune([this](const BackendNodePtr& aChild) {
+      return PrunedBySource(aChild);
+    });
+  }
+  if (!rules.mRoles.empty()) {
+    aFilter.AddPrune([this](const BackendNodePtr& aChild) {
+      return PrunedByRole(aChild);
+    });
+  }
+}
+
+BackendNodePtr TreeBench::SkipRejected(BackendNodePtr aNode,
+                                       const Filter& aFilter) {
+  while (aNode && aFilter.Rejects(aNode)) {
+    AutoIpcOperation op(IpcOperation::GetChildren);
+    aNode = mBackend.NextSibling(aNode, mCounters);
+  }
+  return aNode;
+}
+
+template <typename Visitor>
+void TreeBench::WalkBounded(const BackendNodePtr& aRoot, const Filter& aFilter,
+                            Visitor&& aVisit) {
+  AutoCountSkips<BackendNodePtr> countSkips(aFilter, mCounters);
+  mPath.clear();
+  BackendNodePtr node(aRoot);
+  mCounters.Visit(0);
+  if (!aVisit(node)) {
+    return;
+  }
+
+  while (true) {
+    BackendNodePtr next;
+    if (aFilter.Expands(static_cast<uint32_t>(mPath.size()))) {
+      {
+        AutoIpcOperation op(IpcOperation::GetChildren);
+        next = mBackend.FirstChild(node, mCounters);
+      }
+      next = SkipRejected(std::move(next), aFilter);
+    }
+    if (next) {
+      mPath.push_back(std::move(node));
+    } else {
+      // Climb until a node on the path has a sibling left to visit. The
+      // root's siblings are not part of the walk.
+      while (!mPath.empty()) {
+        {
+          AutoIpcOperation op(IpcOperation::GetChildren);
+          next = mBackend.NextSibling(node, mCounters);
+        }
+        next = SkipRejected(std::move(next), aFilter);
+        if (next) {
+          break;
+        }
+        node = std::move(mPath.back());
+        mPath.pop_back();
+      }
+      if (!next) {
+        break;
+      }
+    }
+
+    node = std::move(next);
+    mCounters.Visit(static_cast<uint32_t>(mPath.size()));
+    if (!aVisit(node)) {
+      break;
+    }
+  }
+  mPath.clear();
+}
+
+bool TreeBench::HasVisibleRole(const BackendNodePtr& aNode, const long aRole) {
+  AutoIpcOperation op(IpcOperation::CheckVisibility);
+  long role, state;
+  return mBackend.GetRole(aNode, role) && role == aRole &&
+         mBackend.GetState(aNode, state) && IsVisibleAccState(state);
+}
+
+BackendNodePtr TreeBench::FindVisibleRole(const BackendNodePtr& aRoot,
+                                          const long aRole) {
+  Filter filter(mOptions.mWalk.mMaxDepth);
+  AddPrunes(filter, nullptr);
+
+  BackendNodePtr found;
+  if (mOptions.mBoundRefs) {
+    WalkBounded(aRoot, filter, [&](const BackendNodePtr& aNode) {
+      if (HasVisibleRole(aNode, aRole)) {
+        found = aNode;
+        return false;
+      }
+      return true;
+    });
+    return found;
+  }
+
+  mWalker.Walk(aRoot, filter, [&](TreeWalker<BackendNodePtr>::Step& aStep) {
+    if (HasVisibleRole(aStep.mNode, aRole)) {
+      found = aStep.mNode;
+      return WalkAction::Stop;
+    }
+    return WalkAction::Continue;
+  });
+  return found;
+}
+
+bool TreeBench::QueryProperties(const BackendNodePtr& aNode) {
+  AutoIpcOperation op(IpcOperation::QueryAccInfo);
+  for (uint32_t i = 0; i < kNumAccProperties; ++i) {
+    const AccProperty prop = static_cast<AccProperty>(i);
+    if (!(mOptions.mPropertyMask & AccPropertyBit(prop))) {
+      continue;
+    }
+
+    const steady_clock::time_point start = steady_clock::now();
+    const bool ok = mBackend.FetchProperty(aNode, prop);
+    std::chrono::duration<double, std::micro> elapsed =
+        steady_clock::now() - start;
+    mCosts.Record(prop, elapsed.count());
+    if (!ok) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool TreeBench::FindDocumentAndQuery(double& aOutMs) {
+  const steady_clock::time_point start = steady_clock::now();
+  const uint64_t outputStartNs = OutputNs();
+
+  BackendNodePtr root;
+  {
+    AutoIpcOperation op(IpcOperation::FindRoot);
+    root = mBackend.Root();
+  }
+  if (!root) {
+    mOptions.mPrint("Couldn't get the root from the %s backend!\n",
+                    mBackend.Name());
+    return false;
+  }
+
+  BackendNodePtr doc = FindVisibleRole(root, kAccRoleDocument);
+  if (!doc) {
+    mOptions.mPrint("Couldn't find document!\n");
+    return false;
+  }
+
+  if (!QueryProperties(doc)) {
+    return false;
+  }
+
+  aOutMs = ElapsedMs(start, outputStartNs);
+  return true;
+}
+
+bool TreeBench::ShouldVisitChild(const BackendNodePtr& aChild,
+                                 const ScreenRect& aViewport) {
+  // One round-trip per child for the state, and when culling, another for
+  // the bounds of those that are visible. Nodes whose state or bounds cannot
+  // be fetched are kept.
+  AutoIpcOperation op(IpcOperation::CheckVisibility);
+  long state;
+  if (mBackend.GetState(aChild, state) && !IsVisibleAccState(state)) {
+    return false;
+  }
+  ScreenRect bounds;
+  return !mOptions.mCullToViewport || !mBackend.GetBounds(aChild, bounds) ||
+         MayIntersectViewport(bounds, aViewport);
+}
+
+void TreeBench::WalkVisible(const BackendNodePtr& aRoot, double& aOutMs) {
+  const steady_clock::time_point start = steady_clock::now();
+  const uint64_t outputStartNs = OutputNs();
+  const ScreenRect viewport = mBackend.Viewport();
+  Filter filter(mOptions.mWalk.mMaxDepth);
+  AddPrunes(filter, &viewport);
+
+  if (mOptions.mBoundRefs) {
+    WalkBounded(aRoot, filter, [this](const BackendNodePtr& aNode) {
+      QueryProperties(aNode);
+      return true;
+    });
+  } else {
+    mWalker.Walk(aRoot, filter,
+                 [this](TreeWalker<BackendNodePtr>::Step& aStep) {
+                   QueryProperties(aStep.mNode);
+                   return WalkAction::Continue;
+                 });
+  }
+
+  aOutMs = ElapsedMs(start, outputStartNs);
+}
+
+void TreeBench::DumpNode(const BackendNodePtr& aNode) {
+  AutoIpcOperation op(IpcOperation::DumpAccInfo);
+  if (mBackend.DumpNode(aNode)) {
+    return;
+  }
+
+  BackendNodeDescription desc;
+  if (!mBackend.Describe(aNode, desc)) {
+    return;
+  }
+
+  // %p adds its own 0x on some C runtimes but not on others.
+  mOptions.mPrint("0x%" PRIxPTR ", parent is 0x%" PRIxPTR
+                  ", \"%s\", role is 0x%X",
+                  reinterpret_cast<uintptr_t>(desc.mIdentity),
+                  reinterpret_cast<uintptr_t>(desc.mParentIdentity),
+                  desc.mName.c_str(), static_cast<unsigned int>(desc.mRole));
+  if (desc.mHasUniqueId) {
+    mOptions.mPrint(", uniqueId is %ld", desc.mUniqueId);
+  }
+  if (desc.mHasParentUniqueId) {
+    mOptions.mPrint(", parentUniqueId is %ld", desc.mParentUniqueId);
+  }
+  mOptions.mPrint("\n");
+}
+
+void TreeBench::DumpTree(const BackendNodePtr& aRoot) {
+  Filter filter(mOptions.mWalk.mMaxDepth);
+  AddPrunes(filter, nullptr);
+
+  if (mOptions.mBoundRefs) {
+    WalkBounded(aRoot, filter, [this](const BackendNodePtr& aNode) {
+      DumpNode(aNode);
+      return true;
+    });
+    return;
+  }
+
+  mWalker.Walk(aRoot, filter, [this](TreeWalker<BackendNodePtr>::Step& aStep) {
+    DumpNode(aStep.mNode);
+    return WalkAction::Continue;
+  });
+}
+
+}  // namespace aspk
@@ -0,0 +1,302 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "TreeDiff.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include "Utf8.h"
+
+namespace aspk {
+
+namespace {
+
+uint32_t ChangedProperties(const DiffNode& aOld, const DiffNode& aNew) {
+  uint32_t changed = 0;
+  if (aOld.mRole != aNew.mRole) {
+    changed |= kDiffRole;
+  }
+  if (aOld.mState != aNew.mState) {
+    changed |= kDiffState;
+  }
+  if (aOld.mIA2States != aNew.mIA2States) {
+    changed |= kDiffIA2States;
+  }
+  if (aOld.mName != aNew.mName) {
+    changed |= kDiffName;
+  }
+  return changed;
+}
+
+/**
+ * Given a sequence of distinct values, sets aOutKeep[i] for the elements of
+ * one longest increasing subsequence, by patience sorting.
+ */
+void MarkLongestIncreasingRun(const std::vector<uint32_t>& aValues,
+                              std::vector<bool>& aOutKeep) {
+  const size_t n = aValues.size();
+  // tails[k] is the index of the smallest tail of an increasing run of
+  // length k + 1; prev links each element to its predecessor in its run.
+  std::vector<size_t> tails;
+  std::vector<size_t> prev(n, SIZE_MAX);
+  for (size_t i = 0; i < n; ++i) {
+    auto it = std::lower_bound(tails.begin(), tails.end(), aValues[i],
+                               [&](size_t aTail, uint32_t aValue) {
+                                 return aValues[aTail] < aValue;
+                               });
+    if (it != tails.begin()) {
+      prev[i] = *(it - 1);
+    }
+    if (it == tails.end()) {
+      tails.push_back(i);
+    } else {
+      *it = i;
+    }
+  }
+
+  aOutKeep.assign(n, false);
+  for (size_t i = tails.empty() ? SIZE_MAX : tails.back(); i != SIZE_MAX;
+       i = prev[i]) {
+    aOutKeep[i] = true;
+  }
+}
+
+}  // namespace
+
+uint32_t DiffTree::AddNode(uint32_t aParent, DiffNode&& aNode) {
+  const uint32_t index = static_cast<uint32_t>(mNodes.size());
+  aNode.mParent = aParent;
+  aNode.mChildren.clear();
+  if (aParent != kNoDiffNode) {
+    std::vector<uint32_t>& siblings = mNodes[aParent].mChildren;
+    aNode.mIndexInParent = static_cast<uint32_t>(siblings.size());
+    siblings.push_back(index);
+  }
+  mNodes.push_back(std::move(aNode));
+  return index;
+}
+
+bool DiffTree::LoadSnapshot(const SnapshotView& aView) {
+  Clear();
+  const uint64_t count = aView.NodeCount();
+  mNodes.reserve(static_cast<size_t>(count));
+  for (uint64_t i = 0; i < count; ++i) {
+    const SnapshotNode& node = aView.Node(static_cast<uint32_t>(i));
+    // Breadth-first order puts parents first and siblings in order.
+    if (i ? node.mParent >= i : node.mParent != kNoSnapshotNode) {
+      Clear();
+      return false;
+    }
+
+    DiffNode diffNode;
+    diffNode.mUniqueId = node.mUniqueId;
+    diffNode.mRole = node.mRole;
+    diffNode.mState = node.mState;
+    diffNode.mIA2States = node.mIA2States;
+    if (const char* name = aView.Name(node)) {
+      diffNode.mName.assign(name, node.mNameLength);
+    }
+    AddNode(i ? node.mParent : kNoDiffNode, std::move(diffNode));
+  }
+  return true;
+}
+
+bool DiffTree::LoadMirror(const TreeMirror& aMirror) {
+  Clear();
+  struct Pending {
+    long mUniqueId;
+    uint32_t mParent;
+  };
+  std::vector<Pending> pending(1, Pending{aMirror.RootId(), kNoDiffNode});
+  while (!pending.empty()) {
+    Pending cur = pending.back();
+    pending.pop_back();
+    const TreeMirror::Node* node = aMirror.Find(cur.mUniqueId);
+    if (!node) {
+      continue;
+    }
+
+    DiffNode diffNode;
+    diffNode.mUniqueId = node->mUniqueId;
+    diffNode.mRole = node->mInfo.mRole;
+    diffNode.mState = static_cast<uint32_t>(node->mInfo.mState);
+    AppendUtf8(node->mInfo.mName.data(), node->mInfo.mName.size(),
+               diffNode.mName);
+    const uint32_t index = AddNode(cur.mParent, std::move(diffNode));
+
+    // Reverse so that siblings are added in order.
+    for (auto it = node->mChildren.rbegin(); it != node->mChildren.rend();
+         ++it) {
+      pending.push_back(Pending{*it, index});
+    }
+  }
+  return !mNodes.empty();
+}
+
+const char* TreeEditTypeName(const TreeEditType aType) {
+  switch (aType) {
+    case TreeEditType::Insert:
+      return "insert";
+    case TreeEditType::Remove:
+      return "remove";
+    case TreeEditType::Move:
+      return "move";
+    case TreeEditType::Change:
+      return "change";
+    default:
+      return "unknown";
+  }
+}
+
+void DiffTrees(const DiffTree& aOld, const DiffTree& aNew,
+               std::vector<TreeEdit>& aOutEdits, TreeDiffStats& aOutStats) {
+  aOutEdits.clear();
+  aOutStats = TreeDiffStats();
+
+  const uint32_t oldSize = static_cast<uint32_t>(aOld.Size());
+  const uint32_t newSize = static_cast<uint32_t>(aNew.Size());
+  std::vector<uint32_t> oldToNew(oldSize, kNoDiffNode);
+  std::vector<uint32_t> newToOld(newSize, kNoDiffNode);
+
+  auto match = [&](uint32_t aOldNode, uint32_t aNewNode) {
+    oldToNew[aOldNode] = aNewNode;
+    newToOld[aNewNode] = aOldNode;
+  };
+
+  // Match by uniqueID. An ID that occurs more than once in the old tree
+  // identifies nothing, so it is left for the positional fallback.
+  std::unordered_map<long, uint32_t> oldById;
+  oldById.reserve(oldSize);
+  for (uint32_t i = 0; i < oldSize; ++i) {
+    const long id = aOld.Node(i).mUniqueId;
+    if (id != kNoUniqueId) {
+      auto result = oldById.emplace(id, i);
+      if (!result.second) {
+        result.first->second = kNoDiffNode;
+      }
+    }
+  }
+  for (uint32_t i = 0; i < newSize; ++i) {
+    const long id = aNew.Node(i).mUniqueId;
+    if (id == kNoUniqueId) {
+      continue;
+    }
+    auto it = oldById.find(id);
+    if (it != oldById.end() && it->second != kNoDiffNode &&
+        oldToNew[it->second] == kNoDiffNode) {
+      match(it->second, i);
+      ++aOutStats.mMatchedById;
+    }
+  }
+
+  // Fall back to structural position. Parents come before their children, so
+  // a node's parent has been matched, if it ever will be, by the time the
+  // node is reached.
+  if (oldSize && newSize && newToOld[0] == kNoDiffNode &&
+      oldToNew[0] == kNoDiffNode) {
+    match(0, 0);
+    ++aOutStats.mMatchedByPosition;
+  }
+  for (uint32_t i = 1; i < newSize; ++i) {
+    const DiffNode& node = aNew.Node(i);
+    const uint32_t oldParent = newToOld[node.mParent];
+    if (newToOld[i] != kNoDiffNode || oldParent == kNoDiffNode) {
+      continue;
+    }
+    const std::vector<uint32_t>& candidates = aOld.Node(oldParent).mChildren;
+    if (node.mIndexInParent >= candidates.size()) {
+      continue;
+    }
+    const uint32_t candidate = candidates[node.mIndexInParent];
+    const DiffNode& oldNode = aOld.Node(candidate);
+    // Two different uniqueIDs are two different nodes.
+    if (oldToNew[candidate] == kNoDiffNode && oldNode.mRole == node.mRole &&
+        (oldNode.mUniqueId == kNoUniqueId || node.mUniqueId == kNoUniqueId)) {
+      match(candidate, i);
+      ++aOutStats.mMatchedByPosition;
+    }
+  }
+
+  // Find siblings that stayed under the same parent but were reordered.
+  std::vector<bool> reordered(newSize, false);
+  std::vector<uint32_t> kept;
+  std::vector<uint32_t> oldPositions;
+  std::vector<bool> inOrder;
+  for (uint32_t i = 0; i < newSize; ++i) {
+    const uint32_t oldParent = newToOld[i];
+    if (oldParent == kNoDiffNode) {
+      continue;
+    }
+    kept.clear();
+    oldPositions.clear();
+    bool sorted = true;
+    for (uint32_t child : aNew.Node(i).mChildren) {
+      const uint32_t oldChild = newToOld[child];
+      if (oldChild == kNoDiffNode || aOld.Node(oldChild).mParent != oldParent) {
+        continue;
+      }
+      const uint32_t position = aOld.Node(oldChild).mIndexInParent;
+      if (!oldPositions.empty() && oldPositions.back() > position) {
+        sorted = false;
+      }
+      kept.push_back(child);
+      oldPositions.push_back(position);
+    }
+    if (sorted) {
+      continue;
+    }
+    MarkLongestIncreasingRun(oldPositions, inOrder);
+    for (size_t k = 0; k < kept.size(); ++k) {
+      reordered[kept[k]] = !inOrder[k];
+    }
+  }
+
+  for (uint32_t i = 0; i < oldSize; ++i) {
+    if (oldToNew[i] == kNoDiffNode) {
+      aOutEdits.push_back(
+          TreeEdit{TreeEditType::Remove, i, kNoDiffNode, 0});
+      ++aOutStats.mRemoved;
+    }
+  }
+
+  for (uint32_t i = 0; i < newSize; ++i) {
+    const uint32_t oldNode = newToOld[i];
+    if (oldNode == kNoDiffNode) {
+      aOutEdits.push_back(
+          TreeEdit{TreeEditType::Insert, kNoDiffNode, i, 0});
+      ++aOutStats.mInserted;
+      continue;
+    }
+
+    bool edited = false;
+    const uint32_t parent = aNew.Node(i).mParent;
+    const uint32_t oldParent = aOld.Node(oldNode).mParent;
+    const bool reparented =
+        (parent == kNoDiffNode) != (oldParent == kNoDiffNode) ||
+        (parent != kNoDiffNode && newToOld[parent] != oldParent);
+    if (reparented || reordered[i]) {
+      aOutEdits.push_back(TreeEdit{TreeEditType::Move, oldNode, i, 0});
+      ++aOutStats.mMoved;
+      edited = true;
+    }
+
+    const uint32_t changed =
+        ChangedProperties(aOld.Node(oldNode), aNew.Node(i));
+    if (changed) {
+      aOutEdits.push_back(TreeEdit{TreeEditType::Change, oldNode, i, changed});
+      ++aOutStats.mChanged;
+      edited = true;
+    }
+
+    if (!edited) {
+      ++aOutStats.mUnchanged;
+    }
+  }
+}
+
+}  // namespace aspk
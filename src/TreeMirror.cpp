@@ -0,0 +1,324 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "TreeMirror.h"
+
+#include <algorithm>
+#include <unordered_set>
+#include <utility>
+
+namespace aspk {
+
+namespace {
+
+struct EventKey {
+  MirrorEventType mType;
+  long mUniqueId;
+
+  bool operator==(const EventKey& aOther) const {
+    return mType == aOther.mType && mUniqueId == aOther.mUniqueId;
+  }
+};
+
+struct EventKeyHash {
+  size_t operator()(const EventKey& aKey) const {
+    return std::hash<long>()(aKey.mUniqueId) * 31 +
+           static_cast<size_t>(aKey.mType);
+  }
+};
+
+}  // anonymous namespace
+
+bool TreeMirror::FetchInfo(long aUniqueId, MirrorNodeInfo& aOut) {
+  ++mStats.mSourceCalls;
+  return mSource.GetInfo(aUniqueId, aOut);
+}
+
+bool TreeMirror::FetchChildIds(long aUniqueId, std::vector<long>& aOut) {
+  ++mStats.mSourceCalls;
+  aOut.clear();
+  return mSource.GetChildIds(aUniqueId, aOut);
+}
+
+bool TreeMirror::Build(long aRootId) {
+  mNodes.clear();
+  mPending.clear();
+  mRootId = aRootId;
+
+  MirrorNodeInfo info;
+  if (!FetchInfo(aRootId, info)) {
+    return false;
+  }
+  info.mParentId = kNoUniqueId;
+  AddSubtree(aRootId, info);
+  return true;
+}
+
+void TreeMirror::AddSubtree(long aUniqueId, const MirrorNodeInfo& aInfo) {
+  std::vector<std::pair<long, MirrorNodeInfo>> stack;
+  stack.emplace_back(aUniqueId, aInfo);
+
+  std::vector<long> childIds;
+  while (!stack.empty()) {
+    long id = stack.back().first;
+    Node& node = mNodes[id];
+    node.mUniqueId = id;
+    node.mInfo = std::move(stack.back().second);
+    node.mChildren.clear();
+    stack.pop_back();
+    ++mStats.mNodesAdded;
+
+    if (!FetchChildIds(id, childIds)) {
+      continue;
+    }
+
+    for (long childId : childIds) {
+      if (mNodes.count(childId)) {
+        // Already mirrored elsewhere; SyncChildren deals with moves.
+        continue;
+      }
+      MirrorNodeInfo childInfo;
+      if (!FetchInfo(childId, childInfo)) {
+        continue;
+      }
+      childInfo.mParentId = id;
+      node.mChildren.push_back(childId);
+      stack.emplace_back(childId, std::move(childInfo));
+    }
+  }
+}
+
+void TreeMirror::RemoveSubtree(long aUniqueId) {
+  std::vector<long> stack(1, aUniqueId);
+  while (!stack.empty()) {
+    long id = stack.back();
+    stack.pop_back();
+
+    auto it = mNodes.find(id);
+    if (it == mNodes.end()) {
+      continue;
+    }
+    stack.insert(stack.end(), it->second.mChildren.begin(),
+                 it->second.mChildren.end());
+    mNodes.erase(it);
+    ++mStats.mNodesRemoved;
+  }
+}
+
+void TreeMirror::DetachFromParent(long aUniqueId) {
+  auto it = mNodes.find(aUniqueId);
+  if (it == mNodes.end()) {
+    return;
+  }
+
+  auto parentIt = mNodes.find(it->second.mInfo.mParentId);
+  if (parentIt == mNodes.end()) {
+    return;
+  }
+
+  std::vector<long>& siblings = parentIt->second.mChildren;
+  siblings.erase(std::remove(siblings.begin(), siblings.end(), aUniqueId),
+                 siblings.end());
+}
+
+void TreeMirror::SyncChildren(long aUniqueId) {
+  if (!mNodes.count(aUniqueId)) {
+    return;
+  }
+
+  std::vector<long> childIds;
+  if (!FetchChildIds(aUniqueId, childIds)) {
+    // The node itself is gone.
+    DetachFromParent(aUniqueId);
+    RemoveSubtree(aUniqueId);
+    return;
+  }
+
+  std::unordered_set<long> current(childIds.begin(), childIds.end());
+  // Iterate over a copy; the list is replaced wholesale below.
+  std::vector<long> previous = mNodes[aUniqueId].mChildren;
+  for (long oldId : previous) {
+    if (current.count(oldId)) {
+      continue;
+    }
+    auto it = mNodes.find(oldId);
+    if (it != mNodes.end() && it->second.mInfo.mParentId == aUniqueId) {
+      RemoveSubtree(oldId);
+    }
+  }
+
+  std::vector<long> children;
+  children.reserve(childIds.size());
+  for (long childId : childIds) {
+    auto it = mNodes.find(childId);
+    if (it != mNodes.end()) {
+      if (it->second.mInfo.mParentId != aUniqueId) {
+        // Moved here from somewhere else in the tree.
+        DetachFromParent(childId);
+        it->second.mInfo.mParentId = aUniqueId;
+      }
+      children.push_back(childId);
+      continue;
+    }
+
+    MirrorNodeInfo info;
+    if (!FetchInfo(childId, info)) {
+      continue;
+    }
+    info.mParentId = aUniqueId;
+    AddSubtree(childId, info);
+    children.push_back(childId);
+  }
+
+  mNodes[aUniqueId].mChildren.swap(children);
+}
+
+void TreeMirror::RefreshInfo(long aUniqueId) {
+  auto it = mNodes.find(aUniqueId);
+  if (it == mNodes.end()) {
+    return;
+  }
+
+  MirrorNodeInfo info;
+  if (!FetchInfo(aUniqueId, info)) {
+    DetachFromParent(aUniqueId);
+    RemoveSubtree(aUniqueId);
+    return;
+  }
+
+  // Structure is only ever changed by SyncChildren.
+  info.mParentId = it->second.mInfo.mParentId;
+  it->second.mInfo = std::move(info);
+  ++mStats.mNodesRefreshed;
+}
+
+void TreeMirror::Enqueue(const MirrorEvent& aEvent) {
+  ++mStats.mEventsReceived;
+  mPending.push_back(aEvent);
+}
+
+void TreeMirror::ApplyPending(uint64_t aNowUs) {
+  std::vector<MirrorEvent> events;
+  events.swap(mPending);
+
+  std::unordered_set<EventKey, EventKeyHash> seen;
+  for (const MirrorEvent& event : events) {
+    uint64_t latency =
+        aNowUs > event.mTimestampUs ? aNowUs - event.mTimestampUs : 0;
+
+    if (!seen.insert(EventKey{event.mType, event.mUniqueId}).second) {
+      ++mStats.mEventsCoalesced;
+      continue;
+    }
+
+    auto it = mNodes.find(event.mUniqueId);
+    switch (event.mType) {
+      case MirrorEventType::Show: {
+        MirrorNodeInfo info;
+        if (!FetchInfo(event.mUniqueId, info)) {
+          ++mStats.mEventsIgnored;
+          continue;
+        }
+        if (mNodes.count(info.mParentId)) {
+          SyncChildren(info.mParentId);
+        } else if (it != mNodes.end()) {
+          RefreshInfo(event.mUniqueId);
+        } else {
+          ++mStats.mEventsIgnored;
+          continue;
+        }
+        break;
+      }
+      case MirrorEventType::Hide: {
+        if (it == mNodes.end()) {
+          ++mStats.mEventsIgnored;
+          continue;
+        }
+        long parentId = it->second.mInfo.mParentId;
+        if (mNodes.count(parentId)) {
+          SyncChildren(parentId);
+        } else {
+          RemoveSubtree(event.mUniqueId);
+        }
+        break;
+      }
+      case MirrorEventType::Reorder:
+        if (it == mNodes.end()) {
+          ++mStats.mEventsIgnored;
+          continue;
+        }
+        SyncChildren(event.mUniqueId);
+        break;
+      case MirrorEventType::NameChange:
+      case MirrorEventType::StateChange:
+        if (it == mNodes.end()) {
+          ++mStats.mEventsIgnored;
+          continue;
+        }
+        RefreshInfo(event.mUniqueId);
+        break;
+      default:
+        ++mStats.mEventsIgnored;
+        continue;
+    }
+
+    ++mStats.mEventsApplied;
+    mStats.mTotalLatencyUs += latency;
+    mStats.mMaxLatencyUs = std::max(mStats.mMaxLatencyUs, latency);
+  }
+}
+
+const TreeMirror::Node* TreeMirror::Find(long aUniqueId) const {
+  auto it = mNodes.find(aUniqueId);
+  if (it == mNodes.end()) {
+    return nullptr;
+  }
+  return &it->second;
+}
+
+void TreeMirror::FindRole(long aRole, std::vector<long>& aOut) const {
+  aOut.clear();
+
+  std::vector<long> stack(1, mRootId);
+  while (!stack.empty()) {
+    const Node* node = Find(stack.back());
+    stack.pop_back();
+    if (!node) {
+      continue;
+    }
+    if (node->mInfo.mRole == aRole) {
+      aOut.push_back(node->mUniqueId);
+    }
+    stack.insert(stack.end(), node->mChildren.rbegin(),
+                 node->mChildren.rend());
+  }
+}
+
+size_t TreeMirror::CountDifferences(const TreeMirror& aOther) const {
+  size_t result = 0;
+
+  for (const auto& entry : mNodes) {
+    const Node& mine = entry.second;
+    const Node* theirs = aOther.Find(entry.first);
+    if (!theirs || mine.mInfo.mParentId != theirs->mInfo.mParentId ||
+        mine.mInfo.mRole != theirs->mInfo.mRole ||
+        mine.mInfo.mState != theirs->mInfo.mState ||
+        mine.mInfo.mName != theirs->mInfo.mName ||
+        mine.mChildren != theirs->mChildren) {
+      ++result;
+    }
+  }
+
+  for (const auto& entry : aOther.mNodes) {
+    if (!Find(entry.first)) {
+      ++result;
+    }
+  }
+
+  return result;
+}
+
+}  // namespace aspk
@@ -0,0 +1,338 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "TreeSnapshot.h"
+
+#include <string.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace aspk {
+
+SnapshotWriter::~SnapshotWriter() {
+  if (mStrings) {
+    fclose(mStrings);
+  }
+}
+
+bool SnapshotWriter::Begin(FILE* aOut) {
+  if (mOut || !aOut) {
+    return false;
+  }
+
+  mStrings = tmpfile();
+  if (!mStrings) {
+    return false;
+  }
+
+  // Reserve space for the header; Finish fills it in.
+  SnapshotHeader header = {};
+  if (fwrite(&header, sizeof(header), 1, aOut) != 1) {
+    return false;
+  }
+
+  mOut = aOut;
+  return true;
+}
+
+bool SnapshotWriter::InternString(const std::string& aStr,
+                                  uint32_t& aOutOffset) {
+  auto it = mInterned.find(aStr);
+  if (it != mInterned.end()) {
+    ++mInternHits;
+    aOutOffset = it->second;
+    return true;
+  }
+
+  // Offsets and lengths are 32-bit in the file format.
+  if (mStringsSize + aStr.size() + 1 >= kNoSnapshotString) {
+    return false;
+  }
+
+  if (fwrite(aStr.c_str(), 1, aStr.size() + 1, mStrings) != aStr.size() + 1) {
+    return false;
+  }
+
+  aOutOffset = static_cast<uint32_t>(mStringsSize);
+  mStringsSize += aStr.size() + 1;
+
+  if (mInterned.size() < kMaxInternedStrings) {
+    mInterned.emplace(aStr, aOutOffset);
+  }
+  return true;
+}
+
+bool SnapshotWriter::AddNode(const SnapshotNodeInfo& aInfo, uint32_t aParent,
+                             uint32_t aChildCount, uint32_t& aOutFirstChild) {
+  if (!mOut || mNodeCount >= mNextFree) {
+    // Either Begin failed or this node was never reserved by a parent.
+    return false;
+  }
+  if ((aParent == kNoSnapshotNode) != !mNodeCount ||
+      (aParent != kNoSnapshotNode && aParent >= mNodeCount)) {
+    return false;
+  }
+  if (mNextFree + aChildCount >= kNoSnapshotNode) {
+    return false;
+  }
+
+  SnapshotNode node = {};
+  node.mRole = aInfo.mRole;
+  node.mState = aInfo.mState;
+  node.mIA2States = aInfo.mIA2States;
+  node.mUniqueId = aInfo.mUniqueId;
+  node.mParent = aParent;
+  node.mFirstChild = static_cast<uint32_t>(mNextFree);
+  node.mChildCount = aChildCount;
+  node.mNameOffset = kNoSnapshotString;
+  if (aInfo.mHasName) {
+    if (!InternString(aInfo.mName, node.mNameOffset)) {
+      return false;
+    }
+    node.mNameLength = static_cast<uint32_t>(aInfo.mName.size());
+  }
+
+  if (fwrite(&node, sizeof(node), 1, mOut) != 1) {
+    return false;
+  }
+
+  aOutFirstChild = node.mFirstChild;
+  mNextFree += aChildCount;
+  ++mNodeCount;
+  return true;
+}
+
+bool SnapshotWriter::Finish() {
+  if (!mOut || mNodeCount != mNextFree) {
+    return false;
+  }
+
+  SnapshotHeader header = {};
+  memcpy(header.mMagic, kSnapshotMagic, sizeof(header.mMagic));
+  header.mVersion = kSnapshotVersion;
+  header.mEndianMark = kSnapshotEndianMark;
+  header.mNodeSize = sizeof(SnapshotNode);
+  header.mNodeCount = mNodeCount;
+  header.mNodesOffset = sizeof(SnapshotHeader);
+  header.mStringsOffset =
+      header.mNodesOffset + mNodeCount * sizeof(SnapshotNode);
+  header.mStringsSize = mStringsSize;
+
+  rewind(mStrings);
+  char buf[64 * 1024];
+  size_t read;
+  while ((read = fread(buf, 1, sizeof(buf), mStrings)) > 0) {
+    if (fwrite(buf, 1, read, mOut) != read) {
+      return false;
+    }
+  }
+  if (ferror(mStrings)) {
+    return false;
+  }
+
+  if (fseek(mOut, 0, SEEK_SET) ||
+      fwrite(&header, sizeof(header), 1, mOut) != 1 || fflush(mOut)) {
+    return false;
+  }
+
+  fclose(mStrings);
+  mStrings = nullptr;
+  mOut = nullptr;
+  mInterned.clear();
+  return true;
+}
+
+bool SnapshotView::Init(const void* aData, size_t aSize) {
+  mHeader = nullptr;
+  mNodes = nullptr;
+  mStrings = nullptr;
+  mStringsSize = 0;
+
+  if (!aData || aSize < sizeof(SnapshotHeader)) {
+    return false;
+  }
+
+  auto header = static_cast<const SnapshotHeader*>(aData);
+  if (memcmp(header->mMagic, kSnapshotMagic, sizeof(header->mMagic)) ||
+      header->mVersion != kSnapshotVersion ||
+      header->mEndianMark != kSnapshotEndianMark ||
+      header->mNodeSize != sizeof(SnapshotNode)) {
+    return false;
+  }
+
+  if (header->mNodesOffset != sizeof(SnapshotHeader) ||
+      header->mNodeCount >
+          (aSize - header->mNodesOffset) / sizeof(SnapshotNode)) {
+    return false;
+  }
+  uint64_t nodesEnd =
+      header->mNodesOffset + header->mNodeCount * sizeof(SnapshotNode);
+  if (header->mStringsOffset != nodesEnd ||
+      header->mStringsSize > aSize - nodesEnd) {
+    return false;
+  }
+
+  auto bytes = static_cast<const char*>(aData);
+  mHeader = header;
+  mNodes = reinterpret_cast<const SnapshotNode*>(bytes + header->mNodesOffset);
+  mStrings = bytes + header->mStringsOffset;
+  mStringsSize = header->mStringsSize;
+  return true;
+}
+
+bool SnapshotView::Validate() const {
+  if (!mHeader) {
+    return false;
+  }
+
+  const uint64_t count = mHeader->mNodeCount;
+  for (uint64_t i = 0; i < count; ++i) {
+    const SnapshotNode& node = mNodes[i];
+
+    if (i ? node.mParent >= i : node.mParent != kNoSnapshotNode) {
+      // Breadth-first order puts every parent before its children.
+      return false;
+    }
+
+    if (node.mFirstChild > count ||
+        node.mChildCount > count - node.mFirstChild) {
+      return false;
+    }
+    for (uint32_t c = 0; c < node.mChildCount; ++c) {
+      if (mNodes[node.mFirstChild + c].mParent != i) {
+        return false;
+      }
+    }
+
+    if (node.mNameOffset != kNoSnapshotString &&
+        (node.mNameOffset >= mStringsSize ||
+         node.mNameLength >= mStringsSize - node.mNameOffset ||
+         mStrings[node.mNameOffset + node.mNameLength])) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+const char* SnapshotView::Name(const SnapshotNode& aNode) const {
+  if (aNode.mNameOffset == kNoSnapshotString) {
+    return nullptr;
+  }
+  return mStrings + aNode.mNameOffset;
+}
+
+#if defined(_WIN32)
+
+bool MappedSnapshot::Open(const SnapshotPathChar* aPath) {
+  Close();
+
+  HANDLE file = ::CreateFileW(aPath, GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  mFile = file;
+
+  LARGE_INTEGER size;
+  if (!::GetFileSizeEx(file, &size) || !size.QuadPart ||
+      static_cast<unsigned long long>(size.QuadPart) > SIZE_MAX) {
+    Close();
+    return false;
+  }
+
+  mMapping = ::CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mMapping) {
+    Close();
+    return false;
+  }
+
+  mData = ::MapViewOfFile(mMapping, FILE_MAP_READ, 0, 0, 0);
+  if (!mData) {
+    Close();
+    return false;
+  }
+  mSize = static_cast<size_t>(size.QuadPart);
+
+  if (!mView.Init(mData, mSize)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void MappedSnapshot::Close() {
+  mView = SnapshotView();
+  if (mData) {
+    ::UnmapViewOfFile(mData);
+    mData = nullptr;
+  }
+  if (mMapping) {
+    ::CloseHandle(mMapping);
+    mMapping = nullptr;
+  }
+  if (mFile) {
+    ::CloseHandle(mFile);
+    mFile = nullptr;
+  }
+  mSize = 0;
+}
+
+#else
+
+bool MappedSnapshot::Open(const SnapshotPathChar* aPath) {
+  Close();
+
+  mFd = open(aPath, O_RDONLY);
+  if (mFd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(mFd, &st) || st.st_size <= 0) {
+    Close();
+    return false;
+  }
+
+  void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                    MAP_PRIVATE, mFd, 0);
+  if (data == MAP_FAILED) {
+    Close();
+    return false;
+  }
+  mData = data;
+  mSize = static_cast<size_t>(st.st_size);
+
+  if (!mView.Init(mData, mSize)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void MappedSnapshot::Close() {
+  mView = SnapshotView();
+  if (mData) {
+    munmap(const_cast<void*>(mData), mSize);
+    mData = nullptr;
+  }
+  if (mFd >= 0) {
+    close(mFd);
+    mFd = -1;
+  }
+  mSize = 0;
+}
+
+#endif
+
+}  // namespace aspk
@@ -10,35 +10,177 @@
 #include "winselect.h"
 #include "ArrayLength.h"
 #include "Accessible2.h"
+#include "ComCall.h"
+#include "ComHandles.h"
+#include "AccBackend.h"
+#include "AccessibleApplication.h"
+#include "BenchReport.h"
+#include "BenchStats.h"
+#include "IpcAccounting.h"
+#include "LiveCount.h"
+#include "IA2Attributes.h"
+#include "ChildFetch.h"
+#include "OutputSink.h"
+#include "ParallelWalk.h"
+#include "ProcessWalk.h"
+#include "PropertyCosts.h"
 #include "Registration.h"
+#include "RoleIndex.h"
+#include "ScreenRect.h"
+#include "Selector.h"
+#include "TreeBench.h"
+#include "TreeDiff.h"
+#include "TreeMirror.h"
+#include "Trace.h"
+#include "TreeSnapshot.h"
+#include "TreeWalk.h"
+#include "Utf8.h"
 
 #include <oleacc.h>
 #include <comdef.h>
+#include <psapi.h>
 
-#include <deque>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 using namespace std;
+using aspk::AccProperty;
+using aspk::ChildStrategy;
+using aspk::ChildStrategyName;
+using aspk::TraversalCounters;
+
+// log() records into the binary trace started by -trace <file>; it costs a
+// single load while tracing is off. tracedecode turns the trace into text.
+#define log(...) ASPK_TRACE(__VA_ARGS__)
+
+static const wchar_t* gTracePath;
+
+// Print writes through gOutputSink, which moves console I/O onto a background
+// thread so that it stays out of the timed traversals. Anything that writes to
+// stdout directly must go through SyncStdout() so that it lands after whatever
+// has been printed so far, and anything the user must see straight away, such
+// as a prompt before a wait, must go through Prompt().
+static aspk::AsyncOutputSink gOutputSink;
+static bool gSyncOutput;
+
+static FILE* SyncStdout() {
+  gOutputSink.Flush();
+  return stdout;
+}
 
-#if defined(DEBUG_LOG)
-#  define log printf
-#else
-#  define log(fmt, ...)
-#endif
+// With -exclude-output-time, every thread adds the time it spends in Print
+// here so that benchmarks can subtract it.
+static bool gExcludeOutputTime;
+static atomic<uint64_t> gOutputNs;
+
+// When set, Print appends to this buffer instead of writing to stdout. Parallel
+// walks use it to collect each node's output for merging in document order.
+static thread_local string* tOutputBuffer;
+
+class AutoRedirectOutput {
+ public:
+  explicit AutoRedirectOutput(string& aBuffer) : mPrev(tOutputBuffer) {
+    tOutputBuffer = &aBuffer;
+  }
+
+  ~AutoRedirectOutput() { tOutputBuffer = mPrev; }
+
+ private:
+  string* mPrev;
+};
+
+static void VPrint(const char* aFmt, va_list aArgs) {
+  chrono::steady_clock::time_point start;
+  if (gExcludeOutputTime) {
+    start = chrono::steady_clock::now();
+  }
+
+  va_list args;
+  va_copy(args, aArgs);
+
+  va_list argsCopy;
+  va_copy(argsCopy, args);
+  char stackBuf[512];
+  int len = vsnprintf(stackBuf, ArrayLength(stackBuf), aFmt, argsCopy);
+  va_end(argsCopy);
+
+  if (len > 0) {
+    const char* formatted = stackBuf;
+    string heapBuf;
+    if (static_cast<size_t>(len) >= ArrayLength(stackBuf)) {
+      heapBuf.resize(len + 1);
+      vsnprintf(&heapBuf[0], len + 1, aFmt, args);
+      formatted = heapBuf.c_str();
+    }
+
+    if (tOutputBuffer) {
+      tOutputBuffer->append(formatted, len);
+    } else {
+      gOutputSink.Write(formatted, len);
+    }
+  }
+
+  va_end(args);
+
+  if (gExcludeOutputTime) {
+    auto elapsed = chrono::steady_clock::now() - start;
+    gOutputNs.fetch_add(
+        chrono::duration_cast<chrono::nanoseconds>(elapsed).count(),
+        memory_order_relaxed);
+  }
+}
+
+static void Print(const char* aFmt, ...) {
+  va_list args;
+  va_start(args, aFmt);
+  VPrint(aFmt, args);
+  va_end(args);
+}
+
+// Prints something the user must see before the tool goes on, such as a
+// prompt to interact with the target during a wait. Print holds output back
+// until a whole chunk fills up.
+static void Prompt(const char* aFmt, ...) {
+  va_list args;
+  va_start(args, aFmt);
+  VPrint(aFmt, args);
+  va_end(args);
+  SyncStdout();
+}
+
+// Returns how much of a timed interval that began when gOutputNs read
+// aStartNs was spent printing, spread across aThreads threads. Returns 0
+// unless -exclude-output-time was given.
+static double OutputMsSince(uint64_t aStartNs, unsigned int aThreads = 1) {
+  if (!gExcludeOutputTime) {
+    return 0.0;
+  }
+  uint64_t ns = gOutputNs.load(memory_order_relaxed) - aStartNs;
+  return static_cast<double>(ns) / 1e6 / aThreads;
+}
 
 DEFINE_GUID(IID_IAccessible2, 0xE89F726E, 0xC4F4, 0x4c19, 0xBB, 0x19, 0xB6,
             0x47, 0xD7, 0xFA, 0x84, 0x78);
 _COM_SMARTPTR_TYPEDEF(IAccessible2, IID_IAccessible2);
 
+DEFINE_GUID(IID_IAccessibleApplication, 0xD49DED83, 0x5B25, 0x43F4, 0x9B, 0x95,
+            0x93, 0xB4, 0x45, 0x95, 0x97, 0x9E);
+_COM_SMARTPTR_TYPEDEF(IAccessibleApplication, IID_IAccessibleApplication);
+
 #define HRCHECK(msg)                          \
   if (FAILED(hr)) {                           \
-    printf("%s, HRESULT == 0x%08X", msg, hr); \
+    Print("%s, HRESULT == 0x%08X", msg, hr);  \
     return false;                             \
   }
 
@@ -159,20 +301,20 @@ IAccessiblePtr GetParent(IAccessiblePtr& aAcc) {
   IAccessiblePtr result;
 
   IDispatchPtr disp;
-  HRESULT hr = aAcc->get_accParent(&disp);
+  HRESULT hr = A11Y_CALL(get_accParent, aAcc, &disp);
   if (FAILED(hr)) {
     return result;
   }
 
-  disp->QueryInterface(IID_IAccessible, (void**)&result);
-  printf("GetParent aAcc: 0x%p, parent: 0x%p\n", aAcc.GetInterfacePtr(),
-         result.GetInterfacePtr());
+  A11Y_CALL(QueryInterface, disp, IID_IAccessible, (void**)&result);
+  Print("GetParent aAcc: 0x%p, parent: 0x%p\n", aAcc.GetInterfacePtr(),
+        result.GetInterfacePtr());
   return result;
 }
 
 IAccessiblePtr GetAcc(IAccessible2Ptr& aAcc2) {
   IAccessiblePtr acc;
-  HRESULT hr = aAcc2->QueryInterface(IID_IAccessible, (void**)&acc);
+  HRESULT hr = A11Y_CALL(QueryInterface, aAcc2, IID_IAccessible, (void**)&acc);
   if (FAILED(hr)) {
     return nullptr;
   }
@@ -181,7 +323,8 @@ IAccessiblePtr GetAcc(IAccessible2Ptr& aAcc2) {
 
 IServiceProviderPtr GetServiceProvider(IAccessiblePtr& aAcc) {
   IServiceProviderPtr svcProv;
-  HRESULT hr = aAcc->QueryInterface(IID_IServiceProvider, (void**)&svcProv);
+  HRESULT hr = A11Y_CALL(QueryInterface, aAcc, IID_IServiceProvider,
+                         (void**)&svcProv);
   if (FAILED(hr)) {
     return nullptr;
   }
@@ -192,104 +335,238 @@ IServiceProviderPtr GetServiceProvider(IAccessiblePtr& aAcc) {
 
 IAccessible2Ptr GetIA2(IServiceProviderPtr& aSvcProv) {
   IAccessible2Ptr acc2;
-  HRESULT hr =
-      aSvcProv->QueryService(IID_IAccessible2, IID_IAccessible2, (void**)&acc2);
+  HRESULT hr = A11Y_CALL(QueryService, aSvcProv, IID_IAccessible2,
+                         IID_IAccessible2, (void**)&acc2);
   if (FAILED(hr)) {
-    printf("QueryService(IID_IAccessible2) failed with hr 0x%08X\n", hr);
-    printf("\t(Is accessibility disabled in prefs?)\n");
+    Print("QueryService(IID_IAccessible2) failed with hr 0x%08X\n", hr);
+    Print("\t(Is accessibility disabled in prefs?)\n");
     return nullptr;
   }
   log("IAccessible2: 0x%p\n", acc2.GetInterfacePtr());
   return acc2;
 }
 
-IAccessible2Ptr GetIA2(IAccessiblePtr& aAcc) {
-  if (!aAcc) {
-    return nullptr;
+// Counts the QueryInterface(IServiceProvider) and QueryService(IAccessible2)
+// calls made through AccNode, and the ones its cache made unnecessary.
+struct InterfaceCacheStats {
+  atomic<uint64_t> mCalls{0};
+  atomic<uint64_t> mSaved{0};
+
+  void Reset() {
+    mCalls = 0;
+    mSaved = 0;
   }
-  IServiceProviderPtr svcProv(GetServiceProvider(aAcc));
-  if (!svcProv) {
-    return nullptr;
+};
+
+static InterfaceCacheStats gInterfaceCache;
+
+// The remote objects that AccNodes hold references to. Each pins a proxy
+// here and the object it stands for in the target process.
+static aspk::LiveCount gLiveProxies;
+
+static void PrintInterfaceCacheStats() {
+  Print("\tinterface cache: %llu QI/QueryService calls made, %llu saved\n",
+        gInterfaceCache.mCalls.load(), gInterfaceCache.mSaved.load());
+}
+
+/**
+ * A handle to an accessible that resolves its IServiceProvider and
+ * IAccessible2 at most once, however many times and from however many
+ * threads they are asked for. Copies share the cache.
+ *
+ * Nodes produced by a traversal also remember the node they were reached
+ * from, so that looking up their parent can reuse the parent's interfaces.
+ */
+class AccNode {
+ public:
+  AccNode() = default;
+  explicit AccNode(const IAccessiblePtr& aAcc)
+      : mCache(aAcc ? make_shared<Cache>(aAcc) : nullptr) {}
+
+  // Returns a node for aAcc, which was reached as a child of this node.
+  AccNode MakeChild(const IAccessiblePtr& aAcc) const {
+    AccNode child(aAcc);
+    child.mParent = mCache;
+    return child;
+  }
+
+  // Returns a node for aAcc, which was reached as a sibling of this node.
+  AccNode MakeSibling(const IAccessiblePtr& aAcc) const {
+    AccNode sibling(aAcc);
+    sibling.mParent = mParent;
+    return sibling;
+  }
+
+  explicit operator bool() const { return !!mCache; }
+
+  IAccessible* operator->() const { return mCache->mAcc.GetInterfacePtr(); }
+
+  IAccessible* GetInterfacePtr() const {
+    return mCache ? mCache->mAcc.GetInterfacePtr() : nullptr;
+  }
+
+  IAccessiblePtr& Acc() const { return mCache->mAcc; }
+
+  // The node this one was reached from by a traversal, if any.
+  AccNode TraversalParent() const {
+    AccNode parent;
+    parent.mCache = mParent;
+    return parent;
+  }
+
+  IServiceProviderPtr ServiceProvider() const {
+    if (!mCache) {
+      return nullptr;
+    }
+    lock_guard<mutex> lock(mCache->mLock);
+    return ResolveServiceProvider();
+  }
+
+  IAccessible2Ptr IA2() const {
+    if (!mCache) {
+      return nullptr;
+    }
+    lock_guard<mutex> lock(mCache->mLock);
+    if (mCache->mResolvedIA2) {
+      // Saved the QueryInterface, and the QueryService if it was reached.
+      gInterfaceCache.mSaved += mCache->mServiceProvider ? 2 : 1;
+      return mCache->mIA2;
+    }
+    IServiceProviderPtr svcProv(ResolveServiceProvider());
+    if (svcProv) {
+      ++gInterfaceCache.mCalls;
+      mCache->mIA2 = GetIA2(svcProv);
+    }
+    mCache->mResolvedIA2 = true;
+    return mCache->mIA2;
+  }
+
+ private:
+  struct Cache {
+    explicit Cache(const IAccessiblePtr& aAcc) : mAcc(aAcc) {
+      gLiveProxies.Add();
+    }
+    ~Cache() { gLiveProxies.Remove(); }
+
+    IAccessiblePtr mAcc;
+    mutex mLock;  // Guards everything below
+    bool mResolvedServiceProvider = false;
+    bool mResolvedIA2 = false;
+    IServiceProviderPtr mServiceProvider;
+    IAccessible2Ptr mIA2;
+  };
+
+  // Called with mCache->mLock held.
+  IServiceProviderPtr ResolveServiceProvider() const {
+    if (mCache->mResolvedServiceProvider) {
+      ++gInterfaceCache.mSaved;
+      return mCache->mServiceProvider;
+    }
+    ++gInterfaceCache.mCalls;
+    mCache->mServiceProvider = GetServiceProvider(mCache->mAcc);
+    mCache->mResolvedServiceProvider = true;
+    return mCache->mServiceProvider;
   }
 
-  return GetIA2(svcProv);
+  shared_ptr<Cache> mCache;
+  shared_ptr<Cache> mParent;
+};
+
+// Returns aNode's parent as reported by get_accParent. When that is the node
+// the traversal came from, its already resolved interfaces are reused.
+static AccNode GetParent(const AccNode& aNode) {
+  IAccessiblePtr parent = GetParent(aNode.Acc());
+  if (!parent) {
+    return AccNode();
+  }
+  AccNode known = aNode.TraversalParent();
+  if (known && known.GetInterfacePtr() == parent.GetInterfacePtr()) {
+    return known;
+  }
+  return AccNode(parent);
 }
 
 HRESULT
-GetUniqueId(IAccessiblePtr& aAcc, long& aOutUniqueId) {
-  IAccessible2Ptr acc2(GetIA2(aAcc));
+GetUniqueId(const AccNode& aAcc, long& aOutUniqueId) {
+  IAccessible2Ptr acc2(aAcc.IA2());
   if (!acc2) {
     return E_FAIL;
   }
-  HRESULT hr = acc2->get_uniqueID(&aOutUniqueId);
+  HRESULT hr = A11Y_CALL(get_uniqueID, acc2, &aOutUniqueId);
   if (SUCCEEDED(hr)) {
-    printf("GetUniqueId aAcc: 0x%p, UniqueID: %d\n", aAcc.GetInterfacePtr(),
-           aOutUniqueId);
+    Print("GetUniqueId aAcc: 0x%p, UniqueID: %d\n", aAcc.GetInterfacePtr(),
+          aOutUniqueId);
   }
   return hr;
 }
 
 HRESULT
-GetWindowHandle(IAccessiblePtr& aAcc, HWND& aOutHwnd) {
-  IAccessible2Ptr acc2(GetIA2(aAcc));
+GetWindowHandle(const AccNode& aAcc, HWND& aOutHwnd) {
+  IAccessible2Ptr acc2(aAcc.IA2());
   if (!acc2) {
     return E_FAIL;
   }
-  HRESULT hr = acc2->get_windowHandle(&aOutHwnd);
+  HRESULT hr = A11Y_CALL(get_windowHandle, acc2, &aOutHwnd);
   if (SUCCEEDED(hr)) {
-    printf("GetWindowHandle aAcc: 0x%p, HWND: 0x%p\n", aAcc.GetInterfacePtr(),
-           aOutHwnd);
+    Print("GetWindowHandle aAcc: 0x%p, HWND: 0x%p\n", aAcc.GetInterfacePtr(),
+          aOutHwnd);
   }
   return hr;
 }
 
 HRESULT
-GetParentUniqueId(IAccessiblePtr& aAcc, long& aOutUniqueId) {
+GetParentUniqueId(const AccNode& aAcc, long& aOutUniqueId) {
+  aspk::AutoIpcOperation op(aspk::IpcOperation::GetParentUniqueId);
   if (!aAcc) {
     return E_INVALIDARG;
   }
-  IAccessiblePtr parent = GetParent(aAcc);
+  AccNode parent = GetParent(aAcc);
   if (!parent) {
     return E_FAIL;
   }
   return GetUniqueId(parent, aOutUniqueId);
 }
 
-void DumpAccInfo(const long aIndex, IAccessiblePtr& aAcc) {
+void DumpAccInfo(const long aIndex, const AccNode& aAcc) {
+  aspk::AutoIpcOperation op(aspk::IpcOperation::DumpAccInfo);
   long parentUniqueId;
   HRESULT hr = GetParentUniqueId(aAcc, parentUniqueId);
   if (FAILED(hr)) {
     return;
   }
 
-  VARIANT varChildSelf;
-  VariantInit(&varChildSelf);
-  varChildSelf.vt = VT_I4;
-  varChildSelf.lVal = CHILDID_SELF;
+  aspk::AutoVariant varChildSelf(CHILDID_SELF);
 
-  BSTR bstr;
-  hr = aAcc->get_accName(varChildSelf, &bstr);
+  aspk::AutoBstr bstr;
+  hr = A11Y_CALL(get_accName, aAcc, varChildSelf.Get(), bstr.Receive());
   if (FAILED(hr)) {
     return;
   }
 
-  VARIANT varRole;
-  hr = aAcc->get_accRole(varChildSelf, &varRole);
+  aspk::AutoVariant varRole;
+  hr = A11Y_CALL(get_accRole, aAcc, varChildSelf.Get(), varRole.Receive());
   if (FAILED(hr)) {
     return;
   }
-  if (varRole.vt != VT_I4) {
+  long role;
+  if (!varRole.GetLong(role)) {
     return;
   }
 
-  printf("Child %d: 0x%p, \"%S\", parent uniqueid is %d, role is 0x%X\n",
-         aIndex, aAcc.GetInterfacePtr(), bstr, parentUniqueId, varRole.lVal);
+  Print("Child %d: 0x%p, \"%S\", parent uniqueid is %d, role is 0x%X\n",
+        aIndex, aAcc.GetInterfacePtr(), bstr.Get(), parentUniqueId, role);
 }
 
-void DumpAccInfo(IAccessiblePtr& aAcc) {
-  IAccessiblePtr parent = GetParent(aAcc);
-  IAccessible2Ptr parent2 = GetIA2(parent);
-  IAccessible2Ptr acc2 = GetIA2(aAcc);
+void DumpAccInfo(const AccNode& aAcc) {
+  aspk::AutoIpcOperation op(aspk::IpcOperation::DumpAccInfo);
+  AccNode parent;
+  IAccessible2Ptr parent2;
+  {
+    aspk::AutoIpcOperation parentOp(aspk::IpcOperation::GetParentUniqueId);
+    parent = GetParent(aAcc);
+    parent2 = parent.IA2();
+  }
+  IAccessible2Ptr acc2 = aAcc.IA2();
 
   log("BEGIN DumpAccInfo for 0x%p\n", aAcc.GetInterfacePtr());
   HRESULT hr = E_FAIL;
@@ -297,7 +574,8 @@ void DumpAccInfo(IAccessiblePtr& aAcc) {
   log("BEGIN GetParentUniqueId for 0x%p\n", aAcc.GetInterfacePtr());
   long parentUniqueId;
   if (parent2) {
-    hr = parent2->get_uniqueID(&parentUniqueId);
+    aspk::AutoIpcOperation parentOp(aspk::IpcOperation::GetParentUniqueId);
+    hr = A11Y_CALL(get_uniqueID, parent2, &parentUniqueId);
   }
   bool parentUidValid = SUCCEEDED(hr);
   log("END GetParentUniqueId for 0x%p\n", aAcc.GetInterfacePtr());
@@ -306,79 +584,78 @@ void DumpAccInfo(IAccessiblePtr& aAcc) {
   hr = E_FAIL;
   long uniqueId;
   if (acc2) {
-    hr = acc2->get_uniqueID(&uniqueId);
+    hr = A11Y_CALL(get_uniqueID, acc2, &uniqueId);
   }
   bool uidValid = SUCCEEDED(hr);
   if (acc2 && !uidValid) {
-    printf("ERROR GetUniqueId for 0x%p failed with code 0x%08X\n",
-           acc2.GetInterfacePtr(), hr);
+    Print("ERROR GetUniqueId for 0x%p failed with code 0x%08X\n",
+          acc2.GetInterfacePtr(), hr);
   }
   log("END GetUniqueId for 0x%p\n", aAcc.GetInterfacePtr());
 
   HWND hwnd;
   if (acc2) {
-    hr = acc2->get_windowHandle(&hwnd);
+    hr = A11Y_CALL(get_windowHandle, acc2, &hwnd);
     if (SUCCEEDED(hr)) {
-      printf("HWND for 0x%p is 0x%p\n", acc2.GetInterfacePtr(), hwnd);
+      Print("HWND for 0x%p is 0x%p\n", acc2.GetInterfacePtr(), hwnd);
     } else {
-      printf("ERROR get_windowHandle for 0x%p failed with code 0x%08X\n",
-             acc2.GetInterfacePtr(), hr);
+      Print("ERROR get_windowHandle for 0x%p failed with code 0x%08X\n",
+            acc2.GetInterfacePtr(), hr);
     }
   }
 
-  VARIANT varChildSelf;
-  VariantInit(&varChildSelf);
-  varChildSelf.vt = VT_I4;
-  varChildSelf.lVal = CHILDID_SELF;
+  aspk::AutoVariant varChildSelf(CHILDID_SELF);
 
-  BSTR bstr;
-  hr = aAcc->get_accName(varChildSelf, &bstr);
+  aspk::AutoBstr bstr;
+  hr = A11Y_CALL(get_accName, aAcc, varChildSelf.Get(), bstr.Receive());
   if (FAILED(hr)) {
-    printf("get_accName\n");
+    Print("get_accName\n");
     return;
   }
 
-  VARIANT varRole;
-  hr = aAcc->get_accRole(varChildSelf, &varRole);
+  aspk::AutoVariant varRole;
+  hr = A11Y_CALL(get_accRole, aAcc, varChildSelf.Get(), varRole.Receive());
   if (FAILED(hr)) {
-    printf("get_accRole\n");
+    Print("get_accRole\n");
     return;
   }
-  if (varRole.vt != VT_I4) {
-    printf("varRole.vt == VT_I4\n");
+  long role;
+  if (!varRole.GetLong(role)) {
+    Print("varRole.vt == VT_I4\n");
     return;
   }
 
-  printf("0x%p, parent is 0x%p, \"%S\", role is 0x%X", aAcc.GetInterfacePtr(),
-         parent.GetInterfacePtr(), bstr, varRole.lVal);
+  Print("0x%p, parent is 0x%p, \"%S\", role is 0x%X", aAcc.GetInterfacePtr(),
+        parent.GetInterfacePtr(), bstr.Get(), role);
   if (uidValid) {
-    printf(", uniqueId is %d", uniqueId);
+    Print(", uniqueId is %d", uniqueId);
   }
   if (parentUidValid) {
-    printf(", parentUniqueId is %d", parentUniqueId);
+    Print(", parentUniqueId is %d", parentUniqueId);
   }
-  printf("\n");
+  Print("\n");
   log("END DumpAccInfo for 0x%p\n", aAcc.GetInterfacePtr());
 }
 
 IAccessiblePtr Navigate(IAccessiblePtr& aAcc, long aNavDir) {
-  VARIANT varStart, varOut;
-  VariantInit(&varStart);
-  varStart.vt = VT_I4;
-  varStart.lVal = CHILDID_SELF;
+  aspk::AutoIpcOperation op(aspk::IpcOperation::Navigate);
+  aspk::AutoVariant varStart(CHILDID_SELF);
+  aspk::AutoVariant varOut;
 
   IAccessiblePtr result;
 
-  HRESULT hr = aAcc->accNavigate(aNavDir, varStart, &varOut);
+  HRESULT hr =
+      A11Y_CALL(accNavigate, aAcc, aNavDir, varStart.Get(), varOut.Receive());
   if (FAILED(hr)) {
     return result;
   }
 
-  if (varOut.vt != VT_DISPATCH) {
+  IDispatch* disp = varOut.GetDispatch();
+  if (!disp) {
     return result;
   }
 
-  varOut.pdispVal->QueryInterface(IID_IAccessible, (void**)&result);
+  A11Y_CALL(QueryInterface, disp, IID_IAccessible, (void**)&result);
   return result;
 }
 
@@ -390,470 +667,2427 @@ IAccessiblePtr GetNextSibling(IAccessiblePtr& aAcc) {
   return Navigate(aAcc, NAVDIR_NEXT);
 }
 
-void DoDfs(IAccessiblePtr& aAcc) {
-  const unsigned int kMaxLevel = 0xFFFFFFFF;
-  unsigned int curLevel = 0;
+static ChildStrategy gChildStrategy = ChildStrategy::Navigate;
+static TraversalCounters gCounters;
+// Children requested per IEnumVARIANT::Next by bulk traversals; set by -batch.
+static size_t gBatchSize = aspk::kMaxChildChunk;
+static bool gBatchSizeSet;
 
-  std::deque<IAccessiblePtr> q;
-  q.push_front(aAcc);
+static const ChildStrategy kAllChildStrategies[] = {ChildStrategy::Navigate,
+                                                    ChildStrategy::Bulk};
 
-  while (!q.empty()) {
-    IAccessiblePtr acc = q.front();
-    q.pop_front();
-    DumpAccInfo(acc);
-    if (curLevel < kMaxLevel) {
-      IAccessiblePtr nextAcc = GetFirstChild(acc);
-      while (nextAcc) {
-        q.push_front(nextAcc);
-        nextAcc = GetNextSibling(nextAcc);
-      }
-      ++curLevel;
-    }
-  }
-}
+static const wchar_t* kChildStrategyNames[] = {L"navigate", L"bulk"};
 
-static bool IsVisibleState(const long aState) {
-  return (aState & (STATE_SYSTEM_INVISIBLE | STATE_SYSTEM_OFFSCREEN)) == 0;
-}
+static_assert(ArrayLength(kAllChildStrategies) ==
+                  ArrayLength(kChildStrategyNames),
+              "Update kChildStrategyNames!");
 
-static bool IsVisible(IAccessiblePtr aAcc) {
-  const VARIANT kChildIdSelf = {VT_I4};
-  VARIANT varState;
-  HRESULT hr = aAcc->get_accState(kChildIdSelf, &varState);
-  if (SUCCEEDED(hr) && varState.vt == VT_I4 && IsVisibleState(varState.lVal)) {
-    return true;
+// Adapts IAccessible to the Provider requirements of aspk::FetchChildren.
+class ComChildProvider {
+ public:
+  using Node = AccNode;
+
+  explicit ComChildProvider(TraversalCounters& aCounters)
+      : mCounters(aCounters) {}
+
+  bool FirstChild(const Node& aNode, Node& aOut) {
+    aOut = aNode.MakeChild(Navigate(aNode.Acc(), NAVDIR_FIRSTCHILD));
+    CountQueryInterface(aOut);
+    return !!aOut;
   }
-  return false;
-}
 
-IAccessiblePtr DoDfsFindRole(IAccessiblePtr& aAcc, const long aRole) {
-  const unsigned int kMaxLevel = 0xFFFFFFFF;
-  unsigned int curLevel = 0;
-  const VARIANT kChildIdSelf = {VT_I4};
+  bool NextSibling(const Node& aNode, Node& aOut) {
+    aOut = aNode.MakeSibling(Navigate(aNode.Acc(), NAVDIR_NEXT));
+    CountQueryInterface(aOut);
+    return !!aOut;
+  }
 
-  std::deque<IAccessiblePtr> q;
-  q.push_front(aAcc);
-
-  while (!q.empty()) {
-    IAccessiblePtr acc = q.front();
-    q.pop_front();
-    VARIANT varRole;
-    HRESULT hr = acc->get_accRole(kChildIdSelf, &varRole);
-    if (SUCCEEDED(hr) && varRole.vt == VT_I4 && varRole.lVal == aRole) {
-      // Check that we're visible too
-      if (IsVisible(acc)) {
-        return acc;
+  long ChildCount(const Node& aNode) {
+    long count = 0;
+    if (FAILED(A11Y_CALL(get_accChildCount, aNode, &count))) {
+      return 0;
+    }
+    return count;
+  }
+
+  size_t ChildChunk(const Node& aNode, size_t aStart, size_t aCount,
+                    Node* aOut) {
+    vector<VARIANT> vars(aCount);
+    ULONG obtained = 0;
+
+    if (!aStart) {
+      mEnum = nullptr;
+      ++mCounters.mRoundTrips;
+      HRESULT hr =
+          A11Y_CALL(QueryInterface, aNode, IID_IEnumVARIANT, (void**)&mEnum);
+      if (SUCCEEDED(hr)) {
+        // The proxy may hand back a cached enumerator that has already been
+        // consumed, so always rewind it.
+        ++mCounters.mRoundTrips;
+        hr = A11Y_CALL(Reset, mEnum);
+      }
+      if (FAILED(hr)) {
+        mEnum = nullptr;
       }
     }
-    if (curLevel < kMaxLevel) {
-      IAccessiblePtr nextAcc = GetFirstChild(acc);
-      while (nextAcc) {
-        q.push_front(nextAcc);
-        nextAcc = GetNextSibling(nextAcc);
+
+    if (mEnum) {
+      HRESULT hr = A11Y_CALL(Next, mEnum, static_cast<ULONG>(aCount),
+                             &vars[0], &obtained);
+      if (FAILED(hr)) {
+        return 0;
       }
-      ++curLevel;
+    } else {
+      // No IEnumVARIANT; oleacc falls back to get_accChild for each index.
+      long obtainedLong = 0;
+      HRESULT hr = A11Y_CALL_FN(AccessibleChildren, aNode.GetInterfacePtr(),
+                                static_cast<LONG>(aStart),
+                                static_cast<LONG>(aCount), &vars[0],
+                                &obtainedLong);
+      if (FAILED(hr)) {
+        return 0;
+      }
+      mCounters.mRoundTrips += obtainedLong;
+      obtained = static_cast<ULONG>(obtainedLong);
     }
-  }
 
-  return nullptr;
-}
+    for (ULONG i = 0; i < obtained; ++i) {
+      if (vars[i].vt == VT_DISPATCH && vars[i].pdispVal) {
+        IAccessiblePtr child;
+        A11Y_CALL(QueryInterface, vars[i].pdispVal, IID_IAccessible,
+                  (void**)&child);
+        aOut[i] = aNode.MakeChild(child);
+        CountQueryInterface(aOut[i]);
+      }
+      VariantClear(&vars[i]);
+    }
 
-const char* GetSource(long uniqueId) {
-  if (uniqueId >= 0) {
-    return "other";
-  }
-  uint32_t contentId = (~uint32_t(uniqueId) & 0x7F000000UL) >> 24;
-  if (contentId) {
-    return "content";
+    return obtained;
   }
-  return "chrome";
-}
 
-int QueryAccInfo(HWND aHwnd, IAccessiblePtr aAcc) {
-  const VARIANT kChildIdSelf = {VT_I4};
-  VARIANT varVal;
-  BSTR bstr;
-  long childCount, uniqueId;
-  AccessibleStates ia2States;
-  IA2Locale ia2Locale;
-  HWND hwnd;
+ private:
+  void CountQueryInterface(const Node& aResult) {
+    if (aResult) {
+      ++mCounters.mRoundTrips;
+    }
+  }
 
-  IAccessible2Ptr acc2 = GetIA2(aAcc);
-
-  // queries: role, state, ia2 state, keyboard shortcut, ia2 attrs, name, desc,
-  // locale, child count, value let's also add uniqueid and hwnd
-  HRESULT hr = acc2->get_accRole(kChildIdSelf, &varVal);
-  HRCHECK("get_accRole");
-  hr = acc2->get_accState(kChildIdSelf, &varVal);
-  HRCHECK("get_accState");
-  hr = acc2->get_accKeyboardShortcut(kChildIdSelf, &bstr);
-  HRCHECK("get_accKeyboardShortcut");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = acc2->get_accName(kChildIdSelf, &bstr);
-  HRCHECK("get_accName");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = acc2->get_accDescription(kChildIdSelf, &bstr);
-  HRCHECK("get_accDescription");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = acc2->get_accChildCount(&childCount);
-  HRCHECK("get_accChildCount");
-  hr = acc2->get_accValue(kChildIdSelf, &bstr);
-  HRCHECK("get_accValue");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = acc2->get_states(&ia2States);
-  HRCHECK("get_states");
-  hr = acc2->get_locale(&ia2Locale);
-  HRCHECK("get_locale");
-  hr = acc2->get_attributes(&bstr);
-  HRCHECK("get_attributes");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = acc2->get_uniqueID(&uniqueId);
-  HRCHECK("get_uniqueID");
+  TraversalCounters& mCounters;
+  IEnumVARIANTPtr mEnum;
+};
 
-#if defined(PRINT_UNIQUE_ID)
-  printf("ID: 0x%08X (%s)\n", uniqueId, GetSource(uniqueId));
-#endif
+// Adds the property getters that aspk::RunSelector needs.
+class ComSelectorProvider : public ComChildProvider {
+ public:
+  explicit ComSelectorProvider(TraversalCounters& aCounters)
+      : ComChildProvider(aCounters) {}
 
-  hr = acc2->get_windowHandle(&hwnd);
-  HRCHECK("get_windowHandle");
-  if (hwnd != aHwnd) {
-    printf("hwnd mismatch!\n");
-    return 1;
+  bool GetRole(const Node& aNode, long& aOut) {
+    const VARIANT kChildIdSelf = {VT_I4};
+    aspk::AutoVariant varRole;
+    return SUCCEEDED(A11Y_CALL(get_accRole, aNode, kChildIdSelf,
+                               varRole.Receive())) &&
+           varRole.GetLong(aOut);
   }
 
-#if defined(TEST_GET_RELATIONS)
-  IAccessibleRelation* relations[64] = {};
-  long count = 0;
-  hr = acc2->get_relations(64, &relations[0], &count);
-#endif  // defined(TEST_GET_RELATIONS)
-  return 0;
-}
+  bool GetIA2Role(const Node& aNode, long& aOut) {
+    IAccessible2Ptr acc2(aNode.IA2());
+    return acc2 && SUCCEEDED(A11Y_CALL(role, acc2, &aOut));
+  }
 
-int FindDocumentAndDump(HWND aHwnd) {
-  const VARIANT kChildIdSelf = {VT_I4};
-  VARIANT varVal;
-  LARGE_INTEGER start, end, freq;
-  BSTR bstr;
-  long childCount, uniqueId;
-  AccessibleStates ia2States;
-  IA2Locale ia2Locale;
-  HWND hwnd;
+  bool GetState(const Node& aNode, long& aOut) {
+    const VARIANT kChildIdSelf = {VT_I4};
+    aspk::AutoVariant varState;
+    return SUCCEEDED(A11Y_CALL(get_accState, aNode, kChildIdSelf,
+                               varState.Receive())) &&
+           varState.GetLong(aOut);
+  }
 
-  QueryPerformanceCounter(&start);
+  bool GetIA2State(const Node& aNode, long& aOut) {
+    IAccessible2Ptr acc2(aNode.IA2());
+    return acc2 && SUCCEEDED(A11Y_CALL(get_states, acc2, &aOut));
+  }
 
-  IAccessiblePtr root;
-  HRESULT hr = AccessibleObjectFromWindow(aHwnd, OBJID_CLIENT, IID_IAccessible,
-                                          (void**)&root);
-  if (FAILED(hr)) {
-    printf("AccessibleObjectFromWindow failed!\n");
-    return 1;
+  bool GetName(const Node& aNode, wstring& aOut) {
+    const VARIANT kChildIdSelf = {VT_I4};
+    aspk::AutoBstr bstr;
+    if (A11Y_CALL(get_accName, aNode, kChildIdSelf, bstr.Receive()) != S_OK) {
+      return false;
+    }
+    return CopyString(bstr, aOut);
   }
-  log("OBJID_CLIENT IAccessible: 0x%p\n", acc.GetInterfacePtr());
 
-  IAccessiblePtr doc = DoDfsFindRole(root, ROLE_SYSTEM_DOCUMENT);
-  if (!doc) {
-    printf("Couldn't find document!\n");
-    return 1;
+  bool GetAttributes(const Node& aNode, wstring& aOut) {
+    IAccessible2Ptr acc2(aNode.IA2());
+    aspk::AutoBstr bstr;
+    if (!acc2 || A11Y_CALL(get_attributes, acc2, bstr.Receive()) != S_OK) {
+      return false;
+    }
+    return CopyString(bstr, aOut);
   }
-  log("Document: 0x%p\n", doc.GetInterfacePtr());
-
-  IAccessible2Ptr doc2 = GetIA2(doc);
-
-  // The following queries are those commonly issued by NVDA:
-  // role, state, ia2 state, keyboard shortcut, ia2 attrs, name, desc, locale,
-  // child count, value let's also add uniqueid and hwnd
-  hr = doc2->get_accRole(kChildIdSelf, &varVal);
-  HRCHECK("get_accRole");
-  hr = doc2->get_accState(kChildIdSelf, &varVal);
-  HRCHECK("get_accState");
-  hr = doc2->get_accKeyboardShortcut(kChildIdSelf, &bstr);
-  HRCHECK("get_accKeyboardShortcut");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = doc2->get_accName(kChildIdSelf, &bstr);
-  HRCHECK("get_accName");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = doc2->get_accDescription(kChildIdSelf, &bstr);
-  HRCHECK("get_accDescription");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = doc2->get_accChildCount(&childCount);
-  HRCHECK("get_accChildCount");
-  hr = doc2->get_accValue(kChildIdSelf, &bstr);
-  HRCHECK("get_accValue");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = doc2->get_states(&ia2States);
-  HRCHECK("get_states");
-  hr = doc2->get_locale(&ia2Locale);
-  HRCHECK("get_locale");
-  hr = doc2->get_attributes(&bstr);
-  HRCHECK("get_attributes");
-  if (hr == S_OK) {
-    SysFreeString(bstr);
-  }
-  hr = doc2->get_uniqueID(&uniqueId);
-  HRCHECK("get_uniqueID");
-  hr = doc2->get_windowHandle(&hwnd);
-  HRCHECK("get_windowHandle");
-  if (hwnd != aHwnd) {
-    printf("hwnd mismatch!\n");
-    return 1;
+
+ private:
+  static bool CopyString(const aspk::AutoBstr& aBstr, wstring& aOut) {
+    if (!aBstr) {
+      return false;
+    }
+    aOut.assign(aBstr.Get(), aBstr.Length());
+    return true;
   }
+};
 
-  QueryPerformanceCounter(&end);
-  QueryPerformanceFrequency(&freq);
-
-  double startMs = static_cast<double>(start.QuadPart * 1000) /
-                   static_cast<double>(freq.QuadPart);
-  double endMs = static_cast<double>(end.QuadPart * 1000) /
-                 static_cast<double>(freq.QuadPart);
-  double diff = endMs - startMs;
-  printf("Total execution time: %g ms\n", diff);
-  return 0;
+static void GetChildren(const AccNode& aAcc, vector<AccNode>& aOut,
+                        TraversalCounters& aCounters) {
+  ComChildProvider provider(aCounters);
+  aspk::FetchChildren(provider, aAcc, gChildStrategy, aOut, aCounters,
+                      gBatchSize);
 }
 
-void DoDfsVisible(HWND aHwnd, IAccessiblePtr& aAcc) {
-  LARGE_INTEGER start, end, freq;
-  QueryPerformanceCounter(&start);
+static void GetChildren(const AccNode& aAcc, vector<AccNode>& aOut) {
+  GetChildren(aAcc, aOut, gCounters);
+}
 
-  const unsigned int kMaxLevel = 0xFFFFFFFF;
-  unsigned int curLevel = 0;
-
-  std::deque<IAccessiblePtr> q;
-  q.push_front(aAcc);
-
-  while (!q.empty()) {
-    IAccessiblePtr acc = q.front();
-    q.pop_front();
-    QueryAccInfo(aHwnd, acc);
-    if (curLevel < kMaxLevel) {
-      IAccessiblePtr nextAcc = GetFirstChild(acc);
-      while (nextAcc) {
-        if (IsVisible(nextAcc)) {
-          q.push_front(nextAcc);
-        }
-        nextAcc = GetNextSibling(nextAcc);
-      }
-      ++curLevel;
-    }
-  }
+// When set, visibility-filtered walks also prune children whose accLocation
+// lies outside the target window's client area.
+static bool gCullToViewport;
 
-  QueryPerformanceCounter(&end);
-  QueryPerformanceFrequency(&freq);
+// When set, tree walks hold only the path to the current node and step
+// between siblings with accNavigate, bounding the proxies they keep alive.
+static bool gBoundRefs;
 
-  double startMs = static_cast<double>(start.QuadPart * 1000) /
-                   static_cast<double>(freq.QuadPart);
-  double endMs = static_cast<double>(end.QuadPart * 1000) /
-                 static_cast<double>(freq.QuadPart);
-  double diff = endMs - startMs;
-  printf("Total execution time: %g ms\n", diff);
-}
+// The order, depth limit and pruning of tree walks, from -order, -max-depth
+// and -prune.
+static aspk::TreeWalkOptions gWalkOptions;
 
-static bool SpeedAll(HWND aHwnd) {
-  int result = FindDocumentAndDump(aHwnd);
-  return !result;
+// Names the current child strategy and, for culled walks, the culling, then
+// any walk options that differ from the defaults. Bounded walks make no use of
+// the strategy and are always depth-first.
+static string TraversalLabel() {
+  string label(gBoundRefs ? "bounded" : ChildStrategyName(gChildStrategy));
+  if (gCullToViewport) {
+    label += "+viewport";
+  }
+  if (!gBoundRefs && gWalkOptions.mOrder != aspk::WalkOrder::DepthFirst) {
+    label += "+";
+    label += aspk::WalkOrderName(gWalkOptions.mOrder);
+  }
+  if (gWalkOptions.mMaxDepth != aspk::kNoDepthLimit) {
+    label += "+depth" + to_string(gWalkOptions.mMaxDepth);
+  }
+  if (!gWalkOptions.mPrune.IsEmpty()) {
+    label += "+pruned";
+  }
+  return label;
 }
 
-static bool SpeedVisible(HWND aHwnd, IAccessiblePtr& aAcc) {
-  DoDfsVisible(aHwnd, aAcc);
+// Gets aProcess's private bytes now and the most it has ever committed.
+static bool GetPrivateBytes(HANDLE aProcess, size_t& aOutNow,
+                            size_t& aOutPeak) {
+  PROCESS_MEMORY_COUNTERS_EX counters = {sizeof(counters)};
+  if (!::GetProcessMemoryInfo(
+          aProcess, reinterpret_cast<PROCESS_MEMORY_COUNTERS*>(&counters),
+          sizeof(counters))) {
+    return false;
+  }
+  aOutNow = counters.PrivateUsage;
+  aOutPeak = counters.PeakPagefileUsage;
   return true;
 }
 
-static bool FindDocument(IAccessiblePtr& aAcc) {
-  IAccessiblePtr doc = DoDfsFindRole(aAcc, ROLE_SYSTEM_DOCUMENT);
-  if (!doc) {
-    printf("Couldn't find document!\n");
-    return false;
+static size_t gRunStartPrivateBytes;
+
+// Resets gCounters, gInterfaceCache, the IPC accounting and the proxy peak so
+// that they describe a single run, and notes the client's memory.
+static void ResetCounters() {
+  gCounters.Reset();
+  gInterfaceCache.Reset();
+  aspk::IpcAccounting::Get().Reset();
+  gLiveProxies.ResetPeak();
+  size_t peak;
+  if (!GetPrivateBytes(::GetCurrentProcess(), gRunStartPrivateBytes, peak)) {
+    gRunStartPrivateBytes = 0;
   }
+}
 
-  printf("Document: 0x%p\n", doc.GetInterfacePtr());
-  return true;
+static void PrintIpcCosts(const uint64_t aNodes) {
+  aspk::IpcAccounting::Get().Print(SyncStdout(), aNodes);
 }
 
-static bool DumpTopLevelAcc(IAccessiblePtr& aAcc) {
-  DumpAccInfo(aAcc);
-  return true;
+// Prints the client's private bytes and the proxies it holds, so that leaks
+// show up as growth across runs. The peak covers the life of the process.
+static void PrintClientResources() {
+  size_t now, peak;
+  if (GetPrivateBytes(::GetCurrentProcess(), now, peak)) {
+    Print("\tclient memory: %zu KB at start, %zu KB final, %zu KB peak\n",
+          gRunStartPrivateBytes / 1024, now / 1024, peak / 1024);
+  }
+  Print("\toutstanding proxies: %llu final, %llu peak\n",
+        gLiveProxies.Live(), gLiveProxies.Peak());
 }
 
-static bool EnumTopLevelChildren(IAccessiblePtr& aAcc) {
-  IEnumVARIANTPtr enumChildren;
-  HRESULT hr = aAcc->QueryInterface(IID_IEnumVARIANT, (void**)&enumChildren);
-  HRCHECK("QueryInterface IID_IEnumVARIANT");
+static void PrintCounters() {
+  Print("[%s] %llu nodes, %llu child round-trips (%g per node)\n",
+        TraversalLabel().c_str(), gCounters.mNodes,
+        gCounters.mRoundTrips, gCounters.RoundTripsPerNode());
+  if (gCounters.mMaxDepth) {
+    Print("\t%u levels deep\n", gCounters.mMaxDepth);
+  }
+  if (gCounters.mPrunedSubtrees || gCounters.mDepthLimited) {
+    Print("\t%llu subtrees pruned, %llu nodes at the depth limit\n",
+          gCounters.mPrunedSubtrees, gCounters.mDepthLimited);
+  }
+  PrintInterfaceCacheStats();
+  PrintIpcCosts(gCounters.mNodes);
+  PrintClientResources();
+}
 
-  hr = enumChildren->Reset();
-  HRCHECK("IEnumVARIANT::Reset");
+static bool IsVisibleState(const long aState) {
+  return (aState & (STATE_SYSTEM_INVISIBLE | STATE_SYSTEM_OFFSCREEN)) == 0;
+}
 
-  ULONG count = 1;
-  VARIANT vChildren;
-  hr = enumChildren->Next(count, &vChildren, &count);
-  HRCHECK("IEnumVARIANT::Next");
+static bool IsVisible(const AccNode& aAcc) {
+  const VARIANT kChildIdSelf = {VT_I4};
+  aspk::AutoVariant varState;
+  HRESULT hr = A11Y_CALL(get_accState, aAcc, kChildIdSelf, varState.Receive());
+  long state;
+  return SUCCEEDED(hr) && varState.GetLong(state) && IsVisibleState(state);
+}
 
-  if (vChildren.vt != VT_DISPATCH) {
-    printf("vChildren: Bad VARIANT type, got 0x%04hx instead!\n", vChildren.vt);
-    return false;
-  }
+// Returns aHwnd's client area in screen coordinates, which is what
+// accLocation reports.
+static aspk::ScreenRect GetViewport(HWND aHwnd) {
+  aspk::ScreenRect viewport;
+  RECT client;
+  if (!GetClientRect(aHwnd, &client)) {
+    return viewport;
+  }
+  POINT topLeft = {client.left, client.top};
+  POINT bottomRight = {client.right, client.bottom};
+  if (!ClientToScreen(aHwnd, &topLeft) ||
+      !ClientToScreen(aHwnd, &bottomRight)) {
+    return viewport;
+  }
+  viewport.mLeft = topLeft.x;
+  viewport.mTop = topLeft.y;
+  viewport.mRight = bottomRight.x;
+  viewport.mBottom = bottomRight.y;
+  return viewport;
+}
 
-  IAccessiblePtr child;
-  hr = vChildren.pdispVal->QueryInterface(IID_IAccessible, (void**)&child);
-  if (hr != S_OK) {
-    printf("vChildren->QueryInterface(IID_IAccessible)\n");
-    return false;
+// Whether aAcc's subtree might be visible within aViewport, judged from its
+// bounding box. Nodes whose location cannot be fetched are kept.
+static bool MayBeInViewport(const AccNode& aAcc,
+                            const aspk::ScreenRect& aViewport) {
+  const VARIANT kChildIdSelf = {VT_I4};
+  long left = 0, top = 0, width = 0, height = 0;
+  HRESULT hr = A11Y_CALL(accLocation, aAcc, &left, &top, &width, &height,
+                         kChildIdSelf);
+  if (FAILED(hr)) {
+    return true;
   }
+  return aspk::MayIntersectViewport(
+      aspk::ScreenRect::FromLocation(left, top, width, height), aViewport);
+}
 
-  return true;
+// The child filter used by visibility-filtered walks. It costs one round-trip
+// per child for the state, and when culling, another for the location of
+// those that are visible.
+static bool ShouldVisitChild(const AccNode& aChild,
+                             const aspk::ScreenRect& aViewport) {
+  return IsVisible(aChild) &&
+         (!gCullToViewport || MayBeInViewport(aChild, aViewport));
 }
 
-static bool NavigateTopLevelChildren(IAccessiblePtr& aAcc) {
-  VARIANT varStart, varOut;
-  VariantInit(&varStart);
-  varStart.vt = VT_I4;
-  varStart.lVal = CHILDID_SELF;
+static const long kIA2RoleHeading = 0x414;  // From AccessibleRole.idl
 
-  HRESULT hr = aAcc->accNavigate(NAVDIR_FIRSTCHILD, varStart, &varOut);
-  HRCHECK("acc->accNavigate");
+using AccRoleIndex = aspk::RoleIndex<AccNode>;
 
-  IAccessiblePtr loopAcc;
-  hr = varOut.pdispVal->QueryInterface(IID_IAccessible, (void**)&loopAcc);
-  HRCHECK("varOut.pdispVal->QI on first child failed");
+// Gets aAcc's MSAA role and, if aWantIA2Role is set, its IA2 role. Either is
+// zero if it is unavailable or, for MSAA, given as a string.
+static void GetRoles(const AccNode& aAcc, const bool aWantIA2Role,
+                     long& aOutRole, long& aOutIA2Role) {
+  const VARIANT kChildIdSelf = {VT_I4};
+  aOutRole = 0;
+  aOutIA2Role = 0;
 
-  long i = 0;
-  while (loopAcc) {
-    DumpAccInfo(i++, loopAcc);
-    hr = loopAcc->accNavigate(NAVDIR_NEXT, varStart, &varOut);
-    if (FAILED(hr)) {
-      break;
-    }
-    if (!(varOut.vt & VT_DISPATCH)) {
-      printf("accNavigate did not give us an IDispatch*\n");
-      return 1;
-    }
-    IAccessiblePtr qiAcc;
-    hr = varOut.pdispVal->QueryInterface(IID_IAccessible, (void**)&qiAcc);
-    HRCHECK("varOut.pdispVal->QI failed");
-    loopAcc = qiAcc;
+  aspk::AutoVariant varRole;
+  HRESULT hr = A11Y_CALL(get_accRole, aAcc, kChildIdSelf, varRole.Receive());
+  if (SUCCEEDED(hr)) {
+    varRole.GetLong(aOutRole);
   }
 
-  return true;
-}
-
-static bool ParentChildNavigation(IAccessiblePtr& aAcc) {
-  IAccessiblePtr child(GetFirstChild(aAcc));
-  if (!child) {
-    printf("GetFirstChild(acc)\n");
-    return false;
+  if (!aWantIA2Role) {
+    return;
+  }
+  IAccessible2Ptr acc2(aAcc.IA2());
+  long ia2Role = 0;
+  if (acc2 && SUCCEEDED(A11Y_CALL(role, acc2, &ia2Role))) {
+    aOutIA2Role = ia2Role;
   }
+}
 
-  IAccessiblePtr root(GetParent(child));
-  if (!root) {
-    printf("GetParent(child)\n");
-    return false;
+using AccWalkFilter = aspk::WalkFilter<AccNode>;
+using AccTreeWalker = aspk::TreeWalker<AccNode>;
+
+// Adds the prune predicates for gWalkOptions to aFilter, and if aViewport is
+// set, the child filter of visibility-filtered walks. Each costs a round-trip
+// or two per child, which the walk's IPC costs account for.
+static void AddWalkPrunes(AccWalkFilter& aFilter,
+                          const aspk::ScreenRect* aViewport = nullptr) {
+  const aspk::PruneRules& rules = gWalkOptions.mPrune;
+  if (aViewport) {
+    aFilter.AddPrune([aViewport](const AccNode& aChild) {
+      aspk::AutoIpcOperation op(aspk::IpcOperation::CheckVisibility);
+      return !ShouldVisitChild(aChild, *aViewport);
+    });
+  }
+  // The child filter has already checked the states.
+  if (rules.mInvisible && !aViewport) {
+    aFilter.AddPrune([](const AccNode& aChild) {
+      aspk::AutoIpcOperation op(aspk::IpcOperation::CheckVisibility);
+      const VARIANT kChildIdSelf = {VT_I4};
+      aspk::AutoVariant varState;
+      long state;
+      // Nodes whose state cannot be fetched are kept.
+      return SUCCEEDED(A11Y_CALL(get_accState, aChild, kChildIdSelf,
+                                 varState.Receive())) &&
+             varState.GetLong(state) && !IsVisibleState(state);
+    });
+  }
+  if (rules.mChrome || rules.mContent) {
+    aFilter.AddPrune([](const AccNode& aChild) {
+      aspk::AutoIpcOperation op(aspk::IpcOperation::CheckPrune);
+      IAccessible2Ptr acc2(aChild.IA2());
+      long uniqueId;
+      return acc2 && SUCCEEDED(A11Y_CALL(get_uniqueID, acc2, &uniqueId)) &&
+             gWalkOptions.mPrune.SkipsSource(uniqueId);
+    });
+  }
+  if (!rules.mRoles.empty()) {
+    aFilter.AddPrune([](const AccNode& aChild) {
+      aspk::AutoIpcOperation op(aspk::IpcOperation::CheckPrune);
+      const aspk::PruneRules& rules = gWalkOptions.mPrune;
+      long role, ia2Role;
+      GetRoles(aChild, rules.HasIA2Roles(), role, ia2Role);
+      return (role && rules.SkipsRole(role)) ||
+             (ia2Role && rules.SkipsRole(ia2Role));
+    });
   }
+}
 
-  printf("Root IAccessible: 0x%p\n", aAcc.GetInterfacePtr());
+// A walker that fetches children with the current strategy into aCounters.
+static AccTreeWalker::FetchFn AccChildFetcher(TraversalCounters& aCounters) {
+  return [&aCounters](const AccNode& aAcc, vector<AccNode>& aOut) {
+    GetChildren(aAcc, aOut, aCounters);
+  };
+}
 
-  IServiceProviderPtr svcProv2(GetServiceProvider(root));
-  if (!svcProv2) {
-    printf("Get svcProv2\n");
-    return false;
-  }
-  printf("IServiceProvider 2: 0x%p\n", svcProv2.GetInterfacePtr());
+/**
+ * Visits every node under aRoot that gWalkOptions reaches, calling
+ * aVisit(node, role, ia2Role) with the roles from GetRoles.
+ */
+template <typename Visitor>
+static void WalkRoles(const AccNode& aRoot, const bool aWantIA2Role,
+                      Visitor&& aVisit) {
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+  AccTreeWalker walker(gWalkOptions.mOrder, AccChildFetcher(gCounters),
+                       gCounters);
+  walker.Walk(aRoot, filter, [&](AccTreeWalker::Step& aStep) {
+    long role, ia2Role;
+    GetRoles(aStep.mNode, aWantIA2Role, role, ia2Role);
+    aVisit(aStep.mNode, role, ia2Role);
+    return aspk::WalkAction::Continue;
+  });
+}
 
-  long uid;
-  GetUniqueId(aAcc, uid);
-  long uid2;
-  GetUniqueId(root, uid2);
+// Indexes every node under aRoot by its MSAA and IA2 roles in one walk.
+static void BuildRoleIndex(const AccNode& aRoot, AccRoleIndex& aOut) {
+  aOut.Clear();
+  WalkRoles(aRoot, true,
+            [&](const AccNode& aAcc, const long aRole, const long aIA2Role) {
+              AccRoleIndex::Handle handle = aOut.AddNode(aAcc);
+              if (aRole) {
+                aOut.AddRole(handle, aRole);
+              }
+              if (aIA2Role) {
+                aOut.AddRole(handle, aIA2Role);
+              }
+            });
+}
 
-  long uid2a;
-  HRESULT hr = GetParentUniqueId(child, uid2a);
-  HRCHECK("GetParentUniqueId(child)");
-  return true;
+// Walks the whole tree under aRoot and collects every node with aRole, which
+// may be an MSAA or an IA2 role. This is what each query costs without an
+// index.
+static void DoDfsFindAllWithRole(const AccNode& aRoot, const long aRole,
+                                 vector<AccNode>& aOut) {
+  aOut.clear();
+  WalkRoles(aRoot, aRole >= aspk::kFirstIA2Role,
+            [&](const AccNode& aAcc, const long aNodeRole,
+                const long aIA2Role) {
+              if (aNodeRole == aRole || aIA2Role == aRole) {
+                aOut.push_back(aAcc);
+              }
+            });
 }
 
-static bool RootAcccessibleUniqueId(IAccessiblePtr& aAcc) {
-  long rootUniqueId;
-  HRESULT hr = GetUniqueId(aAcc, rootUniqueId);
-  HRCHECK("GetUniqueId(acc)");
-  printf("Root accessible's IA2 unique ID is %d\n", rootUniqueId);
-  return true;
+// Returns the first visible node with the MSAA role aRole under aRoot,
+// stopping the walk as soon as it is found. A single query doesn't need a
+// role index; building one would walk the whole tree.
+static AccNode DoDfsFindVisibleRole(const AccNode& aRoot, const long aRole) {
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+  AccTreeWalker walker(gWalkOptions.mOrder, AccChildFetcher(gCounters),
+                       gCounters);
+  AccNode found;
+  walker.Walk(aRoot, filter, [&](AccTreeWalker::Step& aStep) {
+    long role, ia2Role;
+    GetRoles(aStep.mNode, false, role, ia2Role);
+    if (role != aRole || !IsVisible(aStep.mNode)) {
+      return aspk::WalkAction::Continue;
+    }
+    found = aStep.mNode;
+    return aspk::WalkAction::Stop;
+  });
+  return found;
 }
 
-static bool DumpFirstChild(IAccessiblePtr& aAcc) {
-  IAccessiblePtr firstChild = GetFirstChild(aAcc);
-  DumpAccInfo(firstChild);
-  return true;
+const char* GetSource(long uniqueId) {
+  return aspk::NodeSourceName(aspk::GetNodeSource(uniqueId));
 }
 
-static bool DumpEntireTree(IAccessiblePtr& aAcc) {
-  DoDfs(aAcc);
-  return true;
+static LONGLONG QpcFrequency() {
+  static const LONGLONG sFrequency = []() {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    return freq.QuadPart;
+  }();
+  return sFrequency;
 }
 
-static bool CountTopLevelChildren(IAccessiblePtr& aAcc) {
-  IServiceProviderPtr svcProv;
-  HRESULT hr = aAcc->QueryInterface(IID_IServiceProvider, (void**)&svcProv);
-  HRCHECK("QI(IServiceProvider)");
-  printf("IServiceProvider: 0x%p\n", svcProv.GetInterfacePtr());
+static double ElapsedMs(const LARGE_INTEGER& aStart,
+                        const LARGE_INTEGER& aEnd) {
+  return static_cast<double>((aEnd.QuadPart - aStart.QuadPart) * 1000) /
+         static_cast<double>(QpcFrequency());
+}
 
-  IAccessible2Ptr acc2;
-  hr = svcProv->QueryService(IID_IAccessible2, IID_IAccessible2, (void**)&acc2);
-  HRCHECK("svcProv->QueryService");
+static uint64_t NowUs() {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return static_cast<uint64_t>(now.QuadPart) * 1000000ULL /
+         static_cast<uint64_t>(QpcFrequency());
+}
 
-  long rootUniqueId;
-  hr = acc2->get_uniqueID(&rootUniqueId);
-  HRCHECK("acc2->get_uniqueID");
-  printf("Root accessible's IA2 unique ID is %d\n", rootUniqueId);
+static uint32_t gPropertyMask = aspk::kAllAccPropertiesMask;
+static aspk::PropertyCosts gPropertyCosts;
 
-  // Let's try to get a document
-  long childCount = 0;
-  hr = aAcc->get_accChildCount(&childCount);
-  HRCHECK("get_accChildCount(root)");
+struct AccInfo {
+  long mUniqueId;
+  HWND mHwnd;
+  // Views into mAttributesBstr, which lives as long as this AccInfo.
+  aspk::IA2CommonAttributes mAttributes;
+  aspk::AutoBstr mAttributesBstr;
+};
 
-  printf("Root accessible has %d children:\n\n", childCount);
-  return true;
+static HRESULT FetchProperty(IAccessible2Ptr& aAcc2, const AccProperty aProp,
+                             AccInfo& aInfo) {
+  const VARIANT kChildIdSelf = {VT_I4};
+  aspk::AutoVariant varVal;
+  aspk::AutoBstr bstr;
+  long childCount;
+  AccessibleStates ia2States;
+  aspk::AutoLocale ia2Locale;
+  HRESULT hr;
+
+  switch (aProp) {
+    case aspk::kPropRole:
+      return A11Y_CALL(get_accRole, aAcc2, kChildIdSelf, varVal.Receive());
+    case aspk::kPropState:
+      return A11Y_CALL(get_accState, aAcc2, kChildIdSelf, varVal.Receive());
+    case aspk::kPropKeyboardShortcut:
+      return A11Y_CALL(get_accKeyboardShortcut, aAcc2, kChildIdSelf,
+                       bstr.Receive());
+    case aspk::kPropName:
+      return A11Y_CALL(get_accName, aAcc2, kChildIdSelf, bstr.Receive());
+    case aspk::kPropDescription:
+      return A11Y_CALL(get_accDescription, aAcc2, kChildIdSelf,
+                       bstr.Receive());
+    case aspk::kPropChildCount:
+      return A11Y_CALL(get_accChildCount, aAcc2, &childCount);
+    case aspk::kPropValue:
+      return A11Y_CALL(get_accValue, aAcc2, kChildIdSelf, bstr.Receive());
+    case aspk::kPropIA2States:
+      return A11Y_CALL(get_states, aAcc2, &ia2States);
+    case aspk::kPropLocale:
+      return A11Y_CALL(get_locale, aAcc2, ia2Locale.Receive());
+    case aspk::kPropAttributes:
+      // Parsed the way a screen reader would, so that its cost is included.
+      hr = A11Y_CALL(get_attributes, aAcc2, aInfo.mAttributesBstr.Receive());
+      if (hr == S_OK && aInfo.mAttributesBstr) {
+        aspk::ParseCommonIA2Attributes(aInfo.mAttributesBstr.Get(),
+                                       aInfo.mAttributesBstr.Length(),
+                                       aInfo.mAttributes);
+      }
+      return hr;
+    case aspk::kPropUniqueId:
+      return A11Y_CALL(get_uniqueID, aAcc2, &aInfo.mUniqueId);
+    case aspk::kPropWindowHandle:
+      return A11Y_CALL(get_windowHandle, aAcc2, &aInfo.mHwnd);
+    default:
+      return E_INVALIDARG;
+  }
 }
 
-enum A11yTests {
-  NONE = 0,
-  DUMP_TOP_LEVEL_ACCESSIBLE = 1,
-  DUMP_FIRST_CHILD = 2,
-  ENUM_TOP_LEVEL_CHILDREN = 4,
-  NAVIGATE_TOP_LEVEL_CHILDREN = 8,
-  COUNT_TOP_LEVEL_CHILDREN = 0x10,
-  PARENT_CHILD_NAVIGATION = 0x20,
-  ROOT_ACCESSIBLE_UNIQUE_ID = 0x40,
-  FIND_DOCUMENT = 0x80,
-  SPEED_ALL = 0x100,
-  SPEED_VISIBLE = 0x200,
-  DUMP_ENTIRE_TREE = 0x400,
-  RUN_ALL = UINT32_MAX,
-  // XXX: Update this when changing the enum!
-  NUM_A11Y_TESTS = 13
-};
+// Serves the live tree through aspk::AccBackend, so that aspk::TreeBench can
+// walk it.
+class ComBackend : public aspk::AccBackend {
+ public:
+  explicit ComBackend(HWND aHwnd) : mHwnd(aHwnd) {}
 
-static const wchar_t kSwitchHwnd[] = L"-hwnd";
-static const wchar_t kSwitchForceSelector[] = L"-s";
+  static aspk::BackendNodePtr Wrap(const AccNode& aAcc) {
+    if (!aAcc) {
+      return nullptr;
+    }
+    return make_shared<const Node>(aAcc);
+  }
 
-static const A11yTests kTests[] = {
-    NONE,
-    DUMP_TOP_LEVEL_ACCESSIBLE,
+  static const AccNode& Unwrap(const aspk::BackendNodePtr& aNode) {
+    return static_cast<const Node&>(*aNode).mAcc;
+  }
+
+  const char* Name() const override { return "ia2"; }
+
+  aspk::BackendNodePtr Root() override {
+    IAccessiblePtr root;
+    HRESULT hr = A11Y_CALL_FN(AccessibleObjectFromWindow, mHwnd, OBJID_CLIENT,
+                              IID_IAccessible, (void**)&root);
+    if (FAILED(hr)) {
+      Print("AccessibleObjectFromWindow failed!\n");
+      return nullptr;
+    }
+    log("OBJID_CLIENT IAccessible: 0x%p\n", root.GetInterfacePtr());
+    return Wrap(AccNode(root));
+  }
+
+  void GetChildren(const aspk::BackendNodePtr& aNode,
+                   const ChildStrategy aStrategy, const size_t aMaxChunk,
+                   vector<aspk::BackendNodePtr>& aOut,
+                   TraversalCounters& aCounters) override {
+    ComChildProvider provider(aCounters);
+    aspk::FetchChildren(provider, Unwrap(aNode), aStrategy, mChildren,
+                        aCounters, aMaxChunk);
+    aOut.clear();
+    aOut.reserve(mChildren.size());
+    for (const AccNode& child : mChildren) {
+      aOut.push_back(Wrap(child));
+    }
+  }
+
+  aspk::BackendNodePtr FirstChild(const aspk::BackendNodePtr& aNode,
+                                  TraversalCounters& aCounters) override {
+    ComChildProvider provider(aCounters);
+    AccNode child;
+    ++aCounters.mRoundTrips;
+    provider.FirstChild(Unwrap(aNode), child);
+    return Wrap(child);
+  }
+
+  aspk::BackendNodePtr NextSibling(const aspk::BackendNodePtr& aNode,
+                                   TraversalCounters& aCounters) override {
+    ComChildProvider provider(aCounters);
+    AccNode sibling;
+    ++aCounters.mRoundTrips;
+    provider.NextSibling(Unwrap(aNode), sibling);
+    return Wrap(sibling);
+  }
+
+  bool GetRole(const aspk::BackendNodePtr& aNode, long& aOut) override {
+    const VARIANT kChildIdSelf = {VT_I4};
+    aspk::AutoVariant varRole;
+    return SUCCEEDED(A11Y_CALL(get_accRole, Unwrap(aNode), kChildIdSelf,
+                               varRole.Receive())) &&
+           varRole.GetLong(aOut);
+  }
+
+  bool GetIA2Role(const aspk::BackendNodePtr& aNode, long& aOut) override {
+    IAccessible2Ptr acc2 = Unwrap(aNode).IA2();
+    return acc2 && SUCCEEDED(A11Y_CALL(role, acc2, &aOut));
+  }
+
+  bool GetState(const aspk::BackendNodePtr& aNode, long& aOut) override {
+    const VARIANT kChildIdSelf = {VT_I4};
+    aspk::AutoVariant varState;
+    return SUCCEEDED(A11Y_CALL(get_accState, Unwrap(aNode), kChildIdSelf,
+                               varState.Receive())) &&
+           varState.GetLong(aOut);
+  }
+
+  bool GetUniqueId(const aspk::BackendNodePtr& aNode, long& aOut) override {
+    IAccessible2Ptr acc2 = Unwrap(aNode).IA2();
+    return acc2 && SUCCEEDED(A11Y_CALL(get_uniqueID, acc2, &aOut));
+  }
+
+  bool GetBounds(const aspk::BackendNodePtr& aNode,
+                 aspk::ScreenRect& aOut) override {
+    const VARIANT kChildIdSelf = {VT_I4};
+    long left = 0, top = 0, width = 0, height = 0;
+    if (FAILED(A11Y_CALL(accLocation, Unwrap(aNode), &left, &top, &width,
+                         &height, kChildIdSelf))) {
+      return false;
+    }
+    aOut = aspk::ScreenRect::FromLocation(left, top, width, height);
+    return true;
+  }
+
+  aspk::ScreenRect Viewport() override { return GetViewport(mHwnd); }
+
+  // Dumps in the format of every other command, and of the -threads walk.
+  bool DumpNode(const aspk::BackendNodePtr& aNode) override {
+    DumpAccInfo(Unwrap(aNode));
+    return true;
+  }
+
+  bool FetchProperty(const aspk::BackendNodePtr& aNode,
+                     const AccProperty aProp) override {
+    IAccessible2Ptr acc2 = Unwrap(aNode).IA2();
+    if (!acc2) {
+      return false;
+    }
+
+    AccInfo info = {0, mHwnd};
+    HRESULT hr = ::FetchProperty(acc2, aProp, info);
+    if (FAILED(hr)) {
+      Print("%s, HRESULT == 0x%08X\n", aspk::AccPropertyName(aProp), hr);
+      return false;
+    }
+
+#if defined(PRINT_UNIQUE_ID)
+    if (aProp == aspk::kPropUniqueId) {
+      Print("ID: 0x%08X (%s)\n", info.mUniqueId, GetSource(info.mUniqueId));
+    }
+#endif
+
+    if (aProp == aspk::kPropWindowHandle && info.mHwnd != mHwnd) {
+      Print("hwnd mismatch!\n");
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  struct Node : public aspk::BackendNode {
+    explicit Node(const AccNode& aAcc) : mAcc(aAcc) {}
+
+    AccNode mAcc;
+  };
+
+  HWND mHwnd;
+  vector<AccNode> mChildren;
+};
+
+static uint64_t GetOutputNs() { return gOutputNs.load(memory_order_relaxed); }
+
+// Options for a TreeBench that follow the command line.
+static aspk::TreeBenchOptions GetTreeBenchOptions() {
+  aspk::TreeBenchOptions options;
+  options.mStrategy = gChildStrategy;
+  options.mMaxChunk = gBatchSize;
+  options.mPropertyMask = gPropertyMask;
+  options.mCullToViewport = gCullToViewport;
+  options.mBoundRefs = gBoundRefs;
+  options.mWalk = gWalkOptions;
+  options.mPrint = &Print;
+  options.mOutputNs = gExcludeOutputTime ? &GetOutputNs : nullptr;
+  return options;
+}
+
+/**
+ * A TreeBench over the COM tree of aHwnd, with the options that the command
+ * line selects when it is built. Its backend keeps scratch storage and its
+ * walker keeps its stack across walks, so build one per thread and per run
+ * of a benchmark, not one per node or per iteration.
+ */
+class ComTreeBench {
+ public:
+  ComTreeBench(HWND aHwnd, TraversalCounters& aCounters)
+      : mBackend(aHwnd),
+        mBench(mBackend, GetTreeBenchOptions(), aCounters, gPropertyCosts) {}
+
+  aspk::TreeBench& Get() { return mBench; }
+
+ private:
+  ComBackend mBackend;
+  aspk::TreeBench mBench;
+};
+
+// The bench that a walk thread issues QueryAccInfo through. Set by
+// RunWalkThread for the life of the thread.
+static thread_local aspk::TreeBench* tQueryBench;
+
+/**
+ * Issues the queries selected by gPropertyMask. By default these are the ones
+ * commonly made by NVDA: role, state, ia2 state, keyboard shortcut, ia2 attrs,
+ * name, desc, locale, child count and value, plus uniqueid and hwnd. The ia2
+ * attrs are parsed for tag, display, xml-roles and level. The latency of every
+ * call is recorded in gPropertyCosts.
+ */
+int QueryAccInfo(aspk::TreeBench& aBench, const AccNode& aAcc) {
+  return aBench.QueryProperties(ComBackend::Wrap(aAcc)) ? 0 : 1;
+}
+
+int FindDocumentAndDump(aspk::TreeBench& aBench, double& aOutMs) {
+  return aBench.FindDocumentAndQuery(aOutMs) ? 0 : 1;
+}
+
+void DoDfsVisible(aspk::TreeBench& aBench, const AccNode& aAcc,
+                  double& aOutMs) {
+  aBench.WalkVisible(ComBackend::Wrap(aAcc), aOutMs);
+}
+
+void DoDfs(aspk::TreeBench& aBench, const AccNode& aAcc) {
+  aBench.DumpTree(ComBackend::Wrap(aAcc));
+}
+
+// Runs aBody as the body of a walk thread: in the MTA, with a bench of its
+// own in tQueryBench.
+static void RunWalkThread(HWND aHwnd, const function<void()>& aBody) {
+  mozilla::MTARegion mta;
+  TraversalCounters unused;
+  ComTreeBench bench(aHwnd, unused);
+  tQueryBench = &bench.Get();
+  aBody();
+  tQueryBench = nullptr;
+}
+
+static unsigned int gThreadCount = 1;
+
+using ParallelAccWalk = aspk::ParallelWalk<AccNode>;
+
+// Sums the counters of a parallel walk's workers and the skips of the filter
+// that they shared.
+static TraversalCounters SumCounters(const vector<TraversalCounters>& aCounters,
+                                     const AccWalkFilter& aFilter) {
+  TraversalCounters result;
+  result.mPrunedSubtrees = aFilter.PrunedSubtrees();
+  result.mDepthLimited = aFilter.DepthLimited();
+  for (const TraversalCounters& counters : aCounters) {
+    result.mNodes += counters.mNodes;
+    result.mRoundTrips += counters.mRoundTrips;
+    if (counters.mMaxDepth > result.mMaxDepth) {
+      result.mMaxDepth = counters.mMaxDepth;
+    }
+    result.mPrunedSubtrees += counters.mPrunedSubtrees;
+    result.mDepthLimited += counters.mDepthLimited;
+  }
+  return result;
+}
+
+// Obtains aHwnd's client accessible afresh, for a worker in the MTA.
+static AccNode GetClientRoot(HWND aHwnd) {
+  IAccessiblePtr root;
+  HRESULT hr = A11Y_CALL_FN(AccessibleObjectFromWindow, aHwnd, OBJID_CLIENT,
+                            IID_IAccessible, (void**)&root);
+  if (FAILED(hr)) {
+    Print("AccessibleObjectFromWindow failed!\n");
+    return AccNode();
+  }
+  return AccNode(root);
+}
+
+/**
+ * Runs aWalk over the client tree of aHwnd. Workers join the MTA and obtain
+ * their own root, so every proxy they see is usable from any worker. The
+ * calling thread is our STA; it keeps pumping while it waits in case COM needs
+ * to call back into it (eg for the proxy class object registered there).
+ */
+static bool RunParallelWalk(HWND aHwnd, ParallelAccWalk& aWalk,
+                            ParallelAccWalk::VisitFn aVisit, double& aOutMs) {
+  UniqueKernelHandle doneEvent(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  if (!doneEvent) {
+    Print("CreateEvent failed\n");
+    return false;
+  }
+  HANDLE done = doneEvent.get();
+
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+  const uint64_t outputStartNs = gOutputNs;
+
+  aWalk.Start(
+      [aHwnd]() { return GetClientRoot(aHwnd); }, move(aVisit),
+      [aHwnd](size_t, const function<void()>& aBody) {
+        RunWalkThread(aHwnd, aBody);
+      },
+      [done]() { ::SetEvent(done); });
+
+  DWORD index;
+  ::CoWaitForMultipleHandles(0, INFINITE, 1, &done, &index);
+  aWalk.Join();
+
+  QueryPerformanceCounter(&end);
+  const unsigned int threads = static_cast<unsigned int>(aWalk.ThreadCount());
+  aOutMs = ElapsedMs(start, end) - OutputMsSince(outputStartNs, threads);
+  return true;
+}
+
+static void PrintMergedOutput(const ParallelAccWalk& aWalk) {
+  aWalk.ForEachOutput(
+      [](const string& aOutput) {
+        gOutputSink.Write(aOutput.data(), aOutput.size());
+      });
+}
+
+static void PrintParallelStats(const ParallelAccWalk& aWalk) {
+  for (size_t i = 0; i < aWalk.ThreadCount(); ++i) {
+    Print("\tthread %zu: %llu nodes, %llu steals\n", i,
+          aWalk.NodesVisited(i), aWalk.Steals(i));
+  }
+}
+
+static bool ParallelFindDocumentAndDump(HWND aHwnd, unsigned int aThreads,
+                                        TraversalCounters& aOutCounters,
+                                        double& aOutMs) {
+  const VARIANT kChildIdSelf = {VT_I4};
+  vector<TraversalCounters> counters(aThreads);
+  // The result of the last document each worker queried.
+  vector<int> queryResults(aThreads);
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+
+  ParallelAccWalk walk(aThreads);
+  bool ok = RunParallelWalk(
+      aHwnd, walk,
+      [&](size_t aThread, AccNode& aAcc, const uint32_t aDepth, string& aOut,
+          vector<AccNode>& aChildren) {
+        AutoRedirectOutput redirect(aOut);
+        counters[aThread].Visit(aDepth);
+
+        aspk::AutoVariant varRole;
+        HRESULT hr =
+            A11Y_CALL(get_accRole, aAcc, kChildIdSelf, varRole.Receive());
+        long role;
+        if (SUCCEEDED(hr) && varRole.GetLong(role) &&
+            role == ROLE_SYSTEM_DOCUMENT && IsVisible(aAcc)) {
+          // Stops at the first document in document order, whichever worker
+          // reaches it.
+          queryResults[aThread] = QueryAccInfo(*tQueryBench, aAcc);
+          return false;
+        }
+
+        if (filter.Expands(aDepth)) {
+          GetChildren(aAcc, aChildren, counters[aThread]);
+          filter.Prune(aChildren);
+        }
+        return true;
+      },
+      aOutMs);
+
+  PrintMergedOutput(walk);
+
+  if (!ok) {
+    return false;
+  }
+  if (!walk.WasStopped()) {
+    Print("Couldn't find document!\n");
+    return false;
+  }
+
+  aOutCounters = SumCounters(counters, filter);
+  return !queryResults[walk.StopThread()];
+}
+
+static bool ParallelDfsVisible(HWND aHwnd, unsigned int aThreads,
+                               TraversalCounters& aOutCounters,
+                               double& aOutMs) {
+  vector<TraversalCounters> counters(aThreads);
+  const aspk::ScreenRect viewport = GetViewport(aHwnd);
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter, &viewport);
+
+  ParallelAccWalk walk(aThreads);
+  bool ok = RunParallelWalk(
+      aHwnd, walk,
+      [&](size_t aThread, AccNode& aAcc, const uint32_t aDepth, string& aOut,
+          vector<AccNode>& aChildren) {
+        AutoRedirectOutput redirect(aOut);
+        counters[aThread].Visit(aDepth);
+        QueryAccInfo(*tQueryBench, aAcc);
+
+        if (filter.Expands(aDepth)) {
+          GetChildren(aAcc, aChildren, counters[aThread]);
+          filter.Prune(aChildren);
+        }
+        return true;
+      },
+      aOutMs);
+
+  PrintMergedOutput(walk);
+
+  aOutCounters = SumCounters(counters, filter);
+  return ok;
+}
+
+static unsigned int gWarmupIterations = 0;
+static unsigned int gMeasuredIterations = 1;
+static bool gRejectOutliers = true;
+
+static aspk::BenchReport gBenchReport;
+
+using BenchmarkFn = function<bool(double& aOutMs)>;
+
+/**
+ * Runs aRun gWarmupIterations times, discarding the results, and then
+ * gMeasuredIterations times, summarizing the measured times into aOut.
+ * gCounters and gInterfaceCache are reset before every run so that they
+ * describe a single one; gPropertyCosts accumulates over all of the measured
+ * runs.
+ */
+static bool RunBenchmark(const BenchmarkFn& aRun, aspk::SampleSummary& aOut) {
+  double ms = 0.0;
+  for (unsigned int i = 0; i < gWarmupIterations; ++i) {
+    ResetCounters();
+    if (!aRun(ms)) {
+      return false;
+    }
+  }
+
+  gPropertyCosts.Reset();
+
+  vector<double> samples;
+  samples.reserve(gMeasuredIterations);
+  for (unsigned int i = 0; i < gMeasuredIterations; ++i) {
+    ResetCounters();
+    if (!aRun(ms)) {
+      return false;
+    }
+    samples.push_back(ms);
+  }
+
+  return aspk::Summarize(samples, gRejectOutliers, aOut);
+}
+
+static void PrintBenchmark(const char* aLabel,
+                           const aspk::SampleSummary& aSummary) {
+  if (aSummary.mCount + aSummary.mOutliers == 1) {
+    Print("%s: Total execution time: %g ms\n", aLabel, aSummary.mMean);
+    return;
+  }
+  aspk::PrintSummary(SyncStdout(), aLabel, "ms", aSummary);
+}
+
+static void RecordBenchmark(const char* aCommand, const char* aStrategy,
+                            unsigned int aThreads,
+                            const TraversalCounters& aCounters,
+                            const aspk::SampleSummary& aSummary) {
+  aspk::BenchResult result;
+  result.mCommand = aCommand;
+  result.mStrategy = aStrategy;
+  result.mThreads = aThreads;
+  result.mNodes = aCounters.mNodes;
+  result.mRoundTrips = aCounters.mRoundTrips;
+  result.mTimeMs = aSummary;
+  gBenchReport.Add(result);
+}
+
+static void RecordBenchmark(const char* aCommand, unsigned int aThreads,
+                            const TraversalCounters& aCounters,
+                            const aspk::SampleSummary& aSummary) {
+  RecordBenchmark(aCommand, TraversalLabel().c_str(), aThreads,
+                  aCounters, aSummary);
+}
+
+using ParallelRunFn = bool (*)(HWND, unsigned int, TraversalCounters&,
+                               double&);
+
+// What ReportParallelScaling measured at one thread count, with the counters
+// of every worker merged.
+struct ParallelResult {
+  TraversalCounters mCounters;
+  aspk::SampleSummary mSummary;
+};
+
+using ParallelResultFn = function<void(const ParallelResult&)>;
+
+/**
+ * Benchmarks aRun with 1, 2, 4, ... threads up to gThreadCount and reports the
+ * speedup of each thread count's median time relative to the single-threaded
+ * median. aOnResult, if given, is called after each thread count's report.
+ */
+static bool ReportParallelScaling(HWND aHwnd, const char* aCommand,
+                                  ParallelRunFn aRun,
+                                  const ParallelResultFn& aOnResult = nullptr) {
+  double baselineMs = 0.0;
+  unsigned int threads = 1;
+
+  while (true) {
+    TraversalCounters counters;
+    aspk::SampleSummary summary;
+    bool ok = RunBenchmark(
+        [&](double& aOutMs) {
+          return aRun(aHwnd, threads, counters, aOutMs);
+        },
+        summary);
+    if (!ok) {
+      return false;
+    }
+    if (threads == 1) {
+      baselineMs = summary.mMedian;
+    }
+
+    char label[64];
+    snprintf(label, ArrayLength(label), "[%s] %u thread(s)",
+             TraversalLabel().c_str(), threads);
+    PrintBenchmark(label, summary);
+    Print("\tspeedup %.2fx, %llu nodes, %g child round-trips per node\n",
+          summary.mMedian > 0.0 ? baselineMs / summary.mMedian : 0.0,
+          counters.mNodes, counters.RoundTripsPerNode());
+    PrintInterfaceCacheStats();
+    PrintIpcCosts(counters.mNodes);
+    PrintClientResources();
+    RecordBenchmark(aCommand, threads, counters, summary);
+    if (aOnResult) {
+      aOnResult(ParallelResult{counters, summary});
+    }
+
+    if (threads >= gThreadCount) {
+      break;
+    }
+    threads = threads * 2 < gThreadCount ? threads * 2 : gThreadCount;
+  }
+
+  gPropertyCosts.Print(SyncStdout());
+  return true;
+}
+
+static bool SpeedAll(HWND aHwnd) {
+  const ChildStrategy savedStrategy = gChildStrategy;
+  bool ok = true;
+
+  for (ChildStrategy strategy : kAllChildStrategies) {
+    gChildStrategy = strategy;
+    ResetCounters();
+    if (gThreadCount > 1) {
+      ok = ReportParallelScaling(aHwnd, "speed-all",
+                                 &ParallelFindDocumentAndDump);
+      if (!ok) {
+        break;
+      }
+      continue;
+    }
+
+    aspk::SampleSummary summary;
+    ComTreeBench bench(aHwnd, gCounters);
+    ok = RunBenchmark(
+        [&bench](double& aOutMs) {
+          return !FindDocumentAndDump(bench.Get(), aOutMs);
+        },
+        summary);
+    if (!ok) {
+      break;
+    }
+    PrintBenchmark(ChildStrategyName(strategy), summary);
+    PrintCounters();
+    RecordBenchmark("speed-all", 1, gCounters, summary);
+    gPropertyCosts.Print(SyncStdout());
+  }
+
+  gChildStrategy = savedStrategy;
+  return ok;
+}
+
+static bool gCompareViewportCulling;
+
+static void PrintCullingSavings(const TraversalCounters& aStateCounters,
+                                const aspk::SampleSummary& aStateSummary,
+                                const TraversalCounters& aCulledCounters,
+                                const aspk::SampleSummary& aCulledSummary) {
+  const double savedNodes = static_cast<double>(aStateCounters.mNodes) -
+                            static_cast<double>(aCulledCounters.mNodes);
+  const double savedMs = aStateSummary.mMedian - aCulledSummary.mMedian;
+  Print(
+      "\tviewport culling visited %.0f fewer nodes (%.1f%%) and saved %g ms "
+      "(%.1f%%)\n",
+      savedNodes,
+      aStateCounters.mNodes
+          ? savedNodes * 100.0 / static_cast<double>(aStateCounters.mNodes)
+          : 0.0,
+      savedMs,
+      aStateSummary.mMedian > 0.0 ? savedMs * 100.0 / aStateSummary.mMedian
+                                  : 0.0);
+}
+
+static bool SpeedVisible(HWND aHwnd, const AccNode& aAcc) {
+  const ChildStrategy savedStrategy = gChildStrategy;
+  bool ok = true;
+
+  for (ChildStrategy strategy : kAllChildStrategies) {
+    gChildStrategy = strategy;
+
+    // State-only visibility first, then viewport culling if requested.
+    TraversalCounters stateCounters;
+    aspk::SampleSummary stateSummary;
+    // The state-only results at each thread count, when walking in parallel.
+    vector<ParallelResult> stateResults;
+    for (bool cull : {false, true}) {
+      if (cull && !gCompareViewportCulling) {
+        break;
+      }
+      gCullToViewport = cull;
+      ResetCounters();
+      if (gThreadCount > 1) {
+        size_t run = 0;
+        ok = ReportParallelScaling(
+            aHwnd, "speed-visible", &ParallelDfsVisible,
+            [&](const ParallelResult& aResult) {
+              if (!cull) {
+                stateResults.push_back(aResult);
+              } else if (run < stateResults.size()) {
+                // Both passes step through the same thread counts.
+                const ParallelResult& state = stateResults[run++];
+                PrintCullingSavings(state.mCounters, state.mSummary,
+                                    aResult.mCounters, aResult.mSummary);
+              }
+            });
+        if (!ok) {
+          break;
+        }
+        continue;
+      }
+
+      aspk::SampleSummary summary;
+      ComTreeBench bench(aHwnd, gCounters);
+      ok = RunBenchmark(
+          [&bench, &aAcc](double& aOutMs) {
+            DoDfsVisible(bench.Get(), aAcc, aOutMs);
+            return true;
+          },
+          summary);
+      if (!ok) {
+        break;
+      }
+      PrintBenchmark(TraversalLabel().c_str(), summary);
+      PrintCounters();
+      if (cull) {
+        PrintCullingSavings(stateCounters, stateSummary, gCounters, summary);
+      } else {
+        stateCounters = gCounters;
+        stateSummary = summary;
+      }
+      RecordBenchmark("speed-visible", 1, gCounters, summary);
+      gPropertyCosts.Print(SyncStdout());
+    }
+
+    gCullToViewport = false;
+    if (!ok) {
+      break;
+    }
+  }
+
+  gChildStrategy = savedStrategy;
+  return ok;
+}
+
+static const wchar_t* gJsonPath;
+static const wchar_t* gCsvPath;
+static const wchar_t* gBaselinePath;
+static double gRegressionThresholdPercent = 10.0;
+
+static string BstrToUtf8(const aspk::AutoBstr& aBstr) {
+  if (!aBstr) {
+    return string();
+  }
+  return aspk::ToUtf8(aBstr.Get(), aBstr.Length());
+}
+
+static void CollectBenchMetadata(HWND aHwnd, const AccNode& aAcc) {
+  aspk::BenchMetadata& metadata = gBenchReport.Metadata();
+  wstring exePath(GetExePathForWindow(aHwnd));
+  metadata.mExePath = aspk::ToUtf8(exePath.c_str(), exePath.length());
+  metadata.mWarmupIterations = gWarmupIterations;
+  metadata.mMeasuredIterations = gMeasuredIterations;
+
+  IServiceProviderPtr svcProv(aAcc.ServiceProvider());
+  if (!svcProv) {
+    return;
+  }
+
+  IAccessibleApplicationPtr app;
+  HRESULT hr = A11Y_CALL(QueryService, svcProv, IID_IAccessibleApplication,
+                         IID_IAccessibleApplication, (void**)&app);
+  if (FAILED(hr)) {
+    Print("QueryService(IID_IAccessibleApplication) failed with hr 0x%08X\n",
+          hr);
+    return;
+  }
+
+  aspk::AutoBstr bstr;
+  if (SUCCEEDED(A11Y_CALL(get_appName, app, bstr.Receive()))) {
+    metadata.mAppName = BstrToUtf8(bstr);
+  }
+  if (SUCCEEDED(A11Y_CALL(get_appVersion, app, bstr.Receive()))) {
+    metadata.mAppVersion = BstrToUtf8(bstr);
+  }
+  if (SUCCEEDED(A11Y_CALL(get_toolkitName, app, bstr.Receive()))) {
+    metadata.mToolkitName = BstrToUtf8(bstr);
+  }
+  if (SUCCEEDED(A11Y_CALL(get_toolkitVersion, app, bstr.Receive()))) {
+    metadata.mToolkitVersion = BstrToUtf8(bstr);
+  }
+}
+
+using ReportWriterFn = void (aspk::BenchReport::*)(FILE*) const;
+
+static bool WriteBenchReport(const wchar_t* aPath, ReportWriterFn aWriter) {
+  FILE* file = nullptr;
+  if (_wfopen_s(&file, aPath, L"w") || !file) {
+    Print("Could not open \"%S\" for writing\n", aPath);
+    return false;
+  }
+
+  (gBenchReport.*aWriter)(file);
+  fclose(file);
+  Print("Wrote results to \"%S\"\n", aPath);
+  return true;
+}
+
+// Returns false if reading the baseline failed or any metric regressed.
+static bool CompareWithBaseline() {
+  FILE* file = nullptr;
+  if (_wfopen_s(&file, gBaselinePath, L"r") || !file) {
+    Print("Could not open baseline \"%S\"\n", gBaselinePath);
+    return false;
+  }
+
+  vector<aspk::BenchResult> baseline;
+  bool ok = aspk::ReadCsvResults(file, baseline);
+  fclose(file);
+  if (!ok) {
+    Print("Baseline \"%S\" is not a valid results CSV\n", gBaselinePath);
+    return false;
+  }
+
+  Print("\nComparing with baseline \"%S\":\n", gBaselinePath);
+  return !aspk::CompareWithBaseline(baseline, gBenchReport.Results(),
+                                    gRegressionThresholdPercent, SyncStdout());
+}
+
+static bool FindDocument(const AccNode& aAcc) {
+  AccNode doc = DoDfsFindVisibleRole(aAcc, ROLE_SYSTEM_DOCUMENT);
+  if (!doc) {
+    Print("Couldn't find document!\n");
+    return false;
+  }
+
+  Print("Document: 0x%p\n", doc.GetInterfacePtr());
+  return true;
+}
+
+/**
+ * Finds every document, link and heading with a single role index walk, then
+ * finds them again with one walk per role, and compares the two.
+ */
+static bool FindRoles(const AccNode& aAcc) {
+  static const long kRoles[] = {ROLE_SYSTEM_DOCUMENT, ROLE_SYSTEM_LINK,
+                                kIA2RoleHeading};
+  static const char* kRoleNames[] = {"documents", "links", "headings"};
+  static_assert(ArrayLength(kRoles) == ArrayLength(kRoleNames),
+                "Update kRoleNames!");
+
+  LARGE_INTEGER start, end;
+  ResetCounters();
+  QueryPerformanceCounter(&start);
+  AccRoleIndex index;
+  BuildRoleIndex(aAcc, index);
+  vector<AccRoleIndex::Handle> matches =
+      index.FindAny(kRoles, ArrayLength(kRoles));
+  QueryPerformanceCounter(&end);
+  const double indexMs = ElapsedMs(start, end);
+
+  Print("Role index of %zu nodes with %zu distinct roles built in %g ms\n",
+        index.NodeCount(), index.RoleCount(), indexMs);
+  PrintCounters();
+  for (size_t i = 0; i < ArrayLength(kRoles); ++i) {
+    Print("\t%s: %zu\n", kRoleNames[i], index.Find(kRoles[i]).size());
+  }
+  Print("\t%zu matched any of them\n", matches.size());
+
+  ResetCounters();
+  QueryPerformanceCounter(&start);
+  bool same = true;
+  vector<AccNode> found;
+  for (size_t i = 0; i < ArrayLength(kRoles); ++i) {
+    DoDfsFindAllWithRole(aAcc, kRoles[i], found);
+    same = same && found.size() == index.Find(kRoles[i]).size();
+  }
+  QueryPerformanceCounter(&end);
+  const double walksMs = ElapsedMs(start, end);
+
+  Print("%zu separate walks took %g ms (%.2fx the index)\n",
+        ArrayLength(kRoles), walksMs, indexMs > 0.0 ? walksMs / indexMs : 0.0);
+  PrintCounters();
+  if (!same) {
+    Print("The tree changed between walks; counts differ from the index\n");
+  }
+  return true;
+}
+
+static const wchar_t kDefaultSelector[] = L"document link[state!=invisible]";
+static const wchar_t* gSelector = kDefaultSelector;
+// The number of matches after which select stops walking; 0 finds them all.
+static size_t gSelectLimit;
+
+static bool Select(const AccNode& aAcc) {
+  aspk::Selector selector;
+  string error;
+  if (!aspk::CompileSelector(gSelector, selector, error)) {
+    Print("Invalid selector \"%S\": %s\n", gSelector, error.c_str());
+    return false;
+  }
+
+  LARGE_INTEGER start, end;
+  ResetCounters();
+  vector<AccNode> matches;
+  QueryPerformanceCounter(&start);
+  ComSelectorProvider provider(gCounters);
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+  aspk::SelectorRunStats stats = aspk::RunSelector(
+      provider, aAcc, selector, gChildStrategy, gCounters, gWalkOptions.mOrder,
+      filter,
+      [&](const AccNode& aMatch) {
+        matches.push_back(aMatch);
+        return !gSelectLimit || matches.size() < gSelectLimit;
+      },
+      gBatchSize);
+  QueryPerformanceCounter(&end);
+
+  // Dump the matches only now so that the output is not timed.
+  for (const AccNode& match : matches) {
+    DumpAccInfo(match);
+  }
+  Print("\"%S\" matched %llu nodes in %g ms%s, pruning %llu subtrees\n",
+        gSelector, stats.mMatches, ElapsedMs(start, end),
+        stats.mStopped ? " (stopped at -limit)" : "", stats.mPrunedSubtrees);
+  PrintCounters();
+  return true;
+}
+
+static bool DumpTopLevelAcc(const AccNode& aAcc) {
+  DumpAccInfo(aAcc);
+  return true;
+}
+
+static const size_t kEnumBatchSizes[] = {1, 4, 16, 64,
+                                        aspk::kUnboundedChildChunk};
+static bool gEnumWholeTree;
+
+static void FormatBatchSize(const size_t aBatchSize, char* aOut,
+                            const size_t aOutLen) {
+  if (aBatchSize == aspk::kUnboundedChildChunk) {
+    snprintf(aOut, aOutLen, "batch-all");
+  } else {
+    snprintf(aOut, aOutLen, "batch-%zu", aBatchSize);
+  }
+}
+
+/**
+ * Fetches the children of aRoot, and of all of their descendants that
+ * gWalkOptions reaches too if gEnumWholeTree is set, through
+ * IEnumVARIANT::Next in batches of aBatchSize. aCounters.mNodes counts the
+ * children obtained.
+ */
+static void EnumerateChildren(const AccNode& aRoot, const size_t aBatchSize,
+                              TraversalCounters& aCounters, double& aOutMs) {
+  LARGE_INTEGER start;
+  QueryPerformanceCounter(&start);
+
+  ComChildProvider provider(aCounters);
+  AccWalkFilter filter(gEnumWholeTree ? gWalkOptions.mMaxDepth : 1);
+  if (gEnumWholeTree) {
+    AddWalkPrunes(filter);
+  }
+  AccTreeWalker walker(
+      gWalkOptions.mOrder,
+      [&](const AccNode& aAcc, vector<AccNode>& aOut) {
+        aspk::FetchChildren(provider, aAcc, ChildStrategy::Bulk, aOut,
+                            aCounters, aBatchSize);
+      },
+      aCounters);
+  walker.Walk(aRoot, filter, [](AccTreeWalker::Step&) {
+    return aspk::WalkAction::Continue;
+  });
+  // The walk visits the root too, which is not a child.
+  --aCounters.mNodes;
+
+  LARGE_INTEGER end;
+  QueryPerformanceCounter(&end);
+  aOutMs = ElapsedMs(start, end);
+}
+
+/**
+ * Benchmarks enumerating children through IEnumVARIANT with each of
+ * kEnumBatchSizes, or only with the -batch size if one was given, and reports
+ * the throughput and round-trips of each.
+ */
+static bool EnumChildren(const AccNode& aAcc) {
+  Print("IEnumVARIANT enumeration of %s:\n",
+        gEnumWholeTree ? "the entire tree" : "top-level children");
+
+  vector<size_t> batchSizes(kEnumBatchSizes,
+                            kEnumBatchSizes + ArrayLength(kEnumBatchSizes));
+  if (gBatchSizeSet) {
+    batchSizes.assign(1, gBatchSize);
+  }
+
+  size_t bestBatchSize = 0;
+  double bestMs = 0.0;
+  for (size_t batchSize : batchSizes) {
+    TraversalCounters counters;
+    aspk::SampleSummary summary;
+    bool ok = RunBenchmark(
+        [&](double& aOutMs) {
+          counters.Reset();
+          EnumerateChildren(aAcc, batchSize, counters, aOutMs);
+          return true;
+        },
+        summary);
+    if (!ok) {
+      return false;
+    }
+    if (!counters.mNodes) {
+      Print("No children could be enumerated!\n");
+      return false;
+    }
+
+    char label[32];
+    FormatBatchSize(batchSize, label, ArrayLength(label));
+    PrintBenchmark(label, summary);
+    Print("\t%llu children, %llu round-trips (%g per child), "
+          "%.0f children/s\n",
+          counters.mNodes, counters.mRoundTrips,
+          counters.RoundTripsPerNode(),
+          summary.mMedian > 0.0
+              ? static_cast<double>(counters.mNodes) * 1000.0 / summary.mMedian
+              : 0.0);
+    RecordBenchmark("enum-children", label, 1, counters, summary);
+
+    if (!bestBatchSize || summary.mMedian < bestMs) {
+      bestBatchSize = batchSize;
+      bestMs = summary.mMedian;
+    }
+  }
+
+  if (batchSizes.size() > 1) {
+    char label[32];
+    FormatBatchSize(bestBatchSize, label, ArrayLength(label));
+    Print("Fastest: %s (%g ms)\n", label, bestMs);
+  }
+  return true;
+}
+
+static bool NavigateTopLevelChildren(const AccNode& aAcc) {
+  aspk::AutoVariant varStart(CHILDID_SELF);
+  aspk::AutoVariant varOut;
+
+  HRESULT hr = A11Y_CALL(accNavigate, aAcc, NAVDIR_FIRSTCHILD, varStart.Get(),
+                         varOut.Receive());
+  HRCHECK("acc->accNavigate");
+  if (!varOut.GetDispatch()) {
+    Print("accNavigate did not give us an IDispatch*\n");
+    return false;
+  }
+
+  IAccessiblePtr firstAcc;
+  hr = A11Y_CALL(QueryInterface, varOut.GetDispatch(), IID_IAccessible,
+                 (void**)&firstAcc);
+  HRCHECK("varOut.pdispVal->QI on first child failed");
+  AccNode loopAcc = aAcc.MakeChild(firstAcc);
+
+  long i = 0;
+  while (loopAcc) {
+    DumpAccInfo(i++, loopAcc);
+    hr = A11Y_CALL(accNavigate, loopAcc, NAVDIR_NEXT, varStart.Get(),
+                   varOut.Receive());
+    if (FAILED(hr)) {
+      break;
+    }
+    if (!varOut.GetDispatch()) {
+      Print("accNavigate did not give us an IDispatch*\n");
+      return 1;
+    }
+    IAccessiblePtr qiAcc;
+    hr = A11Y_CALL(QueryInterface, varOut.GetDispatch(), IID_IAccessible,
+                   (void**)&qiAcc);
+    HRCHECK("varOut.pdispVal->QI failed");
+    loopAcc = loopAcc.MakeSibling(qiAcc);
+  }
+
+  return true;
+}
+
+static bool ParentChildNavigation(const AccNode& aAcc) {
+  AccNode child(aAcc.MakeChild(GetFirstChild(aAcc.Acc())));
+  if (!child) {
+    Print("GetFirstChild(acc)\n");
+    return false;
+  }
+
+  AccNode root(GetParent(child));
+  if (!root) {
+    Print("GetParent(child)\n");
+    return false;
+  }
+
+  Print("Root IAccessible: 0x%p\n", aAcc.GetInterfacePtr());
+
+  IServiceProviderPtr svcProv2(root.ServiceProvider());
+  if (!svcProv2) {
+    Print("Get svcProv2\n");
+    return false;
+  }
+  Print("IServiceProvider 2: 0x%p\n", svcProv2.GetInterfacePtr());
+
+  long uid;
+  GetUniqueId(aAcc, uid);
+  long uid2;
+  GetUniqueId(root, uid2);
+
+  long uid2a;
+  HRESULT hr = GetParentUniqueId(child, uid2a);
+  HRCHECK("GetParentUniqueId(child)");
+  return true;
+}
+
+static bool RootAcccessibleUniqueId(const AccNode& aAcc) {
+  long rootUniqueId;
+  HRESULT hr = GetUniqueId(aAcc, rootUniqueId);
+  HRCHECK("GetUniqueId(acc)");
+  Print("Root accessible's IA2 unique ID is %d\n", rootUniqueId);
+  return true;
+}
+
+static bool DumpFirstChild(const AccNode& aAcc) {
+  AccNode firstChild = aAcc.MakeChild(GetFirstChild(aAcc.Acc()));
+  DumpAccInfo(firstChild);
+  return true;
+}
+
+static bool ParallelDumpEntireTree(HWND aHwnd) {
+  vector<TraversalCounters> counters(gThreadCount);
+  ResetCounters();
+
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+
+  ParallelAccWalk walk(gThreadCount);
+  double ms = 0.0;
+  bool ok = RunParallelWalk(
+      aHwnd, walk,
+      [&](size_t aThread, AccNode& aAcc, const uint32_t aDepth, string& aOut,
+          vector<AccNode>& aChildren) {
+        AutoRedirectOutput redirect(aOut);
+        counters[aThread].Visit(aDepth);
+        DumpAccInfo(aAcc);
+        if (filter.Expands(aDepth)) {
+          GetChildren(aAcc, aChildren, counters[aThread]);
+          filter.Prune(aChildren);
+        }
+        return true;
+      },
+      ms);
+  if (!ok) {
+    return false;
+  }
+
+  PrintMergedOutput(walk);
+
+  gCounters = SumCounters(counters, filter);
+  Print("Total execution time: %g ms on %u threads\n", ms, gThreadCount);
+  PrintCounters();
+  PrintParallelStats(walk);
+  return true;
+}
+
+static const wchar_t* gSnapshotPath;
+
+static void GetSnapshotNodeInfo(const AccNode& aAcc,
+                                aspk::SnapshotNodeInfo& aOut) {
+  const VARIANT kChildIdSelf = {VT_I4};
+
+  aspk::AutoVariant varVal;
+  long value;
+  if (SUCCEEDED(A11Y_CALL(get_accRole, aAcc, kChildIdSelf,
+                          varVal.Receive())) &&
+      varVal.GetLong(value)) {
+    aOut.mRole = value;
+  }
+  if (SUCCEEDED(A11Y_CALL(get_accState, aAcc, kChildIdSelf,
+                          varVal.Receive())) &&
+      varVal.GetLong(value)) {
+    aOut.mState = static_cast<uint32_t>(value);
+  }
+
+  aspk::AutoBstr bstr;
+  if (A11Y_CALL(get_accName, aAcc, kChildIdSelf, bstr.Receive()) == S_OK &&
+      bstr) {
+    aOut.mHasName = true;
+    aOut.mName = BstrToUtf8(bstr);
+  }
+
+  IAccessible2Ptr acc2(aAcc.IA2());
+  if (!acc2) {
+    return;
+  }
+
+  AccessibleStates ia2States = 0;
+  if (SUCCEEDED(A11Y_CALL(get_states, acc2, &ia2States))) {
+    aOut.mIA2States = static_cast<uint32_t>(ia2States);
+  }
+  long uniqueId = 0;
+  if (SUCCEEDED(A11Y_CALL(get_uniqueID, acc2, &uniqueId))) {
+    aOut.mUniqueId = uniqueId;
+  }
+}
+
+/**
+ * Walks the tree breadth-first, whatever -order says, and streams it to
+ * gSnapshotPath. The snapshot format needs each node's children to be
+ * numbered consecutively, which a breadth-first walk gives us for free: a
+ * node's children are assigned the next free indices when it is written and
+ * are written in that order later. Subtrees that gWalkOptions skips are left
+ * out.
+ */
+static bool WriteTreeSnapshot(const AccNode& aAcc) {
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+
+  FILE* file = nullptr;
+  if (_wfopen_s(&file, gSnapshotPath, L"w+b") || !file) {
+    Print("Could not open \"%S\" for writing\n", gSnapshotPath);
+    return false;
+  }
+
+  aspk::SnapshotWriter writer;
+  bool ok = writer.Begin(file);
+
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+  AccTreeWalker walker(aspk::WalkOrder::BreadthFirst,
+                       AccChildFetcher(gCounters), gCounters);
+  aspk::SnapshotNodeInfo info;
+  // The node is only written once the walk knows how many children it keeps.
+  walker.Walk(
+      aAcc, filter,
+      [&](AccTreeWalker::Step& aStep) {
+        if (!ok) {
+          return aspk::WalkAction::Stop;
+        }
+        info = aspk::SnapshotNodeInfo();
+        GetSnapshotNodeInfo(aStep.mNode, info);
+        return aspk::WalkAction::Continue;
+      },
+      [&](const AccTreeWalker::Step& aStep, const size_t aChildCount) {
+        const uint32_t parent = aStep.mParent == aspk::kNoWalkParent
+                                    ? aspk::kNoSnapshotNode
+                                    : aStep.mParent;
+        uint32_t firstChild;
+        ok = writer.AddNode(info, parent, static_cast<uint32_t>(aChildCount),
+                            firstChild);
+      });
+
+  ok = ok && writer.Finish();
+  fclose(file);
+  QueryPerformanceCounter(&end);
+  if (!ok) {
+    Print("Failed writing snapshot \"%S\"\n", gSnapshotPath);
+    return false;
+  }
+
+  Print("Wrote %llu nodes and %llu bytes of strings (%llu interned) to "
+        "\"%S\" in %g ms\n",
+        writer.NodeCount(), writer.StringsSize(), writer.InternHits(),
+        gSnapshotPath, ElapsedMs(start, end));
+
+  // Reload it to check that it round-trips and to show what reloading costs.
+  QueryPerformanceCounter(&start);
+  aspk::MappedSnapshot mapped;
+  ok = mapped.Open(gSnapshotPath) && mapped.View().Validate();
+  QueryPerformanceCounter(&end);
+  if (!ok || mapped.View().NodeCount() != writer.NodeCount()) {
+    Print("Snapshot \"%S\" failed to reload\n", gSnapshotPath);
+    return false;
+  }
+
+  Print("Mapped and validated %llu nodes in %g ms\n",
+        mapped.View().NodeCount(), ElapsedMs(start, end));
+  return true;
+}
+
+static bool DumpEntireTree(HWND aHwnd, const AccNode& aAcc) {
+  if (gSnapshotPath) {
+    ResetCounters();
+    bool ok = WriteTreeSnapshot(aAcc);
+    PrintCounters();
+    return ok;
+  }
+
+  if (gThreadCount > 1) {
+    return ParallelDumpEntireTree(aHwnd);
+  }
+
+  ResetCounters();
+  ComTreeBench bench(aHwnd, gCounters);
+  DoDfs(bench.Get(), aAcc);
+  PrintCounters();
+  return true;
+}
+
+/**
+ * Polls the private bytes of the process that owns a window on a background
+ * thread, so that the growth of the target while a walk holds proxies into it
+ * can be measured without stopping the walk.
+ */
+class TargetMemorySampler {
+ public:
+  explicit TargetMemorySampler(HWND aHwnd) {
+    DWORD pid = 0;
+    ::GetWindowThreadProcessId(aHwnd, &pid);
+    mProcess.reset(
+        ::OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid));
+  }
+
+  ~TargetMemorySampler() { Stop(); }
+
+  bool Start() {
+    size_t peak;
+    if (!mProcess || !GetPrivateBytes(mProcess.get(), mStart, peak)) {
+      return false;
+    }
+    mMax = mStart;
+    mStop = false;
+    mThread = thread([this]() {
+      while (!mStop.load(memory_order_relaxed)) {
+        Sample();
+        ::Sleep(kIntervalMs);
+      }
+    });
+    return true;
+  }
+
+  void Stop() {
+    if (!mThread.joinable()) {
+      return;
+    }
+    mStop = true;
+    mThread.join();
+    Sample();
+  }
+
+  // The target's private bytes when Start was called, the most seen while
+  // sampling, and the last seen.
+  size_t StartBytes() const { return mStart; }
+  size_t MaxBytes() const { return mMax; }
+  size_t EndBytes() const { return mEnd; }
+
+ private:
+  static const DWORD kIntervalMs = 10;
+
+  void Sample() {
+    size_t now, peak;
+    if (GetPrivateBytes(mProcess.get(), now, peak)) {
+      mEnd = now;
+      if (now > mMax) {
+        mMax = now;
+      }
+    }
+  }
+
+  UniqueKernelHandle mProcess;
+  thread mThread;
+  atomic<bool> mStop{false};
+  size_t mStart = 0;
+  size_t mMax = 0;
+  size_t mEnd = 0;
+};
+
+static long long KBDelta(const size_t aFrom, const size_t aTo) {
+  return (static_cast<long long>(aTo) - static_cast<long long>(aFrom)) / 1024;
+}
+
+/**
+ * Walks the visible tree holding every pending sibling, as DoDfsVisible does
+ * by default, and then holding only the current path, and compares the peak
+ * number of proxies held and the growth of the target's private bytes.
+ */
+static bool RefFootprint(HWND aHwnd, const AccNode& aAcc) {
+  const bool savedBoundRefs = gBoundRefs;
+  uint64_t peaks[2] = {};
+  long long growth[2] = {};
+
+  for (bool bounded : {false, true}) {
+    gBoundRefs = bounded;
+    ResetCounters();
+    TargetMemorySampler sampler(aHwnd);
+    if (!sampler.Start()) {
+      Print("Could not read the target's memory usage\n");
+      gBoundRefs = savedBoundRefs;
+      return false;
+    }
+    double ms = 0.0;
+    ComTreeBench bench(aHwnd, gCounters);
+    DoDfsVisible(bench.Get(), aAcc, ms);
+    sampler.Stop();
+
+    peaks[bounded] = gLiveProxies.Peak();
+    growth[bounded] = KBDelta(sampler.StartBytes(), sampler.MaxBytes());
+    Print("[%s] %llu nodes in %.3f ms, at most %llu proxies held\n",
+          TraversalLabel().c_str(), gCounters.mNodes, ms, peaks[bounded]);
+    Print(
+        "\ttarget memory: %zu KB at start, %+lld KB peak growth, %+lld KB "
+        "after the walk\n",
+        sampler.StartBytes() / 1024, growth[bounded],
+        KBDelta(sampler.StartBytes(), sampler.EndBytes()));
+    PrintIpcCosts(gCounters.mNodes);
+  }
+
+  gBoundRefs = savedBoundRefs;
+  Print("bounded walk: %llu proxies held instead of %llu, target grew %+lld "
+        "KB instead of %+lld KB\n",
+        peaks[true], peaks[false], growth[true], growth[false]);
+  return true;
+}
+
+using ProcessAccWalk = aspk::ProcessWalk<AccNode>;
+
+// Gets the content process that serves aAcc from its IA2 uniqueID, or 0 for
+// the parent process. Fails for nodes whose uniqueID says neither.
+static bool GetServingProcess(const AccNode& aAcc, uint32_t& aOut) {
+  aspk::AutoIpcOperation op(aspk::IpcOperation::GetServingProcess);
+  IAccessible2Ptr acc2(aAcc.IA2());
+  long uniqueId;
+  if (!acc2 || FAILED(A11Y_CALL(get_uniqueID, acc2, &uniqueId)) ||
+      aspk::GetNodeSource(uniqueId) == aspk::NodeSource::Other) {
+    return false;
+  }
+  aOut = aspk::ContentProcessOf(uniqueId);
+  return true;
+}
+
+static string ProcessName(const uint32_t aProcess) {
+  return aProcess ? "content " + to_string(aProcess) : string("chrome");
+}
+
+/**
+ * Walks the client tree of aHwnd with a worker per serving process, each
+ * querying its nodes' properties as speed-visible does, then reports what
+ * each process cost and which one the walk waited on longest.
+ */
+static bool ProcessWalkTree(HWND aHwnd) {
+  UniqueKernelHandle doneEvent(::CreateEventW(nullptr, TRUE, FALSE, nullptr));
+  if (!doneEvent) {
+    Print("CreateEvent failed\n");
+    return false;
+  }
+  HANDLE done = doneEvent.get();
+
+  ResetCounters();
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+
+  LARGE_INTEGER start, end;
+  QueryPerformanceCounter(&start);
+  const uint64_t outputStartNs = gOutputNs;
+
+  ProcessAccWalk walk;
+  walk.Start(
+      [aHwnd]() { return GetClientRoot(aHwnd); }, &GetServingProcess,
+      [&](const AccNode& aAcc, const uint32_t aDepth,
+          TraversalCounters& aCounters, vector<AccNode>& aChildren) {
+        // The properties are fetched for their cost, not to be shown.
+        string discarded;
+        {
+          AutoRedirectOutput redirect(discarded);
+          QueryAccInfo(*tQueryBench, aAcc);
+        }
+        if (filter.Expands(aDepth)) {
+          GetChildren(aAcc, aChildren, aCounters);
+          filter.Prune(aChildren);
+        }
+        return true;
+      },
+      [aHwnd](uint32_t, const function<void()>& aBody) {
+        RunWalkThread(aHwnd, aBody);
+      },
+      [done]() { ::SetEvent(done); });
+
+  DWORD index;
+  ::CoWaitForMultipleHandles(0, INFINITE, 1, &done, &index);
+  walk.Join();
+  QueryPerformanceCounter(&end);
+
+  vector<TraversalCounters> counters;
+  walk.ForEachProcess([&](const ProcessAccWalk::ProcessStats& aStats) {
+    counters.push_back(aStats.mCounters);
+  });
+  const unsigned int threads = static_cast<unsigned int>(counters.size());
+  const double ms =
+      ElapsedMs(start, end) - OutputMsSince(outputStartNs, threads);
+  gCounters = SumCounters(counters, filter);
+  Print("Walked %llu nodes in %g ms on %u threads, one per process\n",
+        gCounters.mNodes, ms, threads);
+
+  uint32_t slowest = 0;
+  uint64_t slowestBusyNs = 0;
+  walk.ForEachProcess([&](const ProcessAccWalk::ProcessStats& aStats) {
+    const aspk::LatencyHistogram& latency = aStats.mLatency;
+    Print("\t%-10s %llu nodes in %llu subtrees, %g child round-trips per "
+          "node, busy %.3f ms\n",
+          ProcessName(aStats.mProcess).c_str(), aStats.mCounters.mNodes,
+          aStats.mSubtrees, aStats.mCounters.RoundTripsPerNode(),
+          aStats.mBusyNs / 1e6);
+    Print("\t%-10s per node (us): mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, "
+          "max %.1f\n",
+          "", latency.Mean() / 1000.0, latency.ValueAtPercentile(50) / 1000.0,
+          latency.ValueAtPercentile(90) / 1000.0,
+          latency.ValueAtPercentile(99) / 1000.0, latency.Max() / 1000.0);
+    if (aStats.mBusyNs > slowestBusyNs) {
+      slowest = aStats.mProcess;
+      slowestBusyNs = aStats.mBusyNs;
+    }
+  });
+  if (threads > 1) {
+    Print("Slowest process: %s, busy for %.0f%% of the walk\n",
+          ProcessName(slowest).c_str(),
+          ms > 0.0 ? slowestBusyNs / 1e4 / ms : 0.0);
+  }
+  PrintCounters();
+  return true;
+}
+
+static unsigned int gDiffSeconds = 10;
+static const size_t kMaxPrintedEdits = 100;
+
+/**
+ * Captures the tree breadth-first into aOut with the same properties that
+ * snapshots record, so that a live capture and a loaded snapshot compare
+ * like for like. Subtrees that gWalkOptions skips are left out, as they are
+ * from snapshots.
+ */
+static void CaptureDiffTree(const AccNode& aAcc, aspk::DiffTree& aOut) {
+  aOut.Clear();
+  AccWalkFilter filter(gWalkOptions.mMaxDepth);
+  AddWalkPrunes(filter);
+  // Nodes are added in the order they are visited, so the walk's indices are
+  // the tree's.
+  AccTreeWalker walker(aspk::WalkOrder::BreadthFirst,
+                       AccChildFetcher(gCounters), gCounters);
+  walker.Walk(aAcc, filter, [&](AccTreeWalker::Step& aStep) {
+    aspk::SnapshotNodeInfo info;
+    GetSnapshotNodeInfo(aStep.mNode, info);
+    aspk::DiffNode node;
+    node.mUniqueId = info.mUniqueId;
+    node.mRole = info.mRole;
+    node.mState = info.mState;
+    node.mIA2States = info.mIA2States;
+    node.mName = std::move(info.mName);
+    aOut.AddNode(aStep.mParent == aspk::kNoWalkParent ? aspk::kNoDiffNode
+                                                      : aStep.mParent,
+                 std::move(node));
+    return aspk::WalkAction::Continue;
+  });
+}
+
+static void PrintTreeDiff(const aspk::DiffTree& aOld,
+                          const aspk::DiffTree& aNew,
+                          const vector<aspk::TreeEdit>& aEdits,
+                          const aspk::TreeDiffStats& aStats) {
+  size_t printed = 0;
+  for (const aspk::TreeEdit& edit : aEdits) {
+    if (printed++ == kMaxPrintedEdits) {
+      Print("... and %zu more edits\n", aEdits.size() - kMaxPrintedEdits);
+      break;
+    }
+
+    const bool inNew = edit.mNewNode != aspk::kNoDiffNode;
+    const aspk::DiffNode& node =
+        inNew ? aNew.Node(edit.mNewNode) : aOld.Node(edit.mOldNode);
+    Print("%-6s uniqueID %ld, role 0x%lX, \"%s\"",
+          aspk::TreeEditTypeName(edit.mType), node.mUniqueId, node.mRole,
+          node.mName.c_str());
+    if (edit.mType == aspk::TreeEditType::Move) {
+      const uint32_t parent = node.mParent;
+      Print(" to child %u of uniqueID %ld", node.mIndexInParent,
+            parent == aspk::kNoDiffNode ? aspk::kNoUniqueId
+                                        : aNew.Node(parent).mUniqueId);
+    } else if (edit.mType == aspk::TreeEditType::Change) {
+      Print(":%s%s%s%s", edit.mChanged & aspk::kDiffRole ? " role" : "",
+            edit.mChanged & aspk::kDiffState ? " state" : "",
+            edit.mChanged & aspk::kDiffIA2States ? " ia2states" : "",
+            edit.mChanged & aspk::kDiffName ? " name" : "");
+    }
+    Print("\n");
+  }
+
+  const uint64_t touched = aStats.mInserted + aStats.mRemoved +
+                           aStats.mMoved + aStats.mChanged;
+  Print("Diff of %zu and %zu nodes: %llu inserted, %llu removed, "
+        "%llu moved, %llu changed, %llu unchanged\n",
+        aOld.Size(), aNew.Size(), aStats.mInserted, aStats.mRemoved,
+        aStats.mMoved, aStats.mChanged, aStats.mUnchanged);
+  Print("Matched %llu nodes by uniqueID and %llu by position; "
+        "%.1f%% of the new tree was edited\n",
+        aStats.mMatchedById, aStats.mMatchedByPosition,
+        aNew.Size() ? 100.0 * touched / aNew.Size() : 0.0);
+}
+
+// Serves a TreeMirror from the live tree. Nodes are resolved from their IA2
+// uniqueID through get_accChild on the root, which Gecko supports for any
+// descendant in the same window.
+class ComMirrorSource : public aspk::MirrorSource {
+ public:
+  ComMirrorSource(const AccNode& aRoot, long aRootId)
+      : mRoot(aRoot), mRootId(aRootId) {}
+
+  bool GetInfo(long aUniqueId, aspk::MirrorNodeInfo& aOut) override {
+    AccNode acc(Resolve(aUniqueId));
+    if (!acc) {
+      return false;
+    }
+
+    const VARIANT kChildIdSelf = {VT_I4};
+    aspk::AutoVariant varVal;
+    if (SUCCEEDED(A11Y_CALL(get_accRole, acc, kChildIdSelf,
+                            varVal.Receive()))) {
+      varVal.GetLong(aOut.mRole);
+    }
+    if (SUCCEEDED(A11Y_CALL(get_accState, acc, kChildIdSelf,
+                            varVal.Receive()))) {
+      varVal.GetLong(aOut.mState);
+    }
+
+    aspk::AutoBstr bstr;
+    if (A11Y_CALL(get_accName, acc, kChildIdSelf, bstr.Receive()) == S_OK &&
+        bstr) {
+      aOut.mName.assign(bstr.Get(), bstr.Length());
+    }
+
+    aOut.mParentId = aspk::kNoUniqueId;
+    if (aUniqueId == mRootId) {
+      return true;
+    }
+
+    IDispatchPtr disp;
+    IAccessiblePtr parent;
+    if (SUCCEEDED(A11Y_CALL(get_accParent, acc, &disp)) && disp &&
+        SUCCEEDED(A11Y_CALL(QueryInterface, disp, IID_IAccessible,
+                            (void**)&parent))) {
+      IAccessible2Ptr parent2(AccNode(parent).IA2());
+      if (parent2) {
+        A11Y_CALL(get_uniqueID, parent2, &aOut.mParentId);
+      }
+    }
+    return true;
+  }
+
+  bool GetChildIds(long aUniqueId, vector<long>& aOut) override {
+    AccNode acc(Resolve(aUniqueId));
+    if (!acc) {
+      return false;
+    }
+
+    GetChildren(acc, mChildren);
+    for (AccNode& child : mChildren) {
+      IAccessible2Ptr child2(child.IA2());
+      long uniqueId;
+      if (child2 && SUCCEEDED(A11Y_CALL(get_uniqueID, child2, &uniqueId))) {
+        aOut.push_back(uniqueId);
+      }
+    }
+    return true;
+  }
+
+ private:
+  AccNode Resolve(long aUniqueId) {
+    if (aUniqueId == mRootId) {
+      return mRoot;
+    }
+
+    aspk::AutoVariant varChild(aUniqueId);
+
+    IDispatchPtr disp;
+    HRESULT hr = A11Y_CALL(get_accChild, mRoot, varChild.Get(), &disp);
+    if (FAILED(hr) || !disp) {
+      return AccNode();
+    }
+
+    IAccessiblePtr result;
+    A11Y_CALL(QueryInterface, disp, IID_IAccessible, (void**)&result);
+    return AccNode(result);
+  }
+
+  AccNode mRoot;
+  long mRootId;
+  vector<AccNode> mChildren;
+};
+
+static unsigned int gMirrorSeconds = 10;
+static aspk::TreeMirror* gMirror;
+static long gMirrorRootId;
+
+static void CALLBACK OnMirrorWinEvent(HWINEVENTHOOK aHook, DWORD aEvent,
+                                      HWND aHwnd, LONG aObjectId,
+                                      LONG aChildId, DWORD aEventThread,
+                                      DWORD aEventTime) {
+  if (!gMirror || aObjectId != OBJID_CLIENT) {
+    return;
+  }
+
+  aspk::MirrorEventType type;
+  switch (aEvent) {
+    case EVENT_OBJECT_SHOW:
+      type = aspk::MirrorEventType::Show;
+      break;
+    case EVENT_OBJECT_HIDE:
+      type = aspk::MirrorEventType::Hide;
+      break;
+    case EVENT_OBJECT_REORDER:
+      type = aspk::MirrorEventType::Reorder;
+      break;
+    case EVENT_OBJECT_NAMECHANGE:
+      type = aspk::MirrorEventType::NameChange;
+      break;
+    case EVENT_OBJECT_STATECHANGE:
+      type = aspk::MirrorEventType::StateChange;
+      break;
+    default:
+      return;
+  }
+
+  // Gecko fires events with the target's uniqueID as the child ID.
+  long uniqueId = aChildId == CHILDID_SELF ? gMirrorRootId : aChildId;
+  gMirror->Enqueue(aspk::MirrorEvent{type, uniqueId, NowUs()});
+}
+
+/**
+ * Mirrors the tree, then keeps the mirror up to date from WinEvents for
+ * gMirrorSeconds while the user interacts with the page. Finally the mirror is
+ * compared against a fresh full walk to see how stale it became.
+ */
+static bool MirrorTree(HWND aHwnd, const AccNode& aAcc) {
+  IAccessible2Ptr acc2(aAcc.IA2());
+  if (!acc2) {
+    return false;
+  }
+  HRESULT hr = A11Y_CALL(get_uniqueID, acc2, &gMirrorRootId);
+  HRCHECK("get_uniqueID(root)");
+
+  ComMirrorSource source(aAcc, gMirrorRootId);
+  aspk::TreeMirror mirror(source);
+
+  uint64_t start = NowUs();
+  if (!mirror.Build(gMirrorRootId)) {
+    Print("Failed to build mirror\n");
+    return false;
+  }
+  uint64_t buildUs = NowUs() - start;
+  Print("Mirrored %zu nodes in %g ms\n", mirror.Size(), buildUs / 1000.0);
+
+  vector<long> docs;
+  start = NowUs();
+  mirror.FindRole(ROLE_SYSTEM_DOCUMENT, docs);
+  Print("Found %zu documents in the mirror in %llu us\n", docs.size(),
+        NowUs() - start);
+
+  DWORD pid = 0;
+  ::GetWindowThreadProcessId(aHwnd, &pid);
+  HWINEVENTHOOK hook = ::SetWinEventHook(
+      EVENT_OBJECT_SHOW, EVENT_OBJECT_NAMECHANGE, nullptr, &OnMirrorWinEvent,
+      pid, 0, WINEVENT_OUTOFCONTEXT);
+  if (!hook) {
+    Print("SetWinEventHook failed\n");
+    return false;
+  }
+  gMirror = &mirror;
+
+  Prompt("Listening for events for %u seconds...\n", gMirrorSeconds);
+
+  uint64_t patchUs = 0;
+  const uint64_t deadline = NowUs() + gMirrorSeconds * 1000000ULL;
+  for (uint64_t now = NowUs(); now < deadline; now = NowUs()) {
+    DWORD waitMs = static_cast<DWORD>((deadline - now) / 1000);
+    ::MsgWaitForMultipleObjects(0, nullptr, FALSE, waitMs, QS_ALLINPUT);
+
+    MSG msg;
+    while (::PeekMessage(&msg, nullptr, 0, 0, PM_REMOVE)) {
+      ::TranslateMessage(&msg);
+      ::DispatchMessage(&msg);
+    }
+
+    if (mirror.PendingCount()) {
+      uint64_t patchStart = NowUs();
+      mirror.ApplyPending(patchStart);
+      patchUs += NowUs() - patchStart;
+    }
+  }
+
+  ::UnhookWinEvent(hook);
+  gMirror = nullptr;
+
+  aspk::TreeMirror fresh(source);
+  start = NowUs();
+  fresh.Build(gMirrorRootId);
+  uint64_t rewalkUs = NowUs() - start;
+
+  const aspk::MirrorUpdateStats& stats = mirror.Stats();
+  Print("Events: %llu received, %llu applied, %llu coalesced, %llu ignored\n",
+        stats.mEventsReceived, stats.mEventsApplied, stats.mEventsCoalesced,
+        stats.mEventsIgnored);
+  Print("Nodes: %llu added, %llu removed, %llu refreshed\n",
+        stats.mNodesAdded, stats.mNodesRemoved, stats.mNodesRefreshed);
+  Print("Event-to-mirror latency: mean %g us, max %llu us\n",
+        stats.MeanLatencyUs(), stats.mMaxLatencyUs);
+  Print("Total patch time: %g ms; full re-walk: %g ms (%zu nodes)\n",
+        patchUs / 1000.0, rewalkUs / 1000.0, fresh.Size());
+  Print("Stale nodes in mirror versus re-walk: %zu\n",
+        mirror.CountDifferences(fresh));
+
+  aspk::DiffTree mirrorTree, freshTree;
+  mirrorTree.LoadMirror(mirror);
+  freshTree.LoadMirror(fresh);
+  vector<aspk::TreeEdit> edits;
+  aspk::TreeDiffStats diffStats;
+  aspk::DiffTrees(mirrorTree, freshTree, edits, diffStats);
+  PrintTreeDiff(mirrorTree, freshTree, edits, diffStats);
+  return true;
+}
+
+/**
+ * Captures the tree, waits gDiffSeconds while the user interacts with the
+ * page, captures it again and prints the edits between the two. With
+ * -snapshot, the first capture is loaded from that snapshot instead.
+ */
+static bool DiffLiveTree(const AccNode& aAcc) {
+  LARGE_INTEGER start, end;
+  aspk::DiffTree before, after;
+  ResetCounters();
+
+  if (gSnapshotPath) {
+    aspk::MappedSnapshot mapped;
+    if (!mapped.Open(gSnapshotPath) || !mapped.View().Validate() ||
+        !before.LoadSnapshot(mapped.View())) {
+      Print("Could not load snapshot \"%S\"\n", gSnapshotPath);
+      return false;
+    }
+    Print("Loaded %zu nodes from \"%S\"\n", before.Size(), gSnapshotPath);
+  } else {
+    QueryPerformanceCounter(&start);
+    CaptureDiffTree(aAcc, before);
+    QueryPerformanceCounter(&end);
+    Print("Captured %zu nodes in %g ms\n", before.Size(),
+          ElapsedMs(start, end));
+    Prompt("Waiting %u seconds before capturing again...\n", gDiffSeconds);
+    ::Sleep(gDiffSeconds * 1000);
+  }
+
+  QueryPerformanceCounter(&start);
+  CaptureDiffTree(aAcc, after);
+  QueryPerformanceCounter(&end);
+  Print("Captured %zu nodes in %g ms\n", after.Size(), ElapsedMs(start, end));
+
+  vector<aspk::TreeEdit> edits;
+  aspk::TreeDiffStats stats;
+  QueryPerformanceCounter(&start);
+  aspk::DiffTrees(before, after, edits, stats);
+  QueryPerformanceCounter(&end);
+  PrintTreeDiff(before, after, edits, stats);
+  Print("Computed %zu edits in %g ms\n", edits.size(), ElapsedMs(start, end));
+  PrintCounters();
+  return true;
+}
+
+static bool CountTopLevelChildren(const AccNode& aAcc) {
+  IServiceProviderPtr svcProv;
+  HRESULT hr = A11Y_CALL(QueryInterface, aAcc, IID_IServiceProvider,
+                         (void**)&svcProv);
+  HRCHECK("QI(IServiceProvider)");
+  Print("IServiceProvider: 0x%p\n", svcProv.GetInterfacePtr());
+
+  IAccessible2Ptr acc2;
+  hr = A11Y_CALL(QueryService, svcProv, IID_IAccessible2, IID_IAccessible2,
+                 (void**)&acc2);
+  HRCHECK("svcProv->QueryService");
+
+  long rootUniqueId;
+  hr = A11Y_CALL(get_uniqueID, acc2, &rootUniqueId);
+  HRCHECK("acc2->get_uniqueID");
+  Print("Root accessible's IA2 unique ID is %d\n", rootUniqueId);
+
+  // Let's try to get a document
+  long childCount = 0;
+  hr = A11Y_CALL(get_accChildCount, aAcc, &childCount);
+  HRCHECK("get_accChildCount(root)");
+
+  Print("Root accessible has %d children:\n\n", childCount);
+  return true;
+}
+
+enum A11yTests {
+  NONE = 0,
+  DUMP_TOP_LEVEL_ACCESSIBLE = 1,
+  DUMP_FIRST_CHILD = 2,
+  ENUM_CHILDREN = 4,
+  NAVIGATE_TOP_LEVEL_CHILDREN = 8,
+  COUNT_TOP_LEVEL_CHILDREN = 0x10,
+  PARENT_CHILD_NAVIGATION = 0x20,
+  ROOT_ACCESSIBLE_UNIQUE_ID = 0x40,
+  FIND_DOCUMENT = 0x80,
+  SPEED_ALL = 0x100,
+  SPEED_VISIBLE = 0x200,
+  DUMP_ENTIRE_TREE = 0x400,
+  MIRROR_TREE = 0x800,
+  FIND_ROLES = 0x1000,
+  SELECT = 0x2000,
+  DIFF_TREE = 0x4000,
+  REF_FOOTPRINT = 0x8000,
+  PROCESS_WALK = 0x10000,
+  RUN_ALL = UINT32_MAX,
+  // XXX: Update this when changing the enum!
+  NUM_A11Y_TESTS = 19
+};
+
+static const wchar_t kSwitchHwnd[] = L"-hwnd";
+static const wchar_t kSwitchForceSelector[] = L"-s";
+static const wchar_t kSwitchChildStrategy[] = L"-children";
+static const wchar_t kSwitchThreads[] = L"-threads";
+static const wchar_t kSwitchMirrorSeconds[] = L"-mirror-seconds";
+static const wchar_t kSwitchProperties[] = L"-props";
+static const wchar_t kSwitchWarmup[] = L"-warmup";
+static const wchar_t kSwitchIterations[] = L"-iterations";
+static const wchar_t kSwitchKeepOutliers[] = L"-keep-outliers";
+static const wchar_t kSwitchJson[] = L"-json";
+static const wchar_t kSwitchCsv[] = L"-csv";
+static const wchar_t kSwitchBaseline[] = L"-baseline";
+static const wchar_t kSwitchThreshold[] = L"-threshold";
+static const wchar_t kSwitchSnapshot[] = L"-snapshot";
+static const wchar_t kSwitchSyncOutput[] = L"-sync-output";
+static const wchar_t kSwitchExcludeOutputTime[] = L"-exclude-output-time";
+static const wchar_t kSwitchTrace[] = L"-trace";
+static const wchar_t kSwitchBatch[] = L"-batch";
+static const wchar_t kSwitchEnumTree[] = L"-enum-tree";
+static const wchar_t kSwitchViewport[] = L"-viewport";
+static const wchar_t kSwitchBoundRefs[] = L"-bound-refs";
+static const wchar_t kSwitchOrder[] = L"-order";
+static const wchar_t kSwitchMaxDepth[] = L"-max-depth";
+static const wchar_t kSwitchPrune[] = L"-prune";
+static const wchar_t kSwitchSelector[] = L"-selector";
+static const wchar_t kSwitchLimit[] = L"-limit";
+static const wchar_t kSwitchDiffSeconds[] = L"-diff-seconds";
+
+static const A11yTests kTests[] = {
+    NONE,
+    DUMP_TOP_LEVEL_ACCESSIBLE,
     DUMP_FIRST_CHILD,
-    ENUM_TOP_LEVEL_CHILDREN,
+    ENUM_CHILDREN,
     NAVIGATE_TOP_LEVEL_CHILDREN,
     COUNT_TOP_LEVEL_CHILDREN,
     PARENT_CHILD_NAVIGATION,
@@ -862,13 +3096,19 @@ static const A11yTests kTests[] = {
     SPEED_ALL,
     SPEED_VISIBLE,
     DUMP_ENTIRE_TREE,
+    MIRROR_TREE,
+    FIND_ROLES,
+    SELECT,
+    DIFF_TREE,
+    REF_FOOTPRINT,
+    PROCESS_WALK,
     RUN_ALL,
 };
 
 static const wchar_t* kTestNames[] = {L"none",
                                       L"dump-top-level",
                                       L"dump-first-child",
-                                      L"enum-top-level-children",
+                                      L"enum-children",
                                       L"navigate-top-level-children",
                                       L"count-top-level-children",
                                       L"parent-child-navigation",
@@ -877,35 +3117,198 @@ static const wchar_t* kTestNames[] = {L"none",
                                       L"speed-all",
                                       L"speed-visible",
                                       L"dump-entire-tree",
+                                      L"mirror-tree",
+                                      L"find-roles",
+                                      L"select",
+                                      L"diff-tree",
+                                      L"ref-footprint",
+                                      L"process-walk",
                                       L"all"};
 
 static_assert(ArrayLength(kTests) == ArrayLength(kTestNames) &&
                   ArrayLength(kTests) == NUM_A11Y_TESTS,
               "You changed the enum! Update kTests and kTestNames!");
 
+// Old command names, still accepted so that existing scripts keep working.
+static const struct {
+  const wchar_t* mName;
+  A11yTests mTest;
+} kTestAliases[] = {
+    {L"enum-top-level-children", ENUM_CHILDREN},
+};
+
 static void Usage(wchar_t* aArgv0) {
-  printf("Usage: %S [-hwnd <hwnd>|-s] <command(s)>\n\n", aArgv0);
-  printf(
+  Print(
+      "Usage: %S [-hwnd <hwnd>|-s] [-children navigate|bulk] [-threads <n>] "
+      "<command(s)>\n\n",
+      aArgv0);
+  Print(
       "If -hwnd is not specified, we will try to find the Firefox window.\n");
-  printf("If we cannot find the window, or if there are multiple windows,\n");
-  printf(
+  Print("If we cannot find the window, or if there are multiple windows,\n");
+  Print(
       "a window selector will be displayed to the user to select the window\n");
-  printf("using the mouse.\n\n");
-  printf(
+  Print("using the mouse.\n\n");
+  Print(
       "If -s is specified, we will unconditionally use the window selector.\n");
-  printf(
+  Print(
+      "-children selects how child accessibles are fetched during tree walks:\n"
+      "\"navigate\" (the default) issues one accNavigate per child, \"bulk\"\n"
+      "fetches all children through IEnumVARIANT in one chunked call.\n"
+      "speed-* commands always report both.\n"
+      "-batch <n>|all sets how many children bulk fetches request per\n"
+      "IEnumVARIANT::Next call (default %zu).\n\n",
+      aspk::kMaxChildChunk);
+  Print(
+      "speed-visible skips children whose states are invisible or\n"
+      "offscreen. -viewport runs it again, also pruning every visible\n"
+      "subtree whose accLocation box lies outside the window's client area,\n"
+      "and reports the nodes and time that saves. Subtrees with empty boxes\n"
+      "are kept, since their content may overflow them.\n\n");
+  Print(
+      "-bound-refs makes tree walks hold only the path to the current node\n"
+      "and step to each sibling with accNavigate, instead of holding every\n"
+      "sibling still to be visited, so that the proxies kept alive in both\n"
+      "processes are bounded by the tree's depth. ref-footprint walks the\n"
+      "visible tree both ways and compares the most proxies held and the\n"
+      "growth of the target's private bytes.\n\n");
+  Print(
+      "-order dfs|bfs walks trees depth-first in document order (the\n"
+      "default) or breadth-first. -max-depth <n> stops walks n levels below\n"
+      "their root. -prune <list> skips the subtrees of children that match\n"
+      "any of a comma-separated list of \"invisible\", \"chrome\",\n"
+      "\"content\" (by IA2 uniqueID) and role names as -selector spells\n"
+      "them, at the cost of a call or two per child. Both apply to every\n"
+      "walk except mirror-tree; snapshots and diff-tree are always\n"
+      "breadth-first, and bounded walks depth-first.\n\n");
+  Print(
+      "process-walk walks the tree with one MTA thread per process that\n"
+      "serves it, as told by IA2 uniqueIDs, handing each subtree to the\n"
+      "thread for its process. Every node's properties are queried as\n"
+      "speed-visible does. It reports the nodes, round-trips, busy time and\n"
+      "per-node latency of each process, and the slowest one.\n\n");
+  Print(
+      "enum-children fetches every top-level child through\n"
+      "IEnumVARIANT::Next, or every node in the tree with -enum-tree, with\n"
+      "batches of 1, 4, 16, 64 and all children (or only the -batch size)\n"
+      "and reports the throughput and round-trips of each. Its old name,\n"
+      "enum-top-level-children, still works.\n\n");
+  Print(
+      "-threads <n> walks the tree on n MTA worker threads that steal\n"
+      "subtrees from each other. speed-* commands report the speedup for\n"
+      "1, 2, 4, ... n threads; dump-entire-tree runs once on n threads.\n"
+      "Output is always merged in document order.\n\n");
+  Print(
+      "-warmup <n> runs each speed-* benchmark n times before measuring.\n"
+      "-iterations <n> measures it n times (default 1) and reports min,\n"
+      "median, mean, stddev, p90, p99 and a 95%% confidence interval.\n"
+      "Outliers beyond 1.5 IQR are rejected unless -keep-outliers is\n"
+      "given.\n\n");
+  Print(
+      "-props <list> restricts the per-node queries made by speed-* commands\n"
+      "to a comma-separated subset of:\n\t");
+  for (uint32_t i = 0; i < aspk::kNumAccProperties; ++i) {
+    Print("%s%s", i ? "," : "",
+          aspk::AccPropertyName(static_cast<AccProperty>(i)));
+  }
+  Print(
+      "\nThe default is \"all\". Per-property call counts and latencies are\n"
+      "reported after each run. The attributes latency includes parsing\n"
+      "out tag, display, xml-roles and level, as screen readers do.\n\n");
+  Print(
+      "-json <file> and -csv <file> save the results of speed-* commands\n"
+      "along with the target's exe path and app/toolkit versions.\n"
+      "-baseline <file> compares them with a CSV saved by an earlier run\n"
+      "and exits with status 2 if the median time or round trips of any\n"
+      "result grew by more than -threshold <percent> (default 10).\n\n");
+  Print(
+      "Output is written by a background thread so that console I/O stays\n"
+      "out of the timed traversals; -sync-output writes it directly instead.\n"
+      "-exclude-output-time also subtracts the time spent formatting output\n"
+      "from speed-* results. For parallel walks that time is divided evenly\n"
+      "between the threads.\n\n");
+  Print(
+      "Every accessibility call made by any command is timed; counts and\n"
+      "p50/p90/p99/p99.9 latencies per method are printed on exit.\n"
+      "Each node's IServiceProvider and IAccessible2 are looked up at most\n"
+      "once; node counts are followed by the lookups that saved.\n\n");
+  Print(
+      "-snapshot <file> makes dump-entire-tree write a compact binary\n"
+      "snapshot (roles, states, IA2 states, uniqueIDs, tree structure and\n"
+      "interned names) instead of printing every node, then maps it back\n"
+      "in to verify it. Snapshots are always written on one thread.\n\n");
+  Print(
+      "-trace <file> records a binary trace of the interfaces and calls made\n"
+      "while walking. Format strings are stored once and arguments are\n"
+      "copied raw, so tracing barely slows the walk; run tracedecode.exe\n"
+      "<file> to turn the trace into text.\n\n");
+  Print(
+      "find-document stops walking at the first visible document.\n"
+      "find-roles indexes every node by its MSAA and IA2 roles in one walk,\n"
+      "lists the documents, links and headings from the index, then\n"
+      "compares it with one walk per role.\n\n");
+  Print(
+      "select walks the tree for the nodes matching -selector <selector>\n"
+      "(default \"%S\"), stopping after -limit <n> matches\n"
+      "if given. Selectors chain role names or * with \">\" (child) or\n"
+      "spaces (descendant); each may be followed by tests such as\n"
+      "[role=link], [state!=invisible], [ia2state=editable], [name*=text]\n"
+      "and [attr:level=2]. Subtrees of invisible or offscreen nodes are\n"
+      "skipped when the last step excludes those states.\n\n",
+      kDefaultSelector);
+  Print(
+      "mirror-tree copies the tree once, keeps the copy current from\n"
+      "WinEvents for -mirror-seconds <n> seconds (default 10), then compares\n"
+      "it with a fresh walk, including an edit script between the two.\n\n");
+  Print(
+      "diff-tree captures the tree, waits -diff-seconds <n> seconds\n"
+      "(default 10) while you interact with the page, captures it again and\n"
+      "prints the inserts, removes, moves and property changes between the\n"
+      "two, matching nodes by IA2 uniqueID and otherwise by position. With\n"
+      "-snapshot <file> it compares that snapshot with the live tree.\n\n");
+  Print(
       "<command> may be one or more of the following (separated by "
       "spaces):\n\n");
 
   // Start at 1 to skip "none"
   for (size_t i = 1; i < ArrayLength(kTestNames); ++i) {
-    printf("\t%S\n", kTestNames[i]);
+    Print("\t%S\n", kTestNames[i]);
   }
-  printf("\n");
+  Print("\n");
 }
 
 static bool gForceWindowSelector;
 
+// Parses a comma-separated list of "invisible", "chrome", "content" and role
+// names as selectors spell them.
+static bool ParsePruneRules(const wchar_t* aSpec, aspk::PruneRules& aOut) {
+  aspk::PruneRules rules;
+  const wchar_t* cur = aSpec;
+
+  while (true) {
+    const wchar_t* comma = wcschr(cur, L',');
+    wstring name(cur, comma ? comma - cur : wcslen(cur));
+    long role;
+    if (name == L"invisible") {
+      rules.mInvisible = true;
+    } else if (name == L"chrome") {
+      rules.mChrome = true;
+    } else if (name == L"content") {
+      rules.mContent = true;
+    } else if (aspk::LookupRoleName(name, role)) {
+      rules.mRoles.push_back(role);
+    } else {
+      return false;
+    }
+    if (!comma) {
+      break;
+    }
+    cur = comma + 1;
+  }
+
+  aOut = move(rules);
+  return true;
+}
+
 static bool ParseCommandLine(int argc, wchar_t* argv[], HWND& aOutHwnd,
                              uint32_t& aOutTestsToRun) {
   aOutHwnd = nullptr;
@@ -924,12 +3327,193 @@ static bool ParseCommandLine(int argc, wchar_t* argv[], HWND& aOutHwnd,
       continue;
     }
 
+    if (!wcscmp(argv[i], kSwitchWarmup) && (i + 1) < argc) {
+      gWarmupIterations = wcstoul(argv[i + 1], nullptr, 0);
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchIterations) && (i + 1) < argc) {
+      gMeasuredIterations = wcstoul(argv[i + 1], nullptr, 0);
+      if (!gMeasuredIterations) {
+        gMeasuredIterations = 1;
+      }
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchKeepOutliers)) {
+      gRejectOutliers = false;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchJson) && (i + 1) < argc) {
+      gJsonPath = argv[++i];
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchCsv) && (i + 1) < argc) {
+      gCsvPath = argv[++i];
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchBaseline) && (i + 1) < argc) {
+      gBaselinePath = argv[++i];
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchSyncOutput)) {
+      gSyncOutput = true;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchExcludeOutputTime)) {
+      gExcludeOutputTime = true;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchSnapshot) && (i + 1) < argc) {
+      gSnapshotPath = argv[++i];
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchBatch) && (i + 1) < argc) {
+      ++i;
+      if (!wcscmp(argv[i], L"all")) {
+        gBatchSize = aspk::kUnboundedChildChunk;
+      } else {
+        gBatchSize = wcstoul(argv[i], nullptr, 10);
+        if (!gBatchSize) {
+          return false;
+        }
+      }
+      gBatchSizeSet = true;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchViewport)) {
+      gCompareViewportCulling = true;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchBoundRefs)) {
+      gBoundRefs = true;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchOrder) && (i + 1) < argc) {
+      ++i;
+      if (!wcsicmp(argv[i], L"dfs")) {
+        gWalkOptions.mOrder = aspk::WalkOrder::DepthFirst;
+      } else if (!wcsicmp(argv[i], L"bfs")) {
+        gWalkOptions.mOrder = aspk::WalkOrder::BreadthFirst;
+      } else {
+        Print("Unknown walk order \"%S\"\n", argv[i]);
+        return false;
+      }
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchMaxDepth) && (i + 1) < argc) {
+      gWalkOptions.mMaxDepth = wcstoul(argv[i + 1], nullptr, 0);
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchPrune) && (i + 1) < argc) {
+      ++i;
+      if (!ParsePruneRules(argv[i], gWalkOptions.mPrune)) {
+        Print("Invalid prune list \"%S\"\n", argv[i]);
+        return false;
+      }
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchEnumTree)) {
+      gEnumWholeTree = true;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchTrace) && (i + 1) < argc) {
+      gTracePath = argv[++i];
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchSelector) && (i + 1) < argc) {
+      gSelector = argv[++i];
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchLimit) && (i + 1) < argc) {
+      gSelectLimit = wcstoul(argv[i + 1], nullptr, 0);
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchThreshold) && (i + 1) < argc) {
+      gRegressionThresholdPercent = wcstod(argv[i + 1], nullptr);
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchProperties) && (i + 1) < argc) {
+      ++i;
+      if (!aspk::ParseAccPropertyMask(argv[i], gPropertyMask)) {
+        Print("Invalid property list \"%S\"\n", argv[i]);
+        return false;
+      }
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchMirrorSeconds) && (i + 1) < argc) {
+      gMirrorSeconds = wcstoul(argv[i + 1], nullptr, 0);
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchDiffSeconds) && (i + 1) < argc) {
+      gDiffSeconds = wcstoul(argv[i + 1], nullptr, 0);
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchThreads) && (i + 1) < argc) {
+      gThreadCount = wcstoul(argv[i + 1], nullptr, 0);
+      if (!gThreadCount) {
+        gThreadCount = 1;
+      }
+      ++i;
+      continue;
+    }
+
+    if (!wcscmp(argv[i], kSwitchChildStrategy) && (i + 1) < argc) {
+      ++i;
+      bool found = false;
+      for (size_t j = 0; j < ArrayLength(kChildStrategyNames); ++j) {
+        if (!wcsicmp(argv[i], kChildStrategyNames[j])) {
+          gChildStrategy = kAllChildStrategies[j];
+          found = true;
+          break;
+        }
+      }
+      if (!found) {
+        Print("Unknown child strategy \"%S\"\n", argv[i]);
+        return false;
+      }
+      continue;
+    }
+
     for (int j = 0; j < ArrayLength(kTestNames); ++j) {
       if (!wcscmp(argv[i], kTestNames[j])) {
         aOutTestsToRun |= kTests[j];
         break;
       }
     }
+    for (const auto& alias : kTestAliases) {
+      if (!wcscmp(argv[i], alias.mName)) {
+        aOutTestsToRun |= alias.mTest;
+      }
+    }
   }
 
   if (aOutTestsToRun == NONE) {
@@ -942,12 +3526,66 @@ static bool ParseCommandLine(int argc, wchar_t* argv[], HWND& aOutHwnd,
 #define RUN_CMD(flag, fn)                             \
   do {                                                \
     if ((testsToRun & flag) && !fn) {                 \
-      printf("Command %s failed, aborting\n", #flag); \
-      fflush(stdout);                                 \
+      Print("Command %s failed, aborting\n", #flag); \
+      SyncStdout();                                   \
       return 1;                                       \
     }                                                 \
   } while (false)
 
+// Starts gOutputSink for the lifetime of wmain, unless -sync-output was given.
+class AutoOutputSink {
+ public:
+  AutoOutputSink() {
+    if (!gSyncOutput) {
+      gOutputSink.Start(stdout);
+    }
+  }
+
+  ~AutoOutputSink() { gOutputSink.Stop(); }
+};
+
+// Records a binary trace to gTracePath for the lifetime of wmain.
+class AutoTrace {
+ public:
+  AutoTrace() {
+    if (!gTracePath) {
+      return;
+    }
+    if (_wfopen_s(&mFile, gTracePath, L"wb") || !mFile) {
+      Print("Could not open \"%S\" for writing\n", gTracePath);
+      mFile = nullptr;
+      return;
+    }
+    if (!aspk::Tracer::Start(mFile)) {
+      Print("Could not start tracing to \"%S\"\n", gTracePath);
+    }
+  }
+
+  ~AutoTrace() {
+    if (!mFile) {
+      return;
+    }
+    aspk::Tracer::Stop();
+    fclose(mFile);
+    Print("Wrote %llu trace events (%llu dropped) to \"%S\"\n",
+          aspk::Tracer::EventsWritten(), aspk::Tracer::EventsDropped(),
+          gTracePath);
+  }
+
+ private:
+  FILE* mFile = nullptr;
+};
+
+// Dumps the per-method latency histograms when wmain returns, whichever
+// command it returns from.
+class AutoPrintMethodLatencies {
+ public:
+  ~AutoPrintMethodLatencies() {
+    Print("\nPer-method latencies:\n");
+    aspk::MethodLatencies::Get().Print(SyncStdout());
+  }
+};
+
 extern "C" int wmain(int argc, wchar_t* argv[]) {
   HWND hwnd = nullptr;
   uint32_t testsToRun = NONE;
@@ -956,6 +3594,8 @@ extern "C" int wmain(int argc, wchar_t* argv[]) {
     return 1;
   }
 
+  AutoOutputSink outputSink;
+  AutoTrace trace;
   mozilla::STARegion sta;
 
   if (gForceWindowSelector) {
@@ -968,49 +3608,73 @@ extern "C" int wmain(int argc, wchar_t* argv[]) {
   WCHAR className[256] = {0};
   GetWindowText(hwnd, caption, ArrayLength(caption));
   GetClassName(hwnd, className, ArrayLength(className));
-  printf("HWND: %p \"%S\" \"%S\"\n", hwnd, className, caption);
+  Print("HWND: %p \"%S\" \"%S\"\n", hwnd, className, caption);
   if (!hwnd || !IsWindow(hwnd)) {
-    printf("Invalid HWND\n");
+    Print("Invalid HWND\n");
     return 1;
   }
 
   wstring ia2path(GetExeDirForWindow(hwnd));
   if (ia2path.empty()) {
-    printf("Could not find exe dir for the selected hwnd!\n");
+    Print("Could not find exe dir for the selected hwnd!\n");
     return 1;
   }
 
   ia2path += L"ia2marshal.dll";
-  printf("Registering \"%S\"\n", ia2path.c_str());
+  Print("Registering \"%S\"\n", ia2path.c_str());
 
   auto proxyDll(mozilla::mscom::RegisterProxyDll(ia2path.c_str()));
   if (!proxyDll) {
-    printf(
+    Print(
         "NULL proxyDll! Are you sure that the test bitness matches the proxy "
         "DLL?\n");
     return 1;
   }
 
+  AutoPrintMethodLatencies printLatenciesAtExit;
+
   // Obtain an interface from the HWND
   IAccessiblePtr topLevelAcc;
-  HRESULT hr = AccessibleObjectFromWindow(hwnd, OBJID_CLIENT, IID_IAccessible,
-                                          (void**)&topLevelAcc);
+  HRESULT hr = A11Y_CALL_FN(AccessibleObjectFromWindow, hwnd, OBJID_CLIENT,
+                            IID_IAccessible, (void**)&topLevelAcc);
   if (FAILED(hr)) {
-    printf("AccessibleObjectFromWindow failed with HRESULT 0x%08lX\n", hr);
+    Print("AccessibleObjectFromWindow failed with HRESULT 0x%08lX\n", hr);
     return 1;
   }
-  printf("OBJID_CLIENT IAccessible: 0x%p\n", topLevelAcc.GetInterfacePtr());
+  Print("OBJID_CLIENT IAccessible: 0x%p\n", topLevelAcc.GetInterfacePtr());
+  AccNode topLevel(topLevelAcc);
 
-  RUN_CMD(DUMP_TOP_LEVEL_ACCESSIBLE, DumpTopLevelAcc(topLevelAcc));
-  RUN_CMD(FIND_DOCUMENT, FindDocument(topLevelAcc));
+  RUN_CMD(DUMP_TOP_LEVEL_ACCESSIBLE, DumpTopLevelAcc(topLevel));
+  RUN_CMD(FIND_DOCUMENT, FindDocument(topLevel));
   RUN_CMD(SPEED_ALL, SpeedAll(hwnd));
-  RUN_CMD(SPEED_VISIBLE, SpeedVisible(hwnd, topLevelAcc));
-  RUN_CMD(ENUM_TOP_LEVEL_CHILDREN, EnumTopLevelChildren(topLevelAcc));
-  RUN_CMD(PARENT_CHILD_NAVIGATION, ParentChildNavigation(topLevelAcc));
-  RUN_CMD(NAVIGATE_TOP_LEVEL_CHILDREN, NavigateTopLevelChildren(topLevelAcc));
-  RUN_CMD(DUMP_ENTIRE_TREE, DumpEntireTree(topLevelAcc));
-  RUN_CMD(COUNT_TOP_LEVEL_CHILDREN, CountTopLevelChildren(topLevelAcc));
-
-  fflush(stdout);
+  RUN_CMD(SPEED_VISIBLE, SpeedVisible(hwnd, topLevel));
+  RUN_CMD(ENUM_CHILDREN, EnumChildren(topLevel));
+  RUN_CMD(PARENT_CHILD_NAVIGATION, ParentChildNavigation(topLevel));
+  RUN_CMD(NAVIGATE_TOP_LEVEL_CHILDREN, NavigateTopLevelChildren(topLevel));
+  RUN_CMD(DUMP_ENTIRE_TREE, DumpEntireTree(hwnd, topLevel));
+  RUN_CMD(COUNT_TOP_LEVEL_CHILDREN, CountTopLevelChildren(topLevel));
+  RUN_CMD(MIRROR_TREE, MirrorTree(hwnd, topLevel));
+  RUN_CMD(FIND_ROLES, FindRoles(topLevel));
+  RUN_CMD(SELECT, Select(topLevel));
+  RUN_CMD(DIFF_TREE, DiffLiveTree(topLevel));
+  RUN_CMD(REF_FOOTPRINT, RefFootprint(hwnd, topLevel));
+  RUN_CMD(PROCESS_WALK, ProcessWalkTree(hwnd));
+
+  if (gJsonPath || gCsvPath || gBaselinePath) {
+    CollectBenchMetadata(hwnd, topLevel);
+  }
+  if (gJsonPath &&
+      !WriteBenchReport(gJsonPath, &aspk::BenchReport::WriteJson)) {
+    return 1;
+  }
+  if (gCsvPath && !WriteBenchReport(gCsvPath, &aspk::BenchReport::WriteCsv)) {
+    return 1;
+  }
+  if (gBaselinePath && !CompareWithBaseline()) {
+    SyncStdout();
+    return 2;
+  }
+
+  SyncStdout();
   return 0;
 }
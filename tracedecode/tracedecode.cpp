@@ -0,0 +1,616 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Turns a binary trace written by a11ytest -trace back into text, one line
+// per event in timestamp order:
+//
+//   <ms since first event> T<thread> <file>:<line> <formatted message>
+//
+// "tracedecode check" instead records traces through the Tracer and checks
+// that they decode to what was recorded.
+
+#include "Trace.h"
+#include "TraceFormat.h"
+#include "Utf8.h"
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace aspk;
+
+namespace {
+
+struct Site {
+  bool mValid = false;
+  uint32_t mLine = 0;
+  std::vector<TraceArgType> mTypes;
+  std::string mFile;
+  std::string mFormat;
+};
+
+struct Arg {
+  TraceArgType mType;
+  int64_t mInt;
+  uint64_t mUInt;
+  double mDouble;
+  std::string mString;  // UTF-8
+};
+
+struct Event {
+  uint64_t mTimestamp;
+  uint32_t mThreadId;
+  std::string mText;
+};
+
+class Reader {
+ public:
+  Reader(const uint8_t* aData, size_t aLen) : mData(aData), mLen(aLen) {}
+
+  bool AtEnd() const { return mPos == mLen; }
+  bool Failed() const { return mFailed; }
+
+  template <typename T>
+  T Read() {
+    T value = T();
+    ReadBytes(&value, sizeof(value));
+    return value;
+  }
+
+  void ReadBytes(void* aOut, size_t aLen) {
+    if (mFailed || aLen > mLen - mPos) {
+      mFailed = true;
+      return;
+    }
+    if (aLen) {
+      memcpy(aOut, mData + mPos, aLen);
+    }
+    mPos += aLen;
+  }
+
+  std::string ReadString(size_t aLen) {
+    std::string str;
+    if (mFailed || aLen > mLen - mPos) {
+      mFailed = true;
+      return str;
+    }
+    str.assign(reinterpret_cast<const char*>(mData + mPos), aLen);
+    mPos += aLen;
+    return str;
+  }
+
+  Reader Sub(size_t aLen) {
+    if (mFailed || aLen > mLen - mPos) {
+      mFailed = true;
+      return Reader(nullptr, 0);
+    }
+    Reader sub(mData + mPos, aLen);
+    mPos += aLen;
+    return sub;
+  }
+
+ private:
+  const uint8_t* mData;
+  size_t mLen;
+  size_t mPos = 0;
+  bool mFailed = false;
+};
+
+std::string Utf16ToUtf8(const std::vector<uint16_t>& aUnits) {
+  std::string out;
+  AppendUtf8(aUnits.data(), aUnits.size(), out);
+  return out;
+}
+
+bool ReadArg(Reader& aReader, TraceArgType aType, Arg& aOut) {
+  aOut = Arg();
+  aOut.mType = aType;
+  switch (aType) {
+    case TraceArgType::Int32:
+      aOut.mInt = aReader.Read<int32_t>();
+      aOut.mUInt = static_cast<uint64_t>(aOut.mInt);
+      break;
+    case TraceArgType::UInt32:
+      aOut.mUInt = aReader.Read<uint32_t>();
+      aOut.mInt = static_cast<int64_t>(aOut.mUInt);
+      break;
+    case TraceArgType::Int64:
+      aOut.mInt = aReader.Read<int64_t>();
+      aOut.mUInt = static_cast<uint64_t>(aOut.mInt);
+      break;
+    case TraceArgType::UInt64:
+    case TraceArgType::Pointer:
+      aOut.mUInt = aReader.Read<uint64_t>();
+      aOut.mInt = static_cast<int64_t>(aOut.mUInt);
+      break;
+    case TraceArgType::Double:
+      aOut.mDouble = aReader.Read<double>();
+      break;
+    case TraceArgType::String:
+      aOut.mString = aReader.ReadString(aReader.Read<uint16_t>());
+      break;
+    case TraceArgType::WideString: {
+      std::vector<uint16_t> units(aReader.Read<uint16_t>());
+      aReader.ReadBytes(units.data(), units.size() * sizeof(uint16_t));
+      aOut.mString = Utf16ToUtf8(units);
+      break;
+    }
+    default:
+      return false;
+  }
+  return !aReader.Failed();
+}
+
+bool IsIntegerType(TraceArgType aType) {
+  return aType != TraceArgType::Double && aType != TraceArgType::String &&
+         aType != TraceArgType::WideString;
+}
+
+void AppendFormatted(std::string& aOut, const char* aFormat, ...) {
+  char buf[1024];
+  va_list args;
+  va_start(args, aFormat);
+  int len = vsnprintf(buf, sizeof(buf), aFormat, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+  if (static_cast<size_t>(len) < sizeof(buf)) {
+    aOut.append(buf, len);
+    return;
+  }
+
+  std::vector<char> big(static_cast<size_t>(len) + 1);
+  va_start(args, aFormat);
+  vsnprintf(big.data(), big.size(), aFormat, args);
+  va_end(args);
+  aOut.append(big.data(), len);
+}
+
+// Formats one printf conversion. aSpec holds the flags, width and precision
+// without the length modifier; the value's recorded type decides how it is
+// passed, so a mismatched conversion still prints something sensible.
+void FormatArg(std::string& aOut, std::string aSpec, char aConversion,
+               const Arg& aArg) {
+  switch (aConversion) {
+    case 'd':
+    case 'i':
+      if (IsIntegerType(aArg.mType)) {
+        AppendFormatted(aOut, (aSpec + "lld").c_str(),
+                        static_cast<long long>(aArg.mInt));
+        return;
+      }
+      break;
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'o':
+      if (IsIntegerType(aArg.mType)) {
+        AppendFormatted(aOut, (aSpec + "ll" + aConversion).c_str(),
+                        static_cast<unsigned long long>(aArg.mUInt));
+        return;
+      }
+      break;
+    case 'c':
+      if (IsIntegerType(aArg.mType)) {
+        std::string ch;
+        AppendUtf8(static_cast<uint32_t>(aArg.mUInt), ch);
+        AppendFormatted(aOut, (aSpec + "s").c_str(), ch.c_str());
+        return;
+      }
+      break;
+    case 'p':
+      if (IsIntegerType(aArg.mType)) {
+        // Match the MSVC runtime, which prints %p as 16 uppercase hex digits.
+        AppendFormatted(aOut, "%016llX",
+                        static_cast<unsigned long long>(aArg.mUInt));
+        return;
+      }
+      break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+      if (aArg.mType == TraceArgType::Double) {
+        AppendFormatted(aOut, (aSpec + aConversion).c_str(), aArg.mDouble);
+        return;
+      }
+      break;
+    case 's':
+    case 'S':
+      if (!IsIntegerType(aArg.mType) && aArg.mType != TraceArgType::Double) {
+        AppendFormatted(aOut, (aSpec + "s").c_str(), aArg.mString.c_str());
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+
+  // The conversion does not fit the recorded type; print the value plainly.
+  switch (aArg.mType) {
+    case TraceArgType::Double:
+      AppendFormatted(aOut, "%g", aArg.mDouble);
+      break;
+    case TraceArgType::String:
+    case TraceArgType::WideString:
+      aOut += aArg.mString;
+      break;
+    case TraceArgType::Int32:
+    case TraceArgType::Int64:
+      AppendFormatted(aOut, "%lld", static_cast<long long>(aArg.mInt));
+      break;
+    default:
+      AppendFormatted(aOut, "0x%llx",
+                      static_cast<unsigned long long>(aArg.mUInt));
+      break;
+  }
+}
+
+std::string FormatMessage(const Site& aSite, const std::vector<Arg>& aArgs) {
+  std::string out;
+  const std::string& fmt = aSite.mFormat;
+  size_t nextArg = 0;
+
+  for (size_t i = 0; i < fmt.size(); ++i) {
+    if (fmt[i] != '%') {
+      out += fmt[i];
+      continue;
+    }
+    if (i + 1 < fmt.size() && fmt[i + 1] == '%') {
+      out += '%';
+      ++i;
+      continue;
+    }
+
+    size_t start = i++;
+    std::string spec = "%";
+    while (i < fmt.size() && strchr("-+ #0", fmt[i])) {
+      spec += fmt[i++];
+    }
+    while (i < fmt.size() && (isdigit(static_cast<unsigned char>(fmt[i])) ||
+                              fmt[i] == '.')) {
+      spec += fmt[i++];
+    }
+    // Drop length modifiers, including the MSVC-specific I64, I32 and w.
+    while (i < fmt.size()) {
+      if (strchr("hljztLqw", fmt[i])) {
+        ++i;
+      } else if (fmt[i] == 'I') {
+        ++i;
+        if (!fmt.compare(i, 2, "64") || !fmt.compare(i, 2, "32")) {
+          i += 2;
+        }
+      } else {
+        break;
+      }
+    }
+    if (i >= fmt.size() || nextArg >= aArgs.size()) {
+      // A truncated conversion, or more conversions than recorded arguments.
+      out.append(fmt, start, i - start + (i < fmt.size()));
+      continue;
+    }
+
+    FormatArg(out, spec, fmt[i], aArgs[nextArg++]);
+  }
+
+  return out;
+}
+
+struct DecodedTrace {
+  uint64_t mTicksPerSecond = 0;
+  // In timestamp order.
+  std::vector<Event> mEvents;
+  uint64_t mDropped = 0;
+  // Whether decoding stopped early at a truncated or corrupt record.
+  bool mCorrupt = false;
+};
+
+// Decodes the trace in aData, returning false if it is not a trace at all.
+bool DecodeTrace(const std::vector<uint8_t>& aData, DecodedTrace& aOut) {
+  aOut = DecodedTrace();
+  Reader reader(aData.data(), aData.size());
+  TraceFileHeader header = reader.Read<TraceFileHeader>();
+  if (reader.Failed() ||
+      memcmp(header.mMagic, kTraceMagic, sizeof(header.mMagic)) ||
+      header.mVersion != kTraceVersion || !header.mTicksPerSecond) {
+    return false;
+  }
+  aOut.mTicksPerSecond = header.mTicksPerSecond;
+
+  std::vector<Site> sites;
+  std::vector<Event>& events = aOut.mEvents;
+  bool corrupt = false;
+
+  while (!reader.AtEnd() && !corrupt) {
+    uint8_t kind = reader.Read<uint8_t>();
+    switch (kind) {
+      case kTraceRecordSite: {
+        uint32_t id = reader.Read<uint32_t>();
+        Site site;
+        site.mLine = reader.Read<uint32_t>();
+        site.mTypes.resize(reader.Read<uint8_t>());
+        reader.ReadBytes(site.mTypes.data(), site.mTypes.size());
+        site.mFile = reader.ReadString(reader.Read<uint16_t>());
+        site.mFormat = reader.ReadString(reader.Read<uint16_t>());
+        site.mValid = true;
+        if (reader.Failed() || id > 0xFFFFFF) {
+          corrupt = true;
+          break;
+        }
+        if (id >= sites.size()) {
+          sites.resize(id + 1);
+        }
+        sites[id] = site;
+        break;
+      }
+      case kTraceRecordEvents: {
+        uint32_t threadId = reader.Read<uint32_t>();
+        Reader eventReader = reader.Sub(reader.Read<uint32_t>());
+        while (!eventReader.AtEnd() && !eventReader.Failed()) {
+          uint32_t id = eventReader.Read<uint32_t>();
+          uint64_t timestamp = eventReader.Read<uint64_t>();
+          if (eventReader.Failed() || id >= sites.size() ||
+              !sites[id].mValid) {
+            corrupt = true;
+            break;
+          }
+
+          const Site& site = sites[id];
+          std::vector<Arg> args(site.mTypes.size());
+          for (size_t i = 0; i < args.size() && !corrupt; ++i) {
+            corrupt = !ReadArg(eventReader, site.mTypes[i], args[i]);
+          }
+          if (corrupt) {
+            break;
+          }
+
+          Event event;
+          event.mTimestamp = timestamp;
+          event.mThreadId = threadId;
+          const char* file = strrchr(site.mFile.c_str(), '\\');
+          if (!file) {
+            file = strrchr(site.mFile.c_str(), '/');
+          }
+          file = file ? file + 1 : site.mFile.c_str();
+          AppendFormatted(event.mText, "T%u %s:%u ", threadId, file,
+                          site.mLine);
+          event.mText += FormatMessage(site, args);
+          events.push_back(std::move(event));
+        }
+        corrupt = corrupt || reader.Failed() || eventReader.Failed();
+        break;
+      }
+      case kTraceRecordDropped: {
+        reader.Read<uint32_t>();
+        aOut.mDropped += reader.Read<uint64_t>();
+        corrupt = reader.Failed();
+        break;
+      }
+      default:
+        corrupt = true;
+        break;
+    }
+  }
+
+  // Each thread's events are already in order; merge the threads by time.
+  std::stable_sort(events.begin(), events.end(),
+                   [](const Event& aA, const Event& aB) {
+                     return aA.mTimestamp < aB.mTimestamp;
+                   });
+  aOut.mCorrupt = corrupt;
+  return true;
+}
+
+bool ReadFile(FILE* aIn, std::vector<uint8_t>& aOut) {
+  aOut.clear();
+  uint8_t buf[64 * 1024];
+  size_t read;
+  while ((read = fread(buf, 1, sizeof(buf), aIn)) > 0) {
+    aOut.insert(aOut.end(), buf, buf + read);
+  }
+  return !ferror(aIn);
+}
+
+// The message of a decoded event, without its thread and call site.
+const char* EventMessage(const Event& aEvent) {
+  const char* space = strchr(aEvent.mText.c_str(), ' ');
+  space = space ? strchr(space + 1, ' ') : nullptr;
+  return space ? space + 1 : "";
+}
+
+int gFailures;
+
+void Expect(const bool aCondition, const char* aWhat) {
+  if (!aCondition) {
+    printf("FAILED: %s\n", aWhat);
+    ++gFailures;
+  }
+}
+
+enum class CheckEnum { Zero, One, Two };
+
+// Traces an event of every argument type, and some from another thread,
+// into aOut, stopping as soon as they are recorded.
+bool RecordCheckTrace(FILE* aOut) {
+  if (!Tracer::Start(aOut)) {
+    return false;
+  }
+  ASPK_TRACE("ints %d %u %i %x\n", -5, 7u, CheckEnum::Two, 0xABCDu);
+  ASPK_TRACE("wide ints %lld %llu\n", -(1LL << 40), 1ULL << 63);
+  ASPK_TRACE("double %g %.3f\n", 1.5, 2.0);
+  ASPK_TRACE("pointer %p\n", reinterpret_cast<void*>(0x1234));
+  ASPK_TRACE("strings \"%s\" \"%S\" %s\n", "narrow", L"wide é",
+             static_cast<const char*>(nullptr));
+  ASPK_TRACE("no arguments, 100%%\n");
+  std::thread other([]() {
+    for (int i = 0; i < 3; ++i) {
+      ASPK_TRACE("thread %d\n", i);
+    }
+  });
+  other.join();
+  Tracer::Stop();
+  return true;
+}
+
+// Writes traces through Tracer and checks that they decode to what was
+// recorded.
+int Check() {
+  const char* const kExpected[] = {
+      "ints -5 7 2 abcd\n",
+      "wide ints -1099511627776 9223372036854775808\n",
+      "double 1.5 2.000\n",
+      "pointer 0000000000001234\n",
+      "strings \"narrow\" \"wide \xc3\xa9\" \n",
+      "no arguments, 100%\n",
+      "thread 0\n",
+      "thread 1\n",
+      "thread 2\n",
+  };
+  const size_t kCount = sizeof(kExpected) / sizeof(kExpected[0]);
+
+  for (int run = 0; run < 20; ++run) {
+    FILE* file = tmpfile();
+    if (!file) {
+      printf("Could not create a temporary file\n");
+      return 1;
+    }
+    std::vector<uint8_t> data;
+    const bool recorded = RecordCheckTrace(file);
+    rewind(file);
+    const bool read = ReadFile(file, data);
+    fclose(file);
+    Expect(recorded && read, "Tracer writes a trace");
+    Expect(Tracer::EventsWritten() == kCount && !Tracer::EventsDropped(),
+           "Tracer writes every event before Stop returns");
+
+    DecodedTrace trace;
+    if (!DecodeTrace(data, trace)) {
+      Expect(false, "tracedecode reads the header");
+      continue;
+    }
+    Expect(!trace.mCorrupt && !trace.mDropped &&
+               trace.mEvents.size() == kCount,
+           "tracedecode decodes every event");
+    if (trace.mEvents.size() != kCount) {
+      continue;
+    }
+    bool same = true;
+    for (size_t i = 0; i < kCount; ++i) {
+      same = same && !strcmp(EventMessage(trace.mEvents[i]), kExpected[i]);
+    }
+    Expect(same, "tracedecode formats events as printf would");
+    Expect(trace.mEvents.front().mThreadId !=
+               trace.mEvents.back().mThreadId,
+           "tracedecode keeps each event's thread");
+
+    // A trace cut short decodes as far as it goes.
+    data.resize(data.size() - 3);
+    Expect(DecodeTrace(data, trace) && trace.mCorrupt &&
+               trace.mEvents.size() < kCount,
+           "tracedecode stops at a truncated record");
+  }
+
+  // A Stop straight after Start can come before the drain thread first
+  // takes the lock; the event must still be written.
+  bool allWritten = true;
+  for (int run = 0; run < 200 && allWritten; ++run) {
+    FILE* file = tmpfile();
+    if (!file || !Tracer::Start(file)) {
+      printf("Could not start a trace\n");
+      return 1;
+    }
+    ASPK_TRACE("stop at once %d\n", run);
+    Tracer::Stop();
+    fclose(file);
+    allWritten = Tracer::EventsWritten() == 1;
+  }
+  Expect(allWritten, "Tracer writes events recorded just before Stop");
+
+  if (gFailures) {
+    printf("%d checks failed\n", gFailures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
+
+void PrintUsage(const char* aExe) {
+  fprintf(stderr,
+          "Usage: %s <trace file> [<output file>]\n"
+          "       %s check\n",
+          aExe, aExe);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc == 2 && !strcmp(argv[1], "check")) {
+    return Check();
+  }
+  if (argc < 2 || argc > 3) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+
+  FILE* in = fopen(argv[1], "rb");
+  if (!in) {
+    fprintf(stderr, "Could not open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  ReadFile(in, data);
+  fclose(in);
+
+  DecodedTrace trace;
+  if (!DecodeTrace(data, trace)) {
+    fprintf(stderr, "%s is not a trace file\n", argv[1]);
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (argc == 3) {
+    out = fopen(argv[2], "w");
+    if (!out) {
+      fprintf(stderr, "Could not open %s\n", argv[2]);
+      return 1;
+    }
+  }
+
+  const std::vector<Event>& events = trace.mEvents;
+  const uint64_t first = events.empty() ? 0 : events.front().mTimestamp;
+  for (const Event& event : events) {
+    double ms = static_cast<double>(event.mTimestamp - first) * 1000.0 /
+                static_cast<double>(trace.mTicksPerSecond);
+    fprintf(out, "%12.6f %s", ms, event.mText.c_str());
+    if (event.mText.empty() || event.mText.back() != '\n') {
+      fputc('\n', out);
+    }
+  }
+
+  if (out != stdout) {
+    fclose(out);
+  }
+
+  fprintf(stderr, "%zu events, %llu dropped\n", events.size(),
+          static_cast<unsigned long long>(trace.mDropped));
+  if (trace.mCorrupt) {
+    fprintf(stderr, "Trace is truncated or corrupt; stopped early\n");
+    return 2;
+  }
+  return 0;
+}
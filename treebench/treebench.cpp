@@ -0,0 +1,1536 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+// Runs the traversals behind speed-all, speed-visible and dump-entire-tree
+// against an in-memory tree. It does not use COM, so it builds anywhere; the
+// Tupfile builds it with g++ on Linux, as in:
+//
+//   g++ -O2 -pthread -I../include treebench.cpp ../src/TreeBench.cpp
+//       ../src/IpcAccounting.cpp ../src/PropertyCosts.cpp
+//       ../src/BenchStats.cpp ../src/LatencyHistogram.cpp
+//       ../src/TreeMirror.cpp ../src/TreeSnapshot.cpp ../src/TreeDiff.cpp
+//       ../src/Selector.cpp ../src/IA2Attributes.cpp
+//
+//   treebench [bench [<depth> [<fanout> [<latency-us>]]]]
+//       Time each traversal over a page-like tree, with every call spinning
+//       for latency-us microseconds (default 0) to stand in for IPC
+//   treebench stack [<depth> [<fanout>]]
+//       Time depth-first walks over the same tree with no latency through a
+//       deque, a vector and a TraversalStack of pending nodes, counting the
+//       heap allocations and AddRef/Release pairs of each
+//   treebench check
+//       Check the traversals, selectors and diffs against trees with known
+//       answers, the mirror against a tree mutated at random, and that a
+//       snapshot reads back as written, in treebench-check.snapshot in the
+//       current directory
+
+#include "FakeBackend.h"
+#include "BenchStats.h"
+#include "ParallelWalk.h"
+#include "ProcessWalk.h"
+#include "Selector.h"
+#include "TraversalStack.h"
+#include "TreeBench.h"
+#include "TreeDiff.h"
+#include "TreeMirror.h"
+#include "TreeSnapshot.h"
+#include "Utf8.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace aspk;
+
+namespace {
+
+const long kRoleWindow = 0x09;
+const long kRoleClient = 0x0A;
+const long kRoleDialog = 0x12;
+const long kRoleGrouping = 0x14;
+const long kRoleLink = 0x1E;
+const long kRoleText = 0x29;
+const long kRolePushButton = 0x2B;
+const long kRoleToolBar = 0x16;
+const long kIA2RoleHeading = 0x414;
+const long kIA2StateStale = 0x4000;
+
+const int kIterations = 5;
+
+// Formats every line as the tool would, but discards it, so that dumps are
+// timed without the cost of a terminal.
+uint64_t gPrintedLines;
+
+void DiscardPrint(const char* aFmt, ...) {
+  char buf[512];
+  va_list args;
+  va_start(args, aFmt);
+  vsnprintf(buf, sizeof(buf), aFmt, args);
+  va_end(args);
+  gPrintedLines += !!strchr(buf, '\n');
+}
+
+void StdoutPrint(const char* aFmt, ...) {
+  va_list args;
+  va_start(args, aFmt);
+  vprintf(aFmt, args);
+  va_end(args);
+}
+
+/**
+ * Builds a tree shaped like a browser window: a tool bar, a background tab's
+ * document, which is invisible, and the selected tab's document. Each
+ * document holds a complete tree of links and text of the given depth and
+ * fanout, in which every fourth interior node is offscreen.
+ */
+void BuildPage(FakeTree& aTree, const unsigned int aDepth,
+               const unsigned int aFanout) {
+  FakeNode* root = aTree.Root();
+  root->mRole = kRoleWindow;
+  FakeNode* toolbar = aTree.AddChild(root, kRoleToolBar);
+  for (unsigned int i = 0; i < aFanout; ++i) {
+    aTree.AddChild(toolbar, kRoleLink, 0, L"Button");
+  }
+
+  for (const long docState : {kAccStateInvisible, 0L}) {
+    FakeNode* doc = aTree.AddChild(root, kAccRoleDocument, docState, L"Page");
+    std::vector<FakeNode*> level(1, doc);
+    for (unsigned int d = 0; d < aDepth; ++d) {
+      std::vector<FakeNode*> next;
+      for (FakeNode* parent : level) {
+        for (unsigned int i = 0; i < aFanout; ++i) {
+          const bool leaf = d + 1 == aDepth;
+          const long state =
+              !leaf && next.size() % 4 == 3 ? kAccStateOffscreen : 0;
+          next.push_back(aTree.AddChild(parent, leaf ? kRoleText : kRoleLink,
+                                        state, leaf ? L"Text" : L"Link"));
+        }
+      }
+      level.swap(next);
+    }
+  }
+}
+
+struct RunResult {
+  SampleSummary mSummary;
+  TraversalCounters mCounters;
+  uint64_t mCalls = 0;
+  uint64_t mPeakRefs = 0;
+};
+
+// Runs aRun once to warm up and then kIterations times, keeping the counters
+// and the most nodes held at once of the last run.
+bool Measure(FakeBackend& aBackend,
+             const std::function<bool(TraversalCounters&, double&)>& aRun,
+             RunResult& aOut) {
+  std::vector<double> samples;
+  for (int i = 0; i <= kIterations; ++i) {
+    aOut.mCounters.Reset();
+    BackendNode::Live().ResetPeak();
+    const uint64_t calls = aBackend.Calls();
+    double ms = 0.0;
+    if (!aRun(aOut.mCounters, ms)) {
+      return false;
+    }
+    aOut.mCalls = aBackend.Calls() - calls;
+    aOut.mPeakRefs = BackendNode::Live().Peak();
+    if (i) {
+      samples.push_back(ms);
+    }
+  }
+  return Summarize(samples, true, aOut.mSummary);
+}
+
+// Names how a walk fetches children, by strategy or bounded, and its order.
+std::string WalkName(const TreeBenchOptions& aOptions) {
+  std::string name(aOptions.mBoundRefs ? "bounded"
+                                       : ChildStrategyName(aOptions.mStrategy));
+  if (aOptions.mWalk.mOrder != WalkOrder::DepthFirst) {
+    name += "+";
+    name += WalkOrderName(aOptions.mWalk.mOrder);
+  }
+  return name;
+}
+
+void PrintResult(const char* aCommand, const TreeBenchOptions& aOptions,
+                 const RunResult& aResult) {
+  char label[64];
+  snprintf(label, sizeof(label), "%-16s [%s]", aCommand,
+           WalkName(aOptions).c_str());
+  PrintSummary(stdout, label, "ms", aResult.mSummary);
+  const double nodes = static_cast<double>(aResult.mCounters.mNodes);
+  printf(
+      "\t%llu nodes, %g child round-trips and %g calls per node, at most %llu "
+      "nodes held\n",
+      static_cast<unsigned long long>(aResult.mCounters.mNodes),
+      aResult.mCounters.RoundTripsPerNode(),
+      nodes ? static_cast<double>(aResult.mCalls) / nodes : 0.0,
+      static_cast<unsigned long long>(aResult.mPeakRefs));
+}
+
+// Every way of walking that is benchmarked and checked.
+std::vector<TreeBenchOptions> AllWalks() {
+  std::vector<TreeBenchOptions> walks;
+  for (ChildStrategy strategy : {ChildStrategy::Navigate,
+                                 ChildStrategy::Bulk}) {
+    TreeBenchOptions options;
+    options.mStrategy = strategy;
+    walks.push_back(options);
+  }
+  TreeBenchOptions breadthFirst;
+  breadthFirst.mStrategy = ChildStrategy::Bulk;
+  breadthFirst.mWalk.mOrder = WalkOrder::BreadthFirst;
+  walks.push_back(breadthFirst);
+  TreeBenchOptions bounded;
+  bounded.mBoundRefs = true;
+  walks.push_back(bounded);
+  return walks;
+}
+
+int Bench(const unsigned int aDepth, const unsigned int aFanout,
+          const unsigned int aLatencyUs) {
+  FakeTree tree;
+  BuildPage(tree, aDepth, aFanout);
+  FakeBackend backend(tree);
+  backend.SetCallLatency(std::chrono::microseconds(aLatencyUs));
+  printf("%zu nodes, %u us per call\n", tree.Size(), aLatencyUs);
+
+  PropertyCosts costs;
+  for (TreeBenchOptions options : AllWalks()) {
+    options.mPrint = &DiscardPrint;
+    RunResult result;
+
+    bool ok = Measure(
+        backend,
+        [&](TraversalCounters& aCounters, double& aOutMs) {
+          TreeBench bench(backend, options, aCounters, costs);
+          return bench.FindDocumentAndQuery(aOutMs);
+        },
+        result);
+    if (!ok) {
+      printf("speed-all failed\n");
+      return 1;
+    }
+    PrintResult("speed-all", options, result);
+
+    Measure(
+        backend,
+        [&](TraversalCounters& aCounters, double& aOutMs) {
+          TreeBench bench(backend, options, aCounters, costs);
+          bench.WalkVisible(backend.Root(), aOutMs);
+          return true;
+        },
+        result);
+    PrintResult("speed-visible", options, result);
+
+    Measure(
+        backend,
+        [&](TraversalCounters& aCounters, double& aOutMs) {
+          TreeBench bench(backend, options, aCounters, costs);
+          auto start = std::chrono::steady_clock::now();
+          bench.DumpTree(backend.Root());
+          std::chrono::duration<double, std::milli> elapsed =
+              std::chrono::steady_clock::now() - start;
+          aOutMs = elapsed.count();
+          return true;
+        },
+        result);
+    PrintResult("dump-entire-tree", options, result);
+  }
+
+  costs.Print(stdout);
+  return 0;
+}
+
+// Stands in for a COM smart pointer, counting every AddRef and Release made
+// by copying and destroying it with an interlocked increment, as a proxy's
+// refcount is. Wrapping a node counts nothing, as a fetched COM interface
+// comes already AddRef'd.
+std::atomic<uint64_t> gAddRefs;
+std::atomic<uint64_t> gReleases;
+
+class CountedRef {
+ public:
+  CountedRef() = default;
+  explicit CountedRef(const FakeNode* aNode) : mNode(aNode) {}
+  CountedRef(const CountedRef& aOther) : mNode(aOther.mNode) {
+    gAddRefs += !!mNode;
+  }
+  CountedRef(CountedRef&& aOther) : mNode(aOther.mNode) {
+    aOther.mNode = nullptr;
+  }
+  ~CountedRef() { gReleases += !!mNode; }
+
+  CountedRef& operator=(CountedRef aOther) {
+    std::swap(mNode, aOther.mNode);
+    return *this;
+  }
+
+  const FakeNode* Get() const { return mNode; }
+
+ private:
+  const FakeNode* mNode = nullptr;
+};
+
+// Counts the heap allocations of the containers that use it.
+uint64_t gHeapAllocations;
+
+template <typename T>
+struct CountingAllocator {
+  using value_type = T;
+
+  CountingAllocator() = default;
+  template <typename U>
+  CountingAllocator(const CountingAllocator<U>&) {}
+
+  T* allocate(const size_t aCount) {
+    ++gHeapAllocations;
+    return static_cast<T*>(::operator new(aCount * sizeof(T)));
+  }
+  void deallocate(T* aPtr, size_t) { ::operator delete(aPtr); }
+};
+
+template <typename T, typename U>
+bool operator==(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+  return true;
+}
+template <typename T, typename U>
+bool operator!=(const CountingAllocator<T>&, const CountingAllocator<U>&) {
+  return false;
+}
+
+using RefVector = std::vector<CountedRef, CountingAllocator<CountedRef>>;
+
+void FetchRefs(const CountedRef& aNode, RefVector& aOut) {
+  aOut.clear();
+  for (const FakeNode* child : aNode.Get()->mChildren) {
+    aOut.emplace_back(child);
+  }
+}
+
+// Walks as dump-entire-tree first did: copies through the front of a deque.
+uint64_t WalkDeque(const FakeNode* aRoot, RefVector& aChildren) {
+  std::deque<CountedRef, CountingAllocator<CountedRef>> pending;
+  pending.push_front(CountedRef(aRoot));
+  uint64_t nodes = 0;
+  while (!pending.empty()) {
+    CountedRef node = pending.front();
+    pending.pop_front();
+    ++nodes;
+    FetchRefs(node, aChildren);
+    for (const CountedRef& child : aChildren) {
+      pending.push_front(child);
+    }
+  }
+  return nodes;
+}
+
+// Walks as TreeBench did before TraversalStack: copies through a vector.
+uint64_t WalkVector(const FakeNode* aRoot, RefVector& aChildren) {
+  RefVector pending(1, CountedRef(aRoot));
+  uint64_t nodes = 0;
+  while (!pending.empty()) {
+    CountedRef node = pending.back();
+    pending.pop_back();
+    ++nodes;
+    FetchRefs(node, aChildren);
+    pending.insert(pending.end(), aChildren.rbegin(), aChildren.rend());
+  }
+  return nodes;
+}
+
+uint64_t WalkStack(const FakeNode* aRoot, TraversalStack<CountedRef>& aPending,
+                   RefVector& aChildren) {
+  aPending.Push(CountedRef(aRoot), 0);
+  CountedRef node;
+  uint32_t depth;
+  uint64_t nodes = 0;
+  while (aPending.Pop(node, depth)) {
+    ++nodes;
+    FetchRefs(node, aChildren);
+    aPending.PushReversed(aChildren, depth + 1);
+  }
+  return nodes;
+}
+
+/**
+ * Times depth-first walks of a fake tree with no latency, so that only the
+ * cost of the pending-node container shows, and counts the heap allocations
+ * and AddRef/Release pairs each makes.
+ */
+int StackBench(const unsigned int aDepth, const unsigned int aFanout) {
+  FakeTree tree;
+  BuildPage(tree, aDepth, aFanout);
+  printf("%zu nodes\n", tree.Size());
+
+  TraversalStack<CountedRef> reused;
+  const struct {
+    const char* mName;
+    std::function<uint64_t(RefVector&)> mWalk;
+  } kWalks[] = {
+      {"deque",
+       [&](RefVector& aChildren) {
+         return WalkDeque(tree.Root(), aChildren);
+       }},
+      {"vector",
+       [&](RefVector& aChildren) {
+         return WalkVector(tree.Root(), aChildren);
+       }},
+      {"stack",
+       [&](RefVector& aChildren) {
+         TraversalStack<CountedRef> pending;
+         const uint64_t nodes = WalkStack(tree.Root(), pending, aChildren);
+         gHeapAllocations += pending.Stats().mBlockAllocations;
+         return nodes;
+       }},
+      {"stack (reused)",
+       [&](RefVector& aChildren) {
+         const uint64_t blocks = reused.Stats().mBlockAllocations;
+         const uint64_t nodes = WalkStack(tree.Root(), reused, aChildren);
+         gHeapAllocations += reused.Stats().mBlockAllocations - blocks;
+         return nodes;
+       }},
+  };
+
+  const int kStackIterations = 20;
+  for (const auto& walk : kWalks) {
+    std::vector<double> samples;
+    uint64_t nodes = 0;
+    RefVector children;
+    for (int i = 0; i <= kStackIterations; ++i) {
+      // The first run warms up, including the reused stack.
+      gHeapAllocations = 0;
+      gAddRefs = 0;
+      gReleases = 0;
+      auto start = std::chrono::steady_clock::now();
+      nodes = walk.mWalk(children);
+      std::chrono::duration<double, std::micro> elapsed =
+          std::chrono::steady_clock::now() - start;
+      if (i) {
+        samples.push_back(elapsed.count());
+      }
+    }
+    if (nodes != tree.Size()) {
+      printf("%s walk visited %llu nodes!\n", walk.mName,
+             static_cast<unsigned long long>(nodes));
+      return 1;
+    }
+
+    SampleSummary summary;
+    Summarize(samples, true, summary);
+    PrintSummary(stdout, walk.mName, "us", summary);
+    const double perNode = static_cast<double>(nodes);
+    printf(
+        "\t%.1f ns per node, %llu heap allocations, %g AddRefs and %g "
+        "Releases per node\n",
+        summary.mMedian * 1000.0 / perNode,
+        static_cast<unsigned long long>(gHeapAllocations),
+        static_cast<double>(gAddRefs.load()) / perNode,
+        static_cast<double>(gReleases.load()) / perNode);
+  }
+  return 0;
+}
+
+int gFailures;
+
+void Expect(const bool aCondition, const char* aWhat) {
+  if (!aCondition) {
+    printf("FAILED: %s\n", aWhat);
+    ++gFailures;
+  }
+}
+
+bool Near(const double aValue, const double aExpected) {
+  return fabs(aValue - aExpected) < 1e-9;
+}
+
+// Summarizes samples whose statistics are worked out by hand.
+void CheckStats() {
+  const std::vector<double> sorted = {1, 2, 3, 4};
+  Expect(Near(Percentile(sorted, 0.0), 1) &&
+             Near(Percentile(sorted, 1.0), 4) &&
+             Near(Percentile(sorted, 0.25), 1.75) &&
+             Near(Percentile(sorted, 0.5), 2.5) &&
+             Near(Percentile(sorted, 0.9), 3.7),
+         "Percentile interpolates between samples");
+  Expect(Near(Percentile(sorted, -1.0), 1) &&
+             Near(Percentile(sorted, 2.0), 4) &&
+             Near(Percentile(std::vector<double>(), 0.5), 0),
+         "Percentile clamps the fraction");
+
+  SampleSummary summary;
+  Expect(!Summarize(std::vector<double>(), true, summary),
+         "Summarize fails without samples");
+
+  // The quartiles are 20 and 30, so the fences are 5 and 45.
+  const std::vector<double> samples = {30, 20, 110, 25, 5, 20, 25, 30};
+  Summarize(samples, true, summary);
+  Expect(summary.mCount == 7 && summary.mOutliers == 1 &&
+             Near(summary.mMin, 5) && Near(summary.mMax, 30) &&
+             Near(summary.mMean, 155.0 / 7),
+         "Summarize rejects samples beyond the fences, keeping those on one");
+  Summarize(samples, false, summary);
+  Expect(summary.mCount == 8 && !summary.mOutliers &&
+             Near(summary.mMax, 110) && Near(summary.mMedian, 25),
+         "Summarize keeps outliers when asked to");
+
+  // A standard deviation of sqrt(2.5), and t = 2.776 for 4 degrees of
+  // freedom.
+  Summarize({10, 11, 12, 13, 14}, true, summary);
+  const double halfWidth = 2.776 * sqrt(2.5) / sqrt(5.0);
+  Expect(Near(summary.mMean, 12) && Near(summary.mStdDev, sqrt(2.5)) &&
+             Near(summary.mCiLow, 12 - halfWidth) &&
+             Near(summary.mCiHigh, 12 + halfWidth),
+         "Summarize gives a Student-t confidence interval");
+
+  Summarize({5}, true, summary);
+  Expect(summary.mCount == 1 && Near(summary.mMin, 5) &&
+             Near(summary.mMax, 5) && Near(summary.mMedian, 5) &&
+             Near(summary.mP99, 5) && Near(summary.mStdDev, 0) &&
+             Near(summary.mCiLow, 5) && Near(summary.mCiHigh, 5),
+         "Summarize handles a single sample");
+
+  // t = 12.706 for 1 degree of freedom, and the standard error is 1.
+  Summarize({6, 4}, true, summary);
+  Expect(summary.mCount == 2 && !summary.mOutliers &&
+             Near(summary.mMedian, 5) && Near(summary.mP90, 5.8) &&
+             Near(summary.mStdDev, sqrt(2.0)) &&
+             Near(summary.mCiLow, 5 - 12.706) &&
+             Near(summary.mCiHigh, 5 + 12.706),
+         "Summarize handles two samples");
+
+  // Too few samples to have quartiles.
+  Summarize({1, 2, 100}, true, summary);
+  Expect(summary.mCount == 3 && !summary.mOutliers,
+         "Summarize rejects no outliers from fewer than four samples");
+}
+
+// Counts aNode and the nodes under it that are not under a node whose state
+// is hidden.
+size_t VisibleSubtreeSize(const FakeNode* aNode) {
+  size_t size = 1;
+  for (const FakeNode* child : aNode->mChildren) {
+    if (IsVisibleAccState(child->mState)) {
+      size += VisibleSubtreeSize(child);
+    }
+  }
+  return size;
+}
+
+// Fetches the children of a node with more children than a bulk call asks
+// for at once, with each strategy, and of a leaf.
+void CheckChildFetch() {
+  const size_t kChildren = 2 * kMaxChildChunk + 5;
+  FakeTree tree;
+  for (size_t i = 0; i < kChildren; ++i) {
+    tree.AddChild(tree.Root(), kRoleText);
+  }
+  const FakeTree::Node root = tree.Root();
+  const FakeTree::Node leaf = tree.Root()->mChildren.back();
+  const std::vector<FakeTree::Node> expected(root->mChildren.begin(),
+                                             root->mChildren.end());
+
+  const struct {
+    ChildStrategy mStrategy;
+    size_t mMaxChunk;
+    // Round-trips for the root and for the leaf.
+    uint64_t mRootTrips;
+    uint64_t mLeafTrips;
+  } kFetches[] = {
+      // FirstChild, then NextSibling on every child.
+      {ChildStrategy::Navigate, kMaxChildChunk, 1 + kChildren, 1},
+      // ChildCount, then a chunk at a time.
+      {ChildStrategy::Bulk, kMaxChildChunk, 1 + 3, 1},
+      {ChildStrategy::Bulk, kUnboundedChildChunk, 1 + 1, 1},
+  };
+  for (const auto& fetch : kFetches) {
+    std::vector<FakeTree::Node> children;
+    TraversalCounters counters;
+    FetchChildren(tree, root, fetch.mStrategy, children, counters,
+                  fetch.mMaxChunk);
+    Expect(children == expected, "FetchChildren returns children in order");
+    Expect(counters.mRoundTrips == fetch.mRootTrips,
+           "FetchChildren counts a round-trip per call");
+
+    counters.Reset();
+    FetchChildren(tree, leaf, fetch.mStrategy, children, counters,
+                  fetch.mMaxChunk);
+    Expect(children.empty() && counters.mRoundTrips == fetch.mLeafTrips,
+           "FetchChildren makes one call for a leaf");
+  }
+}
+
+// Runs aText over aTree, returning the nodes it matches in document order. A
+// non-zero aLimit stops the walk at that many matches.
+std::vector<const FakeNode*> Select(FakeTree& aTree, const wchar_t* aText,
+                                    SelectorRunStats& aStats,
+                                    TraversalCounters& aCounters,
+                                    const size_t aLimit = 0) {
+  std::vector<const FakeNode*> matches;
+  Selector selector;
+  std::string error;
+  if (!CompileSelector(aText, selector, error)) {
+    printf("FAILED: %ls: %s\n", aText, error.c_str());
+    ++gFailures;
+    return matches;
+  }
+  const FakeTree::Node root = aTree.Root();
+  aStats = RunSelector(aTree, root, selector, ChildStrategy::Bulk, aCounters,
+                       [&](const FakeTree::Node& aNode) {
+                         matches.push_back(aNode);
+                         return !aLimit || matches.size() < aLimit;
+                       });
+  return matches;
+}
+
+std::vector<const FakeNode*> Select(FakeTree& aTree, const wchar_t* aText) {
+  SelectorRunStats stats;
+  TraversalCounters counters;
+  return Select(aTree, aText, stats, counters);
+}
+
+// Whether aText fails to compile, with aError.
+bool RejectsSelector(const wchar_t* aText, const char* aError) {
+  Selector selector;
+  std::string error;
+  return !CompileSelector(aText, selector, error) && error == aError;
+}
+
+// Evaluates selectors over a small page whose matches are known.
+void CheckSelector() {
+  FakeTree tree;
+  FakeNode* root = tree.Root();
+  root->mRole = kRoleWindow;
+  FakeNode* doc = tree.AddChild(root, kAccRoleDocument, 0, L"Page");
+  FakeNode* h2 = tree.AddChild(doc, kRoleClient, 0, L"Title");
+  h2->mIA2Role = kIA2RoleHeading;
+  h2->mAttributes = L"tag:h2;level:2;";
+  const FakeNode* signIn = tree.AddChild(doc, kRoleLink, 0, L"Sign in");
+  FakeNode* group = tree.AddChild(doc, kRoleGrouping);
+  FakeNode* help = tree.AddChild(group, kRoleLink, 0, L"Help");
+  help->mIA2State = kIA2StateStale;
+  const FakeNode* ok = tree.AddChild(group, kRolePushButton, 0, L"OK");
+  FakeNode* h3 = tree.AddChild(group, kRoleClient, 0, L"Section");
+  h3->mIA2Role = kIA2RoleHeading;
+  h3->mAttributes = L"tag:h3;level:3;";
+  // Every descendant of an invisible node is invisible too.
+  FakeNode* hidden = tree.AddChild(doc, kRoleGrouping, kAccStateInvisible);
+  const FakeNode* hiddenLink =
+      tree.AddChild(hidden, kRoleLink, kAccStateInvisible, L"Hidden");
+  FakeNode* dialog = tree.AddChild(root, kRoleDialog, 0, L"Confirm");
+  const FakeNode* dialogOk =
+      tree.AddChild(dialog, kRolePushButton, 0, L"OK, thanks");
+
+  using Nodes = std::vector<const FakeNode*>;
+  Expect(Select(tree, L"*").size() == tree.Size() &&
+             Select(tree, L"* > *").size() == tree.Size() - 1,
+         "Selector * matches every node");
+  Expect(Select(tree, L"document > link") == Nodes{signIn},
+         "Selector > matches children only");
+  Expect(Select(tree, L"document link") == Nodes({signIn, help, hiddenLink}),
+         "Selector descendant combinator matches at any depth");
+  Expect(Select(tree, L"window grouping > pushbutton") == Nodes{ok} &&
+             Select(tree, L"dialog pushbutton") == Nodes{dialogOk} &&
+             Select(tree, L"dialog link").empty(),
+         "Selector combinators chain");
+  Expect(Select(tree, L"heading") == Nodes({h2, h3}) &&
+             Select(tree, L"[role=client]") == Nodes({h2, h3}) &&
+             Select(tree, L"*[role!=document][role!=heading] > link") ==
+                 Nodes({help, hiddenLink}),
+         "Selector roles match the MSAA or the IA2 role");
+  Expect(Select(tree, L"link[ia2state=stale]") == Nodes{help} &&
+             Select(tree, L"link[ia2state!=stale]") ==
+                 Nodes({signIn, hiddenLink}),
+         "Selector tests IA2 states");
+  Expect(Select(tree, L"[name*=OK]") == Nodes({ok, dialogOk}) &&
+             Select(tree, L"[name*=\"OK,\"]") == Nodes{dialogOk} &&
+             Select(tree, L"pushbutton[name=OK]") == Nodes{ok} &&
+             Select(tree, L"[name*=ok]").empty(),
+         "Selector matches names");
+  Expect(Select(tree, L"[attr:tag]") == Nodes({h2, h3}) &&
+             Select(tree, L"heading[attr:level=2]") == Nodes{h2} &&
+             Select(tree, L"heading[attr:level!=2]") == Nodes{h3} &&
+             Select(tree, L"[attr:tag*=3]") == Nodes{h3} &&
+             Select(tree, L"[attr:level!=2]").size() == tree.Size() - 1,
+         "Selector matches object attributes");
+
+  SelectorRunStats stats;
+  TraversalCounters counters;
+  Expect(Select(tree, L"link", stats, counters) ==
+                 Nodes({signIn, help, hiddenLink}) &&
+             !stats.mPrunedSubtrees && counters.mNodes == tree.Size(),
+         "Selector walks invisible subtrees unless told to skip them");
+  counters.Reset();
+  Expect(Select(tree, L"link[state!=invisible]", stats, counters) ==
+                 Nodes({signIn, help}) &&
+             stats.mPrunedSubtrees == 1 && counters.mNodes == tree.Size() - 1,
+         "Selector [state!=invisible] prunes invisible subtrees");
+  counters.Reset();
+  Expect(Select(tree, L"document[state!=invisible] link", stats, counters)
+                     .size() == 3 &&
+             !stats.mPrunedSubtrees,
+         "Selector only prunes for the last step");
+
+  counters.Reset();
+  Expect(Select(tree, L"link", stats, counters, 2) == Nodes({signIn, help}) &&
+             stats.mStopped && stats.mMatches == 2 &&
+             counters.mNodes < tree.Size(),
+         "Selector stops at the limit");
+  counters.Reset();
+  Expect(Select(tree, L"link", stats, counters, 3).size() == 3 &&
+             stats.mMatches == 3,
+         "Selector stops at the limit, not before");
+
+  Expect(RejectsSelector(L"  ", "empty selector at offset 2") &&
+             RejectsSelector(L"frob", "unknown role at offset 0") &&
+             RejectsSelector(L"link[state=bogus]",
+                             "unknown state at offset 11") &&
+             RejectsSelector(L"link[ia2state=invisible]",
+                             "unknown state at offset 14") &&
+             RejectsSelector(L"link[color=red]", "unknown test at offset 5") &&
+             RejectsSelector(L"link[name~=x]",
+                             "expected '=', '!=' or '*=' at offset 9") &&
+             RejectsSelector(L"link[state*=focused]",
+                             "expected '=' or '!=' at offset 19") &&
+             RejectsSelector(L"link[name=\"x]", "unterminated string at "
+                                                "offset 13") &&
+             RejectsSelector(L"link[name=x", "expected ']' at offset 11") &&
+             RejectsSelector(L"link >", "expected a role, '*' or '[' at "
+                                        "offset 6") &&
+             RejectsSelector(L"link+link",
+                             "expected '>' or whitespace at offset 4"),
+         "CompileSelector reports errors and their offsets");
+}
+
+// Walks aTree on several workers, stopping at every node with role aStopRole,
+// and checks that the output is that of a single-threaded walk up to the
+// first such node in document order. The path to that node is slowed down so
+// that other workers reach later matches first.
+void CheckParallelWalk(const FakeTree& aTree, const long aStopRole,
+                       const char* aWhat) {
+  std::string expected;
+  const FakeNode* expectedStop = nullptr;
+  std::vector<const FakeNode*> pending(1, aTree.Root());
+  while (!pending.empty()) {
+    const FakeNode* node = pending.back();
+    pending.pop_back();
+    expected += std::to_string(node->mUniqueId) + "\n";
+    if (node->mRole == aStopRole) {
+      expectedStop = node;
+      break;
+    }
+    pending.insert(pending.end(), node->mChildren.rbegin(),
+                   node->mChildren.rend());
+  }
+
+  std::vector<const FakeNode*> slow;
+  for (const FakeNode* node = expectedStop; node; node = node->mParent) {
+    slow.push_back(node);
+  }
+
+  const size_t kThreads = 8;
+  for (int i = 0; i < 10; ++i) {
+    ParallelWalk<FakeTree::Node> walk(kThreads);
+    std::vector<const FakeNode*> stops(kThreads);
+    walk.Start(
+        [&]() { return aTree.Root(); },
+        [&](size_t aThread, FakeTree::Node& aNode, uint32_t,
+            std::string& aOut, std::vector<FakeTree::Node>& aChildren) {
+          aOut = std::to_string(aNode->mUniqueId) + "\n";
+          if (std::find(slow.begin(), slow.end(), aNode) != slow.end()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+          }
+          if (aNode->mRole == aStopRole) {
+            stops[aThread] = aNode;
+            return false;
+          }
+          aChildren.assign(aNode->mChildren.begin(), aNode->mChildren.end());
+          return true;
+        },
+        [](size_t, const std::function<void()>& aBody) { aBody(); },
+        nullptr);
+    walk.Join();
+
+    std::string output;
+    walk.ForEachOutput([&](const std::string& aOut) { output += aOut; });
+    Expect(output == expected, aWhat);
+    Expect(walk.WasStopped() == !!expectedStop &&
+               (!expectedStop || stops[walk.StopThread()] == expectedStop),
+           "ParallelWalk reports the worker that stopped it");
+  }
+}
+
+// Gives every node under aRoot a uniqueID such as Firefox hands out for
+// nodes served by content process aProcess.
+void ServeFromProcess(FakeNode* aRoot, const uint32_t aProcess) {
+  std::vector<FakeNode*> pending(1, aRoot);
+  uint32_t serial = 0;
+  while (!pending.empty()) {
+    FakeNode* node = pending.back();
+    pending.pop_back();
+    node->mUniqueId = ~static_cast<long>((aProcess << 24) | ++serial);
+    pending.insert(pending.end(), node->mChildren.begin(),
+                   node->mChildren.end());
+  }
+}
+
+size_t SubtreeSize(const FakeNode* aNode) {
+  size_t size = 1;
+  for (const FakeNode* child : aNode->mChildren) {
+    size += SubtreeSize(child);
+  }
+  return size;
+}
+
+void CollectSubtree(FakeNode* aNode, std::vector<FakeNode*>& aOut) {
+  aOut.push_back(aNode);
+  for (FakeNode* child : aNode->mChildren) {
+    CollectSubtree(child, aOut);
+  }
+}
+
+// Whether aNode is aAncestor or one of its descendants.
+bool IsInSubtree(const FakeNode* aNode, const FakeNode* aAncestor) {
+  for (; aNode; aNode = aNode->mParent) {
+    if (aNode == aAncestor) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Patches a TreeMirror from the events for random mutations of a FakeTree,
+// checking it against a fresh copy after every batch.
+void CheckMirror() {
+  FakeTree tree;
+  tree.Populate(3, 4, {kRoleLink, kRoleText});
+  FakeMirrorSource source(tree);
+  TreeMirror mirror(source);
+  const long rootId = tree.Root()->mUniqueId;
+  Expect(mirror.Build(rootId) && mirror.Size() == tree.Size(),
+         "TreeMirror::Build copies every node");
+
+  auto matchesTree = [&]() {
+    TreeMirror fresh(source);
+    return fresh.Build(rootId) && mirror.CountDifferences(fresh) == 0;
+  };
+
+  // A renamed node costs one call, however many events it gets.
+  {
+    FakeNode* node = tree.Root()->mChildren[1];
+    node->mName = L"Renamed";
+    const MirrorUpdateStats before = mirror.Stats();
+    for (int i = 0; i < 3; ++i) {
+      mirror.Enqueue(MirrorEvent{MirrorEventType::NameChange,
+                                 node->mUniqueId, 10});
+    }
+    mirror.Enqueue(MirrorEvent{MirrorEventType::NameChange, 12345, 12});
+    mirror.ApplyPending(15);
+    const MirrorUpdateStats& after = mirror.Stats();
+    Expect(after.mEventsReceived - before.mEventsReceived == 4 &&
+               after.mEventsApplied - before.mEventsApplied == 1 &&
+               after.mEventsCoalesced - before.mEventsCoalesced == 2 &&
+               after.mEventsIgnored - before.mEventsIgnored == 1,
+           "TreeMirror coalesces repeated events and ignores unknown nodes");
+    Expect(after.mSourceCalls - before.mSourceCalls == 1 &&
+               after.mNodesRefreshed - before.mNodesRefreshed == 1 &&
+               after.mMaxLatencyUs == 5,
+           "TreeMirror refreshes a renamed node with one call");
+    Expect(mirror.Find(node->mUniqueId)->mInfo.mName == L"Renamed",
+           "TreeMirror picks up a new name");
+  }
+
+  std::mt19937 random(1);
+  auto pick = [&](const std::vector<FakeNode*>& aNodes) {
+    return aNodes[random() % aNodes.size()];
+  };
+  bool matched = true;
+  uint64_t now = 0;
+  for (int batch = 0; batch < 50; ++batch) {
+    for (int i = 0; i < 8; ++i) {
+      std::vector<FakeNode*> nodes;
+      CollectSubtree(tree.Root(), nodes);
+      FakeNode* node = pick(nodes);
+      ++now;
+      // Adds outnumber removals, which take whole subtrees, so that the tree
+      // keeps its size.
+      switch (random() % 8) {
+        case 0:
+        case 1:
+        case 2: {
+          FakeNode* child = tree.AddChild(node, kRoleText, 0, L"Added");
+          mirror.Enqueue(
+              MirrorEvent{MirrorEventType::Show, child->mUniqueId, now});
+          break;
+        }
+        case 3:
+          if (node != tree.Root()) {
+            mirror.Enqueue(
+                MirrorEvent{MirrorEventType::Hide, node->mUniqueId, now});
+            tree.Remove(node);
+          }
+          break;
+        case 4: {
+          // Move to another parent outside the node's own subtree.
+          FakeNode* parent = pick(nodes);
+          if (node == tree.Root() || IsInSubtree(parent, node)) {
+            break;
+          }
+          mirror.Enqueue(
+              MirrorEvent{MirrorEventType::Hide, node->mUniqueId, now});
+          tree.Move(node, parent, random() % (parent->mChildren.size() + 1));
+          mirror.Enqueue(
+              MirrorEvent{MirrorEventType::Show, node->mUniqueId, now});
+          break;
+        }
+        case 5:
+          // Move the first child to the end.
+          if (node->mChildren.size() > 1) {
+            tree.Move(node->mChildren.front(), node, node->mChildren.size());
+            mirror.Enqueue(
+                MirrorEvent{MirrorEventType::Reorder, node->mUniqueId, now});
+          }
+          break;
+        default:
+          node->mName = L"Name " + std::to_wstring(now);
+          mirror.Enqueue(
+              MirrorEvent{MirrorEventType::NameChange, node->mUniqueId, now});
+          break;
+      }
+    }
+    mirror.ApplyPending(now);
+    matched = matched && mirror.Size() == SubtreeSize(tree.Root()) &&
+              matchesTree();
+  }
+  Expect(matched, "TreeMirror matches the tree after every batch of events");
+
+  const MirrorUpdateStats& stats = mirror.Stats();
+  Expect(stats.mEventsReceived == stats.mEventsApplied +
+                                      stats.mEventsCoalesced +
+                                      stats.mEventsIgnored,
+         "TreeMirror accounts for every event");
+}
+
+// Adds a node to aTree for the diff checks and returns its index.
+uint32_t AddDiffNode(DiffTree& aTree, const uint32_t aParent,
+                     const long aUniqueId, const long aRole,
+                     const char* aName = "") {
+  DiffNode node;
+  node.mUniqueId = aUniqueId;
+  node.mRole = aRole;
+  node.mName = aName;
+  return aTree.AddNode(aParent, std::move(node));
+}
+
+// Captures the tree under aRoot as diff-tree walks it, parents first.
+void CaptureDiffTree(const FakeNode* aRoot, DiffTree& aOut) {
+  aOut.Clear();
+  struct Pending {
+    const FakeNode* mNode;
+    uint32_t mParent;
+  };
+  std::vector<Pending> pending(1, Pending{aRoot, kNoDiffNode});
+  while (!pending.empty()) {
+    const Pending cur = pending.back();
+    pending.pop_back();
+    DiffNode node;
+    node.mUniqueId = cur.mNode->mUniqueId;
+    node.mRole = cur.mNode->mRole;
+    node.mState = static_cast<uint32_t>(cur.mNode->mState);
+    node.mName = ToUtf8(cur.mNode->mName.data(), cur.mNode->mName.size());
+    const uint32_t index = aOut.AddNode(cur.mParent, std::move(node));
+    for (auto it = cur.mNode->mChildren.rbegin();
+         it != cur.mNode->mChildren.rend(); ++it) {
+      pending.push_back(Pending{*it, index});
+    }
+  }
+}
+
+bool IsEdit(const TreeEdit& aEdit, const TreeEditType aType,
+            const uint32_t aOldNode, const uint32_t aNewNode,
+            const uint32_t aChanged = 0) {
+  return aEdit.mType == aType && aEdit.mOldNode == aOldNode &&
+         aEdit.mNewNode == aNewNode && aEdit.mChanged == aChanged;
+}
+
+// Diffs small trees whose edit scripts are worked out by hand, and a mirror
+// patched by events against a fresh walk.
+void CheckDiff() {
+  std::vector<TreeEdit> edits;
+  TreeDiffStats stats;
+
+  // Children 1 to 4 with uniqueIDs 2 to 5.
+  DiffTree old;
+  AddDiffNode(old, kNoDiffNode, 1, kRoleWindow);
+  for (long id = 2; id <= 5; ++id) {
+    AddDiffNode(old, 0, id, kRoleLink);
+  }
+
+  DiffTree reordered;
+  AddDiffNode(reordered, kNoDiffNode, 1, kRoleWindow);
+  for (long id : {5, 2, 3, 4}) {
+    AddDiffNode(reordered, 0, id, kRoleLink);
+  }
+  DiffTrees(old, reordered, edits, stats);
+  Expect(edits.size() == 1 && IsEdit(edits[0], TreeEditType::Move, 4, 1) &&
+             stats.mMatchedById == 5 && stats.mUnchanged == 4,
+         "DiffTrees moves only the sibling that left its run");
+
+  // The third child goes under the second.
+  DiffTree reparented;
+  AddDiffNode(reparented, kNoDiffNode, 1, kRoleWindow);
+  const uint32_t second = AddDiffNode(reparented, 0, 2, kRoleLink);
+  AddDiffNode(reparented, 0, 3, kRoleLink);
+  AddDiffNode(reparented, 0, 5, kRoleLink);
+  AddDiffNode(reparented, second, 4, kRoleLink);
+  DiffTrees(old, reparented, edits, stats);
+  Expect(edits.size() == 1 && IsEdit(edits[0], TreeEditType::Move, 3, 4) &&
+             stats.mMoved == 1 && stats.mUnchanged == 4,
+         "DiffTrees moves a reparented node");
+
+  // The second child is replaced by one with another uniqueID and the same
+  // role, which does not fall back to its position.
+  DiffTree replaced;
+  AddDiffNode(replaced, kNoDiffNode, 1, kRoleWindow);
+  for (long id : {2, 6, 4, 5}) {
+    AddDiffNode(replaced, 0, id, kRoleLink);
+  }
+  DiffTrees(old, replaced, edits, stats);
+  Expect(edits.size() == 2 && IsEdit(edits[0], TreeEditType::Remove, 2,
+                                     kNoDiffNode) &&
+             IsEdit(edits[1], TreeEditType::Insert, kNoDiffNode, 2) &&
+             stats.mRemoved == 1 && stats.mInserted == 1 &&
+             !stats.mMatchedByPosition,
+         "DiffTrees removes and inserts nodes with different uniqueIDs");
+
+  // Nodes match by position when their roles agree and one of them lacks a
+  // uniqueID: the first and last children here, but not the second.
+  DiffTree anonOld;
+  AddDiffNode(anonOld, kNoDiffNode, 1, kRoleWindow);
+  AddDiffNode(anonOld, 0, kNoUniqueId, kRoleLink, "Old");
+  AddDiffNode(anonOld, 0, kNoUniqueId, kRoleLink);
+  AddDiffNode(anonOld, 0, 7, kRoleText);
+  DiffTree anonNew;
+  AddDiffNode(anonNew, kNoDiffNode, 1, kRoleWindow);
+  AddDiffNode(anonNew, 0, kNoUniqueId, kRoleLink, "New");
+  AddDiffNode(anonNew, 0, kNoUniqueId, kRoleText);
+  AddDiffNode(anonNew, 0, kNoUniqueId, kRoleText);
+  DiffTrees(anonOld, anonNew, edits, stats);
+  Expect(edits.size() == 3 &&
+             IsEdit(edits[0], TreeEditType::Remove, 2, kNoDiffNode) &&
+             IsEdit(edits[1], TreeEditType::Change, 1, 1, kDiffName) &&
+             IsEdit(edits[2], TreeEditType::Insert, kNoDiffNode, 2) &&
+             stats.mMatchedById == 1 && stats.mMatchedByPosition == 2,
+         "DiffTrees matches nodes without uniqueIDs by position and role");
+
+  // A uniqueID that occurs twice identifies neither node.
+  DiffTree dupOld;
+  AddDiffNode(dupOld, kNoDiffNode, 1, kRoleWindow);
+  AddDiffNode(dupOld, 0, 8, kRoleLink);
+  AddDiffNode(dupOld, 0, 8, kRoleLink);
+  DiffTree dupNew;
+  AddDiffNode(dupNew, kNoDiffNode, 1, kRoleWindow);
+  AddDiffNode(dupNew, 0, 8, kRoleLink);
+  DiffTrees(dupOld, dupNew, edits, stats);
+  Expect(stats.mMatchedById == 1 && stats.mRemoved == 2 &&
+             stats.mInserted == 1,
+         "DiffTrees does not match by a duplicated uniqueID");
+
+  // A mirror loaded before some events differs from a fresh walk by those
+  // events, and once patched by them, by nothing.
+  FakeTree tree;
+  tree.Populate(3, 3, {kRoleLink, kRoleText});
+  FakeMirrorSource source(tree);
+  TreeMirror mirror(source);
+  DiffTree before;
+  Expect(mirror.Build(tree.Root()->mUniqueId) && before.LoadMirror(mirror) &&
+             before.Size() == tree.Size(),
+         "DiffTree::LoadMirror loads every node");
+
+  FakeNode* renamed = tree.Root()->mChildren[0]->mChildren[1];
+  renamed->mName = L"Renamed";
+  mirror.Enqueue(MirrorEvent{MirrorEventType::NameChange,
+                             renamed->mUniqueId, 1});
+  FakeNode* moved = tree.Root()->mChildren[1];
+  mirror.Enqueue(MirrorEvent{MirrorEventType::Hide, moved->mUniqueId, 1});
+  tree.Move(moved, tree.Root()->mChildren[2], 0);
+  mirror.Enqueue(MirrorEvent{MirrorEventType::Show, moved->mUniqueId, 1});
+  mirror.ApplyPending(2);
+
+  DiffTree walked;
+  CaptureDiffTree(tree.Root(), walked);
+  DiffTrees(before, walked, edits, stats);
+  Expect(edits.size() == 2 && stats.mMoved == 1 && stats.mChanged == 1 &&
+             stats.mUnchanged == tree.Size() - 2,
+         "DiffTrees finds a move and a rename since a mirror was loaded");
+
+  DiffTree after;
+  after.LoadMirror(mirror);
+  DiffTrees(after, walked, edits, stats);
+  Expect(edits.empty() && stats.mMatchedById == tree.Size(),
+         "DiffTree::LoadMirror matches a fresh walk once patched");
+}
+
+// Where the snapshot check writes its file, in the current directory.
+#if defined(_WIN32)
+const SnapshotPathChar kSnapshotPath[] = L"treebench-check.snapshot";
+
+FILE* CreateSnapshotFile() {
+  FILE* file = nullptr;
+  return _wfopen_s(&file, kSnapshotPath, L"w+b") ? nullptr : file;
+}
+
+void RemoveSnapshotFile() { _wremove(kSnapshotPath); }
+#else
+const SnapshotPathChar kSnapshotPath[] = "treebench-check.snapshot";
+
+FILE* CreateSnapshotFile() { return fopen(kSnapshotPath, "w+b"); }
+
+void RemoveSnapshotFile() { remove(kSnapshotPath); }
+#endif
+
+// Writes aTree breadth-first to kSnapshotPath, as dump-entire-tree -snapshot
+// does, returning the nodes in the order written.
+bool WriteSnapshot(const FakeTree& aTree, SnapshotWriter& aWriter,
+                   std::vector<const FakeNode*>& aOutOrder) {
+  FILE* file = CreateSnapshotFile();
+  if (!file) {
+    return false;
+  }
+  bool ok = aWriter.Begin(file);
+  aOutOrder.assign(1, aTree.Root());
+  std::vector<uint32_t> parents(1, kNoSnapshotNode);
+  for (size_t i = 0; ok && i < aOutOrder.size(); ++i) {
+    const FakeNode* node = aOutOrder[i];
+    SnapshotNodeInfo info;
+    info.mRole = node->mRole;
+    info.mState = static_cast<uint32_t>(node->mState);
+    info.mIA2States = static_cast<uint32_t>(node->mIA2State);
+    info.mUniqueId = static_cast<int32_t>(node->mUniqueId);
+    info.mHasName = !node->mName.empty();
+    info.mName = ToUtf8(node->mName.data(), node->mName.size());
+    uint32_t firstChild;
+    ok = aWriter.AddNode(info, parents[i],
+                         static_cast<uint32_t>(node->mChildren.size()),
+                         firstChild) &&
+         firstChild == aOutOrder.size();
+    for (const FakeNode* child : node->mChildren) {
+      aOutOrder.push_back(child);
+      parents.push_back(static_cast<uint32_t>(i));
+    }
+  }
+  ok = ok && aWriter.Finish();
+  return !fclose(file) && ok;
+}
+
+// Whether aView holds aOrder's nodes, in that order.
+bool SnapshotMatches(const SnapshotView& aView,
+                     const std::vector<const FakeNode*>& aOrder) {
+  if (aView.NodeCount() != aOrder.size()) {
+    return false;
+  }
+  uint32_t nextChild = 1;
+  for (uint32_t i = 0; i < aOrder.size(); ++i) {
+    const FakeNode* node = aOrder[i];
+    const SnapshotNode& stored = aView.Node(i);
+    const char* name = aView.Name(stored);
+    const std::string utf8 = ToUtf8(node->mName.data(), node->mName.size());
+    const uint32_t parent =
+        node->mParent ? static_cast<uint32_t>(
+                            std::find(aOrder.begin(), aOrder.end(),
+                                      node->mParent) -
+                            aOrder.begin())
+                      : kNoSnapshotNode;
+    if (stored.mRole != node->mRole ||
+        stored.mState != static_cast<uint32_t>(node->mState) ||
+        stored.mIA2States != static_cast<uint32_t>(node->mIA2State) ||
+        stored.mUniqueId != node->mUniqueId || stored.mParent != parent ||
+        stored.mFirstChild != nextChild ||
+        stored.mChildCount != node->mChildren.size() ||
+        (node->mName.empty() ? !!name
+                             : !name || utf8 != name ||
+                                   stored.mNameLength != utf8.size())) {
+      return false;
+    }
+    nextChild += stored.mChildCount;
+  }
+  return true;
+}
+
+// Writes a snapshot of a page, reads it back through a mapping, and checks
+// that damaged copies of it are rejected.
+void CheckSnapshot() {
+  FakeTree tree;
+  BuildPage(tree, 2, 3);
+  tree.Root()->mChildren[0]->mName = L"Caf\u00e9 \u4e2d\u6587";
+  tree.Root()->mChildren[2]->mIA2State = 0x40;
+
+  SnapshotWriter writer;
+  std::vector<const FakeNode*> order;
+  Expect(WriteSnapshot(tree, writer, order),
+         "SnapshotWriter writes a snapshot");
+  // The root has no name, and the others use five distinct names.
+  Expect(writer.NodeCount() == tree.Size() &&
+             writer.InternHits() == tree.Size() - 1 - 5,
+         "SnapshotWriter interns repeated names");
+
+  std::vector<char> bytes;
+  {
+    MappedSnapshot mapped;
+    Expect(mapped.Open(kSnapshotPath) && mapped.View().Validate() &&
+               SnapshotMatches(mapped.View(), order),
+           "MappedSnapshot reads back every node");
+    const SnapshotView& view = mapped.View();
+    const size_t size =
+        sizeof(SnapshotHeader) + view.NodeCount() * sizeof(SnapshotNode) +
+        writer.StringsSize();
+    const char* data = reinterpret_cast<const char*>(&view.Node(0)) -
+                       sizeof(SnapshotHeader);
+    bytes.assign(data, data + size);
+  }
+
+  // Damaged copies, aligned as a mapping would be.
+  std::vector<uint64_t> copy;
+  auto damaged = [&](const std::function<void(char*)>& aDamage,
+                     const size_t aSize, SnapshotView& aView) {
+    copy.assign(bytes.size() / sizeof(uint64_t) + 1, 0);
+    char* data = reinterpret_cast<char*>(copy.data());
+    memcpy(data, bytes.data(), bytes.size());
+    aDamage(data);
+    return aView.Init(data, aSize);
+  };
+  auto nodeAt = [](char* aData, const size_t aIndex) {
+    return reinterpret_cast<SnapshotNode*>(aData + sizeof(SnapshotHeader)) +
+           aIndex;
+  };
+  SnapshotView view;
+  Expect(damaged([](char*) {}, bytes.size(), view) && view.Validate(),
+         "SnapshotView accepts an intact copy");
+  Expect(!damaged([](char*) {}, bytes.size() - 1, view) &&
+             !damaged([](char*) {}, sizeof(SnapshotHeader) - 1, view),
+         "SnapshotView rejects a truncated snapshot");
+  Expect(!damaged([](char* aData) { aData[0] = 'X'; }, bytes.size(), view),
+         "SnapshotView rejects a bad magic number");
+  Expect(damaged([&](char* aData) { nodeAt(aData, 5)->mParent = 0; },
+                 bytes.size(), view) &&
+             !view.Validate(),
+         "Validate rejects a child that does not point at its parent");
+  Expect(damaged([&](char* aData) { ++nodeAt(aData, 0)->mChildCount; },
+                 bytes.size(), view) &&
+             !view.Validate(),
+         "Validate rejects a child range that takes in another's child");
+  Expect(damaged([&](char* aData) {
+                   nodeAt(aData, 1)->mNameOffset =
+                       static_cast<uint32_t>(writer.StringsSize());
+                 },
+                 bytes.size(), view) &&
+             !view.Validate(),
+         "Validate rejects a name outside the string pool");
+
+  // A truncated file fails to open.
+  FILE* file = CreateSnapshotFile();
+  if (file) {
+    fwrite(bytes.data(), 1, bytes.size() / 2, file);
+    fclose(file);
+  }
+  MappedSnapshot truncated;
+  Expect(!truncated.Open(kSnapshotPath),
+         "MappedSnapshot rejects a truncated file");
+  truncated.Close();
+  RemoveSnapshotFile();
+}
+
+// Runs DumpTree with aWalk added to every walk of AllWalks, expecting it to
+// visit aExpectedNodes and to count aExpectedSkips pruned subtrees and nodes
+// at the depth limit together.
+void ExpectDump(FakeBackend& aBackend, const TreeWalkOptions& aWalk,
+                const size_t aExpectedNodes, const uint64_t aExpectedSkips,
+                const char* aWhat) {
+  PropertyCosts costs;
+  for (TreeBenchOptions options : AllWalks()) {
+    const WalkOrder order = options.mWalk.mOrder;
+    options.mWalk = aWalk;
+    options.mWalk.mOrder = order;
+    options.mPrint = &DiscardPrint;
+    TraversalCounters counters;
+    TreeBench bench(aBackend, options, counters, costs);
+    bench.DumpTree(aBackend.Root());
+    Expect(counters.mNodes == aExpectedNodes &&
+               counters.mPrunedSubtrees + counters.mDepthLimited ==
+                   aExpectedSkips,
+           aWhat);
+  }
+}
+
+int Check() {
+  CheckStats();
+  CheckChildFetch();
+  CheckSelector();
+  CheckMirror();
+  CheckDiff();
+  CheckSnapshot();
+
+  const unsigned int kDepth = 3;
+  const unsigned int kFanout = 4;
+  FakeTree tree;
+  BuildPage(tree, kDepth, kFanout);
+  FakeBackend backend(tree);
+  const FakeNode* visibleDoc = tree.Root()->mChildren[2];
+
+  CheckParallelWalk(tree, -1, "ParallelWalk outputs in document order");
+  CheckParallelWalk(tree, kRoleText,
+                    "ParallelWalk stops at the first match in document order");
+
+  // A visible walk reaches the root, the tool bar and its buttons, and
+  // whatever of the selected document is not under an offscreen node. It
+  // skips the background document and every offscreen node it reaches.
+  size_t expectedVisible = 1 + 1 + kFanout;
+  uint64_t hiddenSubtrees = 1;
+  {
+    std::vector<const FakeNode*> pending(1, visibleDoc);
+    while (!pending.empty()) {
+      const FakeNode* node = pending.back();
+      pending.pop_back();
+      ++expectedVisible;
+      for (const FakeNode* child : node->mChildren) {
+        if (IsVisibleAccState(child->mState)) {
+          pending.push_back(child);
+        } else {
+          ++hiddenSubtrees;
+        }
+      }
+    }
+  }
+
+  PropertyCosts costs;
+  for (TreeBenchOptions options : AllWalks()) {
+    options.mPrint = &DiscardPrint;
+    TraversalCounters counters;
+    TreeBench bench(backend, options, counters, costs);
+
+    BackendNodePtr doc =
+        bench.FindVisibleRole(backend.Root(), kAccRoleDocument);
+    Expect(doc && FakeBackend::Unwrap(doc) == visibleDoc,
+           "FindVisibleRole skips the invisible document");
+
+    double ms;
+    counters.Reset();
+    Expect(bench.FindDocumentAndQuery(ms), "FindDocumentAndQuery succeeds");
+
+    counters.Reset();
+    bench.WalkVisible(backend.Root(), ms);
+    Expect(counters.mNodes == expectedVisible,
+           "WalkVisible visits exactly the visible nodes");
+
+    counters.Reset();
+    gPrintedLines = 0;
+    BackendNode::Live().ResetPeak();
+    bench.DumpTree(backend.Root());
+    Expect(counters.mNodes == tree.Size(), "DumpTree visits every node");
+    Expect(gPrintedLines == tree.Size(), "DumpTree prints every node");
+    // The documents are one level below the window.
+    Expect(counters.mMaxDepth == kDepth + 1,
+           "DumpTree counts depth, not nodes");
+    if (options.mBoundRefs) {
+      // The path below the window and the document, plus a sibling.
+      Expect(BackendNode::Live().Peak() <= kDepth + 4,
+             "bounded walks hold no more than the path");
+    }
+  }
+
+  // Depth limits and pruning. The root's children are the tool bar and the
+  // two documents.
+  {
+    TreeWalkOptions walk;
+    walk.mMaxDepth = 0;
+    ExpectDump(backend, walk, 1, 1, "a depth limit of 0 visits the root");
+    walk.mMaxDepth = 1;
+    ExpectDump(backend, walk, 4, 3, "a depth limit of 1 visits the children");
+
+    walk = TreeWalkOptions();
+    walk.mPrune.mRoles.push_back(kRoleToolBar);
+    ExpectDump(backend, walk, tree.Size() - (1 + kFanout), 1,
+               "pruning a role skips its subtrees");
+
+    walk = TreeWalkOptions();
+    walk.mPrune.mInvisible = true;
+    ExpectDump(backend, walk, expectedVisible, hiddenSubtrees,
+               "pruning invisible nodes skips their subtrees");
+  }
+
+  // The stack pops in reverse push order across block boundaries, and
+  // reuses its blocks once emptied.
+  {
+    const uint32_t kCount = 1000;
+    TraversalStack<CountedRef> stack;
+    for (int pass = 0; pass < 2; ++pass) {
+      const uint64_t blocks = stack.Stats().mBlockAllocations;
+      std::vector<FakeNode> nodes(kCount);
+      for (uint32_t i = 0; i < kCount; ++i) {
+        stack.Push(CountedRef(&nodes[i]), i);
+      }
+      bool inOrder = stack.Size() == kCount;
+      CountedRef node;
+      uint32_t depth;
+      for (uint32_t i = kCount; i-- > 0;) {
+        inOrder = inOrder && stack.Pop(node, depth) &&
+                  node.Get() == &nodes[i] && depth == i;
+      }
+      Expect(inOrder && stack.IsEmpty(), "TraversalStack is last in first out");
+      Expect(!pass || stack.Stats().mBlockAllocations == blocks,
+             "TraversalStack reuses its blocks");
+    }
+    Expect(stack.Stats().mPeakSize == kCount &&
+               stack.Stats().mMaxDepth == kCount - 1,
+           "TraversalStack tracks its peak size and depth");
+  }
+
+  // Viewport culling: put the whole selected document but one subtree inside
+  // the viewport.
+  ScreenRect viewport = ScreenRect::FromLocation(0, 0, 100, 100);
+  backend.SetViewport(viewport);
+  for (FakeNode* child : tree.Root()->mChildren[2]->mChildren) {
+    child->mBounds = ScreenRect::FromLocation(10, 10, 10, 10);
+  }
+  FakeNode* culled = tree.Root()->mChildren[2]->mChildren[0];
+  culled->mBounds = ScreenRect::FromLocation(200, 200, 10, 10);
+  for (TreeBenchOptions options : AllWalks()) {
+    options.mCullToViewport = true;
+    options.mPrint = &DiscardPrint;
+    TraversalCounters counters;
+    TreeBench bench(backend, options, counters, costs);
+    double ms;
+    bench.WalkVisible(backend.Root(), ms);
+    // Nodes with empty bounds are kept, but not if their states are hidden,
+    // so culling skips what a visible walk does and the visible part of
+    // culled's subtree.
+    Expect(counters.mNodes == expectedVisible - VisibleSubtreeSize(culled),
+           "viewport culling skips the offscreen subtree and hidden nodes");
+  }
+
+  // Pruning by source: make the selected document's nodes look as if a
+  // content process served them. The rest of the tree is chrome.
+  {
+    const size_t docSize = SubtreeSize(visibleDoc);
+    ServeFromProcess(tree.Root()->mChildren[2], 3);
+    Expect(GetNodeSource(visibleDoc->mUniqueId) == NodeSource::Content &&
+               ContentProcessOf(visibleDoc->mUniqueId) == 3 &&
+               GetNodeSource(tree.Root()->mUniqueId) == NodeSource::Chrome,
+           "uniqueIDs give the content process");
+
+    TreeWalkOptions walk;
+    walk.mPrune.mContent = true;
+    ExpectDump(backend, walk, tree.Size() - docSize, 1,
+               "pruning content skips the content document");
+    walk = TreeWalkOptions();
+    walk.mPrune.mChrome = true;
+    ExpectDump(backend, walk, 1 + docSize, 2,
+               "pruning chrome keeps only the root and content");
+  }
+
+  // A walk with a worker per process: the tool bar is chrome, and each
+  // document is served by a content process of its own.
+  {
+    ServeFromProcess(tree.Root()->mChildren[1], 5);
+    using Walk = ProcessWalk<FakeTree::Node>;
+    Walk walk;
+    walk.Start(
+        [&]() { return static_cast<const FakeTree&>(tree).Root(); },
+        [](const FakeTree::Node& aNode, uint32_t& aOut) {
+          aOut = ContentProcessOf(aNode->mUniqueId);
+          return true;
+        },
+        [&](const FakeTree::Node& aNode, uint32_t, TraversalCounters& aCounters,
+            std::vector<FakeTree::Node>& aChildren) {
+          FetchChildren(tree, aNode, ChildStrategy::Bulk, aChildren,
+                        aCounters);
+          return true;
+        },
+        [](uint32_t, const std::function<void()>& aBody) { aBody(); },
+        nullptr);
+    walk.Join();
+
+    const size_t docSize = SubtreeSize(visibleDoc);
+    std::vector<uint32_t> processes;
+    bool counted = true;
+    uint64_t nodes = 0;
+    walk.ForEachProcess([&](const Walk::ProcessStats& aStats) {
+      processes.push_back(aStats.mProcess);
+      nodes += aStats.mCounters.mNodes;
+      const uint64_t expected =
+          aStats.mProcess ? docSize : 1 + 1 + kFanout;
+      counted = counted && aStats.mCounters.mNodes == expected &&
+                aStats.mSubtrees == 1 &&
+                aStats.mLatency.Count() == expected &&
+                aStats.mCounters.mMaxDepth == (aStats.mProcess ? kDepth + 1
+                                                               : 2);
+    });
+    Expect(processes == std::vector<uint32_t>({0, 3, 5}),
+           "ProcessWalk starts a worker per process");
+    Expect(counted && nodes == tree.Size(),
+           "ProcessWalk visits each process's nodes on its worker");
+  }
+
+  // Print one dump for eyeballing.
+  {
+    FakeTree small;
+    BuildPage(small, 1, 2);
+    FakeBackend smallBackend(small);
+    TreeBenchOptions options;
+    options.mPrint = &StdoutPrint;
+    TraversalCounters counters;
+    TreeBench bench(smallBackend, options, counters, costs);
+    bench.DumpTree(smallBackend.Root());
+  }
+
+  if (gFailures) {
+    printf("%d checks failed\n", gFailures);
+    return 1;
+  }
+  printf("All checks passed\n");
+  return 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc > 1 && !strcmp(argv[1], "check")) {
+    return Check();
+  }
+  if (argc > 1 && !strcmp(argv[1], "stack")) {
+    const unsigned long depth = argc > 2 ? strtoul(argv[2], nullptr, 0) : 4;
+    const unsigned long fanout = argc > 3 ? strtoul(argv[3], nullptr, 0) : 8;
+    return StackBench(static_cast<unsigned int>(depth),
+                      static_cast<unsigned int>(fanout ? fanout : 1));
+  }
+  if (argc > 1 && strcmp(argv[1], "bench")) {
+    printf(
+        "Usage: %s [bench [<depth> [<fanout> [<latency-us>]]]] | stack "
+        "[<depth> [<fanout>]] | check\n",
+        argv[0]);
+    return 2;
+  }
+  const unsigned long depth = argc > 2 ? strtoul(argv[2], nullptr, 0) : 4;
+  const unsigned long fanout = argc > 3 ? strtoul(argv[3], nullptr, 0) : 8;
+  const unsigned long latency = argc > 4 ? strtoul(argv[4], nullptr, 0) : 0;
+  return Bench(static_cast<unsigned int>(depth),
+               static_cast<unsigned int>(fanout ? fanout : 1),
+               static_cast<unsigned int>(latency));
+}